@@ -0,0 +1,177 @@
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "zapp.h"
+#include "gen.h"
+
+#define DEFAULT_SCALE 100
+#define DEFAULT_REPEAT 3
+
+typedef enum {
+  PHASE_LEX,
+  PHASE_PARSE,
+  PHASE_EXECUTE,
+  PHASE_CODEGEN,
+  NPHASES
+} phase_kind;
+
+static const char *phase_str[] = { "lex", "parse", "execute", "codegen" };
+
+// Best time of all repetitions of every phase
+struct result {
+  size_t bytes;
+  uint32_t nodes;
+  double seconds[NPHASES];
+};
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void record(struct result *res, phase_kind phase, double start) {
+  double elapsed = now() - start;
+  if (!res->seconds[phase] || elapsed < res->seconds[phase]) {
+    res->seconds[phase] = elapsed;
+  }
+}
+
+// Runs every phase once on a fresh context, the program's output goes to
+// `devnull` so printing is measured without a terminal in the way
+static void run_once(char *src, struct result *res, int devnull) {
+  struct context ctx;
+  context_init(&ctx);
+  struct tokenizer tokenizer;
+  tokenizer_init_ctx(&tokenizer, src, &ctx);
+
+  double start = now();
+  tok_lex_all(&tokenizer);
+  record(res, PHASE_LEX, start);
+
+  start = now();
+  struct node *prog = parse(&tokenizer);
+  record(res, PHASE_PARSE, start);
+  tokenizer_destroy(&tokenizer);
+  res->nodes = ctx.pools->len;
+
+  fflush(stdout);
+  int saved = dup(STDOUT_FILENO);
+  dup2(devnull, STDOUT_FILENO);
+  start = now();
+  execute_node(prog);
+  output_flush();
+  fflush(stdout);
+  record(res, PHASE_EXECUTE, start);
+
+  FILE *out = fdopen(dup(devnull), "w");
+  start = now();
+  c_codegen(prog, out);
+  record(res, PHASE_CODEGEN, start);
+  fclose(out);
+  dup2(saved, STDOUT_FILENO);
+  close(saved);
+
+  context_destroy(&ctx);
+  frame_destroy();
+}
+
+static void usage() {
+  fprintf(stderr, "Usage: bench.exe [options] [workload...]\n\n");
+  fprintf(stderr, "Options:\n");
+  fprintf(stderr, "  -s scale  size of the generated programs (default %d)\n", DEFAULT_SCALE);
+  fprintf(stderr, "  -r count  repetitions, the best one is reported (default %d)\n",
+          DEFAULT_REPEAT);
+  fprintf(stderr, "  -o file   write results as CSV to `file`\n");
+  fprintf(stderr, "  -g name   print the program of workload `name` and exit\n\n");
+  fprintf(stderr, "Workloads:\n");
+  for (int i = 0; i < nworkloads; ++i) {
+    fprintf(stderr, "  %-12s %s\n", workloads[i].name, workloads[i].desc);
+  }
+  exit(1);
+}
+
+static const struct workload *workload_arg(const char *name) {
+  const struct workload *w = find_workload(name);
+  if (!w) {
+    fprintf(stderr, "Error: unknown workload `%s`\n", name);
+    usage();
+  }
+  return w;
+}
+
+int main(int argc, char **argv) {
+  int scale = DEFAULT_SCALE, repeat = DEFAULT_REPEAT;
+  const char *csv_name = NULL;
+  const struct workload *selected[argc];
+  int nselected = 0;
+
+  for (int i = 1; i < argc; ++i) {
+    if (argv[i][0] != '-') {
+      selected[nselected++] = workload_arg(argv[i]);
+      continue;
+    }
+    if (i + 1 == argc) {
+      usage();
+    }
+    if (!strcmp(argv[i], "-s")) {
+      scale = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-r")) {
+      repeat = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-o")) {
+      csv_name = argv[++i];
+    } else if (!strcmp(argv[i], "-g")) {
+      size_t len;
+      char *src = gen_program(workload_arg(argv[++i]), scale, &len);
+      fwrite(src, 1, len, stdout);
+      return 0;
+    } else {
+      usage();
+    }
+  }
+  if (!nselected) {
+    for (int i = 0; i < nworkloads; ++i) {
+      selected[nselected++] = &workloads[i];
+    }
+  }
+
+  FILE *csv = NULL;
+  if (csv_name && !(csv = fopen(csv_name, "w"))) {
+    perror(csv_name);
+    return 1;
+  }
+  if (csv) {
+    fprintf(csv, "workload,phase,bytes,nodes,seconds,mb_per_s,ns_per_node\n");
+  }
+  int devnull = open("/dev/null", O_WRONLY);
+
+  printf("%-12s %-8s %10s %10s %10s %10s\n", "workload", "phase", "size", "ms", "MB/s", "ns/node");
+  for (int i = 0; i < nselected; ++i) {
+    const struct workload *w = selected[i];
+    struct result res = {};
+    char *src = gen_program(w, scale, &res.bytes);
+    for (int r = 0; r < repeat; ++r) {
+      run_once(src, &res, devnull);
+    }
+    free(src);
+
+    for (phase_kind phase = 0; phase < NPHASES; ++phase) {
+      double secs = res.seconds[phase];
+      double mbps = res.bytes / secs / 1e6;
+      double ns_per_node = secs * 1e9 / res.nodes;
+      printf("%-12s %-8s %9.2fM %10.2f %10.1f %10.2f\n", w->name, phase_str[phase],
+             res.bytes / 1e6, secs * 1e3, mbps, ns_per_node);
+      if (csv) {
+        fprintf(csv, "%s,%s,%zu,%u,%.6f,%.3f,%.3f\n", w->name, phase_str[phase],
+                res.bytes, res.nodes, secs, mbps, ns_per_node);
+      }
+    }
+  }
+
+  if (csv) {
+    fclose(csv);
+  }
+  close(devnull);
+  return 0;
+}
@@ -0,0 +1,152 @@
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gen.h"
+
+#define GEN_SEED 0x5eed
+#define NVARS 64 // distinct variables used by a program
+
+static uint64_t rng_state;
+
+static uint32_t rng_next(uint32_t bound) {
+  rng_state = rng_state * 6364136223846793005ULL + 1442695040888963407ULL;
+  return (rng_state >> 33) % bound;
+}
+
+__attribute__((format(printf, 2, 3)))
+static void bprintf(struct strbuf *buf, const char *fmt, ...) {
+  for (;;) {
+    va_list va;
+    va_start(va, fmt);
+    size_t room = buf->capacity - buf->len;
+    int n = vsnprintf(buf->data + buf->len, room, fmt, va);
+    va_end(va);
+    if ((size_t)n < room) {
+      buf->len += n;
+      return;
+    }
+    buf->capacity = buf->capacity ? buf->capacity * 2 : 4096;
+    buf->data = realloc(buf->data, buf->capacity);
+    if (!buf->data) {
+      perror("realloc");
+      exit(1);
+    }
+  }
+}
+
+// Random expression of the given depth over integer variables. Divisors are
+// non-zero literals, so the program can be executed.
+static void gen_expr(struct strbuf *buf, int depth) {
+  if (depth == 0) {
+    if (rng_next(3)) {
+      bprintf(buf, "v%u", rng_next(NVARS));
+    } else {
+      bprintf(buf, "%u", rng_next(1000));
+    }
+    return;
+  }
+  static const char *ops[] = { "+", "-", "*", "+", "-" };
+  switch (rng_next(6)) {
+    case 0:
+      bprintf(buf, "(");
+      gen_expr(buf, depth - 1);
+      bprintf(buf, ")");
+      return;
+    case 1:
+      gen_expr(buf, depth - 1);
+      bprintf(buf, " / %u", rng_next(9) + 1);
+      return;
+    default:
+      gen_expr(buf, depth - 1);
+      bprintf(buf, " %s ", ops[rng_next(5)]);
+      bprintf(buf, "(");
+      gen_expr(buf, rng_next(depth));
+      bprintf(buf, ")");
+      return;
+  }
+}
+
+// Many short statements, as in generated straight-line code
+static void gen_statements(struct strbuf *buf, int scale) {
+  for (int i = 0; i < NVARS; ++i) {
+    bprintf(buf, "v%d = %d\n", i, i);
+  }
+  for (int i = 0; i < scale * 1000; ++i) {
+    int var = i % NVARS;
+    bprintf(buf, "v%d = v%d + %d * 2 - v%u\n", var, (var + 1) % NVARS, i % 97, rng_next(NVARS));
+  }
+}
+
+// Fewer, much larger expressions
+static void gen_expressions(struct strbuf *buf, int scale) {
+  for (int i = 0; i < NVARS; ++i) {
+    bprintf(buf, "v%d = %d\n", i, i);
+  }
+  for (int i = 0; i < scale * 20; ++i) {
+    bprintf(buf, "v%u = ", rng_next(NVARS));
+    gen_expr(buf, 24);
+    bprintf(buf, "\n");
+  }
+}
+
+// Nested for-in loops, where most of the time goes into execution
+static void gen_loops(struct strbuf *buf, int scale) {
+  bprintf(buf, "s = 0\nt = 1\n");
+  for (int i = 0; i < scale; ++i) {
+    int n = 20 + rng_next(20);
+    bprintf(buf, "for i in 0..%d {\n", n);
+    bprintf(buf, "  for j in 0..%d {\n", n);
+    bprintf(buf, "    for k in 0..%d {\n", n / 2);
+    bprintf(buf, "      s = s + i * j - k * t\n");
+    bprintf(buf, "    }\n");
+    bprintf(buf, "    if (s > 1000000) { s = s / %u }\n", rng_next(7) + 2);
+    bprintf(buf, "  }\n");
+    bprintf(buf, "  t = t + s / 1000\n");
+    bprintf(buf, "}\n");
+  }
+  bprintf(buf, "print s\nprint t\n");
+}
+
+// Output-bound programs, printing integers and floats
+static void gen_prints(struct strbuf *buf, int scale) {
+  bprintf(buf, "f = 0.5\n");
+  for (int i = 0; i < scale; ++i) {
+    bprintf(buf, "for i in 0..%d {\n", 500 + rng_next(500));
+    bprintf(buf, "  print i * %u\n", rng_next(1000));
+    bprintf(buf, "  f = f + 0.25\n");
+    bprintf(buf, "  print f\n");
+    bprintf(buf, "}\n");
+    bprintf(buf, "print %u\n", rng_next(100000));
+  }
+}
+
+const struct workload workloads[] = {
+  { "statements", "long list of short assignments", gen_statements },
+  { "expressions", "deeply nested expressions", gen_expressions },
+  { "loops", "nested for-in loops", gen_loops },
+  { "prints", "heavy print output", gen_prints },
+};
+
+const int nworkloads = sizeof(workloads) / sizeof(*workloads);
+
+const struct workload *find_workload(const char *name) {
+  for (int i = 0; i < nworkloads; ++i) {
+    if (!strcmp(workloads[i].name, name)) {
+      return &workloads[i];
+    }
+  }
+  return NULL;
+}
+
+// Returns a NUL terminated program owned by the caller
+char *gen_program(const struct workload *w, int scale, size_t *len) {
+  struct strbuf buf = {};
+  rng_state = GEN_SEED;
+  w->gen(&buf, scale);
+  bprintf(&buf, "%s", "");
+  *len = buf.len;
+  return buf.data;
+}
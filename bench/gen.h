@@ -0,0 +1,26 @@
+#ifndef _H_GEN
+#define _H_GEN
+
+#include <stddef.h>
+
+struct strbuf {
+  char *data;
+  size_t len;
+  size_t capacity;
+};
+
+// Programs are generated from a fixed seed, so every run measures the same
+// source. Their size grows linearly with `scale`.
+struct workload {
+  const char *name;
+  const char *desc;
+  void (*gen)(struct strbuf *buf, int scale);
+};
+
+extern const struct workload workloads[];
+extern const int nworkloads;
+
+const struct workload *find_workload(const char *name);
+char *gen_program(const struct workload *w, int scale, size_t *len);
+
+#endif // _H_GEN
@@ -7,6 +7,8 @@
 #include <stdarg.h>
 #include <stdbool.h>
 #include <errno.h>
+#include <stdint.h>
+#include <inttypes.h>
 
 #undef DEBUG
 #define ENABLE_DEBUG 0
@@ -18,6 +20,72 @@
 #define ARG_TBUF_FILLED 0x1
 #define ARG_COMPILE 0x2
 #define ARG_PRINT_TREE 0x4
+#define ARG_TREE_WALK 0x8
+#define ARG_PRINT_BYTECODE 0x10
+#define ARG_OPTIMIZE 0x20
+#define ARG_JIT 0x40
+#define ARG_STREAM 0x80
+#define ARG_STATS 0x100
+#define ARG_PROFILE 0x200
+#define ARG_NO_CACHE 0x400
+
+/*
+ * arena
+ */
+
+struct arena_block {
+  struct arena_block *next;
+  size_t size;
+  size_t used;
+  _Alignas(16) char data[];
+};
+
+// Bump allocator, everything allocated from it is freed at once by
+// `arena_release`
+struct arena {
+  struct arena_block *head;
+  size_t used;     // bytes handed out
+  size_t reserved; // bytes allocated for blocks
+  int nallocs;
+  int nblocks;
+};
+
+void *arena_alloc(struct arena *arena, size_t size);
+void *arena_calloc(struct arena *arena, size_t size);
+char *arena_strndup(struct arena *arena, const char *s, size_t n);
+void arena_release(struct arena *arena);
+
+/*
+ * context
+ */
+
+struct hashtable;
+
+struct node_pool;
+
+// Interned identifier, every distinct name is stored once per context
+struct symbol {
+  char *name;
+  int len;
+  int slot; // frame slot of the variable + 1, 0 if not resolved yet
+};
+
+// Compilation context, owns memory of tokens, AST and parser state
+struct context {
+  struct arena arena;
+  struct hashtable *symtab; // identifier -> symbol id + 1
+  struct symbol *symbols;   // indexed by symbol id
+  int nsymbols;
+  int symbols_capacity;
+  struct node_pool *pools;  // pools of all parsed programs, newest first
+  struct node_pool *pool;   // pool being filled by the parser
+  struct node_pool *stream; // pool reused by `parse_next` for every statement
+};
+
+void context_init(struct context *ctx);
+void context_destroy(struct context *ctx);
+struct context *default_context();
+uint32_t intern(struct context *ctx, char *name, int len);
 
 /*
  * tokenize
@@ -27,50 +95,101 @@
 #define IS_SPACE(c) (c == ' ' || c == '\t' || c == '\n')
 #define INCR_COL(tokenizer, n) (tokenizer->ncol += n)
 #define INCR_LINE(tokenizer) (tokenizer->ncol = 0, tokenizer->nline++)
-#define MAX_LOOKAHEAD 3
 
 typedef enum {
   TY_INT,
   TY_FLOAT
 } type_kind;
 
-struct type {
-  type_kind kind;
-};
-
+// Keywords and punctuators get a kind of their own when lexed, so the
+// parser only ever compares kinds
 typedef enum {
   TOKEN_NUM,
   TOKEN_FNUM,
-  TOKEN_PUNCT,
   TOKEN_IDENT,
-  TOKEN_EOF
+  TOKEN_EOF,
+  // keywords
+  TOKEN_IF,     // if
+  TOKEN_ELSE,   // else
+  TOKEN_FOR,    // for
+  TOKEN_IN,     // in
+  TOKEN_PRINT,  // print
+  // punctuators
+  TOKEN_LTE,    // <=
+  TOKEN_GTE,    // >=
+  TOKEN_NEQ,    // !=
+  TOKEN_EQ,     // ==
+  TOKEN_DOTDOT, // ..
+  TOKEN_PLUS,   // +
+  TOKEN_MINUS,  // -
+  TOKEN_SLASH,  // /
+  TOKEN_STAR,   // *
+  TOKEN_LT,     // <
+  TOKEN_GT,     // >
+  TOKEN_LPAREN, // (
+  TOKEN_RPAREN, // )
+  TOKEN_LBRACE, // {
+  TOKEN_RBRACE, // }
+  TOKEN_ASSIGN, // =
+  TOKEN_DOT     // .
 } token_kind;
 
+#define NTOKEN_KINDS (TOKEN_DOT + 1)
+
+// Tokens are kept densely packed, their text is addressed by a 32-bit
+// offset into the buffer. Columns are only needed for error messages, so
+// they are recomputed from the offset instead of being stored.
 struct token {
-  token_kind kind;
-  struct type *type;
-  char *start;
-  int len;
-  int nline;
-  int ncol;
+  uint32_t start; // offset of the token in `buf` of the tokenizer
+  uint32_t nline;
+  uint32_t sym;   // symbol id if `kind` is TOKEN_IDENT
+  uint16_t len;
+  uint8_t kind;   // token_kind
+  uint8_t type;   // type_kind of the literal if `kind` is TOKEN_NUM
 };
 
+#define TOK_STR(tokenizer, tok) ((tokenizer)->buf + (tok)->start)
+
+// Tokens are lexed into `tokens` either on demand, as the parser peeks at
+// them, or all at once by `tok_lex_all`. The parser walks them with `pos`,
+// so any number of tokens can be looked ahead at.
+//
+// A source read from a stream is loaded into `buf` in chunks. Only whole
+// lines are shown to the lexer: the byte at `end` is kept in `held` and
+// replaced with the terminating '\0' until the next chunk is read.
 struct tokenizer {
+  struct context *ctx;
   char *buf;
-  char *cur;
-  struct token lookahead[MAX_LOOKAHEAD];
-  int avail_tokens;
+  char *cur; // where lexing continues
+  struct token *tokens;
+  uint32_t ntokens;
+  uint32_t capacity;
+  uint32_t pos; // next token to be consumed by the parser
   int nline;
   int ncol;
+  int fd;         // stream the source is read from, -1 once it is exhausted
+  size_t end;     // length of the source visible to the lexer
+  size_t filled;  // length of the source read so far
+  size_t bufsize; // size of `buf` if owned by the tokenizer
+  char held;
+  bool mapped;    // `buf` is a file mapped into memory
+  bool owns_fd;   // `fd` was opened by the tokenizer
 };
 
 void tokenizer_init(struct tokenizer *tokenizer, char *buf);
+void tokenizer_init_ctx(struct tokenizer *tokenizer, char *buf, struct context *ctx);
+void tokenizer_init_fd(struct tokenizer *tokenizer, int fd, struct context *ctx);
+void tokenizer_init_file(struct tokenizer *tokenizer, const char *fname, bool stream,
+                         struct context *ctx);
+void tokenizer_destroy(struct tokenizer *tokenizer);
+void tok_lex_all(struct tokenizer *tokenizer);
+int tok_col(struct tokenizer *tokenizer, struct token *tok);
 struct token *tok_peek(struct tokenizer *tokenizer);
 struct token *tok_npeek(struct tokenizer *tokenizer, int n);
-int tok_equals(struct token *tok, const char *s);
-void tok_skip(struct tokenizer *tokenizer, const char *s);
-int tok_consume(struct tokenizer *tokenizer, const char *s);
+void tok_skip(struct tokenizer *tokenizer, token_kind kind);
+int tok_consume(struct tokenizer *tokenizer, token_kind kind);
 void tok_consume_lookahead(struct tokenizer *tokenizer);
+const char *token_kind_name(token_kind kind);
 
 /*
  * parse
@@ -97,46 +216,122 @@ typedef enum {
   ND_VAR     // variable
 } node_kind;
 
+#define NNODE_KINDS (ND_VAR + 1)
+
 union actual_value {
-  int num;        // integer value if `kind` is ND_NUM
-  double fnum;    // integer value if `kind` is ND_NUM
+  int64_t num;    // value of TY_INT
+  double fnum;    // value of TY_FLOAT
   char *str;
 };
 
 struct zapp_value {
-  struct type *type;
+  type_kind kind;
   union actual_value val;
 };
 
 struct var {
-  char *name;
-  int len;
+  uint32_t sym; // symbol id in the context that parsed the variable
+  int slot;     // index into `frame`, assigned by `resolve`
 };
 
-struct node {
-  node_kind kind;
-  struct node *next;
-  struct node *lhs;
-  struct node *rhs;
-  struct type *type;
-  union actual_value val;
-  struct var var; // used if `kind` is ND_VAR
+// ND_FOR found not to run a block at a time by the tree walker, so that it
+// is not analyzed again every time the loop is entered
+#define NODE_NO_VEC 1
 
-  // These three are used for conditional jumps
-  struct node *cond;
-  struct node *then;
-  struct node *els;
+// Nodes of a program are stored contiguously in one pool. Children are
+// referenced by 32-bit indices relative to the parent node (0 means there
+// is no child), so a pool can be moved as a whole.
+struct node {
+  uint8_t kind;  // node_kind
+  uint8_t type;  // type_kind of the value produced by the node
+  uint8_t flags; // NODE_* bits learned while the program runs
+  int32_t next;  // next statement of the enclosing block
+  union {
+    // Binary operations and ND_ASSIGN, unary ones and ND_PRINT use only `rhs`
+    struct {
+      int32_t lhs;
+      int32_t rhs;
+    } bin;
+    // ND_IF
+    struct {
+      int32_t cond;
+      int32_t then;
+      int32_t els;
+    } branch;
+    // ND_FOR
+    struct {
+      int32_t init;
+      int32_t cond;
+      int32_t inc;
+      int32_t body;
+    } loop;
+    // ND_BLOCK
+    struct {
+      int32_t body;
+    } block;
+    union actual_value val; // ND_NUM
+    struct var var;         // ND_VAR
+    // Statements other than ND_FOR keep their source line behind the
+    // fields above, ND_FOR uses all of them and has the line of its `init`
+    struct {
+      int32_t fields[3];
+      uint32_t nline; // starting from 1, 0 if made up by the compiler
+    } loc;
+  };
+};
 
-  // For loops
-  struct node *init;
-  struct node *inc;
+#define CHILD(node, field) ((node) + (node)->field)
+#define OPT_CHILD(node, field) ((node)->field ? CHILD(node, field) : NULL)
 
-  // Sequeunce of statements
-  struct node *body;
+struct node_pool {
+  struct node_pool *next;
+  struct node *nodes;
+  uint32_t len;
+  uint32_t capacity;
+  void *map;       // mapping `nodes` were loaded into, NULL if allocated
+  size_t map_size;
 };
 
-struct node *expr(struct tokenizer *tokenizer);
+// Appends a zeroed node to `pool`, which may move the pool
+uint32_t pool_new_node(struct node_pool *pool, node_kind kind);
 struct node *parse(struct tokenizer *tokenizer);
+struct node *parse_next(struct tokenizer *tokenizer);
+uint32_t node_line(struct node *node);
+
+/*
+ * resolve
+ */
+
+// Values of all variables, indexed by slot. Slots are given out once per
+// distinct name and stay valid across `parse` calls. Each slot has a single
+// static type, the value's `kind`, which is widened from TY_INT to TY_FLOAT
+// (converting the value) once any program assigns a float to it. Every
+// thread has a frame of its own, so separate programs can be compiled on
+// separate threads.
+struct frame {
+  struct zapp_value *values;
+  struct symbol *names; // name of the variable owning each slot
+  int nslots;
+  int capacity;
+};
+
+extern _Thread_local struct frame frame;
+
+void resolve(struct context *ctx, struct node *prog);
+int frame_temp(type_kind type);
+void frame_release_temps();
+void frame_destroy();
+struct hashtable *frame_slot_table();
+int frame_add_slot(const char *name, int len, type_kind type);
+
+/*
+ * optimize
+ */
+
+// Folds constant expressions and branches of a resolved program and
+// optimizes its loops. New nodes are added to the pool of `prog`, so the
+// returned program replaces it.
+struct node *optimize(struct context *ctx, struct node *prog);
 
 /*
  * misc
@@ -146,18 +341,266 @@ _Noreturn void panic(const char *fmt, ...);
 
 _Noreturn void panic_tok(struct tokenizer *tokenizer, const char *fmt, ...);
 
+/*
+ * stats
+ */
+
+typedef enum {
+  STAGE_READ,
+  STAGE_LEX,
+  STAGE_PARSE,
+  STAGE_OPTIMIZE,
+  STAGE_COMPILE, // to bytecode or machine code
+  STAGE_EXECUTE,
+  STAGE_CODEGEN,
+  STAGE_CACHE,   // looking programs up in the cache and storing them
+  NSTAGES
+} stage_kind;
+
+// Time spent in every stage is always measured when `enabled` is set, which
+// costs a couple of clock reads per stage. Counters are updated on hot paths,
+// so they are only compiled in with ZAPP_STATS (`make STATS=1`).
+struct stats {
+  bool enabled;
+  double wall[NSTAGES];
+  double cpu[NSTAGES];
+  double wall_start;
+  double cpu_start;
+  uint64_t tokens[NTOKEN_KINDS];
+  uint64_t nodes[NNODE_KINDS];
+  uint64_t nallocs;     // heap allocations of growing arrays
+  uint64_t alloc_bytes;
+};
+
+extern _Thread_local struct stats stats;
+
+#ifdef ZAPP_STATS
+#define STAT_INC(counter) (++stats.counter)
+#define STAT_ALLOC(bytes) (++stats.nallocs, stats.alloc_bytes += (bytes))
+#else
+#define STAT_INC(counter) ((void)0)
+#define STAT_ALLOC(bytes) ((void)0)
+#endif
+
+void stats_start();
+void stats_stop(stage_kind stage);
+void stats_print(struct context *ctx, FILE *fp);
+
+/*
+ * cache
+ */
+
+// Identifies a program in the cache: hash and length of its source, and
+// whether it was optimized
+struct cache_key {
+  uint64_t hash[2];
+  uint64_t len;
+  uint32_t flags;
+};
+
+#define CACHE_OPTIMIZED 0x1
+
+void cache_key_init(struct cache_key *key, const char *src, size_t len, uint32_t flags);
+struct node *cache_load(struct context *ctx, struct cache_key *key);
+void cache_store(struct context *ctx, struct node *prog, struct cache_key *key);
+
+/*
+ * profile
+ */
+
+#define PROFILE_FOLDED "zapp.folded" // where `--profile` writes folded stacks
+
+void profile_execute(struct context *ctx, struct node *prog);
+void profile_report(FILE *fp);
+void profile_write_folded(const char *fname);
+
+/*
+ * output
+ */
+
+#define FMT_INT_SIZE 20    // longest int64_t in decimal
+#define FMT_FLOAT_SIZE 320 // longest double formatted with "%f", with '\0'
+
+// Output captured in memory, e.g. of iterations run ahead of their turn
+struct output_buf {
+  char *data;
+  size_t len;
+  size_t capacity;
+};
+
+int fmt_int(char *buf, int64_t value);
+int fmt_float(char *buf, double value);
+void output_int(int64_t value);
+void output_float(double value);
+void output_flush();
+void output_write(struct output_buf *sink, const char *data, size_t len);
+struct output_buf *output_capture(struct output_buf *sink);
+
 /*
  * ast
  */
 
+// Integer arithmetic wraps around like the machine does, so it is carried out
+// on unsigned values where overflow is defined.
+#define WRAP(lhs, op, rhs) ((int64_t)((uint64_t)(lhs) op (uint64_t)(rhs)))
+
+bool is_range_loop(struct node *loop);
+bool has_assign(struct node *node);
 double eval_node(struct node *node);
+int64_t eval_int(struct node *node);
+double eval_float(struct node *node);
 void execute_node(struct node *node);
 void print_node_tree(struct node *node);
+const char *node_kind_name(node_kind kind);
+
+/*
+ * bytecode
+ */
+
+// Operations with I/F suffix work on int64 and double registers respectively
+typedef enum {
+  OP_HALT,   // stop execution
+  OP_MOVE,   // r[a] = r[b]
+  OP_LOADK,  // r[a] = k[target]
+  OP_I2F,    // r[a] = (double)r[b]
+  OP_F2I,    // r[a] = (int64_t)r[b]
+  OP_TESTF,  // r[a] = r[b] != 0.0
+  OP_ADDI,   // r[a] = r[b] + r[c]
+  OP_SUBI,   // r[a] = r[b] - r[c]
+  OP_MULI,   // r[a] = r[b] * r[c]
+  OP_DIVI,   // r[a] = r[b] / r[c]
+  OP_LTI,    // r[a] = r[b] < r[c]
+  OP_LTEI,   // r[a] = r[b] <= r[c]
+  OP_EQI,    // r[a] = r[b] == r[c]
+  OP_NEQI,   // r[a] = r[b] != r[c]
+  OP_NEGI,   // r[a] = -r[b]
+  OP_ADDF,
+  OP_SUBF,
+  OP_MULF,
+  OP_DIVF,
+  OP_LTF,
+  OP_LTEF,
+  OP_EQF,
+  OP_NEQF,
+  OP_NEGF,
+  OP_JMP,    // pc = target
+  OP_JMPF,   // if (!r[a]) pc = target
+  OP_JMPT,   // if (r[a]) pc = target
+  OP_JLTI,   // if (r[a] < r[b]) pc += (int16_t)c
+  OP_JLTF,
+  OP_PRINTI, // print r[a] as an integer
+  OP_PRINTF, // print r[a] as a float
+  OP_PFOR,   // if loops[a] runs on threads, pc = target once it is done
+  OP_VFOR    // if vec_loops[a] runs a block at a time, pc = target once it is done
+} opcode;
+
+struct instr {
+  uint16_t op;
+  uint16_t a;
+  union {
+    struct {
+      uint16_t b;
+      uint16_t c;
+    };
+    int32_t target; // absolute jump destination
+  };
+};
+
+struct par_loop;
+struct vec_loop;
+
+// Registers are laid out as [variables | constants | temporaries], where
+// variable registers are frame slots. First `nkregs` constants are preloaded
+// into `regs` by the compiler so instructions can address them directly, the
+// rest are loaded from `consts` with OP_LOADK. Registers are untagged, the
+// compiler knows the type of every one of them.
+struct chunk {
+  struct instr *code;
+  int ncode;
+  int capacity;
+  union actual_value *regs;
+  union actual_value *consts;
+  uint8_t *const_types; // type of every constant, for bc_dump
+  int nregs;
+  int nvars;
+  int nconsts;
+  int nkregs;
+  struct par_loop **loops; // loops OP_PFOR may run on threads
+  int nloops;
+  struct vec_loop **vec_loops; // loops OP_VFOR may run a block at a time
+  int nvec_loops;
+  int range; // register holding the start of the range of `bc_compile_range`,
+             // the end is in the next one
+};
+
+struct chunk *bc_compile(struct node *prog);
+struct chunk *bc_compile_range(struct node *loop);
+void bc_free(struct chunk *chunk);
+void bc_dump(struct chunk *chunk);
+void vm_execute(struct chunk *chunk);
+void vm_execute_regs(struct chunk *chunk, union actual_value *regs);
+
+/*
+ * jit
+ */
+
+// Machine code of a program, mapped readable and executable but not writable
+struct jit_code {
+  void *mem;
+  size_t size;
+};
+
+struct jit_code *jit_compile(struct node *prog);
+void jit_execute(struct jit_code *code);
+void jit_free(struct jit_code *code);
 
 /*
  * c_codegen
  */
 
 void c_codegen(struct node *prog, FILE *fp);
+char *c_codegen_str(struct node *prog, size_t *len);
+
+/*
+ * batch
+ */
+
+// Compiles every file of `fnames` to C on `njobs` threads, writing each next
+// to its source with the `.zapp` extension replaced by `.c`
+void compile_batch(char **fnames, int nfiles, int njobs, bool optimize);
+
+/*
+ * parallel
+ */
+
+// Range loop whose iterations can run in any order, on any thread. Every
+// variable the body assigns is either a sum or product of the iterations,
+// or assigned in every iteration before it is read.
+struct par_loop;
+
+// Threads are started by the first loop run on them, so the number of them
+// can only be set before that
+void par_init(int nthreads);
+int par_threads();
+struct par_loop *par_analyze(struct node *loop, bool compiled);
+bool par_execute(struct par_loop *loop);
+bool par_execute_node(struct node *loop);
+void par_free(struct par_loop *loop);
+
+/*
+ * vector
+ */
+
+// Range loop whose body only does arithmetic on the loop variable and values
+// which do not change in the loop, evaluated for a block of iterations at
+// once, each operation by a single kernel over all of them.
+struct vec_loop;
+
+// Loops run a block at a time unless turned off before any program runs
+void vec_init(bool enabled);
+struct vec_loop *vec_analyze(struct node *loop);
+bool vec_execute(struct vec_loop *loop);
+bool vec_execute_node(struct node *loop);
+void vec_free(struct vec_loop *loop);
 
 #endif // _ZAPP_H
@@ -0,0 +1,63 @@
+#include "zapp.h"
+
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#define ARENA_ALIGN 16
+
+static struct arena_block *arena_new_block(struct arena *arena, size_t size) {
+  struct arena_block *block = malloc(sizeof(*block) + size);
+  if (!block) {
+    panic("Error: %s\n", strerror(errno));
+  }
+  block->size = size;
+  block->used = 0;
+  arena->reserved += size;
+  ++arena->nblocks;
+  return block;
+}
+
+void *arena_alloc(struct arena *arena, size_t size) {
+  size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+  struct arena_block *block = arena->head;
+  if (!block || block->size - block->used < size) {
+    // Oversized requests get a block of their own behind the current one,
+    // so the rest of the current block is not wasted.
+    if (size > ARENA_BLOCK_SIZE / 4 && block) {
+      struct arena_block *big = arena_new_block(arena, size);
+      big->next = block->next;
+      block->next = big;
+      big->used = size;
+      arena->used += size;
+      ++arena->nallocs;
+      return big->data;
+    }
+    block = arena_new_block(arena, size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE);
+    block->next = arena->head;
+    arena->head = block;
+  }
+  void *ptr = block->data + block->used;
+  block->used += size;
+  arena->used += size;
+  ++arena->nallocs;
+  return ptr;
+}
+
+void *arena_calloc(struct arena *arena, size_t size) {
+  return memset(arena_alloc(arena, size), 0, size);
+}
+
+char *arena_strndup(struct arena *arena, const char *s, size_t n) {
+  char *str = arena_alloc(arena, n + 1);
+  memcpy(str, s, n);
+  str[n] = '\0';
+  return str;
+}
+
+void arena_release(struct arena *arena) {
+  struct arena_block *block = arena->head;
+  while (block) {
+    struct arena_block *next = block->next;
+    free(block);
+    block = next;
+  }
+  memset(arena, 0, sizeof(*arena));
+}
@@ -1,120 +1,196 @@
 #include "zapp.h"
-#include "hash/hashtable.h"
 
 #define NODE_INDENT_LEN 2
 
-struct hashtable locals = {};
+static int64_t div_int(int64_t lhs, int64_t rhs) {
+  if (rhs == 0) {
+    panic("Error: division by zero\n");
+  }
+  if (rhs == -1) {
+    return WRAP(0, -, lhs);
+  }
+  return lhs / rhs;
+}
+
+static void assign(struct node *var, struct node *rhs) {
+  struct zapp_value *value = &frame.values[var->var.slot];
+  if (var->type == TY_INT) {
+    value->val.num = eval_int(rhs);
+  } else {
+    value->val.fnum = eval_float(rhs);
+  }
+}
+
+// Range loops built by the parser, `var = start`, `var < end`, `var = var + 1`,
+// over an integer variable and an integer end
+bool is_range_loop(struct node *loop) {
+  if (loop->kind != ND_FOR) {
+    return false;
+  }
+  struct node *init = CHILD(loop, loop.init);
+  struct node *cond = CHILD(loop, loop.cond);
+  struct node *inc = CHILD(loop, loop.inc);
+  if (init->kind != ND_ASSIGN || cond->kind != ND_LT || inc->kind != ND_ASSIGN) {
+    return false;
+  }
+  struct node *var = CHILD(init, bin.lhs);
+  struct node *step = CHILD(inc, bin.rhs);
+  return var->type == TY_INT && CHILD(cond, bin.rhs)->type == TY_INT &&
+         CHILD(cond, bin.lhs)->kind == ND_VAR && CHILD(cond, bin.lhs)->var.slot == var->var.slot &&
+         CHILD(inc, bin.lhs)->var.slot == var->var.slot && step->kind == ND_ADD &&
+         CHILD(step, bin.lhs)->kind == ND_VAR && CHILD(step, bin.lhs)->var.slot == var->var.slot &&
+         CHILD(step, bin.rhs)->kind == ND_NUM && CHILD(step, bin.rhs)->type == TY_INT &&
+         CHILD(step, bin.rhs)->val.num == 1;
+}
+
+// Whether evaluating `node` assigns any variable
+bool has_assign(struct node *node) {
+  switch (node->kind) {
+    case ND_ASSIGN:
+      return true;
+    case ND_NUM:
+    case ND_VAR:
+      return false;
+    default:
+      return (node->bin.lhs && has_assign(CHILD(node, bin.lhs))) ||
+             has_assign(CHILD(node, bin.rhs));
+  }
+}
 
-double _eval_node(struct node *node) {
-  double rv = 0;
+// Comparison operands are evaluated in the wider of their types
+static int64_t compare(struct node *node) {
+  struct node *lhs = CHILD(node, bin.lhs);
+  struct node *rhs = CHILD(node, bin.rhs);
+  if (lhs->type == TY_INT && rhs->type == TY_INT) {
+    int64_t l = eval_int(lhs), r = eval_int(rhs);
+    switch (node->kind) {
+      case ND_LT:  return l < r;
+      case ND_LTE: return l <= r;
+      case ND_EQ:  return l == r;
+      default:     return l != r;
+    }
+  }
+  double l = eval_float(lhs), r = eval_float(rhs);
+  switch (node->kind) {
+    case ND_LT:  return l < r;
+    case ND_LTE: return l <= r;
+    case ND_EQ:  return l == r;
+    default:     return l != r;
+  }
+}
+
+// Evaluates node of type TY_INT
+int64_t eval_int(struct node *node) {
   switch(node->kind) {
     case ND_ADD:
-      rv = _eval_node(node->lhs) + _eval_node(node->rhs);
-      break;
+      return WRAP(eval_int(CHILD(node, bin.lhs)), +, eval_int(CHILD(node, bin.rhs)));
     case ND_SUB:
-      rv = _eval_node(node->lhs) - _eval_node(node->rhs);
-      break;
+      return WRAP(eval_int(CHILD(node, bin.lhs)), -, eval_int(CHILD(node, bin.rhs)));
     case ND_MUL:
-      rv = _eval_node(node->lhs) * _eval_node(node->rhs);
-      break;
-    case ND_DIV:
-      rv = _eval_node(node->lhs) / _eval_node(node->rhs);
-      break;
+      return WRAP(eval_int(CHILD(node, bin.lhs)), *, eval_int(CHILD(node, bin.rhs)));
+    case ND_DIV: {
+      int64_t lhs = eval_int(CHILD(node, bin.lhs));
+      return div_int(lhs, eval_int(CHILD(node, bin.rhs)));
+    }
     case ND_LT:
-      rv = _eval_node(node->lhs) < _eval_node(node->rhs);
-      break;
     case ND_LTE:
-      rv = _eval_node(node->lhs) <= _eval_node(node->rhs);
-      break;
     case ND_EQ:
-      rv = _eval_node(node->lhs) == _eval_node(node->rhs);
-      break;
     case ND_NEQ:
-      rv = _eval_node(node->lhs) != _eval_node(node->rhs);
-      break;
+      return compare(node);
     case ND_NUM:
-      if (node->type->kind == TY_INT) {
-        rv = node->val.num;
-      } else {
-        rv = node->val.fnum;
-      }
-      break;
+      return node->val.num;
     case ND_NEG:
-      rv = -_eval_node(node->rhs);
-      break;
+      return WRAP(0, -, eval_int(CHILD(node, bin.rhs)));
+    case ND_ASSIGN:
+      assign(CHILD(node, bin.lhs), CHILD(node, bin.rhs));
+      return frame.values[CHILD(node, bin.lhs)->var.slot].val.num;
     case ND_VAR:
-      if (htable_contains(&locals, node->var.name, strlen(node->var.name))) {
-        void *value = htable_get(&locals, node->var.name, strlen(node->var.name));
-        rv = *(double *)&value;
-      } else {
-        // TODO: Rework panicing on undefined var
-        /* panic_tok(node->tok, "Undefined variable"); */
-      }
-      break;
+      // TODO: Rework panicing on undefined var, for now they read as zero
+      return frame.values[node->var.slot].val.num;
+    default:
+      return 0;
   }
-  return rv;
 }
 
-double eval_node(struct node *node) {
-  if (!locals.buckets) {
-    htable_init(&locals, NULL);
+// Evaluates node of any type as a float
+double eval_float(struct node *node) {
+  if (node->type == TY_INT) {
+    return eval_int(node);
+  }
+  switch(node->kind) {
+    case ND_ADD:
+      return eval_float(CHILD(node, bin.lhs)) + eval_float(CHILD(node, bin.rhs));
+    case ND_SUB:
+      return eval_float(CHILD(node, bin.lhs)) - eval_float(CHILD(node, bin.rhs));
+    case ND_MUL:
+      return eval_float(CHILD(node, bin.lhs)) * eval_float(CHILD(node, bin.rhs));
+    case ND_DIV:
+      return eval_float(CHILD(node, bin.lhs)) / eval_float(CHILD(node, bin.rhs));
+    case ND_NUM:
+      return node->val.fnum;
+    case ND_NEG:
+      return -eval_float(CHILD(node, bin.rhs));
+    case ND_ASSIGN:
+      assign(CHILD(node, bin.lhs), CHILD(node, bin.rhs));
+      return frame.values[CHILD(node, bin.lhs)->var.slot].val.fnum;
+    case ND_VAR:
+      return frame.values[node->var.slot].val.fnum;
+    default:
+      return 0;
   }
-  return _eval_node(node);
+}
+
+double eval_node(struct node *node) {
+  return eval_float(node);
 }
 
 void execute_node(struct node *node) {
-  if (!locals.buckets) {
-    htable_init(&locals, NULL);
-  }
   switch (node->kind) {
     case ND_IF:
-      if (eval_node(node->cond)) {
-        for (struct node *body = node->then->body; body; body = body->next) {
+      if (CHILD(node, branch.cond)->type == TY_INT ? eval_int(CHILD(node, branch.cond))
+                                                   : eval_float(CHILD(node, branch.cond))) {
+        struct node *then = CHILD(node, branch.then);
+        for (struct node *body = OPT_CHILD(then, block.body); body; body = OPT_CHILD(body, next)) {
           execute_node(body);
         }
-      } else {
-        if (node->els) {
-          for (struct node *body = node->els->body; body; body = body->next) {
-            execute_node(body);
-          }
+      } else if (node->branch.els) {
+        struct node *els = CHILD(node, branch.els);
+        for (struct node *body = OPT_CHILD(els, block.body); body; body = OPT_CHILD(body, next)) {
+          execute_node(body);
         }
       }
       break;
     case ND_PRINT:
-      if (node->rhs->type->kind == TY_INT) {
-        printf("%d\n", (int)eval_node(node->rhs));
+      if (CHILD(node, bin.rhs)->type == TY_INT) {
+        output_int(eval_int(CHILD(node, bin.rhs)));
+      }
+      else if (node->type == TY_INT) {
+        output_int((int64_t)eval_float(CHILD(node, bin.rhs)));
       }
-      else if (node->rhs->type->kind == TY_FLOAT) {
-        printf("%lf\n", eval_node(node->rhs));
+      else {
+        output_float(eval_float(CHILD(node, bin.rhs)));
       }
       break;
     case ND_FOR:
-      if (node->init) {
-        execute_node(node->init);
+      execute_node(CHILD(node, loop.init));
+      if (par_execute_node(node) || vec_execute_node(node)) {
+        break;
       }
-      while (eval_node(node->cond) != 0) {
-        execute_node(node->body);
-        if (node->inc) {
-          execute_node(node->inc);
-        }
+      while (eval_int(CHILD(node, loop.cond))) {
+        execute_node(CHILD(node, loop.body));
+        execute_node(CHILD(node, loop.inc));
       }
       break;
-    case ND_ASSIGN: {
-      double tmp = _eval_node(node->rhs);
-      htable_push(
-          &locals, node->lhs->var.name,
-          strlen(node->lhs->var.name),
-          (void *)*(uint64_t *)&tmp
-      );
+    case ND_ASSIGN:
+      assign(CHILD(node, bin.lhs), CHILD(node, bin.rhs));
       break;
-    }
     case ND_BLOCK:
-      for (struct node *tmp = node->body; tmp; tmp = tmp->next) {
+      for (struct node *tmp = OPT_CHILD(node, block.body); tmp; tmp = OPT_CHILD(tmp, next)) {
         execute_node(tmp);
       }
       break;
     default:
-      eval_node(node);
+      eval_float(node);
       break;
   }
 }
@@ -141,45 +217,50 @@ static const char *nodekind_to_str[] = {
 static void _print_node_tree_recursive(struct node *node, int level) {
   switch (node->kind) {
     case ND_NUM:
-      printf("%*c%s : %d\n", level * NODE_INDENT_LEN, ' ', nodekind_to_str[node->kind],
-             node->val.num);
+      if (node->type == TY_INT) {
+        printf("%*c%s : %" PRId64 "\n", level * NODE_INDENT_LEN, ' ',
+               nodekind_to_str[node->kind], node->val.num);
+      } else {
+        printf("%*c%s : %lf\n", level * NODE_INDENT_LEN, ' ',
+               nodekind_to_str[node->kind], node->val.fnum);
+      }
       break;
     case ND_VAR:
       printf("%*c%s : %s\n", level * NODE_INDENT_LEN, ' ', nodekind_to_str[node->kind],
-             node->var.name);
+             frame.names[node->var.slot].name);
       break;
     case ND_IF:
       printf("%*c%s\n", level * NODE_INDENT_LEN, ' ', nodekind_to_str[node->kind]);
-      _print_node_tree_recursive(node->cond, level + 1);
-      _print_node_tree_recursive(node->then, level + 1);
-      if (node->els) {
-        _print_node_tree_recursive(node->els, level + 1);
+      _print_node_tree_recursive(CHILD(node, branch.cond), level + 1);
+      _print_node_tree_recursive(CHILD(node, branch.then), level + 1);
+      if (node->branch.els) {
+        _print_node_tree_recursive(CHILD(node, branch.els), level + 1);
       }
       break;
     case ND_PRINT:
       printf("%*c%s\n", level * NODE_INDENT_LEN, ' ', nodekind_to_str[node->kind]);
-      _print_node_tree_recursive(node->rhs, level + 1);
+      _print_node_tree_recursive(CHILD(node, bin.rhs), level + 1);
       break;
     case ND_FOR:
       printf("%*c%s\n", level * NODE_INDENT_LEN, ' ', nodekind_to_str[node->kind]);
-      _print_node_tree_recursive(node->init, level + 1);
-      _print_node_tree_recursive(node->cond, level + 1);
-      _print_node_tree_recursive(node->inc, level + 1);
-      _print_node_tree_recursive(node->body, level + 1);
+      _print_node_tree_recursive(CHILD(node, loop.init), level + 1);
+      _print_node_tree_recursive(CHILD(node, loop.cond), level + 1);
+      _print_node_tree_recursive(CHILD(node, loop.inc), level + 1);
+      _print_node_tree_recursive(CHILD(node, loop.body), level + 1);
       break;
     case ND_BLOCK:
-      node = node->body;
-      for (; node; node = node->next) {
+      node = OPT_CHILD(node, block.body);
+      for (; node; node = OPT_CHILD(node, next)) {
         _print_node_tree_recursive(node, level);
       }
       break;
     default:
       printf("%*c%s\n", level * NODE_INDENT_LEN, ' ', nodekind_to_str[node->kind]);
-      if (node->lhs) {
-        _print_node_tree_recursive(node->lhs, level + 1);
+      if (node->bin.lhs) {
+        _print_node_tree_recursive(CHILD(node, bin.lhs), level + 1);
       }
-      if (node->rhs) {
-        _print_node_tree_recursive(node->rhs, level + 1);
+      if (node->bin.rhs) {
+        _print_node_tree_recursive(CHILD(node, bin.rhs), level + 1);
       }
   }
 }
@@ -187,3 +268,7 @@ static void _print_node_tree_recursive(struct node *node, int level) {
 void print_node_tree(struct node *node) {
   _print_node_tree_recursive(node, 0);
 }
+
+const char *node_kind_name(node_kind kind) {
+  return nodekind_to_str[kind];
+}
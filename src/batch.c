@@ -0,0 +1,97 @@
+#include <pthread.h>
+
+#include "zapp.h"
+
+// Files are handed out to workers one at a time, so a worker that got
+// small files keeps taking more while another one is busy with a large file
+struct batch {
+  char **fnames;
+  int nfiles;
+  int next; // index of the next file to be compiled
+  bool optimize;
+};
+
+// `a.zapp` is compiled to `a.c`, names without the extension get `.c`
+// appended
+static char *output_name(const char *fname) {
+  size_t len = strlen(fname);
+  const char *ext = ".zapp";
+  if (len > strlen(ext) && !strcmp(fname + len - strlen(ext), ext)) {
+    len -= strlen(ext);
+  }
+  char *name = malloc(len + 3);
+  if (!name) {
+    panic("Error: %s\n", strerror(errno));
+  }
+  memcpy(name, fname, len);
+  strcpy(name + len, ".c");
+  return name;
+}
+
+// Everything a program is compiled with is either local to this call or
+// owned by the calling thread
+static void compile_file(const char *fname, bool optimize_prog) {
+  struct context ctx;
+  context_init(&ctx);
+  struct tokenizer tokenizer;
+  tokenizer_init_file(&tokenizer, fname, false, &ctx);
+  tok_lex_all(&tokenizer);
+  struct node *prog = parse(&tokenizer);
+  tokenizer_destroy(&tokenizer);
+  if (optimize_prog) {
+    prog = optimize(&ctx, prog);
+  }
+
+  char *out_name = output_name(fname);
+  FILE *fp = fopen(out_name, "w");
+  if (!fp) {
+    panic("Error: %s: %s\n", out_name, strerror(errno));
+  }
+  c_codegen(prog, fp);
+  if (fclose(fp) != 0) {
+    panic("Error: %s: %s\n", out_name, strerror(errno));
+  }
+  free(out_name);
+
+  context_destroy(&ctx);
+  frame_destroy();
+}
+
+static void *worker(void *arg) {
+  struct batch *batch = arg;
+  for (;;) {
+    int i = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED);
+    if (i >= batch->nfiles) {
+      return NULL;
+    }
+    compile_file(batch->fnames[i], batch->optimize);
+  }
+}
+
+void compile_batch(char **fnames, int nfiles, int njobs, bool optimize) {
+  struct batch batch = { .fnames = fnames, .nfiles = nfiles, .optimize = optimize };
+  if (njobs > nfiles) {
+    njobs = nfiles;
+  }
+  if (njobs <= 1) {
+    worker(&batch);
+    return;
+  }
+
+  // The calling thread is one of the workers
+  pthread_t *threads = malloc((njobs - 1) * sizeof(pthread_t));
+  if (!threads) {
+    panic("Error: %s\n", strerror(errno));
+  }
+  for (int i = 0; i < njobs - 1; ++i) {
+    int err = pthread_create(&threads[i], NULL, worker, &batch);
+    if (err) {
+      panic("Error: %s\n", strerror(err));
+    }
+  }
+  worker(&batch);
+  for (int i = 0; i < njobs - 1; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+}
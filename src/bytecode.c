@@ -0,0 +1,568 @@
+#include "zapp.h"
+#include "hash/hashtable.h"
+
+#define CHUNK_INITSIZE 64
+#define MAX_REGS UINT16_MAX
+#define MIN_TEMP_REGS 1024
+
+struct bc_compiler {
+  struct chunk *chunk;
+  struct arena arena;      // memory released once compilation is done
+  struct hashtable consts; // constant bits -> constant index + 1
+  int consts_capacity;
+  int temp_base;
+  int ntemps;
+  int max_temps;
+  bool parallel; // loops with independent iterations get OP_PFOR
+};
+
+// Constants are keyed by their type followed by the raw value, so
+// keys may contain zero bytes and must be compared as memory. Integer literals
+// used where a float is expected become float constants.
+struct const_key {
+  char kind;
+  union actual_value value;
+} __attribute__((packed));
+
+static bool const_cmp_func(const char *key1, const char *key2, size_t len) {
+  return !memcmp(key1, key2, len);
+}
+
+static int emit(struct bc_compiler *c, uint16_t op, int a, int b, int cc) {
+  struct chunk *chunk = c->chunk;
+  if (chunk->ncode == chunk->capacity) {
+    chunk->capacity = chunk->capacity ? chunk->capacity * 2 : CHUNK_INITSIZE;
+    chunk->code = realloc(chunk->code, chunk->capacity * sizeof(struct instr));
+    if (!chunk->code) {
+      panic("Error: %s\n", strerror(errno));
+    }
+  }
+  struct instr *ins = &chunk->code[chunk->ncode];
+  ins->op = op;
+  ins->a = a;
+  ins->b = b;
+  ins->c = cc;
+  return chunk->ncode++;
+}
+
+static int emit_jump(struct bc_compiler *c, uint16_t op, int a, int target) {
+  int pc = emit(c, op, a, 0, 0);
+  c->chunk->code[pc].target = target;
+  return pc;
+}
+
+static void patch_jump(struct bc_compiler *c, int pc) {
+  c->chunk->code[pc].target = c->chunk->ncode;
+}
+
+static struct const_key num_key(struct node *node, type_kind want) {
+  struct const_key key = { .kind = want };
+  if (want == TY_INT) {
+    key.value.num = node->val.num;
+  } else {
+    key.value.fnum = node->type == TY_INT ? node->val.num : node->val.fnum;
+  }
+  return key;
+}
+
+static int alloc_temp(struct bc_compiler *c);
+
+// Returns register holding constant `node`, constants which did not fit into
+// the register file are loaded into `dst` (or a temporary) first.
+static int const_reg(struct bc_compiler *c, struct node *node, type_kind want, int dst) {
+  struct const_key key = num_key(node, want);
+  int idx = (intptr_t)htable_get(&c->consts, (char *)&key, sizeof(key)) - 1;
+  if (idx < 0) {
+    panic("ICE: constant missing from the constant table\n");
+  }
+  if (idx < c->chunk->nkregs) {
+    return c->chunk->nvars + idx;
+  }
+  int reg = dst >= 0 ? dst : alloc_temp(c);
+  int pc = emit(c, OP_LOADK, reg, 0, 0);
+  c->chunk->code[pc].target = idx;
+  return reg;
+}
+
+static void *grow(void *arr, int n, int *capacity, size_t size) {
+  if (n < *capacity) {
+    return arr;
+  }
+  *capacity = *capacity ? *capacity * 2 : CHUNK_INITSIZE;
+  arr = realloc(arr, *capacity * size);
+  if (!arr) {
+    panic("Error: %s\n", strerror(errno));
+  }
+  return arr;
+}
+
+static type_kind pick_type(type_kind ty1, type_kind ty2) {
+  if (ty1 == TY_FLOAT || ty2 == TY_FLOAT) {
+    return TY_FLOAT;
+  }
+  return TY_INT;
+}
+
+// Type operands of `node` are evaluated in
+static type_kind operand_type(struct node *node) {
+  switch (node->kind) {
+    case ND_LT:
+    case ND_LTE:
+    case ND_EQ:
+    case ND_NEQ:
+      return pick_type(CHILD(node, bin.lhs)->type, CHILD(node, bin.rhs)->type);
+    case ND_ASSIGN:
+      return CHILD(node, bin.lhs)->type;
+    default:
+      return node->type;
+  }
+}
+
+// First pass: give every distinct constant a register, so temporaries can be
+// placed after them. Variables already own registers through their slots.
+// `want` is the type the value of `node` is used as.
+static void collect_regs(struct bc_compiler *c, struct node *node, type_kind want) {
+  if (!node) {
+    return;
+  }
+  struct chunk *chunk = c->chunk;
+  switch (node->kind) {
+    case ND_VAR:
+      return;
+    case ND_NUM: {
+      struct const_key key = num_key(node, node->type == TY_INT ? want : TY_FLOAT);
+      if (!htable_contains(&c->consts, (char *)&key, sizeof(key))) {
+        chunk->consts = grow(chunk->consts, chunk->nconsts,
+                             &c->consts_capacity, sizeof(union actual_value));
+        chunk->const_types = realloc(chunk->const_types, c->consts_capacity);
+        if (!chunk->const_types) {
+          panic("Error: %s\n", strerror(errno));
+        }
+        chunk->const_types[chunk->nconsts] = key.kind;
+        chunk->consts[chunk->nconsts++] = key.value;
+        struct const_key *stored = arena_alloc(&c->arena, sizeof(*stored));
+        *stored = key;
+        htable_push(&c->consts, (char *)stored, sizeof(*stored),
+                    (void *)(intptr_t)chunk->nconsts);
+      }
+      return;
+    }
+    case ND_BLOCK:
+      for (struct node *cur = OPT_CHILD(node, block.body); cur; cur = OPT_CHILD(cur, next)) {
+        collect_regs(c, cur, cur->type);
+      }
+      return;
+    case ND_IF:
+      collect_regs(c, CHILD(node, branch.cond), CHILD(node, branch.cond)->type);
+      collect_regs(c, CHILD(node, branch.then), TY_INT);
+      collect_regs(c, OPT_CHILD(node, branch.els), TY_INT);
+      return;
+    case ND_FOR:
+      collect_regs(c, CHILD(node, loop.init), TY_INT);
+      collect_regs(c, CHILD(node, loop.cond), TY_INT);
+      collect_regs(c, CHILD(node, loop.inc), TY_INT);
+      collect_regs(c, CHILD(node, loop.body), TY_INT);
+      return;
+    default:
+      collect_regs(c, OPT_CHILD(node, bin.lhs), operand_type(node));
+      collect_regs(c, CHILD(node, bin.rhs), operand_type(node));
+      return;
+  }
+}
+
+static int alloc_temp(struct bc_compiler *c) {
+  int reg = c->temp_base + c->ntemps++;
+  if (c->ntemps > c->max_temps) {
+    c->max_temps = c->ntemps;
+  }
+  if (reg >= MAX_REGS) {
+    panic("Error: expression is too complex to be compiled\n");
+  }
+  return reg;
+}
+
+// Float opcodes follow the integer ones in the same order
+static uint16_t typed_op(uint16_t op, type_kind type) {
+  return type == TY_FLOAT ? op + (OP_ADDF - OP_ADDI) : op;
+}
+
+static uint16_t binary_op(node_kind kind, type_kind type) {
+  switch (kind) {
+    case ND_ADD: return typed_op(OP_ADDI, type);
+    case ND_SUB: return typed_op(OP_SUBI, type);
+    case ND_MUL: return typed_op(OP_MULI, type);
+    case ND_DIV: return typed_op(OP_DIVI, type);
+    case ND_LT:  return typed_op(OP_LTI, type);
+    case ND_LTE: return typed_op(OP_LTEI, type);
+    case ND_EQ:  return typed_op(OP_EQI, type);
+    case ND_NEQ: return typed_op(OP_NEQI, type);
+    default:
+      panic("ICE: node kind %d is not a binary operation\n", kind);
+  }
+}
+
+// Compiles expression `node` and returns register holding its value as type
+// `want`, which is never narrower than the type of `node`. If `dst` is
+// non-negative, the value is guaranteed to end up in that register.
+static int compile_expr(struct bc_compiler *c, struct node *node, type_kind want, int dst) {
+  int reg;
+  if (want != node->type && node->kind != ND_NUM) {
+    int save = c->ntemps;
+    int src = compile_expr(c, node, node->type, -1);
+    c->ntemps = save;
+    reg = dst >= 0 ? dst : alloc_temp(c);
+    emit(c, OP_I2F, reg, src, 0);
+    return reg;
+  }
+  switch (node->kind) {
+    case ND_NUM:
+    case ND_VAR:
+      reg = node->kind == ND_NUM ? const_reg(c, node, want, dst) : node->var.slot;
+      if (dst >= 0 && dst != reg) {
+        emit(c, OP_MOVE, dst, reg, 0);
+        return dst;
+      }
+      return reg;
+    case ND_ASSIGN:
+      reg = CHILD(node, bin.lhs)->var.slot;
+      compile_expr(c, CHILD(node, bin.rhs), node->type, reg);
+      if (dst >= 0 && dst != reg) {
+        emit(c, OP_MOVE, dst, reg, 0);
+        return dst;
+      }
+      return reg;
+    case ND_NEG: {
+      int save = c->ntemps;
+      int rhs = compile_expr(c, CHILD(node, bin.rhs), node->type, -1);
+      c->ntemps = save;
+      reg = dst >= 0 ? dst : alloc_temp(c);
+      emit(c, typed_op(OP_NEGI, node->type), reg, rhs, 0);
+      return reg;
+    }
+    default: {
+      int save = c->ntemps;
+      type_kind type = operand_type(node);
+      int lhs = compile_expr(c, CHILD(node, bin.lhs), type, -1);
+      // Nested assignment on the right could overwrite variable we are
+      // about to read, so take a copy of it first.
+      if (lhs < c->temp_base && has_assign(CHILD(node, bin.rhs))) {
+        lhs = compile_expr(c, CHILD(node, bin.lhs), type, alloc_temp(c));
+      }
+      int rhs = compile_expr(c, CHILD(node, bin.rhs), type, -1);
+      c->ntemps = save;
+      reg = dst >= 0 ? dst : alloc_temp(c);
+      emit(c, binary_op(node->kind, type), reg, lhs, rhs);
+      return reg;
+    }
+  }
+}
+
+static void compile_stmt(struct bc_compiler *c, struct node *node);
+
+static void compile_block(struct bc_compiler *c, struct node *node) {
+  for (struct node *cur = OPT_CHILD(node, block.body); cur; cur = OPT_CHILD(cur, next)) {
+    compile_stmt(c, cur);
+  }
+}
+
+// Jumps back to `body` while r[lhs] < r[rhs]
+static void emit_loop_test(struct bc_compiler *c, int lhs, int rhs, type_kind type, int body) {
+  int offset = body - (c->chunk->ncode + 1);
+  if (offset >= INT16_MIN) {
+    emit(c, type == TY_FLOAT ? OP_JLTF : OP_JLTI, lhs, rhs, (uint16_t)(int16_t)offset);
+    return;
+  }
+  int reg = alloc_temp(c);
+  emit(c, typed_op(OP_LTI, type), reg, lhs, rhs);
+  emit_jump(c, OP_JMPT, reg, body);
+}
+
+// Loop may be run on threads once its variable is initialized, OP_PFOR skips
+// the sequential code then. Returns position of the OP_PFOR or -1.
+static int compile_par_loop(struct bc_compiler *c, struct node *node) {
+  struct chunk *chunk = c->chunk;
+  struct par_loop *loop;
+  if (!c->parallel || chunk->nloops > UINT16_MAX || !(loop = par_analyze(node, true))) {
+    return -1;
+  }
+  chunk->loops = realloc(chunk->loops, (chunk->nloops + 1) * sizeof(struct par_loop *));
+  if (!chunk->loops) {
+    panic("Error: %s\n", strerror(errno));
+  }
+  chunk->loops[chunk->nloops] = loop;
+  return emit_jump(c, OP_PFOR, chunk->nloops++, 0);
+}
+
+// Loop may be evaluated a block of iterations at a time, the same way as
+// `compile_par_loop`. Returns position of the OP_VFOR or -1.
+static int compile_vec_loop(struct bc_compiler *c, struct node *node) {
+  struct chunk *chunk = c->chunk;
+  struct vec_loop *loop;
+  if (chunk->nvec_loops > UINT16_MAX || !(loop = vec_analyze(node))) {
+    return -1;
+  }
+  chunk->vec_loops = realloc(chunk->vec_loops,
+                             (chunk->nvec_loops + 1) * sizeof(struct vec_loop *));
+  if (!chunk->vec_loops) {
+    panic("Error: %s\n", strerror(errno));
+  }
+  chunk->vec_loops[chunk->nvec_loops] = loop;
+  return emit_jump(c, OP_VFOR, chunk->nvec_loops++, 0);
+}
+
+static void compile_for(struct bc_compiler *c, struct node *node) {
+  struct node *cond = CHILD(node, loop.cond);
+  compile_expr(c, CHILD(node, loop.init), CHILD(node, loop.init)->type, -1);
+  int par_jump = compile_par_loop(c, node);
+  int vec_jump = compile_vec_loop(c, node);
+  int test_jump = emit_jump(c, OP_JMP, 0, 0);
+  int body = c->chunk->ncode;
+  compile_block(c, CHILD(node, loop.body));
+  compile_expr(c, CHILD(node, loop.inc), CHILD(node, loop.inc)->type, -1);
+  patch_jump(c, test_jump);
+
+  // Range loops always test `i < end`, so the back edge is normally a single
+  // compare-and-branch unless the body is too long for a 16-bit offset.
+  int save = c->ntemps;
+  int offset = body - (c->chunk->ncode + 1);
+  if (cond->kind == ND_LT && !has_assign(cond) && offset >= INT16_MIN) {
+    type_kind type = operand_type(cond);
+    int lhs = compile_expr(c, CHILD(cond, bin.lhs), type, -1);
+    int rhs = compile_expr(c, CHILD(cond, bin.rhs), type, -1);
+    emit_loop_test(c, lhs, rhs, type, body);
+  } else {
+    int reg = compile_expr(c, cond, TY_INT, -1);
+    emit_jump(c, OP_JMPT, reg, body);
+  }
+  c->ntemps = save;
+  if (par_jump >= 0) {
+    patch_jump(c, par_jump);
+  }
+  if (vec_jump >= 0) {
+    patch_jump(c, vec_jump);
+  }
+}
+
+static void compile_stmt(struct bc_compiler *c, struct node *node) {
+  int save = c->ntemps;
+  switch (node->kind) {
+    case ND_IF: {
+      struct node *expr = CHILD(node, branch.cond);
+      int cond = compile_expr(c, expr, expr->type, -1);
+      if (expr->type == TY_FLOAT) {
+        // Jumps test integer registers, so turn the float into a flag first
+        int reg = alloc_temp(c);
+        emit(c, OP_TESTF, reg, cond, 0);
+        cond = reg;
+      }
+      c->ntemps = save;
+      int else_jump = emit_jump(c, OP_JMPF, cond, 0);
+      compile_block(c, CHILD(node, branch.then));
+      if (node->branch.els) {
+        int end_jump = emit_jump(c, OP_JMP, 0, 0);
+        patch_jump(c, else_jump);
+        compile_block(c, CHILD(node, branch.els));
+        patch_jump(c, end_jump);
+      } else {
+        patch_jump(c, else_jump);
+      }
+      break;
+    }
+    case ND_PRINT: {
+      int save = c->ntemps;
+      int reg = compile_expr(c, CHILD(node, bin.rhs), CHILD(node, bin.rhs)->type, -1);
+      if (node->type != CHILD(node, bin.rhs)->type) {
+        int src = reg;
+        reg = alloc_temp(c);
+        emit(c, OP_F2I, reg, src, 0);
+      }
+      if (node->type == TY_INT) {
+        emit(c, OP_PRINTI, reg, 0, 0);
+      } else {
+        emit(c, OP_PRINTF, reg, 0, 0);
+      }
+      c->ntemps = save;
+      break;
+    }
+    case ND_FOR:
+      compile_for(c, node);
+      break;
+    case ND_BLOCK:
+      compile_block(c, node);
+      break;
+    default:
+      compile_expr(c, node, node->type, -1);
+      break;
+  }
+  c->ntemps = save;
+}
+
+// Compiles `prog`, or if `loop` is given the iterations of range loop `loop`
+// over the two registers starting at `range`
+static struct chunk *compile_chunk(struct node *prog, struct node *loop) {
+  struct bc_compiler c = {};
+  c.chunk = calloc(1, sizeof(struct chunk));
+  if (!c.chunk) {
+    panic("Error: %s\n", strerror(errno));
+  }
+  htable_init(&c.consts, const_cmp_func, &c.arena);
+  c.parallel = !loop && par_threads() > 1;
+
+  struct chunk *chunk = c.chunk;
+  chunk->nvars = frame.nslots;
+  collect_regs(&c, prog, TY_INT);
+  if (loop) {
+    collect_regs(&c, CHILD(loop, loop.inc), TY_INT);
+  }
+  if (chunk->nvars > MAX_REGS - MIN_TEMP_REGS) {
+    panic("Error: program uses too many variables\n");
+  }
+  chunk->nkregs = MAX_REGS - MIN_TEMP_REGS - chunk->nvars;
+  if (chunk->nkregs > chunk->nconsts) {
+    chunk->nkregs = chunk->nconsts;
+  }
+  c.temp_base = chunk->nvars + chunk->nkregs;
+
+  if (loop) {
+    // i = start, body, i = i + 1 while i < end, as `compile_for` does
+    chunk->range = alloc_temp(&c);
+    alloc_temp(&c);
+    int var = CHILD(CHILD(loop, loop.init), bin.lhs)->var.slot;
+    emit(&c, OP_MOVE, var, chunk->range, 0);
+    int test_jump = emit_jump(&c, OP_JMP, 0, 0);
+    int body = chunk->ncode;
+    compile_block(&c, prog);
+    compile_expr(&c, CHILD(loop, loop.inc), CHILD(loop, loop.inc)->type, -1);
+    patch_jump(&c, test_jump);
+    emit_loop_test(&c, var, chunk->range + 1, TY_INT, body);
+  } else {
+    compile_stmt(&c, prog);
+  }
+  emit(&c, OP_HALT, 0, 0, 0);
+
+  chunk->nregs = c.temp_base + c.max_temps;
+  chunk->regs = calloc(chunk->nregs ? chunk->nregs : 1, sizeof(union actual_value));
+  memcpy(&chunk->regs[chunk->nvars], chunk->consts,
+         chunk->nkregs * sizeof(union actual_value));
+  arena_release(&c.arena);
+  return chunk;
+}
+
+struct chunk *bc_compile(struct node *prog) {
+  return compile_chunk(prog, NULL);
+}
+
+// Chunk running the iterations of range loop `loop` from r[range] up to
+// r[range + 1], for threads which each run a part of the loop
+struct chunk *bc_compile_range(struct node *loop) {
+  return compile_chunk(CHILD(loop, loop.body), loop);
+}
+
+void bc_free(struct chunk *chunk) {
+  free(chunk->code);
+  free(chunk->regs);
+  free(chunk->consts);
+  free(chunk->const_types);
+  for (int i = 0; i < chunk->nloops; ++i) {
+    par_free(chunk->loops[i]);
+  }
+  free(chunk->loops);
+  for (int i = 0; i < chunk->nvec_loops; ++i) {
+    vec_free(chunk->vec_loops[i]);
+  }
+  free(chunk->vec_loops);
+  free(chunk);
+}
+
+static const char *opcode_to_str[] = {
+  "HALT",
+  "MOVE",
+  "LOADK",
+  "I2F",
+  "F2I",
+  "TESTF",
+  "ADDI",
+  "SUBI",
+  "MULI",
+  "DIVI",
+  "LTI",
+  "LTEI",
+  "EQI",
+  "NEQI",
+  "NEGI",
+  "ADDF",
+  "SUBF",
+  "MULF",
+  "DIVF",
+  "LTF",
+  "LTEF",
+  "EQF",
+  "NEQF",
+  "NEGF",
+  "JMP",
+  "JMPF",
+  "JMPT",
+  "JLTI",
+  "JLTF",
+  "PRINTI",
+  "PRINTF",
+  "PFOR",
+  "VFOR"
+};
+
+void bc_dump(struct chunk *chunk) {
+  printf("; %d registers: %d variables, %d of %d constants\n",
+         chunk->nregs, chunk->nvars, chunk->nkregs, chunk->nconsts);
+  for (int i = 0; i < chunk->nvars; ++i) {
+    printf(";   r%d = %s\n", i, frame.names[i].name);
+  }
+  for (int i = chunk->nvars; i < chunk->nvars + chunk->nkregs; ++i) {
+    if (chunk->const_types[i - chunk->nvars] == TY_INT) {
+      printf(";   r%d = %" PRId64 "\n", i, chunk->regs[i].num);
+    } else {
+      printf(";   r%d = %g\n", i, chunk->regs[i].fnum);
+    }
+  }
+  for (int pc = 0; pc < chunk->ncode; ++pc) {
+    struct instr *ins = &chunk->code[pc];
+    printf("%4d  %-6s ", pc, opcode_to_str[ins->op]);
+    switch (ins->op) {
+      case OP_HALT:
+        break;
+      case OP_MOVE:
+      case OP_I2F:
+      case OP_F2I:
+      case OP_TESTF:
+      case OP_NEGI:
+      case OP_NEGF:
+        printf("r%d, r%d", ins->a, ins->b);
+        break;
+      case OP_LOADK:
+        printf("r%d, k%d", ins->a, ins->target);
+        break;
+      case OP_JMP:
+        printf("%d", ins->target);
+        break;
+      case OP_JMPF:
+      case OP_JMPT:
+        printf("r%d, %d", ins->a, ins->target);
+        break;
+      case OP_JLTI:
+      case OP_JLTF:
+        printf("r%d, r%d, %d", ins->a, ins->b, pc + 1 + (int16_t)ins->c);
+        break;
+      case OP_PRINTI:
+      case OP_PRINTF:
+        printf("r%d", ins->a);
+        break;
+      case OP_PFOR:
+      case OP_VFOR:
+        printf("loop%d, %d", ins->a, ins->target);
+        break;
+      default:
+        printf("r%d, r%d, r%d", ins->a, ins->b, ins->c);
+        break;
+    }
+    printf("\n");
+  }
+}
@@ -1,164 +1,347 @@
+#include <math.h>
+#include <unistd.h>
+
 #include "zapp.h"
-#include "hash/hashtable.h"
 
 #define INDENT_SIZE 2
+#define EMIT_INITSIZE (64 * 1024)
+#define EMIT_FLUSH_SIZE (256 * 1024)
+
+// Output is collected in a buffer and written out in large chunks. Nearly
+// all of it is fixed strings, names and integers, which are copied in
+// directly, only floats go through printf formatting.
+struct emitter {
+  char *buf;
+  size_t len;
+  size_t capacity;
+  int fd; // where the output is flushed to, -1 to keep all of it in `buf`
+};
+
+static _Thread_local struct emitter out; // output of the program being compiled
+
+// Temporaries of `-O` are named "$t0", "$t1", ..., which is not a valid C
+// identifier. The '$' is replaced by more underscores than any variable of
+// the program starts with, so they can not clash in C either.
+static _Thread_local int temp_underscores;
+
+static void flush() {
+  size_t done = 0;
+  while (done < out.len) {
+    ssize_t n = write(out.fd, out.buf + done, out.len - done);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      panic("Error: %s\n", strerror(errno));
+    }
+    done += n;
+  }
+  out.len = 0;
+}
+
+// Makes room for `len` more bytes, returns where they go
+static char *reserve(size_t len) {
+  if (out.len + len > out.capacity) {
+    while (out.len + len > out.capacity) {
+      out.capacity = out.capacity ? out.capacity * 2 : EMIT_INITSIZE;
+    }
+    out.buf = realloc(out.buf, out.capacity);
+    if (!out.buf) {
+      panic("Error: %s\n", strerror(errno));
+    }
+  }
+  return out.buf + out.len;
+}
+
+static void emit(const char *s, size_t len) {
+  memcpy(reserve(len), s, len);
+  out.len += len;
+  if (out.fd != -1 && out.len >= EMIT_FLUSH_SIZE) {
+    flush();
+  }
+}
+
+#define EMIT_LIT(s) emit(s, sizeof(s) - 1)
+
+// Starts a new line indented by `level`
+static void emit_line(int level) {
+  // Like `%*c` with a space, so a zero width still takes one character
+  int width = level ? level * INDENT_SIZE : 1;
+  char *p = reserve(width + 1);
+  *p = '\n';
+  memset(p + 1, ' ', width);
+  out.len += width + 1;
+}
+
+static void emit_int(int64_t value) {
+  char buf[24];
+  char *p = buf + sizeof(buf);
+  uint64_t abs = value < 0 ? -(uint64_t)value : (uint64_t)value;
+  do {
+    *--p = '0' + abs % 10;
+    abs /= 10;
+  } while (abs);
+  if (value < 0) {
+    *--p = '-';
+  }
+  emit(p, buf + sizeof(buf) - p);
+}
+
+// Floats are printed exactly, as folded constants may need all the digits,
+// and always as a floating literal so C does not turn them into integers
+static void print_float(double value) {
+  char buf[32];
+  int len = snprintf(buf, sizeof(buf), "%.17g", value);
+  emit(buf, len);
+  if (!strpbrk(buf, ".e")) {
+    EMIT_LIT(".0");
+  }
+}
+
+static void count_temp_underscores() {
+  temp_underscores = 1;
+  for (int i = 0; i < frame.nslots; ++i) {
+    char *name = frame.names[i].name;
+    int n = 0;
+    while (name[n] == '_') {
+      ++n;
+    }
+    if (n >= temp_underscores) {
+      temp_underscores = n + 1;
+    }
+  }
+}
+
+static void emit_var(int slot) {
+  struct symbol *name = &frame.names[slot];
+  if (name->name[0] != '$') {
+    emit(name->name, name->len);
+    return;
+  }
+  for (int i = 0; i < temp_underscores; ++i) {
+    EMIT_LIT("_");
+  }
+  emit(name->name + 1, name->len - 1);
+}
 
-static FILE *out; // global output file being compiled
-struct hashtable vars;
+// All variables are declared upfront, as the program may read a variable
+// outside of the block that assigned it. Like in the interpreter, variables
+// which were never assigned read as zero.
+static void declare_vars() {
+  for (int i = 0; i < frame.nslots; ++i) {
+    emit_line(1);
+    if (frame.values[i].kind == TY_INT) {
+      EMIT_LIT("long long ");
+    } else {
+      EMIT_LIT("double ");
+    }
+    emit_var(i);
+    EMIT_LIT(" = 0;");
+  }
+}
 
-__attribute__((format(printf, 1, 2)))
-static void println(const char *fmt, ...) {
-  va_list va;
-  va_start(va, fmt);
-  vfprintf(out, fmt, va);
-  va_end(va);
+static void codegen_init(int fd) {
+  out.len = 0;
+  out.fd = fd;
+  count_temp_underscores();
+  EMIT_LIT("extern int printf(const char *__restrict __format, ...);\n\n");
+  EMIT_LIT("int main(int argc, char **argv) ");
 }
 
-static void codegen_init(FILE *fp) {
-  out = fp;
-  htable_init(&vars, NULL);
-  println("extern int printf(const char *__restrict __format, ...);\n\n");
-  println("int main(int argc, char **argv) ");
+static void c_generate_node(struct node *node);
+
+// Binding strength of operations in C, 0 for everything else
+static int precedence(struct node *node) {
+  switch (node->kind) {
+    case ND_NEG: return 5;
+    case ND_MUL:
+    case ND_DIV: return 4;
+    case ND_ADD:
+    case ND_SUB: return 3;
+    case ND_LT:
+    case ND_LTE: return 2;
+    case ND_EQ:
+    case ND_NEQ: return 1;
+    default: return 0;
+  }
+}
+
+// AST already encodes the order of operations, so operands binding weaker
+// than `parent` are parenthesized. Operations are left associative, hence
+// the right operand needs parentheses on equal precedence as well.
+static void c_generate_operand(struct node *parent, struct node *node) {
+  int prec = precedence(node);
+  bool parens = prec && (prec < precedence(parent) ||
+                         (prec == precedence(parent) && node == CHILD(parent, bin.rhs)));
+  if (parens) {
+    EMIT_LIT("(");
+  }
+  c_generate_node(node);
+  if (parens) {
+    EMIT_LIT(")");
+  }
 }
 
 static void c_generate_node(struct node *node) {
-  static int level = 0;
-  static bool with_newline = 1;
+  static _Thread_local int level = 0;
+  static _Thread_local bool with_newline = 1;
 
   switch (node->kind) {
     case ND_ADD:
-      c_generate_node(node->lhs);
-      println(" + ");
-      c_generate_node(node->rhs);
+      c_generate_operand(node, CHILD(node, bin.lhs));
+      EMIT_LIT(" + ");
+      c_generate_operand(node, CHILD(node, bin.rhs));
       break;
     case ND_SUB:
-      c_generate_node(node->lhs);
-      println(" - ");
-      c_generate_node(node->rhs);
+      c_generate_operand(node, CHILD(node, bin.lhs));
+      EMIT_LIT(" - ");
+      c_generate_operand(node, CHILD(node, bin.rhs));
       break;
     case ND_MUL:
-      c_generate_node(node->lhs);
-      println(" * ");
-      c_generate_node(node->rhs);
+      c_generate_operand(node, CHILD(node, bin.lhs));
+      EMIT_LIT(" * ");
+      c_generate_operand(node, CHILD(node, bin.rhs));
       break;
     case ND_DIV:
-      c_generate_node(node->lhs);
-      println(" / ");
-      c_generate_node(node->rhs);
+      c_generate_operand(node, CHILD(node, bin.lhs));
+      EMIT_LIT(" / ");
+      c_generate_operand(node, CHILD(node, bin.rhs));
       break;
     case ND_LT:
-      c_generate_node(node->lhs);
-      println(" < ");
-      c_generate_node(node->rhs);
+      c_generate_operand(node, CHILD(node, bin.lhs));
+      EMIT_LIT(" < ");
+      c_generate_operand(node, CHILD(node, bin.rhs));
       break;
     case ND_LTE:
-      c_generate_node(node->lhs);
-      println(" <= ");
-      c_generate_node(node->rhs);
+      c_generate_operand(node, CHILD(node, bin.lhs));
+      EMIT_LIT(" <= ");
+      c_generate_operand(node, CHILD(node, bin.rhs));
       break;
     case ND_EQ:
-      c_generate_node(node->lhs);
-      println(" == ");
-      c_generate_node(node->rhs);
+      c_generate_operand(node, CHILD(node, bin.lhs));
+      EMIT_LIT(" == ");
+      c_generate_operand(node, CHILD(node, bin.rhs));
       break;
     case ND_NEQ:
-      c_generate_node(node->lhs);
-      println(" != ");
-      c_generate_node(node->rhs);
+      c_generate_operand(node, CHILD(node, bin.lhs));
+      EMIT_LIT(" != ");
+      c_generate_operand(node, CHILD(node, bin.rhs));
       break;
     case ND_NEG:
-      println("-");
-      c_generate_node(node->rhs);
+      EMIT_LIT("-");
+      c_generate_operand(node, CHILD(node, bin.rhs));
       break;
     case ND_ASSIGN:
       if (with_newline) {
-        println("\n%*c", level * INDENT_SIZE, ' ');
-      }
-      if (!htable_contains(&vars, node->lhs->var.name, node->lhs->var.len)) {
-        htable_push(&vars, node->lhs->var.name, node->lhs->var.len, NULL);
-        if (node->lhs->type->kind == TY_INT) {
-          println("int ");
-        } else if (node->lhs->type->kind == TY_FLOAT) {
-          println("double ");
-        }
+        emit_line(level);
       }
-
-      c_generate_node(node->lhs);
-      println(" = ");
-      c_generate_node(node->rhs);
+      c_generate_operand(node, CHILD(node, bin.lhs));
+      EMIT_LIT(" = ");
+      c_generate_operand(node, CHILD(node, bin.rhs));
 
       if (with_newline) {
-        println(";");
+        EMIT_LIT(";");
       }
       break;
     case ND_FOR:
       with_newline = 0;
-      println("\n%*cfor (", level * INDENT_SIZE, ' ');
-      if (node->init) {
-        c_generate_node(node->init);
-        println("; ");
-      }
-
-      if (node->cond) {
-        c_generate_node(node->cond);
-      }
-      println("; ");
-      if (node->inc) {
-        c_generate_node(node->inc);
-      }
+      emit_line(level);
+      EMIT_LIT("for (");
+      c_generate_node(CHILD(node, loop.init));
+      EMIT_LIT("; ");
+      c_generate_node(CHILD(node, loop.cond));
+      EMIT_LIT("; ");
+      c_generate_node(CHILD(node, loop.inc));
 
-      println(") ");
+      EMIT_LIT(") ");
       with_newline = 1;
-      c_generate_node(node->body);
+      c_generate_node(CHILD(node, loop.body));
       break;
     case ND_IF:
-      println("\n%*cif (", level * INDENT_SIZE, ' ');
-      c_generate_node(node->cond);
-      println(") ");
-      c_generate_node(node->then);
-      if (node->els) {
-        println(" else ");
-        c_generate_node(node->els);
+      emit_line(level);
+      EMIT_LIT("if (");
+      c_generate_node(CHILD(node, branch.cond));
+      EMIT_LIT(") ");
+      c_generate_node(CHILD(node, branch.then));
+      if (node->branch.els) {
+        EMIT_LIT(" else ");
+        c_generate_node(CHILD(node, branch.els));
       }
       break;
-    case ND_PRINT: {
-        char *spec = "%d";
-        if (node->rhs->type->kind == TY_FLOAT) {
-          spec = "%lf";
-        }
-        println("\n%*cprintf(\"%s\\n\", ", level * INDENT_SIZE, ' ', spec);
-        c_generate_node(node->rhs);
-        println(");");
-        break;
+    case ND_PRINT:
+      // Cast as literals and comparisons are plain `int` in C
+      emit_line(level);
+      if (node->type == TY_FLOAT) {
+        EMIT_LIT("printf(\"%lf\\n\", (double)(");
+      } else {
+        EMIT_LIT("printf(\"%lld\\n\", (long long)(");
       }
+      c_generate_node(CHILD(node, bin.rhs));
+      EMIT_LIT("));");
+      break;
     case ND_BLOCK:
       ++level;
-      println("{");
-      for (struct node *cur = node->body; cur; cur = cur->next) {
+      EMIT_LIT("{");
+      if (level == 1) {
+        declare_vars();
+      }
+      for (struct node *cur = OPT_CHILD(node, block.body); cur; cur = OPT_CHILD(cur, next)) {
         c_generate_node(cur);
       }
       --level;
       if (level) {
-        println("\n%*c}", level * INDENT_SIZE, ' ');
+        emit_line(level);
+        EMIT_LIT("}");
       } else {
-        println("\n}");
+        EMIT_LIT("\n}");
       }
       break;
     case ND_NUM:
-      if (node->type->kind == TY_INT) {
-        println("%d", node->val.num);
-      } else if (node->type->kind == TY_FLOAT) {
-        println("%lf", node->val.fnum);
+      // Folded constants may be negative, keep them from merging with a
+      // preceding minus into `--`
+      if (node->type == TY_INT && node->val.num == INT64_MIN) {
+        EMIT_LIT("(-9223372036854775807 - 1)");
+      } else if (node->type == TY_INT && node->val.num < 0) {
+        EMIT_LIT("(");
+        emit_int(node->val.num);
+        EMIT_LIT(")");
+      } else if (node->type == TY_INT) {
+        emit_int(node->val.num);
+      } else if (node->type == TY_FLOAT) {
+        if (signbit(node->val.fnum)) {
+          EMIT_LIT("(");
+        }
+        print_float(node->val.fnum);
+        if (signbit(node->val.fnum)) {
+          EMIT_LIT(")");
+        }
       }
       break;
     case ND_VAR:
-      println("%.*s", node->var.len, node->var.name);
+      emit_var(node->var.slot);
       break;
   }
 }
 
 void c_codegen(struct node *prog, FILE *fp) {
-  codegen_init(fp);
+  // Anything already written through `fp` has to come first
+  fflush(fp);
+  codegen_init(fileno(fp));
   c_generate_node(prog);
-  println("\n");
+  EMIT_LIT("\n");
+  flush();
+}
+
+// Returns the generated code as a string owned by the caller, `len` is set
+// to its length
+char *c_codegen_str(struct node *prog, size_t *len) {
+  codegen_init(-1);
+  c_generate_node(prog);
+  EMIT_LIT("\n");
+  *reserve(1) = '\0';
+
+  char *buf = out.buf;
+  *len = out.len;
+  out = (struct emitter){};
+  return buf;
 }
@@ -0,0 +1,352 @@
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "zapp.h"
+
+// Bump whenever nodes are laid out or typed differently or the layout of the
+// file changes, files written by other versions are taken for misses and
+// overwritten
+#define CACHE_VERSION 2
+// Checksum of the sources zapp is built from, set by the Makefile, so that
+// files written by any other build are misses even if nobody bumped the
+// version
+#ifndef ZAPP_BUILD_ID
+#define ZAPP_BUILD_ID 0
+#endif
+#define CACHE_MAGIC "zappast"
+#define CACHE_ALIGN 64
+// Programs of larger sources would make for caches of several times their
+// size, and lexing them takes long enough for the cache not to matter
+#define CACHE_MAX_SOURCE (64 * 1024 * 1024)
+
+#define HASH_K1 0x9e3779b97f4a7c15ULL
+#define HASH_K2 0xc2b2ae3d27d4eb4fULL
+
+// A cache file is the pool of a resolved program, as nodes only refer to
+// each other by relative offsets, followed by the frame slots the program
+// was resolved to. Slot names are stored after all slots.
+struct cache_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t node_size;
+  uint64_t build;
+  struct cache_key key;
+  uint32_t nnodes;
+  uint32_t root;
+  uint32_t nslots;
+  uint32_t names_len;
+  uint64_t nodes_offset;
+  uint64_t slots_offset;
+  uint64_t names_offset;
+};
+
+struct cache_slot {
+  uint32_t name; // offset of the name from `names_offset`
+  uint32_t len;
+  uint32_t type; // type_kind
+};
+
+static uint64_t rotl(uint64_t x, int n) {
+  return (x << n) | (x >> (64 - n));
+}
+
+// Final mix of MurmurHash3
+static uint64_t fmix(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+// Sources are hashed a word at a time in two independent lanes, which gives
+// 128 bits of hash at a fraction of the cost of lexing
+void cache_key_init(struct cache_key *key, const char *src, size_t len, uint32_t flags) {
+  uint64_t a = HASH_K1 ^ len, b = HASH_K2;
+  size_t i = 0;
+  for (; i + 8 <= len; i += 8) {
+    uint64_t word;
+    memcpy(&word, src + i, 8);
+    a = rotl(a ^ word, 29) * HASH_K1;
+    b = rotl(b + word, 31) * HASH_K2;
+  }
+  uint64_t tail = 0;
+  memcpy(&tail, src + i, len - i);
+  a = rotl(a ^ tail, 29) * HASH_K1;
+  b = rotl(b + tail, 31) * HASH_K2;
+
+  memset(key, 0, sizeof(*key));
+  key->hash[0] = fmix(a + b);
+  key->hash[1] = fmix(a ^ rotl(b, 17));
+  key->len = len;
+  key->flags = flags;
+}
+
+// Creates directory `path` along with any missing parents
+static bool make_dirs(char *path) {
+  for (char *p = path + 1;; ++p) {
+    if (*p == '/' || !*p) {
+      char c = *p;
+      *p = '\0';
+      bool ok = mkdir(path, 0755) == 0 || errno == EEXIST;
+      *p = c;
+      if (!ok || !c) {
+        return ok;
+      }
+    }
+  }
+}
+
+// Cache lives in ZAPP_CACHE_DIR, $XDG_CACHE_HOME/zapp or ~/.cache/zapp. An
+// empty ZAPP_CACHE_DIR turns caching off.
+static bool cache_path(char *path, size_t size, struct cache_key *key) {
+  char dir[PATH_MAX];
+  const char *env;
+  if ((env = getenv("ZAPP_CACHE_DIR"))) {
+    snprintf(dir, sizeof(dir), "%s", env);
+  } else if ((env = getenv("XDG_CACHE_HOME")) && *env) {
+    snprintf(dir, sizeof(dir), "%s/zapp", env);
+  } else if ((env = getenv("HOME")) && *env) {
+    snprintf(dir, sizeof(dir), "%s/.cache/zapp", env);
+  } else {
+    return false;
+  }
+  if (!*dir || !make_dirs(dir)) {
+    return false;
+  }
+  int len = snprintf(path, size, "%s/%016" PRIx64 "%016" PRIx64 "-%x.ast", dir,
+                     key->hash[0], key->hash[1], key->flags);
+  return len > 0 && (size_t)len < size;
+}
+
+// Identity of this build, which also tells apart builds of changed sources
+// made without the Makefile if they have a different set of node kinds
+static uint64_t build_id() {
+  return (uint64_t)ZAPP_BUILD_ID << 32 | NNODE_KINDS;
+}
+
+static bool header_valid(struct cache_header *hdr, size_t size, struct cache_key *key) {
+  if (memcmp(hdr->magic, CACHE_MAGIC, sizeof(hdr->magic)) || hdr->version != CACHE_VERSION ||
+      hdr->node_size != sizeof(struct node) || hdr->build != build_id() ||
+      memcmp(&hdr->key, key, sizeof(*key))) {
+    return false;
+  }
+  return hdr->nnodes && hdr->root < hdr->nnodes && hdr->nodes_offset % CACHE_ALIGN == 0 &&
+         hdr->nodes_offset >= sizeof(*hdr) &&
+         hdr->slots_offset == hdr->nodes_offset + (uint64_t)hdr->nnodes * sizeof(struct node) &&
+         hdr->names_offset == hdr->slots_offset + (uint64_t)hdr->nslots * sizeof(struct cache_slot) &&
+         hdr->names_offset + hdr->names_len == size;
+}
+
+// Nodes of a mapped file still to be checked by `nodes_valid`
+struct node_check {
+  struct node *nodes;
+  uint32_t nnodes;
+  uint8_t *seen;
+  uint32_t *stack;
+  uint32_t top;
+};
+
+static bool check_child(struct node_check *check, uint32_t parent, int32_t offset, bool required) {
+  if (!offset) {
+    return !required;
+  }
+  int64_t child = (int64_t)parent + offset;
+  if (child < 0 || child >= check->nnodes) {
+    return false;
+  }
+  if (check->seen[child]) {
+    // Loops share the node of their variable, leaves can not make a cycle
+    struct node *node = &check->nodes[child];
+    return node->kind == ND_VAR || node->kind == ND_NUM;
+  }
+  check->seen[child] = 1;
+  check->stack[check->top++] = child;
+  return true;
+}
+
+// Checks that the nodes of a mapped file form a tree under `root`, apart from
+// shared leaves, with children where the walker, the VM and the JIT expect
+// them and variables in the `nslots` slots of the file, so that a corrupted
+// or planted file can not make them read outside of the pool or the frame
+static bool nodes_valid(struct node *nodes, uint32_t nnodes, uint32_t root, uint32_t nslots) {
+  struct node_check check = { nodes, nnodes, calloc(nnodes, 1), malloc(nnodes * sizeof(uint32_t)), 0 };
+  if (!check.seen || !check.stack) {
+    panic("Error: %s\n", strerror(errno));
+  }
+  bool ok = nodes[root].kind == ND_BLOCK;
+  check.seen[root] = 1;
+  check.stack[check.top++] = root;
+  while (ok && check.top) {
+    uint32_t i = check.stack[--check.top];
+    struct node *node = &nodes[i];
+    if (node->kind >= NNODE_KINDS || node->type > TY_FLOAT || !check_child(&check, i, node->next, false)) {
+      ok = false;
+      break;
+    }
+    switch (node->kind) {
+      case ND_NUM:
+        break;
+      case ND_VAR:
+        ok = node->var.slot >= 0 && (uint32_t)node->var.slot < nslots;
+        break;
+      case ND_BLOCK:
+        ok = check_child(&check, i, node->block.body, false);
+        break;
+      case ND_IF:
+        ok = check_child(&check, i, node->branch.cond, true) &&
+             check_child(&check, i, node->branch.then, true) &&
+             check_child(&check, i, node->branch.els, false);
+        break;
+      case ND_FOR:
+        ok = check_child(&check, i, node->loop.init, true) &&
+             check_child(&check, i, node->loop.cond, true) &&
+             check_child(&check, i, node->loop.inc, true) &&
+             check_child(&check, i, node->loop.body, true);
+        break;
+      case ND_NEG:
+      case ND_PRINT:
+        ok = check_child(&check, i, node->bin.rhs, true);
+        break;
+      case ND_ASSIGN:
+        ok = check_child(&check, i, node->bin.lhs, true) && CHILD(node, bin.lhs)->kind == ND_VAR &&
+             check_child(&check, i, node->bin.rhs, true);
+        break;
+      default:
+        ok = check_child(&check, i, node->bin.lhs, true) &&
+             check_child(&check, i, node->bin.rhs, true);
+        break;
+    }
+  }
+  free(check.seen);
+  free(check.stack);
+  return ok;
+}
+
+// Maps the program cached under `key` into a pool of `ctx` and restores the
+// frame it was resolved with, returns NULL if it is not in the cache. Nodes
+// are mapped copy-on-write and checked once, which takes a single pass over
+// them, far less than lexing and parsing the source.
+struct node *cache_load(struct context *ctx, struct cache_key *key) {
+  char path[PATH_MAX];
+  // Slots are restored at the positions they were stored at
+  if (frame.nslots || !cache_path(path, sizeof(path), key)) {
+    return NULL;
+  }
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    return NULL;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct cache_header)) {
+    close(fd);
+    return NULL;
+  }
+  char *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    return NULL;
+  }
+
+  struct cache_header *hdr = (struct cache_header *)map;
+  bool valid = header_valid(hdr, st.st_size, key);
+  struct cache_slot *slots = valid ? (struct cache_slot *)(map + hdr->slots_offset) : NULL;
+  for (uint32_t i = 0; valid && i < hdr->nslots; ++i) {
+    valid = (uint64_t)slots[i].name + slots[i].len <= hdr->names_len && slots[i].len &&
+            slots[i].type <= TY_FLOAT;
+  }
+  valid = valid && nodes_valid((struct node *)(map + hdr->nodes_offset), hdr->nnodes, hdr->root,
+                               hdr->nslots);
+  if (!valid) {
+    munmap(map, st.st_size);
+    return NULL;
+  }
+  for (uint32_t i = 0; i < hdr->nslots; ++i) {
+    frame_add_slot(map + hdr->names_offset + slots[i].name, slots[i].len, slots[i].type);
+  }
+
+  struct node_pool *pool = calloc(1, sizeof(*pool));
+  if (!pool) {
+    panic("Error: %s\n", strerror(errno));
+  }
+  pool->nodes = (struct node *)(map + hdr->nodes_offset);
+  pool->len = pool->capacity = hdr->nnodes;
+  pool->map = map;
+  pool->map_size = st.st_size;
+  pool->next = ctx->pools;
+  ctx->pools = pool;
+  return &pool->nodes[hdr->root];
+}
+
+static bool write_cache(FILE *fp, struct node_pool *pool, struct cache_header *hdr) {
+  static const char padding[CACHE_ALIGN];
+  bool ok = fwrite(hdr, sizeof(*hdr), 1, fp) == 1 &&
+            fwrite(padding, 1, hdr->nodes_offset - sizeof(*hdr), fp) ==
+                hdr->nodes_offset - sizeof(*hdr) &&
+            fwrite(pool->nodes, sizeof(struct node), pool->len, fp) == pool->len;
+  uint32_t name = 0;
+  for (int i = 0; ok && i < frame.nslots; ++i) {
+    struct cache_slot slot = { name, frame.names[i].len, frame.values[i].kind };
+    ok = fwrite(&slot, sizeof(slot), 1, fp) == 1;
+    name += slot.len;
+  }
+  for (int i = 0; ok && i < frame.nslots; ++i) {
+    ok = fwrite(frame.names[i].name, frame.names[i].len, 1, fp) == 1;
+  }
+  return ok;
+}
+
+// Stores program `prog` of `ctx`, which has to be the only program resolved
+// so far. Failing to store it is not an error, the program is just parsed
+// again next time. The file is written under a temporary name and renamed
+// into place, so processes storing the same program at once never see a
+// partial file.
+void cache_store(struct context *ctx, struct node *prog, struct cache_key *key) {
+  struct node_pool *pool = NULL;
+  for (struct node_pool *cur = ctx->pools; cur; cur = cur->next) {
+    if (prog >= cur->nodes && prog < cur->nodes + cur->len) {
+      pool = cur;
+    }
+  }
+  char path[PATH_MAX], tmp[PATH_MAX + 8];
+  if (!pool || key->len > CACHE_MAX_SOURCE || !cache_path(path, sizeof(path), key)) {
+    return;
+  }
+
+  struct cache_header hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, CACHE_MAGIC, sizeof(hdr.magic));
+  hdr.version = CACHE_VERSION;
+  hdr.node_size = sizeof(struct node);
+  hdr.build = build_id();
+  hdr.key = *key;
+  hdr.nnodes = pool->len;
+  hdr.root = prog - pool->nodes;
+  hdr.nslots = frame.nslots;
+  for (int i = 0; i < frame.nslots; ++i) {
+    hdr.names_len += frame.names[i].len;
+  }
+  hdr.nodes_offset = (sizeof(hdr) + CACHE_ALIGN - 1) / CACHE_ALIGN * CACHE_ALIGN;
+  hdr.slots_offset = hdr.nodes_offset + (uint64_t)pool->len * sizeof(struct node);
+  hdr.names_offset = hdr.slots_offset + (uint64_t)frame.nslots * sizeof(struct cache_slot);
+
+  snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+  int fd = mkstemp(tmp);
+  if (fd == -1) {
+    return;
+  }
+  FILE *fp = fdopen(fd, "wb");
+  if (!fp) {
+    close(fd);
+    unlink(tmp);
+    return;
+  }
+  bool ok = write_cache(fp, pool, &hdr);
+  if (fclose(fp) != 0 || !ok || rename(tmp, path) != 0) {
+    unlink(tmp);
+  }
+}
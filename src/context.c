@@ -0,0 +1,65 @@
+#include <sys/mman.h>
+
+#include "zapp.h"
+#include "hash/hashtable.h"
+
+#define SYMBOLS_INITSIZE 64
+
+void context_init(struct context *ctx) {
+  memset(ctx, 0, sizeof(*ctx));
+  ctx->symtab = arena_alloc(&ctx->arena, sizeof(struct hashtable));
+  htable_init(ctx->symtab, NULL, &ctx->arena);
+}
+
+void context_destroy(struct context *ctx) {
+  struct node_pool *pool = ctx->pools;
+  while (pool) {
+    struct node_pool *next = pool->next;
+    if (pool->map) {
+      munmap(pool->map, pool->map_size);
+    } else {
+      free(pool->nodes);
+    }
+    free(pool);
+    pool = next;
+  }
+  ctx->pools = ctx->pool = ctx->stream = NULL;
+  free(ctx->symbols);
+  ctx->symbols = NULL;
+  ctx->nsymbols = ctx->symbols_capacity = 0;
+  arena_release(&ctx->arena);
+  ctx->symtab = NULL;
+}
+
+// Context used by tokenizers that were not given one explicitly, lives until
+// the process exits
+struct context *default_context() {
+  static struct context ctx;
+  if (!ctx.symtab) {
+    context_init(&ctx);
+  }
+  return &ctx;
+}
+
+uint32_t intern(struct context *ctx, char *name, int len) {
+  intptr_t sym = (intptr_t)htable_get(ctx->symtab, name, len);
+  if (sym) {
+    return sym - 1;
+  }
+
+  if (ctx->nsymbols == ctx->symbols_capacity) {
+    ctx->symbols_capacity = ctx->symbols_capacity ? ctx->symbols_capacity * 2
+                                                  : SYMBOLS_INITSIZE;
+    ctx->symbols = realloc(ctx->symbols, ctx->symbols_capacity * sizeof(struct symbol));
+    if (!ctx->symbols) {
+      panic("Error: %s\n", strerror(errno));
+    }
+    STAT_ALLOC(ctx->symbols_capacity * sizeof(struct symbol));
+  }
+  struct symbol *symbol = &ctx->symbols[ctx->nsymbols];
+  memset(symbol, 0, sizeof(*symbol));
+  symbol->name = arena_strndup(&ctx->arena, name, len);
+  symbol->len = len;
+  htable_push(ctx->symtab, symbol->name, len, (void *)(intptr_t)++ctx->nsymbols);
+  return ctx->nsymbols - 1;
+}
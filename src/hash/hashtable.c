@@ -1,7 +1,15 @@
+#include "zapp.h"
 #include "hashtable.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define H1(hash) ((hash) >> 7)
+#define H2(hash) ((int8_t)((hash) & 0x7f))
+
 static int hash_round_size(int size) {
-  int i = 1;
+  int i = HASHTABLE_INITSIZE;
   while (i < size) {
     i <<= 1;
   }
@@ -21,25 +29,105 @@ static uint64_t fnv_hash(char *key, int n) {
   return hash;
 }
 
+// Bitmask of positions in the group starting at `ctrl` holding `byte`
+static inline uint32_t group_match(const int8_t *ctrl, int8_t byte) {
+#ifdef __SSE2__
+  __m128i group = _mm_loadu_si128((const __m128i *)ctrl);
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(byte)));
+#else
+  uint32_t mask = 0;
+  for (int i = 0; i < HASHTABLE_GROUP_WIDTH; ++i) {
+    mask |= (uint32_t)(ctrl[i] == byte) << i;
+  }
+  return mask;
+#endif
+}
+
+// Bitmask of positions in the group which are either empty or deleted, both
+// states have the sign bit set while full slots do not.
+static inline uint32_t group_match_free(const int8_t *ctrl) {
+#ifdef __SSE2__
+  return _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)ctrl));
+#else
+  uint32_t mask = 0;
+  for (int i = 0; i < HASHTABLE_GROUP_WIDTH; ++i) {
+    mask |= (uint32_t)(ctrl[i] < 0) << i;
+  }
+  return mask;
+#endif
+}
+
+static void set_ctrl(struct hashtable *ht, int i, int8_t byte) {
+  ht->ctrl[i] = byte;
+  if (i < HASHTABLE_GROUP_WIDTH) {
+    ht->ctrl[ht->nbuckets + i] = byte;
+  }
+}
+
 static struct hashtable_entry *htable_find(struct hashtable *ht, char *key,
                                            int len, uint64_t hash) {
-  struct hashtable_entry *entry = ht->buckets[hash & (ht->nbuckets - 1)];
-  while (entry) {
-    if (hash == entry->hash_key && ht->cmp_func(key, entry->key, len)) {
-      return entry;
+  int mask = ht->nbuckets - 1;
+  int pos = H1(hash) & mask;
+  for (int step = HASHTABLE_GROUP_WIDTH;; step += HASHTABLE_GROUP_WIDTH) {
+    const int8_t *group = &ht->ctrl[pos];
+    for (uint32_t match = group_match(group, H2(hash)); match; match &= match - 1) {
+      struct hashtable_entry *entry = &ht->buckets[(pos + __builtin_ctz(match)) & mask];
+      if (entry->len == len && ht->cmp_func(key, entry->key, len)) {
+        return entry;
+      }
+    }
+    if (group_match(group, HASHTABLE_CTRL_EMPTY)) {
+      return NULL;
     }
-    entry = entry->next;
+    pos = (pos + step) & mask;
   }
-  return NULL;
 }
 
-int htable_init(struct hashtable *ht, hashtable_cmp_func cmp_func) {
-  ht->buckets = calloc(1, HASHTABLE_INITSIZE * sizeof(struct hashtable_entry *));
-  if (!ht->buckets) {
+// Returns slot where the key with `hash` should be inserted, table is never
+// full so this always succeeds
+static int htable_find_free(struct hashtable *ht, uint64_t hash) {
+  int mask = ht->nbuckets - 1;
+  int pos = H1(hash) & mask;
+  for (int step = HASHTABLE_GROUP_WIDTH;; step += HASHTABLE_GROUP_WIDTH) {
+    uint32_t match = group_match_free(&ht->ctrl[pos]);
+    if (match) {
+      return (pos + __builtin_ctz(match)) & mask;
+    }
+    pos = (pos + step) & mask;
+  }
+}
+
+static int htable_alloc(struct hashtable *ht, int nbuckets) {
+  size_t ctrl_size = nbuckets + HASHTABLE_GROUP_WIDTH;
+  size_t size = ctrl_size + nbuckets * sizeof(struct hashtable_entry);
+  char *mem = ht->arena ? arena_alloc(ht->arena, size) : malloc(size);
+  if (!mem) {
     return 1;
   }
+  memset(mem, HASHTABLE_CTRL_EMPTY, ctrl_size);
+  ht->ctrl = (int8_t *)mem;
+  ht->buckets = (struct hashtable_entry *)(mem + ctrl_size);
+  ht->nbuckets = nbuckets;
   ht->nentries = 0;
-  ht->nbuckets = HASHTABLE_INITSIZE;
+  ht->ndeleted = 0;
+  return 0;
+}
+
+void htable_destroy(struct hashtable *ht) {
+  if (!ht->arena) {
+    free(ht->ctrl);
+  }
+  ht->ctrl = NULL;
+  ht->buckets = NULL;
+  ht->nbuckets = ht->nentries = ht->ndeleted = ht->nrehashes = 0;
+}
+
+int htable_init(struct hashtable *ht, hashtable_cmp_func cmp_func, struct arena *arena) {
+  ht->arena = arena;
+  ht->nrehashes = 0;
+  if (htable_alloc(ht, HASHTABLE_INITSIZE)) {
+    return 1;
+  }
   if (!cmp_func) {
     ht->cmp_func = default_cmp_func;
   } else {
@@ -48,92 +136,119 @@ int htable_init(struct hashtable *ht, hashtable_cmp_func cmp_func) {
   return 0;
 }
 
+static void htable_insert(struct hashtable *ht, char *key, int len,
+                          void *value, uint64_t hash) {
+  int i = htable_find_free(ht, hash);
+  if (ht->ctrl[i] == HASHTABLE_CTRL_DELETED) {
+    --ht->ndeleted;
+  }
+  set_ctrl(ht, i, H2(hash));
+  ht->buckets[i].key = key;
+  ht->buckets[i].len = len;
+  ht->buckets[i].value = value;
+  ++ht->nentries;
+}
+
 int htable_push(struct hashtable *ht, char *key, int len, void *value) {
   uint64_t hash = fnv_hash(key, len);
-  struct hashtable_entry *new_entry;
-  if (new_entry = htable_find(ht, key, len, hash)) {
-    new_entry->value = value;
+  struct hashtable_entry *entry;
+  if ((entry = htable_find(ht, key, len, hash))) {
+    entry->value = value;
     return 0;
   }
 
-  new_entry = malloc(sizeof(struct hashtable_entry));
-  if (!new_entry) {
-    return 1;
-  }
-  ++ht->nentries;
-  if (ht->nentries / ht->nbuckets > HASHTABLE_HIGH) {
-    if (htable_rehash(ht, ht->nbuckets * HASHTABLE_GROWTH_FACTOR)) {
+  if (ht->nentries + ht->ndeleted + 1 > ht->nbuckets * HASHTABLE_HIGH) {
+    // When most of the used slots are tombstones, rehashing at the same size
+    // is enough to get rid of them
+    int new_size = ht->nbuckets;
+    if (ht->nentries + 1 > ht->nbuckets * HASHTABLE_HIGH / 2) {
+      new_size *= HASHTABLE_GROWTH_FACTOR;
+    }
+    if (htable_rehash(ht, new_size)) {
       return 1;
     }
   }
-  new_entry->key = key;
-  new_entry->hash_key = hash;
-  new_entry->len = len;
-  new_entry->value = value;
-  new_entry->next = ht->buckets[hash & (ht->nbuckets - 1)];
-  ht->buckets[hash & (ht->nbuckets - 1)] = new_entry;
+  htable_insert(ht, key, len, value, hash);
   return 0;
 }
 
 int htable_rehash(struct hashtable *ht, int new_size) {
   new_size = hash_round_size(new_size);
-  struct hashtable_entry **new_buckets = calloc(1, sizeof(struct hashtable_entry *) * new_size);
-  if (!new_buckets) {
+  if (new_size * HASHTABLE_HIGH < ht->nentries + 1) {
     return 1;
   }
-  for (int i = 0; i < ht->nbuckets; ++i) {
-    struct hashtable_entry *entry = ht->buckets[i];
-    while (entry) {
-      new_buckets[entry->hash_key & (new_size - 1)] = entry;
-      entry = entry->next;
+  struct hashtable old = *ht;
+  if (htable_alloc(ht, new_size)) {
+    return 1;
+  }
+  for (int i = 0; i < old.nbuckets; ++i) {
+    if (old.ctrl[i] >= 0) {
+      struct hashtable_entry *entry = &old.buckets[i];
+      htable_insert(ht, entry->key, entry->len, entry->value,
+                    fnv_hash(entry->key, entry->len));
     }
   }
-  free(ht->buckets);
-  ht->buckets = new_buckets;
-  ht->nbuckets = new_size;
+  if (!ht->arena) {
+    free(old.ctrl);
+  }
+  ++ht->nrehashes;
   return 0;
 }
 
 void *htable_get(struct hashtable *ht, char *key, int len) {
   uint64_t hash = fnv_hash(key, len);
   struct hashtable_entry *entry;
-  if (entry = htable_find(ht, key, len, hash)) {
+  if ((entry = htable_find(ht, key, len, hash))) {
     return entry->value;
   }
   return NULL;
 }
 
 bool htable_contains(struct hashtable *ht, char *key, int len) {
-  uint64_t hash = fnv_hash(key, len);
-  struct hashtable_entry *entry = ht->buckets[hash & (ht->nbuckets - 1)];
-  while (entry) {
-    if (hash == entry->hash_key && ht->cmp_func(key, entry->key, len)) {
-      return 1;
-    }
-    entry = entry->next;
-  }
-  return 0;
+  return htable_find(ht, key, len, fnv_hash(key, len)) != NULL;
 }
 
 void htable_remove(struct hashtable *ht, char *key, int len) {
-  uint64_t hash = fnv_hash(key, len);
-  struct hashtable_entry *entry = ht->buckets[hash & (ht->nbuckets - 1)];
-  struct hashtable_entry *prev_entry = NULL;
-  while (entry) {
-    if (hash == entry->hash_key && ht->cmp_func(key, entry->key, len)) {
-      if (!prev_entry) {
-        ht->buckets[hash & (ht->nbuckets - 1)] = entry->next;
-      } else {
-        prev_entry->next = entry->next;
-      }
-      if (entry->value) {
-        free(entry->value);
+  struct hashtable_entry *entry = htable_find(ht, key, len, fnv_hash(key, len));
+  if (!entry) {
+    return;
+  }
+  if (entry->value) {
+    free(entry->value);
+  }
+  set_ctrl(ht, entry - ht->buckets, HASHTABLE_CTRL_DELETED);
+  --ht->nentries;
+  ++ht->ndeleted;
+}
+
+// Groups probed until the one holding bucket `i` is reached from the home
+// group of its key
+static int probe_length(struct hashtable *ht, int i) {
+  struct hashtable_entry *entry = &ht->buckets[i];
+  uint64_t hash = fnv_hash(entry->key, entry->len);
+  int mask = ht->nbuckets - 1;
+  int pos = H1(hash) & mask;
+  int nprobes = 1;
+  for (int step = HASHTABLE_GROUP_WIDTH; ((i - pos) & mask) >= HASHTABLE_GROUP_WIDTH;
+       step += HASHTABLE_GROUP_WIDTH) {
+    pos = (pos + step) & mask;
+    ++nprobes;
+  }
+  return nprobes;
+}
+
+void htable_stats(struct hashtable *ht, struct hashtable_stats *stats) {
+  stats->nentries = ht->nentries;
+  stats->ndeleted = ht->ndeleted;
+  stats->nbuckets = ht->nbuckets;
+  stats->nrehashes = ht->nrehashes;
+  stats->longest_probe = 0;
+  for (int i = 0; i < ht->nbuckets; ++i) {
+    if (ht->ctrl[i] >= 0) {
+      int nprobes = probe_length(ht, i);
+      if (nprobes > stats->longest_probe) {
+        stats->longest_probe = nprobes;
       }
-      --ht->nentries;
-      free(entry);
     }
-    prev_entry = entry;
-    entry = entry->next;
   }
 }
-
@@ -6,34 +6,57 @@
 #include <stdbool.h>
 #include <string.h>
 
-#define HASHTABLE_LOW 0.1
-#define HASHTABLE_HIGH 0.5
-#define HASHTABLE_INITSIZE 2
+// Open addressing table in the style of Swiss tables: one control byte per
+// slot holds either a state below or 7 bits of the key's hash, and groups of
+// HASHTABLE_GROUP_WIDTH control bytes are probed at once.
+#define HASHTABLE_GROUP_WIDTH 16
+#define HASHTABLE_INITSIZE 16
+#define HASHTABLE_HIGH 0.875
 #define HASHTABLE_GROWTH_FACTOR 2
 
+#define HASHTABLE_CTRL_EMPTY ((int8_t)-128)
+#define HASHTABLE_CTRL_DELETED ((int8_t)-2)
+
+struct arena;
+
 typedef bool (*hashtable_cmp_func)(const char *key1, const char *key2, size_t len);
 
 struct hashtable_entry {
-  struct hashtable_entry *next;
-  void *value;
   char *key;
+  void *value;
   int len;
-  uint64_t hash_key;
 };
 
 struct hashtable {
-  struct hashtable_entry **buckets;
+  // `nbuckets` control bytes followed by a copy of the first group, so
+  // probing near the end never wraps in the middle of a group
+  int8_t *ctrl;
+  struct hashtable_entry *buckets;
   int nentries;
+  int ndeleted;
   int nbuckets;
+  int nrehashes;
   hashtable_cmp_func cmp_func;
+  struct arena *arena; // if set, buckets and entries are allocated from it
 };
 
-int htable_init(struct hashtable *ht, hashtable_cmp_func cmp_func);
+// Occupancy of a table, `longest_probe` is the number of groups looked at by
+// the slowest lookup of a stored key
+struct hashtable_stats {
+  int nentries;
+  int ndeleted;
+  int nbuckets;
+  int longest_probe;
+  int nrehashes;
+};
+
+int htable_init(struct hashtable *ht, hashtable_cmp_func cmp_func, struct arena *arena);
+void htable_destroy(struct hashtable *ht);
 int htable_push(struct hashtable *ht, char *key, int len, void *value);
 void *htable_get(struct hashtable *ht, char *key, int len);
 bool htable_contains(struct hashtable *ht, char *key, int len);
 int htable_rehash(struct hashtable *h, int new_sizet);
 void htable_remove(struct hashtable *ht, char *key, int len);
+void htable_stats(struct hashtable *ht, struct hashtable_stats *stats);
 
 #endif // _HASHMAP_H
-
@@ -0,0 +1,816 @@
+#include <stddef.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "zapp.h"
+
+#if defined(__x86_64__) && !defined(_WIN32)
+
+#define JIT_INITSIZE 4096
+#define JIT_LOOP_WEIGHT 8
+#define JIT_MAX_WEIGHT ((int64_t)1 << 20)
+
+// General purpose and SSE registers by their encoding
+enum {
+  RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+  R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+enum {
+  XMM0, XMM1
+};
+
+// Condition codes, flipping the lowest bit negates a condition
+enum {
+  CC_AE = 0x3,
+  CC_E = 0x4,
+  CC_NE = 0x5,
+  CC_A = 0x7,
+  CC_P = 0xa,
+  CC_NP = 0xb,
+  CC_L = 0xc,
+  CC_GE = 0xd,
+  CC_LE = 0xe,
+  CC_G = 0xf
+};
+
+// Variables live in `frame.values`, which RBX points to while the program
+// runs. The most used ones are kept in callee-saved registers instead, so they
+// survive calls into the runtime; SSE registers are all caller-saved and are
+// written back around calls.
+static const int int_regs[] = { R12, R13, R14, R15, RBP };
+static const int float_regs[] = { 8, 9, 10, 11, 12, 13, 14, 15 };
+
+#define NELEMS(arr) ((int)(sizeof(arr) / sizeof((arr)[0])))
+
+struct jit {
+  uint8_t *code;
+  size_t len;
+  size_t capacity;
+  int8_t *regs;     // register holding each slot, -1 if it stays in memory
+  int64_t *weights; // uses of each slot, weighted by loop nesting
+};
+
+// Second operand of an instruction
+struct operand {
+  enum { OPND_REG, OPND_MEM, OPND_IMM } kind;
+  int reg;
+  int32_t value; // OPND_MEM: offset from RBX, OPND_IMM: sign extended immediate
+};
+
+#define REG(r) ((struct operand){ .kind = OPND_REG, .reg = (r) })
+#define IMM(v) ((struct operand){ .kind = OPND_IMM, .value = (v) })
+
+static void emit8(struct jit *j, uint8_t byte) {
+  if (j->len == j->capacity) {
+    j->capacity = j->capacity ? j->capacity * 2 : JIT_INITSIZE;
+    j->code = realloc(j->code, j->capacity);
+    if (!j->code) {
+      panic("Error: %s\n", strerror(errno));
+    }
+  }
+  j->code[j->len++] = byte;
+}
+
+static void emit32(struct jit *j, uint32_t value) {
+  for (int i = 0; i < 4; ++i) {
+    emit8(j, value >> (i * 8));
+  }
+}
+
+static void emit64(struct jit *j, uint64_t value) {
+  emit32(j, value);
+  emit32(j, value >> 32);
+}
+
+static bool fits_int32(int64_t value) {
+  return value >= INT32_MIN && value <= INT32_MAX;
+}
+
+// Emits instruction `op` (0x0fXX for two byte opcodes) with register or
+// opcode extension `reg` and register or memory operand `rm`. `prefix` is a
+// mandatory SSE prefix or 0, `w` selects 64-bit operand size.
+static void emit_op(struct jit *j, uint8_t prefix, bool w, int op, int reg, struct operand rm) {
+  if (prefix) {
+    emit8(j, prefix);
+  }
+  uint8_t rex = 0x40 | (w << 3) | ((reg & 8) >> 1);
+  if (rm.kind == OPND_REG) {
+    rex |= (rm.reg & 8) >> 3;
+  }
+  if (rex != 0x40) {
+    emit8(j, rex);
+  }
+  if (op > 0xff) {
+    emit8(j, op >> 8);
+  }
+  emit8(j, op);
+  if (rm.kind == OPND_REG) {
+    emit8(j, 0xc0 | (reg & 7) << 3 | (rm.reg & 7));
+  } else if (rm.value >= INT8_MIN && rm.value <= INT8_MAX) {
+    emit8(j, 0x40 | (reg & 7) << 3 | RBX);
+    emit8(j, rm.value);
+  } else {
+    emit8(j, 0x80 | (reg & 7) << 3 | RBX);
+    emit32(j, rm.value);
+  }
+}
+
+static void emit_push(struct jit *j, int reg) {
+  if (reg & 8) {
+    emit8(j, 0x41);
+  }
+  emit8(j, 0x50 | (reg & 7));
+}
+
+static void emit_pop(struct jit *j, int reg) {
+  if (reg & 8) {
+    emit8(j, 0x41);
+  }
+  emit8(j, 0x58 | (reg & 7));
+}
+
+static void emit_mov_imm(struct jit *j, int reg, int64_t value) {
+  if (value == 0) {
+    emit_op(j, 0, false, 0x31, reg, REG(reg)); // xor r32, r32
+  } else if (value > 0 && value <= UINT32_MAX) {
+    if (reg & 8) {
+      emit8(j, 0x41);
+    }
+    emit8(j, 0xb8 | (reg & 7));
+    emit32(j, value);
+  } else if (fits_int32(value)) {
+    emit_op(j, 0, true, 0xc7, 0, REG(reg));
+    emit32(j, value);
+  } else {
+    emit8(j, 0x48 | (reg & 8) >> 3);
+    emit8(j, 0xb8 | (reg & 7));
+    emit64(j, value);
+  }
+}
+
+// reg = operand
+static void emit_load(struct jit *j, int reg, struct operand opnd) {
+  if (opnd.kind == OPND_IMM) {
+    emit_mov_imm(j, reg, opnd.value);
+  } else if (opnd.kind != OPND_REG || opnd.reg != reg) {
+    emit_op(j, 0, true, 0x8b, reg, opnd);
+  }
+}
+
+static void emit_call(struct jit *j, void *fn) {
+  emit_mov_imm(j, RAX, (intptr_t)fn);
+  emit_op(j, 0, false, 0xff, 2, REG(RAX));
+}
+
+// Emits jump with a 32-bit displacement to be patched later, returns its
+// position. `cc` is a condition code or -1 for unconditional jumps.
+static size_t emit_jump(struct jit *j, int cc) {
+  if (cc < 0) {
+    emit8(j, 0xe9);
+  } else {
+    emit8(j, 0x0f);
+    emit8(j, 0x80 | cc);
+  }
+  emit32(j, 0);
+  return j->len - 4;
+}
+
+static void patch_jump_to(struct jit *j, size_t pos, size_t target) {
+  int32_t rel = target - (pos + 4);
+  memcpy(&j->code[pos], &rel, sizeof(rel));
+}
+
+static void patch_jump(struct jit *j, size_t pos) {
+  patch_jump_to(j, pos, j->len);
+}
+
+// al = condition `cc`, zero extended to the whole of RAX
+static void emit_setcc(struct jit *j, int cc) {
+  emit_op(j, 0, false, 0x0f90 | cc, 0, REG(RAX));
+  emit_op(j, 0, false, 0x0fb6, RAX, REG(RAX));
+}
+
+/*
+ * runtime
+ */
+
+_Noreturn static void division_by_zero() {
+  panic("Error: division by zero\n");
+}
+
+/*
+ * register allocation
+ */
+
+static void count_uses(struct jit *j, struct node *node, int64_t weight) {
+  switch (node->kind) {
+    case ND_VAR:
+      j->weights[node->var.slot] += weight;
+      return;
+    case ND_NUM:
+      return;
+    case ND_BLOCK:
+      for (struct node *cur = OPT_CHILD(node, block.body); cur; cur = OPT_CHILD(cur, next)) {
+        count_uses(j, cur, weight);
+      }
+      return;
+    case ND_IF:
+      count_uses(j, CHILD(node, branch.cond), weight);
+      count_uses(j, CHILD(node, branch.then), weight);
+      if (node->branch.els) {
+        count_uses(j, CHILD(node, branch.els), weight);
+      }
+      return;
+    case ND_FOR: {
+      count_uses(j, CHILD(node, loop.init), weight);
+      int64_t inner = weight;
+      if (inner < JIT_MAX_WEIGHT) {
+        inner *= JIT_LOOP_WEIGHT;
+      }
+      count_uses(j, CHILD(node, loop.cond), inner);
+      count_uses(j, CHILD(node, loop.inc), inner);
+      count_uses(j, CHILD(node, loop.body), inner);
+      return;
+    }
+    default:
+      if (node->bin.lhs) {
+        count_uses(j, CHILD(node, bin.lhs), weight);
+      }
+      count_uses(j, CHILD(node, bin.rhs), weight);
+      return;
+  }
+}
+
+// Gives registers of `regs` to the most used variables of type `type`. Uses
+// inside of loops count more, so variables of the innermost loops stay in
+// registers across their bodies.
+static void alloc_regs(struct jit *j, type_kind type, const int *regs, int nregs) {
+  for (int i = 0; i < nregs; ++i) {
+    int best = -1;
+    for (int slot = 0; slot < frame.nslots; ++slot) {
+      if (frame.values[slot].kind != type || j->regs[slot] >= 0 || !j->weights[slot]) {
+        continue;
+      }
+      if (best < 0 || j->weights[slot] > j->weights[best]) {
+        best = slot;
+      }
+    }
+    if (best < 0) {
+      return;
+    }
+    j->regs[best] = regs[i];
+  }
+}
+
+static struct operand slot_mem(int slot) {
+  size_t offset = slot * sizeof(struct zapp_value) + offsetof(struct zapp_value, val);
+  return (struct operand){ .kind = OPND_MEM, .value = offset };
+}
+
+static struct operand var_operand(struct jit *j, struct node *var) {
+  int slot = var->var.slot;
+  return j->regs[slot] >= 0 ? REG(j->regs[slot]) : slot_mem(slot);
+}
+
+// Moves float variables held in registers between the registers and the
+// frame, around calls which clobber them
+static void sync_float_regs(struct jit *j, bool to_frame) {
+  for (int slot = 0; slot < frame.nslots; ++slot) {
+    if (j->regs[slot] < 0 || frame.values[slot].kind != TY_FLOAT) {
+      continue;
+    }
+    if (to_frame) {
+      emit_op(j, 0xf2, false, 0x0f11, j->regs[slot], slot_mem(slot)); // movsd
+    } else {
+      emit_op(j, 0xf2, false, 0x0f10, j->regs[slot], slot_mem(slot));
+    }
+  }
+}
+
+/*
+ * expressions
+ */
+
+static void gen_int(struct jit *j, struct node *node);
+static void gen_float(struct jit *j, struct node *node);
+
+// Whether integer `node` can be used as an operand as is
+static bool int_leaf(struct jit *j, struct node *node, struct operand *opnd) {
+  if (node->type != TY_INT) {
+    return false;
+  }
+  if (node->kind == ND_VAR) {
+    *opnd = var_operand(j, node);
+    return true;
+  }
+  if (node->kind == ND_NUM && fits_int32(node->val.num)) {
+    *opnd = IMM(node->val.num);
+    return true;
+  }
+  return false;
+}
+
+static bool is_commutative(node_kind kind) {
+  return kind == ND_ADD || kind == ND_MUL || kind == ND_EQ || kind == ND_NEQ;
+}
+
+// Evaluates operands of integer operation `node`, leaving the left one in RAX
+// and returning the right one. If the right operand is evaluated first to
+// avoid a spill, the operands come swapped and `swapped` is set.
+static struct operand gen_int_operands(struct jit *j, struct node *node, bool *swapped) {
+  struct node *lhs = CHILD(node, bin.lhs);
+  struct node *rhs = CHILD(node, bin.rhs);
+  struct operand opnd;
+  *swapped = false;
+  if (int_leaf(j, rhs, &opnd)) {
+    gen_int(j, lhs);
+    return opnd;
+  }
+  // Reading the left operand after the right one is only fine when the right
+  // one does not assign
+  if (int_leaf(j, lhs, &opnd) && !has_assign(rhs)) {
+    gen_int(j, rhs);
+    if (is_commutative(node->kind) || node->kind == ND_LT || node->kind == ND_LTE) {
+      *swapped = true;
+      return opnd;
+    }
+    emit_op(j, 0, true, 0x8b, RCX, REG(RAX));
+    emit_load(j, RAX, opnd);
+    return REG(RCX);
+  }
+  gen_int(j, lhs);
+  emit_push(j, RAX);
+  gen_int(j, rhs);
+  emit_op(j, 0, true, 0x8b, RCX, REG(RAX));
+  emit_pop(j, RAX);
+  return REG(RCX);
+}
+
+// Integer comparison of RAX with `opnd`, returns condition code of `kind`
+static int gen_int_compare(struct jit *j, struct node *node) {
+  bool swapped;
+  struct operand opnd = gen_int_operands(j, node, &swapped);
+  if (opnd.kind == OPND_IMM) {
+    emit_op(j, 0, true, 0x81, 7, REG(RAX));
+    emit32(j, opnd.value);
+  } else {
+    emit_op(j, 0, true, 0x3b, RAX, opnd);
+  }
+  switch (node->kind) {
+    case ND_LT:  return swapped ? CC_G : CC_L;
+    case ND_LTE: return swapped ? CC_GE : CC_LE;
+    case ND_EQ:  return CC_E;
+    default:     return CC_NE;
+  }
+}
+
+// Stores the float in `xmm` into variable `var`
+static void store_float(struct jit *j, struct node *var, int xmm) {
+  struct operand dst = var_operand(j, var);
+  if (dst.kind == OPND_REG) {
+    emit_op(j, 0x66, false, 0x0f28, dst.reg, REG(xmm)); // movapd
+  } else {
+    emit_op(j, 0xf2, false, 0x0f11, xmm, dst); // movsd
+  }
+}
+
+// Loads leaf `node` as a float into `xmm`
+static void load_float(struct jit *j, struct node *node, int xmm) {
+  if (node->kind == ND_NUM) {
+    union actual_value value = { .fnum = node->type == TY_INT ? node->val.num : node->val.fnum };
+    emit_mov_imm(j, RCX, value.num);
+    emit_op(j, 0x66, true, 0x0f6e, xmm, REG(RCX)); // movq
+  } else if (node->type == TY_INT) {
+    emit_op(j, 0xf2, true, 0x0f2a, xmm, var_operand(j, node)); // cvtsi2sd
+  } else {
+    struct operand src = var_operand(j, node);
+    emit_op(j, src.kind == OPND_REG ? 0x66 : 0xf2, false,
+            src.kind == OPND_REG ? 0x0f28 : 0x0f10, xmm, src);
+  }
+}
+
+// Evaluates operands of float operation `node` into XMM0 and returns the
+// right one, which is a register or memory
+static struct operand gen_float_operands(struct jit *j, struct node *node) {
+  struct node *lhs = CHILD(node, bin.lhs);
+  struct node *rhs = CHILD(node, bin.rhs);
+  if (rhs->kind == ND_VAR || rhs->kind == ND_NUM) {
+    gen_float(j, lhs);
+    if (rhs->kind == ND_VAR && rhs->type == TY_FLOAT) {
+      return var_operand(j, rhs);
+    }
+    load_float(j, rhs, XMM1);
+    return REG(XMM1);
+  }
+  gen_float(j, lhs);
+  emit_op(j, 0x66, true, 0x0f7e, XMM0, REG(RAX)); // movq rax, xmm0
+  emit_push(j, RAX);
+  gen_float(j, rhs);
+  emit_op(j, 0x66, false, 0x0f28, XMM1, REG(XMM0));
+  emit_pop(j, RAX);
+  emit_op(j, 0x66, true, 0x0f6e, XMM0, REG(RAX));
+  return REG(XMM1);
+}
+
+// RAX = result of float comparison `node`. Unordered operands compare false
+// except for `!=`, like in C.
+static void gen_float_compare(struct jit *j, struct node *node) {
+  struct operand rhs = gen_float_operands(j, node);
+  if (rhs.kind != OPND_REG) {
+    emit_op(j, 0xf2, false, 0x0f10, XMM1, rhs);
+    rhs = REG(XMM1);
+  }
+  switch (node->kind) {
+    case ND_LT:
+    case ND_LTE:
+      // rhs > lhs, which is false for unordered operands
+      emit_op(j, 0x66, false, 0x0f2e, rhs.reg, REG(XMM0)); // ucomisd
+      emit_setcc(j, node->kind == ND_LT ? CC_A : CC_AE);
+      return;
+    default:
+      emit_op(j, 0x66, false, 0x0f2e, XMM0, rhs);
+      emit_op(j, 0, false, 0x0f90 | (node->kind == ND_EQ ? CC_E : CC_NE), 0, REG(RAX));
+      emit_op(j, 0, false, 0x0f90 | (node->kind == ND_EQ ? CC_NP : CC_P), 0, REG(RCX));
+      emit_op(j, 0, false, node->kind == ND_EQ ? 0x20 : 0x08, RCX, REG(RAX)); // and/or al, cl
+      emit_op(j, 0, false, 0x0fb6, RAX, REG(RAX));
+      return;
+  }
+}
+
+// RAX = RAX / opnd, panicking on division by zero
+static void gen_div(struct jit *j, struct operand opnd) {
+  if (opnd.kind == OPND_IMM && opnd.value == -1) {
+    emit_op(j, 0, true, 0xf7, 3, REG(RAX)); // neg
+    return;
+  }
+  if (opnd.kind == OPND_IMM && opnd.value != 0) {
+    emit_mov_imm(j, RCX, opnd.value);
+    emit8(j, 0x48);
+    emit8(j, 0x99); // cqo
+    emit_op(j, 0, true, 0xf7, 7, REG(RCX)); // idiv
+    return;
+  }
+  emit_load(j, RCX, opnd);
+  emit_op(j, 0, true, 0x85, RCX, REG(RCX));
+  size_t nonzero = emit_jump(j, CC_NE);
+  // Stack may hold spilled operands, so align it for the call
+  emit_op(j, 0, true, 0x83, 4, REG(RSP));
+  emit8(j, 0xf0);
+  emit_call(j, division_by_zero);
+  patch_jump(j, nonzero);
+
+  // INT64_MIN / -1 traps, while it has to wrap around
+  emit_op(j, 0, true, 0x83, 7, REG(RCX));
+  emit8(j, 0xff);
+  size_t divide = emit_jump(j, CC_NE);
+  emit_op(j, 0, true, 0xf7, 3, REG(RAX));
+  size_t done = emit_jump(j, -1);
+  patch_jump(j, divide);
+  emit8(j, 0x48);
+  emit8(j, 0x99);
+  emit_op(j, 0, true, 0xf7, 7, REG(RCX));
+  patch_jump(j, done);
+}
+
+// `var = var + x` and `var = var - x` update the variable in place, returns
+// false for other assignments
+static bool gen_update(struct jit *j, struct node *node) {
+  struct node *var = CHILD(node, bin.lhs);
+  struct node *rhs = CHILD(node, bin.rhs);
+  if (var->type != TY_INT || (rhs->kind != ND_ADD && rhs->kind != ND_SUB)) {
+    return false;
+  }
+  struct node *lhs = CHILD(rhs, bin.lhs);
+  struct operand opnd, dst = var_operand(j, var);
+  if (lhs->kind != ND_VAR || lhs->var.slot != var->var.slot ||
+      !int_leaf(j, CHILD(rhs, bin.rhs), &opnd)) {
+    return false;
+  }
+  if (opnd.kind == OPND_IMM) {
+    emit_op(j, 0, true, 0x81, rhs->kind == ND_ADD ? 0 : 5, dst);
+    emit32(j, opnd.value);
+  } else if (dst.kind == OPND_REG) {
+    emit_op(j, 0, true, rhs->kind == ND_ADD ? 0x03 : 0x2b, dst.reg, opnd);
+  } else if (opnd.kind == OPND_REG) {
+    emit_op(j, 0, true, rhs->kind == ND_ADD ? 0x01 : 0x29, opnd.reg, dst);
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// Assignment, the assigned value is left in RAX or XMM0 if `want_value`
+static void gen_assign(struct jit *j, struct node *node, bool want_value) {
+  struct node *var = CHILD(node, bin.lhs);
+  struct node *rhs = CHILD(node, bin.rhs);
+  if (var->type == TY_FLOAT) {
+    gen_float(j, rhs);
+    store_float(j, var, XMM0);
+    return;
+  }
+  if (!want_value && gen_update(j, node)) {
+    return;
+  }
+  struct operand dst = var_operand(j, var), opnd;
+  if (!want_value && int_leaf(j, rhs, &opnd) && (opnd.kind != OPND_MEM || dst.kind == OPND_REG)) {
+    if (dst.kind == OPND_REG) {
+      emit_load(j, dst.reg, opnd);
+    } else if (opnd.kind == OPND_IMM) {
+      emit_op(j, 0, true, 0xc7, 0, dst);
+      emit32(j, opnd.value);
+    } else {
+      emit_op(j, 0, true, 0x89, opnd.reg, dst);
+    }
+    return;
+  }
+  gen_int(j, rhs);
+  emit_op(j, 0, true, 0x89, RAX, dst);
+}
+
+// RAX = value of integer expression `node`
+static void gen_int(struct jit *j, struct node *node) {
+  switch (node->kind) {
+    case ND_NUM:
+      emit_mov_imm(j, RAX, node->val.num);
+      return;
+    case ND_VAR:
+      emit_load(j, RAX, var_operand(j, node));
+      return;
+    case ND_NEG:
+      gen_int(j, CHILD(node, bin.rhs));
+      emit_op(j, 0, true, 0xf7, 3, REG(RAX));
+      return;
+    case ND_ASSIGN:
+      gen_assign(j, node, true);
+      return;
+    case ND_LT:
+    case ND_LTE:
+    case ND_EQ:
+    case ND_NEQ:
+      if (CHILD(node, bin.lhs)->type == TY_FLOAT || CHILD(node, bin.rhs)->type == TY_FLOAT) {
+        gen_float_compare(j, node);
+      } else {
+        emit_setcc(j, gen_int_compare(j, node));
+      }
+      return;
+    default: {
+      bool swapped;
+      struct operand opnd = gen_int_operands(j, node, &swapped);
+      switch (node->kind) {
+        case ND_ADD:
+        case ND_SUB:
+          if (opnd.kind == OPND_IMM) {
+            emit_op(j, 0, true, 0x81, node->kind == ND_ADD ? 0 : 5, REG(RAX));
+            emit32(j, opnd.value);
+          } else {
+            emit_op(j, 0, true, node->kind == ND_ADD ? 0x03 : 0x2b, RAX, opnd);
+          }
+          return;
+        case ND_MUL:
+          if (opnd.kind == OPND_IMM) {
+            emit_op(j, 0, true, 0x69, RAX, REG(RAX));
+            emit32(j, opnd.value);
+          } else {
+            emit_op(j, 0, true, 0x0faf, RAX, opnd);
+          }
+          return;
+        case ND_DIV:
+          gen_div(j, opnd);
+          return;
+        default:
+          panic("ICE: node kind %d is not an integer operation\n", node->kind);
+      }
+    }
+  }
+}
+
+// XMM0 = value of expression `node` as a float
+static void gen_float(struct jit *j, struct node *node) {
+  if (node->type == TY_INT) {
+    if (node->kind == ND_NUM || node->kind == ND_VAR) {
+      load_float(j, node, XMM0);
+      return;
+    }
+    gen_int(j, node);
+    emit_op(j, 0xf2, true, 0x0f2a, XMM0, REG(RAX));
+    return;
+  }
+  switch (node->kind) {
+    case ND_NUM:
+    case ND_VAR:
+      load_float(j, node, XMM0);
+      return;
+    case ND_NEG:
+      gen_float(j, CHILD(node, bin.rhs));
+      emit_mov_imm(j, RAX, INT64_MIN);
+      emit_op(j, 0x66, true, 0x0f6e, XMM1, REG(RAX));
+      emit_op(j, 0x66, false, 0x0f57, XMM0, REG(XMM1)); // xorpd
+      return;
+    case ND_ASSIGN:
+      gen_assign(j, node, true);
+      return;
+    default: {
+      struct operand rhs = gen_float_operands(j, node);
+      int op;
+      switch (node->kind) {
+        case ND_ADD: op = 0x0f58; break;
+        case ND_SUB: op = 0x0f5c; break;
+        case ND_MUL: op = 0x0f59; break;
+        case ND_DIV: op = 0x0f5e; break;
+        default:
+          panic("ICE: node kind %d is not a float operation\n", node->kind);
+      }
+      emit_op(j, 0xf2, false, op, XMM0, rhs);
+      return;
+    }
+  }
+}
+
+/*
+ * statements
+ */
+
+// Emits jump taken when condition `cond` is `when`, returns its position
+static size_t gen_cond_jump(struct jit *j, struct node *cond, bool when) {
+  int cc;
+  if ((cond->kind == ND_LT || cond->kind == ND_LTE || cond->kind == ND_EQ || cond->kind == ND_NEQ) &&
+      CHILD(cond, bin.lhs)->type == TY_INT && CHILD(cond, bin.rhs)->type == TY_INT) {
+    cc = gen_int_compare(j, cond);
+  } else {
+    if (cond->type == TY_FLOAT) {
+      // Anything but zero is true, NaN included
+      gen_float(j, cond);
+      emit_op(j, 0x66, false, 0x0f57, XMM1, REG(XMM1));
+      emit_op(j, 0x66, false, 0x0f2e, XMM0, REG(XMM1));
+      emit_op(j, 0, false, 0x0f90 | CC_NE, 0, REG(RAX));
+      emit_op(j, 0, false, 0x0f90 | CC_P, 0, REG(RCX));
+      emit_op(j, 0, false, 0x08, RCX, REG(RAX));
+      emit_op(j, 0, false, 0x0fb6, RAX, REG(RAX));
+    } else {
+      gen_int(j, cond);
+    }
+    emit_op(j, 0, true, 0x85, RAX, REG(RAX));
+    cc = CC_NE;
+  }
+  return emit_jump(j, when ? cc : cc ^ 1);
+}
+
+static void gen_stmt(struct jit *j, struct node *node);
+
+static void gen_block(struct jit *j, struct node *node) {
+  for (struct node *cur = OPT_CHILD(node, block.body); cur; cur = OPT_CHILD(cur, next)) {
+    gen_stmt(j, cur);
+  }
+}
+
+static void gen_stmt(struct jit *j, struct node *node) {
+  switch (node->kind) {
+    case ND_IF: {
+      size_t else_jump = gen_cond_jump(j, CHILD(node, branch.cond), false);
+      gen_block(j, CHILD(node, branch.then));
+      if (node->branch.els) {
+        size_t end_jump = emit_jump(j, -1);
+        patch_jump(j, else_jump);
+        gen_block(j, CHILD(node, branch.els));
+        patch_jump(j, end_jump);
+      } else {
+        patch_jump(j, else_jump);
+      }
+      return;
+    }
+    case ND_FOR: {
+      gen_stmt(j, CHILD(node, loop.init));
+      size_t test_jump = emit_jump(j, -1);
+      size_t body = j->len;
+      gen_block(j, CHILD(node, loop.body));
+      gen_stmt(j, CHILD(node, loop.inc));
+      patch_jump(j, test_jump);
+      patch_jump_to(j, gen_cond_jump(j, CHILD(node, loop.cond), true), body);
+      return;
+    }
+    case ND_PRINT: {
+      struct node *expr = CHILD(node, bin.rhs);
+      if (expr->type == TY_INT) {
+        gen_int(j, expr);
+        emit_op(j, 0, true, 0x8b, RDI, REG(RAX));
+      } else {
+        gen_float(j, expr);
+        if (node->type == TY_INT) {
+          emit_op(j, 0xf2, true, 0x0f2c, RDI, REG(XMM0)); // cvttsd2si
+        }
+      }
+      sync_float_regs(j, true);
+      emit_call(j, node->type == TY_INT ? (void *)output_int : (void *)output_float);
+      sync_float_regs(j, false);
+      return;
+    }
+    case ND_BLOCK:
+      gen_block(j, node);
+      return;
+    case ND_ASSIGN:
+      gen_assign(j, node, false);
+      return;
+    default:
+      if (node->type == TY_INT) {
+        gen_int(j, node);
+      } else {
+        gen_float(j, node);
+      }
+      return;
+  }
+}
+
+// Saves callee-saved registers and loads variables kept in registers, the
+// stack is left 16-byte aligned for calls
+static void gen_prologue(struct jit *j) {
+  emit_push(j, RBX);
+  for (int i = 0; i < NELEMS(int_regs); ++i) {
+    emit_push(j, int_regs[i]);
+  }
+  emit_op(j, 0, true, 0x83, 5, REG(RSP)); // sub rsp, 8
+  emit8(j, 8);
+  emit_op(j, 0, true, 0x8b, RBX, REG(RDI));
+  for (int slot = 0; slot < frame.nslots; ++slot) {
+    if (j->regs[slot] >= 0 && frame.values[slot].kind == TY_INT) {
+      emit_op(j, 0, true, 0x8b, j->regs[slot], slot_mem(slot));
+    }
+  }
+  sync_float_regs(j, false);
+}
+
+static void gen_epilogue(struct jit *j) {
+  for (int slot = 0; slot < frame.nslots; ++slot) {
+    if (j->regs[slot] >= 0 && frame.values[slot].kind == TY_INT) {
+      emit_op(j, 0, true, 0x89, j->regs[slot], slot_mem(slot));
+    }
+  }
+  sync_float_regs(j, true);
+  emit_op(j, 0, true, 0x83, 0, REG(RSP)); // add rsp, 8
+  emit8(j, 8);
+  for (int i = NELEMS(int_regs) - 1; i >= 0; --i) {
+    emit_pop(j, int_regs[i]);
+  }
+  emit_pop(j, RBX);
+  emit8(j, 0xc3);
+}
+
+struct jit_code *jit_compile(struct node *prog) {
+  struct jit j = {};
+  j.regs = malloc(frame.nslots + 1);
+  j.weights = calloc(frame.nslots + 1, sizeof(int64_t));
+  if (!j.regs || !j.weights) {
+    panic("Error: %s\n", strerror(errno));
+  }
+  memset(j.regs, -1, frame.nslots + 1);
+  count_uses(&j, prog, 1);
+  alloc_regs(&j, TY_INT, int_regs, NELEMS(int_regs));
+  alloc_regs(&j, TY_FLOAT, float_regs, NELEMS(float_regs));
+
+  gen_prologue(&j);
+  gen_stmt(&j, prog);
+  gen_epilogue(&j);
+
+  // Code is written while the mapping is writable and only then made
+  // executable, it is never both at once
+  struct jit_code *code = calloc(1, sizeof(struct jit_code));
+  long page = sysconf(_SC_PAGESIZE);
+  code->size = (j.len + page - 1) / page * page;
+  code->mem = mmap(NULL, code->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (code->mem == MAP_FAILED) {
+    panic("Error: %s\n", strerror(errno));
+  }
+  memcpy(code->mem, j.code, j.len);
+  if (mprotect(code->mem, code->size, PROT_READ | PROT_EXEC)) {
+    panic("Error: %s\n", strerror(errno));
+  }
+  free(j.code);
+  free(j.regs);
+  free(j.weights);
+  return code;
+}
+
+void jit_execute(struct jit_code *code) {
+  void (*entry)(struct zapp_value *values);
+  memcpy(&entry, &code->mem, sizeof(entry));
+  entry(frame.values);
+}
+
+void jit_free(struct jit_code *code) {
+  munmap(code->mem, code->size);
+  free(code);
+}
+
+#else
+
+struct jit_code *jit_compile(struct node *prog) {
+  panic("Error: JIT compilation is only supported on x86-64\n");
+}
+
+void jit_execute(struct jit_code *code) {
+}
+
+void jit_free(struct jit_code *code) {
+}
+
+#endif // defined(__x86_64__) && !defined(_WIN32)
@@ -1,49 +1,54 @@
-#include <sys/stat.h>
-#include <sys/types.h>
-#include <fcntl.h>
+#include <ctype.h>
 #include <unistd.h>
 
 #include "zapp.h"
 
 static int arg_flags = 0x0;
+static struct context ctx;
+static char **sources; // files the source is read from
+static int nsources;
+static int njobs;      // threads compiling files, 0 if not given
 
 _Noreturn static void usage() {
-  printf("Usage: zapp [options] [-i cmd | filename]\n\n");
+  printf("Usage: zapp [options] [-i cmd | filename... | -]\n\n");
+  printf("Options:\n");
+  printf("  -i cmd  execute `cmd` instead of reading source file\n");
+  printf("  -       read source from the standard input\n");
+  printf("  -c      emit C code instead of executing the program\n");
+  printf("  -t      print AST of the program\n");
+  printf("  -b      print bytecode of the program\n");
+  printf("  -w      execute the program by walking its AST instead of bytecode\n");
+  printf("  -j      compile the program to machine code and run it\n");
+  printf("  -O      optimize the program before executing or emitting it\n");
+  printf("  -s      execute every statement as soon as it is parsed, with the types\n");
+  printf("          variables have so far: unlike in a normal run, a statement\n");
+  printf("          before the first float assigned to a variable uses it as an\n");
+  printf("          integer, e.g. in integer divisions\n");
+  printf("  --stats print time spent in every stage and internal counters on exit\n");
+  printf("  --no-cache\n");
+  printf("          neither load the program from the cache nor store it there\n");
+  printf("  --no-vector\n");
+  printf("          run every iteration of for loops on its own, also the ones\n");
+  printf("          which could be evaluated a block of iterations at a time\n");
+  printf("  --jobs N\n");
+  printf("          with -c, compile the files on N threads, each to a .c file of its own\n");
+  printf("  --threads N\n");
+  printf("          run iterations of for loops which do not depend on each other\n");
+  printf("          on N threads\n");
+  printf("  --profile\n");
+  printf("          count executions and time of every source line, report the\n");
+  printf("          hottest ones on exit and write folded stacks to %s\n", PROFILE_FOLDED);
   exit(0);
 }
 
-static char *read_file(const char *fname) {
-  int fd = open(fname, O_RDONLY);
-  if (fd == -1) {
-    return NULL;
+static bool is_number(const char *s) {
+  if (!*s) {
+    return false;
   }
-
-  struct stat st;
-  if (fstat(fd, &st) != 0) {
-    close(fd);
-    return NULL;
-  }
-
-  if (!(st.st_mode & S_IFREG)) {
-    errno = EBADF; // Error: not a regular file
-    close(fd);
-    return NULL;
-  }
-
-  char *buf = malloc(st.st_size * sizeof(char) + 1);
-  if (!buf) {
-    close(fd);
-    return NULL;
+  while (isdigit(*s)) {
+    ++s;
   }
-
-  if (read(fd, buf, st.st_size) == -1) {
-    free(buf);
-    close(fd);
-    return NULL;
-  }
-
-  buf[st.st_size] = '\0';
-  return buf;
+  return !*s;
 }
 
 static void shift_arg(int *argc, char **argv) {
@@ -68,7 +73,7 @@ static void parse_arg(int *argc, char **argv, struct tokenizer *tokenizer) {
       shift_arg(argc, argv);
     } else {
       shift_arg(argc, argv);
-      tokenizer_init(tokenizer, strdup(*argv));
+      tokenizer_init_ctx(tokenizer, strdup(*argv), &ctx);
       arg_flags |= ARG_TBUF_FILLED;
       shift_arg(argc, argv);
     }
@@ -78,53 +83,255 @@ static void parse_arg(int *argc, char **argv, struct tokenizer *tokenizer) {
   } else if (!strcmp(*argv, "-t")) {
     shift_arg(argc, argv);
     arg_flags |= ARG_PRINT_TREE;
-  } else if (!strncmp(*argv, "-", 1)) {
+  } else if (!strcmp(*argv, "-b")) {
+    shift_arg(argc, argv);
+    arg_flags |= ARG_PRINT_BYTECODE;
+  } else if (!strcmp(*argv, "-w")) {
+    shift_arg(argc, argv);
+    arg_flags |= ARG_TREE_WALK;
+  } else if (!strcmp(*argv, "-j")) {
+    shift_arg(argc, argv);
+    arg_flags |= ARG_JIT;
+  } else if (!strcmp(*argv, "-O")) {
+    shift_arg(argc, argv);
+    arg_flags |= ARG_OPTIMIZE;
+  } else if (!strcmp(*argv, "-s")) {
+    shift_arg(argc, argv);
+    arg_flags |= ARG_STREAM;
+  } else if (!strcmp(*argv, "--stats")) {
+    shift_arg(argc, argv);
+    arg_flags |= ARG_STATS;
+    stats.enabled = true;
+  } else if (!strcmp(*argv, "--no-cache")) {
+    shift_arg(argc, argv);
+    arg_flags |= ARG_NO_CACHE;
+  } else if (!strcmp(*argv, "--no-vector")) {
+    shift_arg(argc, argv);
+    vec_init(false);
+  } else if (!strcmp(*argv, "--jobs")) {
+    shift_arg(argc, argv);
+    if (*argc < 1 || !is_number(*argv) || atoi(*argv) < 1) {
+      fprintf(stderr, "Error: --jobs option requires a number of jobs\n");
+      exit(1);
+    }
+    njobs = atoi(*argv);
+    shift_arg(argc, argv);
+  } else if (!strcmp(*argv, "--threads")) {
+    shift_arg(argc, argv);
+    if (*argc < 1 || !is_number(*argv) || atoi(*argv) < 1) {
+      fprintf(stderr, "Error: --threads option requires a number of threads\n");
+      exit(1);
+    }
+    par_init(atoi(*argv));
+    shift_arg(argc, argv);
+  } else if (!strcmp(*argv, "--profile")) {
+    shift_arg(argc, argv);
+    arg_flags |= ARG_PROFILE;
+  } else if (!strncmp(*argv, "-", 1) && (*argv)[1]) {
     fprintf(stderr, "Error: option `%s` is not recognized\n", *argv);
     usage();
   } else {
-    // If buffer already filled, do nothing
-    if (arg_flags & ARG_TBUF_FILLED) {
+    // If buffer already filled by -i, do nothing
+    if ((arg_flags & ARG_TBUF_FILLED) && !nsources) {
       shift_arg(argc, argv);
     } else {
-      char *buf;
-      if ((buf = read_file(*argv))) {
-        tokenizer_init(tokenizer, buf);
-        arg_flags |= ARG_TBUF_FILLED;
-        shift_arg(argc, argv);
-      } else {
-        panic("Error: %s\n", strerror(errno));
-      }
+      // Opened once all options are known
+      sources[nsources++] = *argv;
+      arg_flags |= ARG_TBUF_FILLED;
+      shift_arg(argc, argv);
     }
   }
 }
 
 static void parse_args(int argc, char **argv, struct tokenizer *tokenizer) {
   shift_arg(&argc, argv);
+  sources = malloc((argc ? argc : 1) * sizeof(*sources));
+  if (!sources) {
+    panic("Error: %s\n", strerror(errno));
+  }
 
   while (argc > 0) {
     parse_arg(&argc, argv, tokenizer);
   }
 }
 
+static bool has_loop(struct node *node) {
+  switch (node->kind) {
+    case ND_FOR:
+      return true;
+    case ND_BLOCK:
+      for (struct node *cur = OPT_CHILD(node, block.body); cur; cur = OPT_CHILD(cur, next)) {
+        if (has_loop(cur)) {
+          return true;
+        }
+      }
+      return false;
+    case ND_IF:
+      return has_loop(CHILD(node, branch.then)) ||
+             (node->branch.els && has_loop(CHILD(node, branch.els)));
+    default:
+      return false;
+  }
+}
+
+static struct node *optimize_program(struct node *program) {
+  if (arg_flags & ARG_OPTIMIZE) {
+    stats_start();
+    program = optimize(&ctx, program);
+    stats_stop(STAGE_OPTIMIZE);
+  }
+  return program;
+}
+
+// Programs of source files are looked up in the cache before they are lexed
+// and parsed, and stored in it afterwards. Cached programs of -O are the
+// optimized ones.
+static struct node *load_program(struct tokenizer *tokenizer) {
+  struct cache_key key;
+  bool use_cache = tokenizer->mapped && !(arg_flags & ARG_NO_CACHE);
+  if (use_cache) {
+    stats_start();
+    cache_key_init(&key, tokenizer->buf, tokenizer->end,
+                   (arg_flags & ARG_OPTIMIZE) ? CACHE_OPTIMIZED : 0);
+    struct node *program = cache_load(&ctx, &key);
+    stats_stop(STAGE_CACHE);
+    if (program) {
+      return program;
+    }
+  }
+
+  stats_start();
+  tok_lex_all(tokenizer);
+  stats_stop(STAGE_LEX);
+  stats_start();
+  struct node *program = parse(tokenizer);
+  stats_stop(STAGE_PARSE);
+  program = optimize_program(program);
+
+  if (use_cache) {
+    stats_start();
+    cache_store(&ctx, program, &key);
+    stats_stop(STAGE_CACHE);
+  }
+  return program;
+}
+
+static void run(struct node *program) {
+  if (arg_flags & ARG_PRINT_TREE) {
+    print_node_tree(program);
+  }
+
+  if (arg_flags & ARG_COMPILE) {
+    stats_start();
+    c_codegen(program, stdout);
+    stats_stop(STAGE_CODEGEN);
+  } else if (arg_flags & ARG_PROFILE) {
+    stats_start();
+    profile_execute(&ctx, program);
+    stats_stop(STAGE_EXECUTE);
+  } else if ((arg_flags & ARG_TREE_WALK) ||
+             ((arg_flags & ARG_STREAM) && !(arg_flags & ARG_PRINT_BYTECODE) && !has_loop(program))) {
+    // Statements executed one by one which have no loop run only once,
+    // compiling them would take longer than walking them
+    stats_start();
+    execute_node(program);
+    stats_stop(STAGE_EXECUTE);
+  } else if (arg_flags & ARG_JIT) {
+    stats_start();
+    struct jit_code *code = jit_compile(program);
+    stats_stop(STAGE_COMPILE);
+    stats_start();
+    jit_execute(code);
+    stats_stop(STAGE_EXECUTE);
+    jit_free(code);
+  } else {
+    stats_start();
+    struct chunk *chunk = bc_compile(program);
+    stats_stop(STAGE_COMPILE);
+    if (arg_flags & ARG_PRINT_BYTECODE) {
+      bc_dump(chunk);
+    }
+    stats_start();
+    vm_execute(chunk);
+    stats_stop(STAGE_EXECUTE);
+    bc_free(chunk);
+  }
+  // Anything printed to stdout next comes after the program's output
+  output_flush();
+}
+
 int main(int argc, char **argv) {
   struct tokenizer tokenizer = {};
+  context_init(&ctx);
   parse_args(argc, argv, &tokenizer);
   if (!(arg_flags & ARG_TBUF_FILLED)) {
     fprintf(stderr, "Error: no source input is provided\n");
     usage();
   }
+  if ((arg_flags & ARG_STREAM) && (arg_flags & ARG_COMPILE)) {
+    fprintf(stderr, "Error: -s cannot be combined with -c\n");
+    exit(1);
+  }
+  bool batch = nsources > 1 || (nsources && njobs);
+  if (batch && !(arg_flags & ARG_COMPILE)) {
+    fprintf(stderr, "Error: several files or --jobs can only be given with -c\n");
+    exit(1);
+  }
+  if ((arg_flags & ARG_PROFILE) && (arg_flags & ARG_COMPILE)) {
+    fprintf(stderr, "Error: --profile cannot be combined with -c\n");
+    exit(1);
+  }
+  if (batch && (arg_flags & ARG_STATS)) {
+    fprintf(stderr, "Error: --stats cannot be combined with several files or --jobs\n");
+    exit(1);
+  }
 
-  struct node *program = parse(&tokenizer);
-
-  if (arg_flags & ARG_PRINT_TREE) {
-    print_node_tree(program);
+  if (batch) {
+    if (!njobs) {
+      njobs = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    compile_batch(sources, nsources, njobs, arg_flags & ARG_OPTIMIZE);
+    return 0;
+  }
+  if (nsources) {
+    // Sources executed statement by statement are streamed even from regular
+    // files, so only a few lines of them are in memory at a time
+    stats_start();
+    tokenizer_init_file(&tokenizer, sources[0], arg_flags & ARG_STREAM, &ctx);
+    stats_stop(STAGE_READ);
   }
 
-  if (arg_flags & ARG_COMPILE) {
-    c_codegen(program, stdout);
+  if (arg_flags & ARG_STREAM) {
+    // Variables and their types carry over from one statement to the next,
+    // nothing else does
+    // Tokens are lexed as the parser needs them, so lexing is counted as
+    // parsing here
+    for (;;) {
+      stats_start();
+      struct node *stmt = parse_next(&tokenizer);
+      stats_stop(STAGE_PARSE);
+      if (!stmt) {
+        break;
+      }
+      run(optimize_program(stmt));
+      frame_release_temps();
+    }
+    tokenizer_destroy(&tokenizer);
   } else {
-    execute_node(program);
+    struct node *program = load_program(&tokenizer);
+    tokenizer_destroy(&tokenizer);
+    run(program);
   }
 
+  // Reports go after all of the program's output
+  fflush(stdout);
+  if (arg_flags & ARG_PROFILE) {
+    profile_report(stderr);
+    profile_write_folded(PROFILE_FOLDED);
+  }
+  if (arg_flags & ARG_STATS) {
+    stats_print(&ctx, stderr);
+  }
+  context_destroy(&ctx);
   return 0;
 }
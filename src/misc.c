@@ -15,5 +15,7 @@ _Noreturn void panic_tok(struct tokenizer *tokenizer, const char *fmt, ...) {
   va_start(ap, fmt);
   vsnprintf(err_msg, 500, fmt, ap);
   va_end(ap);
-  panic("Error: %s at [%d;%d]\n", err_msg, tokenizer->nline, tokenizer->ncol);
+  // Errors are reported at the token the parser is looking at
+  struct token *tok = tok_peek(tokenizer);
+  panic("Error: %s at [%d;%d]\n", err_msg, tok->nline, tok_col(tokenizer, tok));
 }
@@ -0,0 +1,1227 @@
+#include <math.h>
+#include <stddef.h>
+
+#include "zapp.h"
+
+static bool is_num(struct node *node) {
+  return node->kind == ND_NUM;
+}
+
+static bool is_const(struct node *node, double value) {
+  if (!is_num(node)) {
+    return false;
+  }
+  return node->type == TY_INT ? node->val.num == value : node->val.fnum == value;
+}
+
+static bool has_side_effects(struct node *node) {
+  switch (node->kind) {
+    case ND_ASSIGN:
+      return true;
+    case ND_NUM:
+    case ND_VAR:
+      return false;
+    default:
+      return (node->bin.lhs && has_side_effects(CHILD(node, bin.lhs))) ||
+             has_side_effects(CHILD(node, bin.rhs));
+  }
+}
+
+// Expressions which can be evaluated ahead of time without changing the
+// behaviour of the program: no assignments and no integer division which
+// could fail.
+static bool is_pure(struct node *node) {
+  switch (node->kind) {
+    case ND_NUM:
+    case ND_VAR:
+      return true;
+    case ND_ASSIGN:
+      return false;
+    case ND_DIV:
+      if (node->type == TY_INT && !(is_num(CHILD(node, bin.rhs)) &&
+                                    CHILD(node, bin.rhs)->val.num != 0)) {
+        return false;
+      }
+      // fallthrough
+    default:
+      return (!node->bin.lhs || is_pure(CHILD(node, bin.lhs))) &&
+             is_pure(CHILD(node, bin.rhs));
+  }
+}
+
+// Points `field` of `from` at `to`, which has to live in the same pool
+static void link(struct node *from, int32_t *field, struct node *to) {
+  *field = to ? (int32_t)(to - from) : 0;
+}
+
+static void rebase(int32_t *field, int32_t delta) {
+  if (*field) {
+    *field += delta;
+  }
+}
+
+// Overwrites expression `dst` with its descendant `src`, children offsets are
+// adjusted as they are relative to the node holding them
+static void replace_node(struct node *dst, struct node *src) {
+  int32_t next = dst->next;
+  int32_t delta = src - dst;
+  *dst = *src;
+  dst->next = next;
+  switch (dst->kind) {
+    case ND_NUM:
+    case ND_VAR:
+      break;
+    default:
+      rebase(&dst->bin.lhs, delta);
+      rebase(&dst->bin.rhs, delta);
+      break;
+  }
+}
+
+static void set_num(struct node *node, union actual_value val) {
+  node->kind = ND_NUM;
+  node->val = val;
+}
+
+// Evaluates constant expression `node`, returns false if that has to be left
+// for runtime
+static bool fold_binary(struct node *node) {
+  struct node *lhs = OPT_CHILD(node, bin.lhs);
+  struct node *rhs = CHILD(node, bin.rhs);
+  if ((lhs && !is_num(lhs)) || !is_num(rhs)) {
+    return false;
+  }
+  // Integer division by zero is a runtime error
+  if (node->kind == ND_DIV && node->type == TY_INT && rhs->val.num == 0) {
+    return false;
+  }
+  union actual_value val;
+  if (node->type == TY_INT) {
+    val.num = eval_int(node);
+  } else {
+    val.fnum = eval_float(node);
+    // There are no literals for infinities and NaN in the emitted C
+    if (!isfinite(val.fnum)) {
+      return false;
+    }
+  }
+  set_num(node, val);
+  return true;
+}
+
+// Rewrites `x + 0`, `x * 1` and alike into `x`. Float identities which do not
+// hold for negative zero or NaN are left alone.
+static void simplify_binary(struct node *node) {
+  struct node *lhs = CHILD(node, bin.lhs);
+  struct node *rhs = CHILD(node, bin.rhs);
+  bool is_int = node->type == TY_INT;
+  struct node *keep = NULL;
+  switch (node->kind) {
+    case ND_ADD:
+      if (is_int && is_const(rhs, 0)) {
+        keep = lhs;
+      } else if (is_int && is_const(lhs, 0)) {
+        keep = rhs;
+      }
+      break;
+    case ND_SUB:
+      if (is_const(rhs, 0)) {
+        keep = lhs;
+      }
+      break;
+    case ND_MUL:
+      if (is_const(rhs, 1)) {
+        keep = lhs;
+      } else if (is_const(lhs, 1)) {
+        keep = rhs;
+      } else if (is_int && (is_const(rhs, 0) || is_const(lhs, 0)) && is_pure(node)) {
+        set_num(node, (union actual_value){ .num = 0 });
+        return;
+      }
+      break;
+    case ND_DIV:
+      if (is_const(rhs, 1)) {
+        keep = lhs;
+      }
+      break;
+    default:
+      break;
+  }
+  // Type of the result may not change, it decides how the value is printed
+  if (keep && keep->type == node->type) {
+    replace_node(node, keep);
+  }
+}
+
+static void fold_expr(struct node *node) {
+  switch (node->kind) {
+    case ND_NUM:
+    case ND_VAR:
+      return;
+    case ND_ASSIGN:
+      fold_expr(CHILD(node, bin.rhs));
+      return;
+    case ND_NEG:
+      fold_expr(CHILD(node, bin.rhs));
+      if (!fold_binary(node) && CHILD(node, bin.rhs)->kind == ND_NEG) {
+        replace_node(node, CHILD(CHILD(node, bin.rhs), bin.rhs));
+      }
+      return;
+    default:
+      fold_expr(CHILD(node, bin.lhs));
+      fold_expr(CHILD(node, bin.rhs));
+      if (!fold_binary(node)) {
+        simplify_binary(node);
+      }
+      return;
+  }
+}
+
+static bool is_true(struct node *node) {
+  return node->type == TY_INT ? node->val.num != 0 : node->val.fnum != 0;
+}
+
+static void fold_stmt(struct node *node);
+
+static bool is_self_assign(struct node *node) {
+  return node->kind == ND_ASSIGN && CHILD(node, bin.rhs)->kind == ND_VAR &&
+         CHILD(node, bin.rhs)->var.slot == CHILD(node, bin.lhs)->var.slot;
+}
+
+// Folds statements of `block`, `if` statements with a constant condition are
+// replaced by the statements of the taken branch and `x = x` left over from
+// simplification is dropped
+static void fold_block(struct node *block) {
+  struct node *prev = NULL;
+  struct node *cur = OPT_CHILD(block, block.body);
+  while (cur) {
+    struct node *next = OPT_CHILD(cur, next);
+    fold_stmt(cur);
+    if (is_self_assign(cur)) {
+      if (prev) {
+        link(prev, &prev->next, next);
+      } else {
+        link(block, &block->block.body, next);
+      }
+      cur = next;
+      continue;
+    }
+    if (cur->kind != ND_IF || !is_num(CHILD(cur, branch.cond))) {
+      prev = cur;
+      cur = next;
+      continue;
+    }
+    struct node *taken = is_true(CHILD(cur, branch.cond)) ? CHILD(cur, branch.then)
+                                                         : OPT_CHILD(cur, branch.els);
+    struct node *first = taken ? OPT_CHILD(taken, block.body) : NULL;
+    struct node *last = first;
+    while (last && last->next) {
+      last = CHILD(last, next);
+    }
+    if (last) {
+      link(last, &last->next, next);
+    } else {
+      first = next;
+    }
+    if (prev) {
+      link(prev, &prev->next, first);
+    } else {
+      link(block, &block->block.body, first);
+    }
+    // Spliced statements are already folded
+    prev = last ? last : prev;
+    cur = next;
+  }
+}
+
+static void fold_stmt(struct node *node) {
+  switch (node->kind) {
+    case ND_BLOCK:
+      fold_block(node);
+      return;
+    case ND_IF:
+      fold_expr(CHILD(node, branch.cond));
+      fold_block(CHILD(node, branch.then));
+      if (node->branch.els) {
+        fold_block(CHILD(node, branch.els));
+      }
+      return;
+    case ND_FOR:
+      fold_expr(CHILD(node, loop.init));
+      fold_expr(CHILD(node, loop.cond));
+      fold_expr(CHILD(node, loop.inc));
+      fold_block(CHILD(node, loop.body));
+      return;
+    case ND_PRINT:
+      fold_expr(CHILD(node, bin.rhs));
+      return;
+    default:
+      fold_expr(node);
+      return;
+  }
+}
+
+/*
+ * Loops
+ *
+ * Loop transformations add nodes to the pool of the program, which moves it,
+ * so they address nodes by index like the parser does.
+ */
+
+#define UNROLL_MAX_TRIPS 8
+#define UNROLL_MAX_NODES 256
+
+#define NODE(o, idx) (&(o)->pool->nodes[idx])
+#define LINK(o, parent, field, child) \
+  (NODE(o, parent)->field = (int32_t)(child) - (int32_t)(parent))
+#define CHILD_IDX(o, idx, field) ((idx) + NODE(o, idx)->field)
+
+struct optimizer {
+  struct node_pool *pool;
+  struct hoisted *hoisted; // invariants hoisted out of the current loop
+  int nhoisted;
+  int hoisted_capacity;
+};
+
+struct hoisted {
+  uint32_t expr; // hoisted expression, moved out of the loop
+  int slot;      // temporary holding its value
+};
+
+// Set of variable slots, slots added after its creation are never members
+struct slots {
+  bool *has;
+  int len;
+};
+
+static struct slots slots_new() {
+  struct slots set = { .has = calloc(frame.nslots ? frame.nslots : 1, sizeof(bool)),
+                       .len = frame.nslots };
+  if (!set.has) {
+    panic("Error: %s\n", strerror(errno));
+  }
+  return set;
+}
+
+static bool slots_has(struct slots *set, int slot) {
+  return slot < set->len && set->has[slot];
+}
+
+// What running a statement may do besides computing values
+struct effects {
+  struct slots writes; // variables assigned
+  bool prints;
+  bool fails;          // integer division by a value which may be zero
+};
+
+static void collect_effects(struct node *node, struct effects *fx) {
+  switch (node->kind) {
+    case ND_NUM:
+    case ND_VAR:
+      return;
+    case ND_BLOCK:
+      for (struct node *cur = OPT_CHILD(node, block.body); cur; cur = OPT_CHILD(cur, next)) {
+        collect_effects(cur, fx);
+      }
+      return;
+    case ND_IF:
+      collect_effects(CHILD(node, branch.cond), fx);
+      collect_effects(CHILD(node, branch.then), fx);
+      if (node->branch.els) {
+        collect_effects(CHILD(node, branch.els), fx);
+      }
+      return;
+    case ND_FOR:
+      collect_effects(CHILD(node, loop.init), fx);
+      collect_effects(CHILD(node, loop.cond), fx);
+      collect_effects(CHILD(node, loop.inc), fx);
+      collect_effects(CHILD(node, loop.body), fx);
+      return;
+    case ND_ASSIGN:
+      fx->writes.has[CHILD(node, bin.lhs)->var.slot] = true;
+      collect_effects(CHILD(node, bin.rhs), fx);
+      return;
+    case ND_PRINT:
+      fx->prints = true;
+      collect_effects(CHILD(node, bin.rhs), fx);
+      return;
+    case ND_DIV: {
+      struct node *rhs = CHILD(node, bin.rhs);
+      if (node->type == TY_INT && !(is_num(rhs) && rhs->val.num != 0)) {
+        fx->fails = true;
+      }
+    }
+      // fallthrough
+    default:
+      if (node->bin.lhs) {
+        collect_effects(CHILD(node, bin.lhs), fx);
+      }
+      collect_effects(CHILD(node, bin.rhs), fx);
+      return;
+  }
+}
+
+static struct effects effects_of(struct node *node) {
+  struct effects fx = { .writes = slots_new() };
+  collect_effects(node, &fx);
+  return fx;
+}
+
+// Whether `node` reads any of the variables in `set`
+static bool reads_any(struct node *node, struct slots *set) {
+  switch (node->kind) {
+    case ND_NUM:
+      return false;
+    case ND_VAR:
+      return slots_has(set, node->var.slot);
+    case ND_BLOCK:
+      for (struct node *cur = OPT_CHILD(node, block.body); cur; cur = OPT_CHILD(cur, next)) {
+        if (reads_any(cur, set)) {
+          return true;
+        }
+      }
+      return false;
+    case ND_IF:
+      return reads_any(CHILD(node, branch.cond), set) ||
+             reads_any(CHILD(node, branch.then), set) ||
+             (node->branch.els && reads_any(CHILD(node, branch.els), set));
+    case ND_FOR:
+      return reads_any(CHILD(node, loop.init), set) ||
+             reads_any(CHILD(node, loop.cond), set) ||
+             reads_any(CHILD(node, loop.inc), set) ||
+             reads_any(CHILD(node, loop.body), set);
+    case ND_ASSIGN:
+      return reads_any(CHILD(node, bin.rhs), set);
+    default:
+      return (node->bin.lhs && reads_any(CHILD(node, bin.lhs), set)) ||
+             reads_any(CHILD(node, bin.rhs), set);
+  }
+}
+
+static int count_nodes(struct node *node) {
+  switch (node->kind) {
+    case ND_NUM:
+    case ND_VAR:
+      return 1;
+    case ND_BLOCK: {
+      int n = 1;
+      for (struct node *cur = OPT_CHILD(node, block.body); cur; cur = OPT_CHILD(cur, next)) {
+        n += count_nodes(cur);
+      }
+      return n;
+    }
+    case ND_IF:
+      return 1 + count_nodes(CHILD(node, branch.cond)) + count_nodes(CHILD(node, branch.then)) +
+             (node->branch.els ? count_nodes(CHILD(node, branch.els)) : 0);
+    case ND_FOR:
+      return 1 + count_nodes(CHILD(node, loop.init)) + count_nodes(CHILD(node, loop.cond)) +
+             count_nodes(CHILD(node, loop.inc)) + count_nodes(CHILD(node, loop.body));
+    default:
+      return 1 + (node->bin.lhs ? count_nodes(CHILD(node, bin.lhs)) : 0) +
+             count_nodes(CHILD(node, bin.rhs));
+  }
+}
+
+static bool expr_equal(struct node *a, struct node *b) {
+  if (a->kind != b->kind || a->type != b->type) {
+    return false;
+  }
+  switch (a->kind) {
+    case ND_NUM:
+      return a->val.num == b->val.num;
+    case ND_VAR:
+      return a->var.slot == b->var.slot;
+    default:
+      if (!a->bin.lhs != !b->bin.lhs) {
+        return false;
+      }
+      return (!a->bin.lhs || expr_equal(CHILD(a, bin.lhs), CHILD(b, bin.lhs))) &&
+             expr_equal(CHILD(a, bin.rhs), CHILD(b, bin.rhs));
+  }
+}
+
+static int loop_slot(struct node *node) {
+  return CHILD(CHILD(node, loop.init), bin.lhs)->var.slot;
+}
+
+static uint32_t new_var(struct optimizer *o, int slot) {
+  uint32_t idx = pool_new_node(o->pool, ND_VAR);
+  NODE(o, idx)->var.slot = slot;
+  NODE(o, idx)->type = frame.values[slot].kind;
+  return idx;
+}
+
+static uint32_t new_assign(struct optimizer *o, uint32_t var, uint32_t rhs) {
+  uint32_t idx = pool_new_node(o->pool, ND_ASSIGN);
+  LINK(o, idx, bin.lhs, var);
+  LINK(o, idx, bin.rhs, rhs);
+  NODE(o, idx)->type = NODE(o, var)->type;
+  return idx;
+}
+
+// Replacement of reads of variable `slot` while cloning
+struct subst {
+  int slot;
+  struct node with; // ND_NUM or ND_VAR
+};
+
+static uint32_t clone_node(struct optimizer *o, uint32_t src, struct subst *subst);
+
+static void clone_child(struct optimizer *o, uint32_t dst, uint32_t src, size_t field,
+                        struct subst *subst) {
+  int32_t offset = *(int32_t *)((char *)NODE(o, src) + field);
+  if (offset) {
+    uint32_t child = clone_node(o, src + offset, subst);
+    *(int32_t *)((char *)NODE(o, dst) + field) = (int32_t)child - (int32_t)dst;
+  }
+}
+
+#define CLONE_CHILD(o, dst, src, field, subst) \
+  clone_child(o, dst, src, offsetof(struct node, field), subst)
+
+// Deep copy of statement or expression `src`, without its `next` link
+static uint32_t clone_node(struct optimizer *o, uint32_t src, struct subst *subst) {
+  uint32_t dst = pool_new_node(o->pool, NODE(o, src)->kind);
+  *NODE(o, dst) = *NODE(o, src);
+  NODE(o, dst)->next = 0;
+  switch (NODE(o, dst)->kind) {
+    case ND_NUM:
+      break;
+    case ND_VAR:
+      if (subst && NODE(o, dst)->var.slot == subst->slot) {
+        *NODE(o, dst) = subst->with;
+      }
+      break;
+    case ND_BLOCK: {
+      uint32_t prev = 0;
+      NODE(o, dst)->block.body = 0;
+      for (uint32_t cur = NODE(o, src)->block.body ? CHILD_IDX(o, src, block.body) : 0; cur;
+           cur = NODE(o, cur)->next ? CHILD_IDX(o, cur, next) : 0) {
+        uint32_t copy = clone_node(o, cur, subst);
+        if (prev) {
+          LINK(o, prev, next, copy);
+        } else {
+          LINK(o, dst, block.body, copy);
+        }
+        prev = copy;
+      }
+      break;
+    }
+    case ND_IF:
+      CLONE_CHILD(o, dst, src, branch.cond, subst);
+      CLONE_CHILD(o, dst, src, branch.then, subst);
+      CLONE_CHILD(o, dst, src, branch.els, subst);
+      break;
+    case ND_FOR:
+      CLONE_CHILD(o, dst, src, loop.init, subst);
+      CLONE_CHILD(o, dst, src, loop.cond, subst);
+      CLONE_CHILD(o, dst, src, loop.inc, subst);
+      CLONE_CHILD(o, dst, src, loop.body, subst);
+      break;
+    default:
+      CLONE_CHILD(o, dst, src, bin.lhs, subst);
+      CLONE_CHILD(o, dst, src, bin.rhs, subst);
+      break;
+  }
+  return dst;
+}
+
+// Growable list of statement indices
+struct stmt_list {
+  uint32_t *items;
+  int len;
+  int capacity;
+};
+
+static void stmt_push(struct stmt_list *list, uint32_t stmt) {
+  if (list->len == list->capacity) {
+    list->capacity = list->capacity ? list->capacity * 2 : 16;
+    list->items = realloc(list->items, list->capacity * sizeof(uint32_t));
+    if (!list->items) {
+      panic("Error: %s\n", strerror(errno));
+    }
+  }
+  list->items[list->len++] = stmt;
+}
+
+// Appends statements of block `block` to `list`
+static void stmt_push_block(struct optimizer *o, struct stmt_list *list, uint32_t block) {
+  for (uint32_t cur = NODE(o, block)->block.body ? CHILD_IDX(o, block, block.body) : 0; cur;
+       cur = NODE(o, cur)->next ? CHILD_IDX(o, cur, next) : 0) {
+    stmt_push(list, cur);
+  }
+}
+
+// Makes `list` the statements of block `block`
+static void stmt_link(struct optimizer *o, uint32_t block, struct stmt_list *list) {
+  NODE(o, block)->block.body = 0;
+  for (int i = 0; i < list->len; ++i) {
+    if (i) {
+      LINK(o, list->items[i - 1], next, list->items[i]);
+    } else {
+      LINK(o, block, block.body, list->items[i]);
+    }
+    NODE(o, list->items[i])->next = 0;
+  }
+}
+
+// Replaces loop with a copy of its body per iteration, with the loop variable
+// substituted by its value, if the trip count is small and known.
+static bool unroll_loop(struct optimizer *o, uint32_t loop, struct stmt_list *out) {
+  struct node *node = NODE(o, loop);
+  if (!is_range_loop(node)) {
+    return false;
+  }
+  struct node *start = CHILD(CHILD(node, loop.init), bin.rhs);
+  struct node *end = CHILD(CHILD(node, loop.cond), bin.rhs);
+  if (!is_num(start) || !is_num(end) || start->type != TY_INT || end->type != TY_INT) {
+    return false;
+  }
+  int64_t from = start->val.num, to = end->val.num;
+  int64_t trips = to > from ? to - from : 0;
+  struct node *body = CHILD(node, loop.body);
+  if (trips > UNROLL_MAX_TRIPS || trips * count_nodes(body) > UNROLL_MAX_NODES) {
+    return false;
+  }
+  int slot = loop_slot(node);
+  struct effects fx = effects_of(body);
+  bool writes_var = fx.writes.has[slot];
+  free(fx.writes.has);
+  if (writes_var) {
+    return false;
+  }
+
+  uint32_t body_idx = CHILD_IDX(o, loop, loop.body);
+  struct subst subst = { .slot = slot };
+  subst.with.kind = ND_NUM;
+  subst.with.type = frame.values[slot].kind;
+  for (int64_t i = from; i < to; ++i) {
+    if (subst.with.type == TY_INT) {
+      subst.with.val.num = i;
+    } else {
+      subst.with.val.fnum = i;
+    }
+    uint32_t copy = clone_node(o, body_idx, &subst);
+    stmt_push_block(o, out, copy);
+  }
+  // Loop variable is left with the value it would have after the loop, the
+  // assignment in `init` is reused for that
+  uint32_t init = CHILD_IDX(o, loop, loop.init);
+  NODE(o, CHILD_IDX(o, init, bin.rhs))->val.num = trips ? to : from;
+  stmt_push(out, init);
+  return true;
+}
+
+// Merges `second` into `first` if both loop over the same range and running
+// their bodies interleaved cannot be told apart from running them one after
+// another. Returns the statement to put after the fused loop, if any.
+static bool fuse_loops(struct optimizer *o, uint32_t first, uint32_t second, uint32_t *after) {
+  struct node *l1 = NODE(o, first), *l2 = NODE(o, second);
+  if (!is_range_loop(l1) || !is_range_loop(l2)) {
+    return false;
+  }
+  struct node *start1 = CHILD(CHILD(l1, loop.init), bin.rhs);
+  struct node *start2 = CHILD(CHILD(l2, loop.init), bin.rhs);
+  struct node *end1 = CHILD(CHILD(l1, loop.cond), bin.rhs);
+  struct node *end2 = CHILD(CHILD(l2, loop.cond), bin.rhs);
+  int var1 = loop_slot(l1), var2 = loop_slot(l2);
+  if (!expr_equal(start1, start2) || !expr_equal(end1, end2) ||
+      !is_pure(start1) || !is_pure(end1) ||
+      frame.values[var1].kind != frame.values[var2].kind) {
+    return false;
+  }
+  struct node *body1 = CHILD(l1, loop.body), *body2 = CHILD(l2, loop.body);
+  struct effects fx1 = effects_of(body1), fx2 = effects_of(body2);
+  struct slots vars = slots_new();
+  vars.has[var1] = vars.has[var2] = true;
+  // Output of one body may not move relative to output or failure of the
+  // other, neither may change the range or the loop variables
+  bool legal = !(fx1.prints && (fx2.prints || fx2.fails)) && !(fx2.prints && fx1.fails) &&
+               !fx1.writes.has[var1] && !fx1.writes.has[var2] &&
+               !fx2.writes.has[var1] && !fx2.writes.has[var2] &&
+               !reads_any(start1, &fx1.writes) && !reads_any(end1, &fx1.writes) &&
+               !reads_any(start1, &fx2.writes) && !reads_any(end1, &fx2.writes) &&
+               !reads_any(start1, &vars) && !reads_any(end1, &vars);
+  // Second body would see the first variable change instead of its final value
+  if (legal && var1 != var2) {
+    memset(vars.has, 0, vars.len);
+    vars.has[var1] = true;
+    legal = !reads_any(body2, &vars);
+  }
+  // Bodies may not touch variables written by the other one
+  for (int i = 0; legal && i < fx1.writes.len; ++i) {
+    legal = !(fx1.writes.has[i] && fx2.writes.has[i]);
+  }
+  legal = legal && !reads_any(body2, &fx1.writes) && !reads_any(body1, &fx2.writes);
+  free(fx1.writes.has);
+  free(fx2.writes.has);
+  free(vars.has);
+  if (!legal) {
+    return false;
+  }
+
+  uint32_t body1_idx = CHILD_IDX(o, first, loop.body);
+  uint32_t body2_idx = CHILD_IDX(o, second, loop.body);
+  struct stmt_list stmts = {};
+  stmt_push_block(o, &stmts, body1_idx);
+  if (var1 == var2) {
+    stmt_push_block(o, &stmts, body2_idx);
+    *after = 0;
+  } else {
+    struct subst subst = { .slot = var2 };
+    subst.with.kind = ND_VAR;
+    subst.with.type = frame.values[var1].kind;
+    subst.with.var.slot = var1;
+    stmt_push_block(o, &stmts, clone_node(o, body2_idx, &subst));
+    // Second variable ends up with the same value as the first one
+    *after = new_assign(o, new_var(o, var2), new_var(o, var1));
+  }
+  stmt_link(o, body1_idx, &stmts);
+  free(stmts.items);
+  return true;
+}
+
+// Moves node `expr` to a fresh index and turns the old one into a read of
+// `slot`, returns the new index
+static uint32_t move_out(struct optimizer *o, uint32_t expr, int slot) {
+  uint32_t moved = pool_new_node(o->pool, NODE(o, expr)->kind);
+  *NODE(o, moved) = *NODE(o, expr);
+  int32_t delta = (int32_t)expr - (int32_t)moved;
+  struct node *node = NODE(o, moved);
+  if (node->kind != ND_NUM && node->kind != ND_VAR) {
+    rebase(&node->bin.lhs, delta);
+    rebase(&node->bin.rhs, delta);
+  }
+  node->next = 0;
+  int32_t next = NODE(o, expr)->next;
+  memset(NODE(o, expr), 0, sizeof(struct node));
+  NODE(o, expr)->kind = ND_VAR;
+  NODE(o, expr)->type = frame.values[slot].kind;
+  NODE(o, expr)->var.slot = slot;
+  NODE(o, expr)->next = next;
+  return moved;
+}
+
+// Replaces maximal loop invariant subexpressions of `expr` with temporaries
+static void hoist_expr(struct optimizer *o, uint32_t expr, struct slots *writes) {
+  struct node *node = NODE(o, expr);
+  if (node->kind == ND_NUM || node->kind == ND_VAR) {
+    return;
+  }
+  if (is_pure(node) && !reads_any(node, writes)) {
+    for (int i = 0; i < o->nhoisted; ++i) {
+      if (expr_equal(NODE(o, o->hoisted[i].expr), node)) {
+        move_out(o, expr, o->hoisted[i].slot);
+        return;
+      }
+    }
+    if (o->nhoisted == o->hoisted_capacity) {
+      o->hoisted_capacity = o->hoisted_capacity ? o->hoisted_capacity * 2 : 8;
+      o->hoisted = realloc(o->hoisted, o->hoisted_capacity * sizeof(struct hoisted));
+      if (!o->hoisted) {
+        panic("Error: %s\n", strerror(errno));
+      }
+    }
+    int slot = frame_temp(node->type);
+    o->hoisted[o->nhoisted].slot = slot;
+    o->hoisted[o->nhoisted++].expr = move_out(o, expr, slot);
+    return;
+  }
+  if (node->kind == ND_ASSIGN) {
+    hoist_expr(o, CHILD_IDX(o, expr, bin.rhs), writes);
+    return;
+  }
+  if (node->bin.lhs) {
+    hoist_expr(o, CHILD_IDX(o, expr, bin.lhs), writes);
+  }
+  hoist_expr(o, CHILD_IDX(o, expr, bin.rhs), writes);
+}
+
+static void hoist_stmt(struct optimizer *o, uint32_t stmt, struct slots *writes) {
+  switch (NODE(o, stmt)->kind) {
+    case ND_BLOCK:
+      for (uint32_t cur = NODE(o, stmt)->block.body ? CHILD_IDX(o, stmt, block.body) : 0; cur;
+           cur = NODE(o, cur)->next ? CHILD_IDX(o, cur, next) : 0) {
+        hoist_stmt(o, cur, writes);
+      }
+      return;
+    case ND_IF:
+      hoist_expr(o, CHILD_IDX(o, stmt, branch.cond), writes);
+      hoist_stmt(o, CHILD_IDX(o, stmt, branch.then), writes);
+      if (NODE(o, stmt)->branch.els) {
+        hoist_stmt(o, CHILD_IDX(o, stmt, branch.els), writes);
+      }
+      return;
+    case ND_FOR:
+      hoist_expr(o, CHILD_IDX(o, stmt, loop.init), writes);
+      hoist_expr(o, CHILD_IDX(o, stmt, loop.cond), writes);
+      hoist_stmt(o, CHILD_IDX(o, stmt, loop.body), writes);
+      return;
+    case ND_PRINT:
+      hoist_expr(o, CHILD_IDX(o, stmt, bin.rhs), writes);
+      return;
+    default:
+      hoist_expr(o, stmt, writes);
+      return;
+  }
+}
+
+// Computes invariants of `loop`, including its range bound, into temporaries
+// assigned in front of it
+static void hoist_loop(struct optimizer *o, uint32_t loop, struct stmt_list *out) {
+  struct effects fx = effects_of(NODE(o, loop));
+  o->nhoisted = 0;
+  hoist_expr(o, CHILD_IDX(o, CHILD_IDX(o, loop, loop.cond), bin.rhs), &fx.writes);
+  hoist_stmt(o, CHILD_IDX(o, loop, loop.body), &fx.writes);
+  free(fx.writes.has);
+  for (int i = 0; i < o->nhoisted; ++i) {
+    stmt_push(out, new_assign(o, new_var(o, o->hoisted[i].slot), o->hoisted[i].expr));
+  }
+}
+
+/*
+ * Induction variables
+ *
+ * Range loops whose body only adds to variables are replaced with closed
+ * forms of the sums. Variables which grow by the same amount every iteration
+ * are linear induction variables, others may add any polynomial of the loop
+ * variable and of linear induction variables. Closed forms are computed with
+ * the same wrapping integer arithmetic as the loop, divisions are applied to
+ * factors they divide exactly, so results match the loop even on overflow.
+ */
+
+#define POLY_MAX_DEGREE 3
+#define INDUCTION_MAX_VARS 16
+
+// Polynomial of the iteration number k, its coefficients are expressions
+// which do not change during the loop, 0 standing for zero
+struct poly {
+  uint32_t coef[POLY_MAX_DEGREE + 1];
+};
+
+// Statement `var = var + step` or `var = var - step` of a loop body
+struct induction {
+  int slot;
+  uint32_t step;
+  bool negate;
+  bool linear; // step is the same in every iteration
+};
+
+struct induction_loop {
+  struct induction vars[INDUCTION_MAX_VARS];
+  int nvars;
+  int slot;             // loop variable
+  struct slots targets; // loop variable and all induction variables
+};
+
+static uint32_t new_int(struct optimizer *o, int64_t value) {
+  uint32_t idx = pool_new_node(o->pool, ND_NUM);
+  NODE(o, idx)->type = TY_INT;
+  NODE(o, idx)->val.num = value;
+  return idx;
+}
+
+static uint32_t new_int_binary(struct optimizer *o, node_kind kind, uint32_t lhs, uint32_t rhs) {
+  uint32_t idx = pool_new_node(o->pool, kind);
+  if (lhs) {
+    LINK(o, idx, bin.lhs, lhs);
+  }
+  LINK(o, idx, bin.rhs, rhs);
+  NODE(o, idx)->type = TY_INT;
+  return idx;
+}
+
+static uint32_t new_block(struct optimizer *o, struct stmt_list *stmts) {
+  uint32_t idx = pool_new_node(o->pool, ND_BLOCK);
+  stmt_link(o, idx, stmts);
+  return idx;
+}
+
+static uint32_t new_if(struct optimizer *o, uint32_t cond, struct stmt_list *then,
+                       struct stmt_list *els) {
+  uint32_t then_idx = new_block(o, then);
+  uint32_t els_idx = els ? new_block(o, els) : 0;
+  uint32_t idx = pool_new_node(o->pool, ND_IF);
+  LINK(o, idx, branch.cond, cond);
+  LINK(o, idx, branch.then, then_idx);
+  if (els_idx) {
+    LINK(o, idx, branch.els, els_idx);
+  }
+  return idx;
+}
+
+static uint32_t coef_add(struct optimizer *o, uint32_t a, uint32_t b) {
+  if (!a || !b) {
+    return a ? a : b;
+  }
+  return new_int_binary(o, ND_ADD, a, b);
+}
+
+static uint32_t coef_mul(struct optimizer *o, uint32_t a, uint32_t b) {
+  if (!a || !b) {
+    return 0;
+  }
+  return new_int_binary(o, ND_MUL, a, b);
+}
+
+static struct poly poly_add(struct optimizer *o, struct poly *a, struct poly *b, bool sub) {
+  struct poly sum = {};
+  for (int d = 0; d <= POLY_MAX_DEGREE; ++d) {
+    uint32_t rhs = b->coef[d];
+    if (sub && rhs) {
+      rhs = new_int_binary(o, ND_NEG, 0, rhs);
+    }
+    sum.coef[d] = coef_add(o, a->coef[d], rhs);
+  }
+  return sum;
+}
+
+static bool poly_mul(struct optimizer *o, struct poly *a, struct poly *b, struct poly *product) {
+  *product = (struct poly){};
+  for (int i = 0; i <= POLY_MAX_DEGREE; ++i) {
+    for (int j = 0; j <= POLY_MAX_DEGREE; ++j) {
+      if (!a->coef[i] || !b->coef[j]) {
+        continue;
+      }
+      if (i + j > POLY_MAX_DEGREE) {
+        return false;
+      }
+      uint32_t term = coef_mul(o, clone_node(o, a->coef[i], NULL), clone_node(o, b->coef[j], NULL));
+      product->coef[i + j] = coef_add(o, product->coef[i + j], term);
+    }
+  }
+  return true;
+}
+
+static struct induction *find_induction(struct induction_loop *l, int slot, int *pos) {
+  for (int i = 0; i < l->nvars; ++i) {
+    if (l->vars[i].slot == slot) {
+      *pos = i;
+      return &l->vars[i];
+    }
+  }
+  return NULL;
+}
+
+// Value of `expr` in the statement `pos` of the body as a polynomial of k
+static bool to_poly(struct optimizer *o, struct induction_loop *l, uint32_t expr, int pos,
+                    struct poly *out) {
+  *out = (struct poly){};
+  struct node *node = NODE(o, expr);
+  if (!reads_any(node, &l->targets)) {
+    out->coef[0] = clone_node(o, expr, NULL);
+    return true;
+  }
+  switch (node->kind) {
+    case ND_VAR: {
+      int slot = node->var.slot;
+      if (slot == l->slot) {
+        // Loop variable is `start + k`, it holds `start` where closed forms
+        // are computed
+        out->coef[0] = new_var(o, slot);
+        out->coef[1] = new_int(o, 1);
+        return true;
+      }
+      int at;
+      struct induction *iv = find_induction(l, slot, &at);
+      if (!iv->linear) {
+        return false;
+      }
+      // `var0 + k * step`, or one step more once its statement has run
+      uint32_t step = clone_node(o, iv->step, NULL);
+      if (iv->negate) {
+        step = new_int_binary(o, ND_NEG, 0, step);
+      }
+      out->coef[0] = new_var(o, slot);
+      if (at < pos) {
+        out->coef[0] = coef_add(o, out->coef[0], clone_node(o, step, NULL));
+      }
+      out->coef[1] = step;
+      return true;
+    }
+    case ND_NEG: {
+      struct poly zero = {}, rhs;
+      if (!to_poly(o, l, CHILD_IDX(o, expr, bin.rhs), pos, &rhs)) {
+        return false;
+      }
+      *out = poly_add(o, &zero, &rhs, true);
+      return true;
+    }
+    case ND_ADD:
+    case ND_SUB:
+    case ND_MUL: {
+      node_kind kind = node->kind;
+      struct poly lhs, rhs;
+      if (!to_poly(o, l, CHILD_IDX(o, expr, bin.lhs), pos, &lhs) ||
+          !to_poly(o, l, CHILD_IDX(o, expr, bin.rhs), pos, &rhs)) {
+        return false;
+      }
+      if (kind == ND_MUL) {
+        return poly_mul(o, &lhs, &rhs, out);
+      }
+      *out = poly_add(o, &lhs, &rhs, kind == ND_SUB);
+      return true;
+    }
+    default:
+      return false;
+  }
+}
+
+// Recognizes `var = var + step`, `var = step + var` and `var = var - step`
+static bool match_induction(struct optimizer *o, struct node *stmt, struct induction *iv) {
+  if (stmt->kind != ND_ASSIGN || stmt->type != TY_INT) {
+    return false;
+  }
+  struct node *rhs = CHILD(stmt, bin.rhs);
+  iv->slot = CHILD(stmt, bin.lhs)->var.slot;
+  if (rhs->kind != ND_ADD && rhs->kind != ND_SUB) {
+    return false;
+  }
+  struct node *lhs = CHILD(rhs, bin.lhs), *step = CHILD(rhs, bin.rhs);
+  if (rhs->kind == ND_ADD && !(lhs->kind == ND_VAR && lhs->var.slot == iv->slot)) {
+    struct node *tmp = lhs;
+    lhs = step;
+    step = tmp;
+  }
+  if (lhs->kind != ND_VAR || lhs->var.slot != iv->slot || has_side_effects(step)) {
+    return false;
+  }
+  iv->step = step - o->pool->nodes;
+  iv->negate = rhs->kind == ND_SUB;
+  return true;
+}
+
+// Emits statements computing sums of k^d for k below `n` into temporaries
+static void emit_power_sums(struct optimizer *o, int n, int degree, uint32_t sums[],
+                            struct stmt_list *out) {
+  sums[0] = n;
+  if (degree < 1) {
+    return;
+  }
+  // k sums to (n - 1) * n / 2, halve whichever of the factors is even
+  int x = frame_temp(TY_INT), y = frame_temp(TY_INT);
+  stmt_push(out, new_assign(o, new_var(o, x),
+                            new_int_binary(o, ND_SUB, new_var(o, n), new_int(o, 1))));
+  stmt_push(out, new_assign(o, new_var(o, y), new_var(o, n)));
+  struct stmt_list then = {}, els = {};
+  stmt_push(&then, new_assign(o, new_var(o, y),
+                              new_int_binary(o, ND_DIV, new_var(o, y), new_int(o, 2))));
+  stmt_push(&els, new_assign(o, new_var(o, x),
+                             new_int_binary(o, ND_DIV, new_var(o, x), new_int(o, 2))));
+  uint32_t half = new_int_binary(o, ND_MUL, new_int_binary(o, ND_DIV, new_var(o, n), new_int(o, 2)),
+                                 new_int(o, 2));
+  uint32_t even = new_int_binary(o, ND_EQ, new_int_binary(o, ND_SUB, new_var(o, n), half),
+                                 new_int(o, 0));
+  stmt_push(out, new_if(o, even, &then, &els));
+  free(then.items);
+  free(els.items);
+  int s1 = frame_temp(TY_INT);
+  stmt_push(out, new_assign(o, new_var(o, s1),
+                            new_int_binary(o, ND_MUL, new_var(o, x), new_var(o, y))));
+  sums[1] = s1;
+
+  if (degree >= 2) {
+    // k^2 sums to (n - 1) * n * (2n - 1) / 6, one of the factors is divisible
+    // by three depending on n % 3
+    int z = frame_temp(TY_INT), r = frame_temp(TY_INT);
+    stmt_push(out, new_assign(o, new_var(o, z),
+                              new_int_binary(o, ND_SUB,
+                                             new_int_binary(o, ND_MUL, new_var(o, n), new_int(o, 2)),
+                                             new_int(o, 1))));
+    uint32_t third = new_int_binary(o, ND_MUL,
+                                    new_int_binary(o, ND_DIV, new_var(o, n), new_int(o, 3)),
+                                    new_int(o, 3));
+    stmt_push(out, new_assign(o, new_var(o, r), new_int_binary(o, ND_SUB, new_var(o, n), third)));
+    // if (r == 0) { y = y / 3 } else { if (r == 1) { x = x / 3 } else { z = z / 3 } }
+    int factors[] = { y, x, z };
+    struct stmt_list els = {};
+    for (int rem = 2; rem >= 0; --rem) {
+      uint32_t divide = new_assign(o, new_var(o, factors[rem]),
+                                   new_int_binary(o, ND_DIV, new_var(o, factors[rem]),
+                                                  new_int(o, 3)));
+      if (rem == 2) {
+        stmt_push(&els, divide);
+        continue;
+      }
+      struct stmt_list then = {};
+      stmt_push(&then, divide);
+      uint32_t branch = new_if(o, new_int_binary(o, ND_EQ, new_var(o, r), new_int(o, rem)),
+                               &then, &els);
+      free(then.items);
+      els.len = 0;
+      stmt_push(&els, branch);
+    }
+    stmt_push(out, els.items[0]);
+    free(els.items);
+    int s2 = frame_temp(TY_INT);
+    stmt_push(out, new_assign(o, new_var(o, s2),
+                              new_int_binary(o, ND_MUL,
+                                             new_int_binary(o, ND_MUL, new_var(o, x), new_var(o, y)),
+                                             new_var(o, z))));
+    sums[2] = s2;
+  }
+  if (degree >= 3) {
+    // k^3 sums to the square of the sum of k
+    int s3 = frame_temp(TY_INT);
+    stmt_push(out, new_assign(o, new_var(o, s3),
+                              new_int_binary(o, ND_MUL, new_var(o, s1), new_var(o, s1))));
+    sums[3] = s3;
+  }
+}
+
+static bool closed_form_loop(struct optimizer *o, uint32_t loop, struct stmt_list *out) {
+  struct node *node = NODE(o, loop);
+  if (!is_range_loop(node)) {
+    return false;
+  }
+  struct induction_loop l = { .slot = loop_slot(node) };
+  struct node *end = CHILD(CHILD(node, loop.cond), bin.rhs);
+  struct node *body = CHILD(node, loop.body);
+  if (frame.values[l.slot].kind != TY_INT || end->type != TY_INT || !is_pure(end) ||
+      !body->block.body) {
+    return false;
+  }
+  for (struct node *cur = CHILD(body, block.body); cur; cur = OPT_CHILD(cur, next)) {
+    struct induction *iv = &l.vars[l.nvars];
+    int pos;
+    if (l.nvars == INDUCTION_MAX_VARS || !match_induction(o, cur, iv) || iv->slot == l.slot ||
+        find_induction(&l, iv->slot, &pos)) {
+      return false;
+    }
+    ++l.nvars;
+  }
+
+  l.targets = slots_new();
+  l.targets.has[l.slot] = true;
+  for (int i = 0; i < l.nvars; ++i) {
+    l.targets.has[l.vars[i].slot] = true;
+  }
+  bool ok = !reads_any(end, &l.targets);
+  for (int i = 0; i < l.nvars; ++i) {
+    l.vars[i].linear = !reads_any(NODE(o, l.vars[i].step), &l.targets);
+  }
+
+  // Sums are computed before any variable is updated, so linear variables,
+  // which other sums may read, are updated last
+  struct poly polys[INDUCTION_MAX_VARS];
+  int degree = 0;
+  for (int i = 0; ok && i < l.nvars; ++i) {
+    ok = to_poly(o, &l, l.vars[i].step, i, &polys[i]);
+    for (int d = 0; ok && d <= POLY_MAX_DEGREE; ++d) {
+      if (polys[i].coef[d] && d > degree) {
+        degree = d;
+      }
+    }
+  }
+  free(l.targets.has);
+  if (!ok) {
+    return false;
+  }
+
+  // i = start
+  // if (i < end) {
+  //   n = end - i
+  //   <sums of k^d for k below n>
+  //   var = var + coef0 * n + coef1 * sum1 + ...
+  //   i = i + n
+  // }
+  uint32_t init = CHILD_IDX(o, loop, loop.init);
+  uint32_t end_idx = CHILD_IDX(o, CHILD_IDX(o, loop, loop.cond), bin.rhs);
+  struct stmt_list then = {};
+  int n = frame_temp(TY_INT);
+  stmt_push(&then, new_assign(o, new_var(o, n),
+                              new_int_binary(o, ND_SUB, clone_node(o, end_idx, NULL),
+                                             new_var(o, l.slot))));
+  uint32_t sums[POLY_MAX_DEGREE + 1];
+  emit_power_sums(o, n, degree, sums, &then);
+  for (int pass = 0; pass < 2; ++pass) {
+    for (int i = 0; i < l.nvars; ++i) {
+      struct induction *iv = &l.vars[i];
+      if (iv->linear != pass) {
+        continue;
+      }
+      uint32_t total = 0;
+      for (int d = 0; d <= degree; ++d) {
+        total = coef_add(o, total, coef_mul(o, polys[i].coef[d], new_var(o, sums[d])));
+      }
+      uint32_t update = new_int_binary(o, iv->negate ? ND_SUB : ND_ADD, new_var(o, iv->slot), total);
+      stmt_push(&then, new_assign(o, new_var(o, iv->slot), update));
+    }
+  }
+  stmt_push(&then, new_assign(o, new_var(o, l.slot),
+                              new_int_binary(o, ND_ADD, new_var(o, l.slot), new_var(o, n))));
+  uint32_t cond = new_int_binary(o, ND_LT, new_var(o, l.slot), clone_node(o, end_idx, NULL));
+  stmt_push(out, init);
+  stmt_push(out, new_if(o, cond, &then, NULL));
+  free(then.items);
+  return true;
+}
+
+static void optimize_stmt(struct optimizer *o, uint32_t stmt);
+
+static void optimize_block(struct optimizer *o, uint32_t block) {
+  struct stmt_list stmts = {}, out = {};
+  stmt_push_block(o, &stmts, block);
+  for (int i = 0; i < stmts.len; ++i) {
+    optimize_stmt(o, stmts.items[i]);
+  }
+  for (int i = 0; i < stmts.len; ++i) {
+    uint32_t stmt = stmts.items[i];
+    if (NODE(o, stmt)->kind != ND_FOR) {
+      stmt_push(&out, stmt);
+      continue;
+    }
+    uint32_t after = 0;
+    while (i + 1 < stmts.len && !after && fuse_loops(o, stmt, stmts.items[i + 1], &after)) {
+      ++i;
+    }
+    if (!closed_form_loop(o, stmt, &out) && !unroll_loop(o, stmt, &out)) {
+      hoist_loop(o, stmt, &out);
+      stmt_push(&out, stmt);
+    }
+    if (after) {
+      stmt_push(&out, after);
+    }
+  }
+  stmt_link(o, block, &out);
+  free(stmts.items);
+  free(out.items);
+}
+
+static void optimize_stmt(struct optimizer *o, uint32_t stmt) {
+  switch (NODE(o, stmt)->kind) {
+    case ND_BLOCK:
+      optimize_block(o, stmt);
+      return;
+    case ND_IF:
+      optimize_block(o, CHILD_IDX(o, stmt, branch.then));
+      if (NODE(o, stmt)->branch.els) {
+        optimize_block(o, CHILD_IDX(o, stmt, branch.els));
+      }
+      return;
+    case ND_FOR:
+      optimize_block(o, CHILD_IDX(o, stmt, loop.body));
+      return;
+    default:
+      return;
+  }
+}
+
+struct node *optimize(struct context *ctx, struct node *prog) {
+  struct optimizer o = {};
+  for (struct node_pool *pool = ctx->pools; pool; pool = pool->next) {
+    if (prog >= pool->nodes && prog < pool->nodes + pool->len) {
+      o.pool = pool;
+    }
+  }
+  if (!o.pool) {
+    panic("ICE: program is not in a pool of the context\n");
+  }
+  uint32_t root = prog - o.pool->nodes;
+  fold_stmt(prog);
+  optimize_stmt(&o, root);
+  // Unrolled bodies got constants in place of loop variables
+  fold_stmt(NODE(&o, root));
+  free(o.hoisted);
+  return NODE(&o, root);
+}
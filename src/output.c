@@ -0,0 +1,165 @@
+#include <math.h>
+
+#include "zapp.h"
+
+#define OUTPUT_SIZE (64 * 1024)
+
+// Output of `print` statements is collected in a buffer of the executing
+// thread and handed to stdio in large blocks, so printing a value neither
+// parses a format nor locks the stream. Whatever is left in the buffer is
+// written out when the process exits.
+static _Thread_local struct {
+  char buf[OUTPUT_SIZE];
+  size_t len;
+  struct output_buf *sink; // where the buffer is flushed to, NULL for stdout
+} out;
+
+static const char digit_pairs[] =
+  "00010203040506070809"
+  "10111213141516171819"
+  "20212223242526272829"
+  "30313233343536373839"
+  "40414243444546474849"
+  "50515253545556575859"
+  "60616263646566676869"
+  "70717273747576777879"
+  "80818283848586878889"
+  "90919293949596979899";
+
+static int fmt_uint(char *buf, uint64_t value) {
+  char tmp[FMT_INT_SIZE];
+  char *p = tmp + sizeof(tmp);
+  while (value >= 100) {
+    p -= 2;
+    memcpy(p, &digit_pairs[value % 100 * 2], 2);
+    value /= 100;
+  }
+  if (value >= 10) {
+    p -= 2;
+    memcpy(p, &digit_pairs[value * 2], 2);
+  } else {
+    *--p = '0' + value;
+  }
+  int len = tmp + sizeof(tmp) - p;
+  memcpy(buf, p, len);
+  return len;
+}
+
+// Same as printf's "%" PRId64, returns the length without a terminating '\0'
+int fmt_int(char *buf, int64_t value) {
+  if (value < 0) {
+    *buf = '-';
+    return fmt_uint(buf + 1, -(uint64_t)value) + 1;
+  }
+  return fmt_uint(buf, value);
+}
+
+// Same as printf's "%f": the exact value of the double rounded to six
+// decimals, ties to even. Values of at least 1e12 have their digits formatted
+// by printf, below that the value times 10^6 is computed exactly in 128 bits.
+int fmt_float(char *buf, double value) {
+  if (!isfinite(value) || fabs(value) >= 1e12) {
+    return snprintf(buf, FMT_FLOAT_SIZE, "%f", value);
+  }
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  int exp = (bits >> 52) & 0x7ff;
+  uint64_t mant = bits & ((1ULL << 52) - 1);
+  if (exp) {
+    mant |= 1ULL << 52;
+  } else {
+    exp = 1;
+  }
+  // value * 10^6 = mant * 5^6 * 2^shift
+  unsigned __int128 scaled = (unsigned __int128)mant * 15625;
+  int shift = exp - 1075 + 6;
+  uint64_t micros;
+  if (shift >= 0) {
+    micros = scaled << shift;
+  } else if (shift <= -128) {
+    // `scaled` is below 2^67, far less than half of 2^128
+    micros = 0;
+  } else {
+    unsigned __int128 quot = scaled >> -shift;
+    unsigned __int128 rem = scaled - (quot << -shift);
+    unsigned __int128 half = (unsigned __int128)1 << (-shift - 1);
+    if (rem > half || (rem == half && (quot & 1))) {
+      ++quot;
+    }
+    micros = quot;
+  }
+
+  char *p = buf;
+  if (bits >> 63) {
+    *p++ = '-';
+  }
+  p += fmt_uint(p, micros / 1000000);
+  *p++ = '.';
+  uint32_t frac = micros % 1000000;
+  for (int i = 6; i > 0; i -= 2) {
+    memcpy(p + i - 2, &digit_pairs[frac % 100 * 2], 2);
+    frac /= 100;
+  }
+  return p + 6 - buf;
+}
+
+// Appends `len` bytes to `sink`, or writes them to stdout if it is NULL
+void output_write(struct output_buf *sink, const char *data, size_t len) {
+  if (!sink) {
+    fwrite(data, 1, len, stdout);
+    return;
+  }
+  if (sink->len + len > sink->capacity) {
+    size_t capacity = sink->capacity ? sink->capacity : OUTPUT_SIZE;
+    while (capacity < sink->len + len) {
+      capacity *= 2;
+    }
+    sink->data = realloc(sink->data, capacity);
+    if (!sink->data) {
+      panic("Error: %s\n", strerror(errno));
+    }
+    sink->capacity = capacity;
+  }
+  memcpy(sink->data + sink->len, data, len);
+  sink->len += len;
+}
+
+void output_flush() {
+  if (out.len) {
+    output_write(out.sink, out.buf, out.len);
+    out.len = 0;
+  }
+}
+
+// Output printed by the calling thread from now on is kept in `sink`, or
+// goes to stdout again if `sink` is NULL. Whatever was printed before is
+// flushed to where it was meant to go. Returns the sink replaced.
+struct output_buf *output_capture(struct output_buf *sink) {
+  output_flush();
+  struct output_buf *prev = out.sink;
+  out.sink = sink;
+  return prev;
+}
+
+void output_int(int64_t value) {
+  if (out.len + FMT_INT_SIZE + 1 > OUTPUT_SIZE) {
+    output_flush();
+  }
+  out.len += fmt_int(out.buf + out.len, value);
+  out.buf[out.len++] = '\n';
+}
+
+void output_float(double value) {
+  if (out.len + FMT_FLOAT_SIZE + 1 > OUTPUT_SIZE) {
+    output_flush();
+  }
+  out.len += fmt_float(out.buf + out.len, value);
+  out.buf[out.len++] = '\n';
+}
+
+// Exit handlers run before stdio flushes its streams, so the output still
+// goes out in order when a program stops with an error
+__attribute__((constructor))
+static void output_init() {
+  atexit(output_flush);
+}
@@ -0,0 +1,720 @@
+#include <pthread.h>
+
+#include "zapp.h"
+
+#define PAR_MIN_TRIP 16             // shorter loops are not even analyzed
+#define PAR_MIN_WORK (1 << 18)      // iterations times nodes of the body
+#define PAR_CHUNKS_PER_THREAD 16
+#define PAR_PRINT_CHUNK 1024        // iterations of a chunk of a loop which prints
+#define PAR_MAX_CHUNKS (1 << 16)
+
+// How the value a variable has after the loop is made up of the values the
+// threads computed
+typedef enum {
+  SHARE_LAST,    // value of the last iteration
+  SHARE_SUM,     // `v = v + e` and `v = v - e` only, sum of the threads' sums
+  SHARE_PRODUCT  // `v = v * e` only, product of the threads' products
+} share_kind;
+
+struct par_loop {
+  struct node *loop;
+  int var;             // slot of the loop variable
+  int nnodes;          // nodes of the body, to tell whether a split pays off
+  bool prints;
+  int *slots;          // variables assigned by the body, but `var`
+  uint8_t *shares;     // share_kind of each of `slots`
+  int nslots;
+  struct chunk *chunk; // body compiled by `bc_compile_range`, NULL if walked
+};
+
+/*
+ * analysis
+ */
+
+// What the body of a loop does with a variable
+struct slot_use {
+  int reads;    // reads other than those of reductions
+  bool assigns; // assigned by anything but a reduction
+  bool sums;    // `v = v + e` or `v = v - e` statement
+  bool products;
+};
+
+struct analysis {
+  struct slot_use *uses;
+  int nslots;
+  int nnodes;
+  bool prints;
+  bool fails; // integer division by a value which may be zero
+};
+
+// Operand `e` of reduction `v = v + e`, `v = e + v`, `v = v - e`, `v = v * e`
+// or `v = e * v`, NULL if `assign` is not one
+static struct node *reduction_operand(struct node *assign, node_kind *op) {
+  int slot = CHILD(assign, bin.lhs)->var.slot;
+  struct node *rhs = CHILD(assign, bin.rhs);
+  if (CHILD(assign, bin.lhs)->type != TY_INT ||
+      (rhs->kind != ND_ADD && rhs->kind != ND_SUB && rhs->kind != ND_MUL)) {
+    return NULL;
+  }
+  struct node *lhs = CHILD(rhs, bin.lhs), *other = CHILD(rhs, bin.rhs);
+  *op = rhs->kind == ND_MUL ? ND_MUL : ND_ADD;
+  if (lhs->kind == ND_VAR && lhs->var.slot == slot) {
+    return other;
+  }
+  if (rhs->kind != ND_SUB && other->kind == ND_VAR && other->var.slot == slot) {
+    return lhs;
+  }
+  return NULL;
+}
+
+// Records how the body uses every variable. Only assignments which are
+// statements of their own can be reductions, the value of an assignment
+// used as an expression would be that of a single thread.
+static void scan(struct analysis *a, struct node *node, bool stmt) {
+  ++a->nnodes;
+  switch (node->kind) {
+    case ND_NUM:
+      return;
+    case ND_VAR:
+      ++a->uses[node->var.slot].reads;
+      return;
+    case ND_BLOCK:
+      for (struct node *cur = OPT_CHILD(node, block.body); cur; cur = OPT_CHILD(cur, next)) {
+        scan(a, cur, true);
+      }
+      return;
+    case ND_IF:
+      scan(a, CHILD(node, branch.cond), false);
+      scan(a, CHILD(node, branch.then), true);
+      if (node->branch.els) {
+        scan(a, CHILD(node, branch.els), true);
+      }
+      return;
+    case ND_FOR:
+      scan(a, CHILD(node, loop.init), true);
+      scan(a, CHILD(node, loop.cond), false);
+      scan(a, CHILD(node, loop.inc), true);
+      scan(a, CHILD(node, loop.body), true);
+      return;
+    case ND_PRINT:
+      a->prints = true;
+      scan(a, CHILD(node, bin.rhs), false);
+      return;
+    case ND_ASSIGN: {
+      struct slot_use *use = &a->uses[CHILD(node, bin.lhs)->var.slot];
+      node_kind op;
+      struct node *operand = stmt ? reduction_operand(node, &op) : NULL;
+      if (operand) {
+        *(op == ND_MUL ? &use->products : &use->sums) = true;
+        scan(a, operand, false);
+      } else {
+        use->assigns = true;
+        scan(a, CHILD(node, bin.rhs), false);
+      }
+      return;
+    }
+    case ND_DIV: {
+      struct node *rhs = CHILD(node, bin.rhs);
+      if (node->type == TY_INT && !(rhs->kind == ND_NUM && rhs->val.num != 0)) {
+        a->fails = true;
+      }
+    }
+      // fallthrough
+    default:
+      if (node->bin.lhs) {
+        scan(a, CHILD(node, bin.lhs), false);
+      }
+      scan(a, CHILD(node, bin.rhs), false);
+      return;
+  }
+}
+
+static bool is_written(struct analysis *a, int slot) {
+  struct slot_use *use = &a->uses[slot];
+  return use->assigns || use->sums || use->products;
+}
+
+static bool is_reduction(struct analysis *a, int slot) {
+  struct slot_use *use = &a->uses[slot];
+  return !use->assigns && !use->reads && use->sums != use->products;
+}
+
+// Whether `expr` only reads variables which are not written by the body,
+// reductions aside, or have been assigned in this iteration already
+static bool reads_defined(struct analysis *a, struct node *expr, bool *defined) {
+  switch (expr->kind) {
+    case ND_NUM:
+      return true;
+    case ND_VAR:
+      return !is_written(a, expr->var.slot) || defined[expr->var.slot];
+    case ND_ASSIGN: {
+      node_kind op;
+      struct node *rhs = CHILD(expr, bin.rhs);
+      if (is_reduction(a, CHILD(expr, bin.lhs)->var.slot)) {
+        rhs = reduction_operand(expr, &op);
+      }
+      return reads_defined(a, rhs, defined);
+    }
+    default:
+      return (!expr->bin.lhs || reads_defined(a, CHILD(expr, bin.lhs), defined)) &&
+             reads_defined(a, CHILD(expr, bin.rhs), defined);
+  }
+}
+
+// Marks variables assigned by `expr` as defined. All of them are assigned
+// whenever `expr` is evaluated, as no operator skips an operand.
+static void define(struct node *expr, bool *defined) {
+  switch (expr->kind) {
+    case ND_NUM:
+    case ND_VAR:
+      return;
+    case ND_ASSIGN:
+      define(CHILD(expr, bin.rhs), defined);
+      defined[CHILD(expr, bin.lhs)->var.slot] = true;
+      return;
+    default:
+      if (expr->bin.lhs) {
+        define(CHILD(expr, bin.lhs), defined);
+      }
+      define(CHILD(expr, bin.rhs), defined);
+      return;
+  }
+}
+
+static bool check_expr(struct analysis *a, struct node *expr, bool *defined) {
+  if (!reads_defined(a, expr, defined)) {
+    return false;
+  }
+  define(expr, defined);
+  return true;
+}
+
+static bool *copy_defined(struct analysis *a, bool *defined) {
+  bool *copy = malloc(a->nslots ? a->nslots : 1);
+  if (!copy) {
+    panic("Error: %s\n", strerror(errno));
+  }
+  memcpy(copy, defined, a->nslots);
+  return copy;
+}
+
+// Follows statements of an iteration in order, tracking variables which are
+// surely assigned by then in `defined`. Fails on a read of a variable which
+// may still hold the value of an earlier iteration.
+static bool check_stmt(struct analysis *a, struct node *node, bool *defined) {
+  switch (node->kind) {
+    case ND_BLOCK:
+      for (struct node *cur = OPT_CHILD(node, block.body); cur; cur = OPT_CHILD(cur, next)) {
+        if (!check_stmt(a, cur, defined)) {
+          return false;
+        }
+      }
+      return true;
+    case ND_IF: {
+      if (!check_expr(a, CHILD(node, branch.cond), defined)) {
+        return false;
+      }
+      bool *then = copy_defined(a, defined);
+      bool ok = check_stmt(a, CHILD(node, branch.then), then) &&
+                (!node->branch.els || check_stmt(a, CHILD(node, branch.els), defined));
+      // Assigned after the `if` only if assigned by both branches
+      for (int i = 0; node->branch.els && i < a->nslots; ++i) {
+        defined[i] = defined[i] && then[i];
+      }
+      free(then);
+      return ok;
+    }
+    case ND_FOR: {
+      // The body may not run at all, so only the loop variable is surely
+      // assigned after the loop
+      if (!check_expr(a, CHILD(node, loop.init), defined) ||
+          !check_expr(a, CHILD(node, loop.cond), defined)) {
+        return false;
+      }
+      bool *body = copy_defined(a, defined);
+      bool ok = check_stmt(a, CHILD(node, loop.body), body) &&
+                check_expr(a, CHILD(node, loop.inc), body);
+      free(body);
+      return ok;
+    }
+    case ND_PRINT:
+      return check_expr(a, CHILD(node, bin.rhs), defined);
+    default:
+      return check_expr(a, node, defined);
+  }
+}
+
+static bool reads_written(struct analysis *a, struct node *expr) {
+  switch (expr->kind) {
+    case ND_NUM:
+      return false;
+    case ND_VAR:
+      return is_written(a, expr->var.slot);
+    default:
+      return (expr->bin.lhs && reads_written(a, CHILD(expr, bin.lhs))) ||
+             reads_written(a, CHILD(expr, bin.rhs));
+  }
+}
+
+// Plan for running iterations of `loop` on threads, NULL if they may depend
+// on each other. That is the case if the body assigns the loop variable or
+// any variable used by the range end, if it may fail with a division by
+// zero, or if it reads a variable assigned in an earlier iteration other than
+// by a reduction. Variables which are not surely assigned by the end of an
+// iteration would have to be taken from the last iteration which assigned
+// them, so they keep the loop sequential too. If `compiled`, threads run the
+// body as bytecode, otherwise they walk it.
+struct par_loop *par_analyze(struct node *loop, bool compiled) {
+  if (!is_range_loop(loop)) {
+    return NULL;
+  }
+  struct analysis a = { .nslots = frame.nslots };
+  a.uses = calloc(a.nslots ? a.nslots : 1, sizeof(struct slot_use));
+  bool *defined = calloc(a.nslots ? a.nslots : 1, sizeof(bool));
+  if (!a.uses || !defined) {
+    panic("Error: %s\n", strerror(errno));
+  }
+  int var = CHILD(CHILD(loop, loop.init), bin.lhs)->var.slot;
+  struct node *end = CHILD(CHILD(loop, loop.cond), bin.rhs);
+  scan(&a, CHILD(loop, loop.body), true);
+  bool ok = !a.fails && !is_written(&a, var) && !has_assign(end) && !reads_written(&a, end) &&
+            check_stmt(&a, CHILD(loop, loop.body), defined);
+
+  struct par_loop *plan = NULL;
+  int nwritten = 0;
+  for (int i = 0; ok && i < a.nslots; ++i) {
+    if (is_written(&a, i)) {
+      // Variables other than reductions have to be assigned by every iteration
+      ok = is_reduction(&a, i) || defined[i];
+      ++nwritten;
+    }
+  }
+  if (ok) {
+    plan = calloc(1, sizeof(struct par_loop));
+    if (!plan || !(plan->slots = malloc((nwritten ? nwritten : 1) * sizeof(int))) ||
+        !(plan->shares = malloc(nwritten ? nwritten : 1))) {
+      panic("Error: %s\n", strerror(errno));
+    }
+    plan->loop = loop;
+    plan->var = var;
+    plan->nnodes = a.nnodes;
+    plan->prints = a.prints;
+    for (int i = 0; i < a.nslots; ++i) {
+      if (!is_written(&a, i)) {
+        continue;
+      }
+      plan->slots[plan->nslots] = i;
+      plan->shares[plan->nslots++] = !is_reduction(&a, i) ? SHARE_LAST
+                                   : a.uses[i].sums       ? SHARE_SUM
+                                                          : SHARE_PRODUCT;
+    }
+    if (compiled) {
+      plan->chunk = bc_compile_range(loop);
+    }
+  }
+  free(a.uses);
+  free(defined);
+  return plan;
+}
+
+void par_free(struct par_loop *loop) {
+  if (!loop) {
+    return;
+  }
+  if (loop->chunk) {
+    bc_free(loop->chunk);
+  }
+  free(loop->slots);
+  free(loop->shares);
+  free(loop);
+}
+
+/*
+ * execution
+ */
+
+// Output of a chunk of iterations, written once all chunks before it are
+struct chunk_output {
+  struct output_buf buf;
+  bool done;
+};
+
+// A loop being run. Iterations are split into `nchunks` chunks of
+// consecutive iterations.
+struct job {
+  struct par_loop *plan;
+  struct zapp_value *values; // frame of the thread running the loop
+  int nslots;
+  int64_t start;
+  uint64_t trip;
+  uint32_t nchunks;
+  int nranges;               // 1 if chunks have to be taken in order
+  struct chunk_output *outputs; // NULL if the loop does not print
+  struct output_buf *sink;   // where the thread running the loop prints to
+  uint32_t next_output;      // next chunk to be written, under `output_lock`
+  union actual_value *last;  // variables of the plan as the last chunk left them
+};
+
+// Every worker starts with a range of chunks of its own and takes them from
+// the front. Once it runs out, it steals the back half of the range of
+// another worker. A range is the first chunk and the one after the last
+// packed into a word, so taking and stealing are a single CAS.
+struct worker {
+  struct frame frame;       // variables of the iterations run by the worker
+  union actual_value *regs; // registers of the compiled body
+  int nregs;
+  uint64_t range;
+};
+
+// Worker 0 is whichever thread runs the loop, the others are threads
+// started on first use which wait for loops in between
+static struct {
+  int nthreads;
+  bool started;
+  struct worker *workers;
+  pthread_mutex_t lock;
+  pthread_cond_t posted;   // a job was posted
+  pthread_cond_t finished; // the last worker is done with the job
+  uint64_t generation;     // number of jobs posted
+  int nbusy;               // threads not done with the job yet
+  struct job *job;
+  pthread_mutex_t output_lock;
+} pool = {
+  .nthreads = 1,
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .posted = PTHREAD_COND_INITIALIZER,
+  .finished = PTHREAD_COND_INITIALIZER,
+  .output_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+// Loops nested in a loop run on threads run sequentially
+static _Thread_local bool in_job;
+
+// Sets the number of threads loops are run on, 1 runs every loop
+// sequentially. Has to be called before any loop runs on threads.
+void par_init(int nthreads) {
+  pool.nthreads = nthreads > 1 ? nthreads : 1;
+}
+
+int par_threads() {
+  return pool.nthreads;
+}
+
+static uint64_t pack_range(uint32_t lo, uint32_t hi) {
+  return (uint64_t)hi << 32 | lo;
+}
+
+static bool take_chunk(uint64_t *range, uint32_t *chunk) {
+  uint64_t cur = __atomic_load_n(range, __ATOMIC_ACQUIRE);
+  for (;;) {
+    uint32_t lo = cur, hi = cur >> 32;
+    if (lo >= hi) {
+      return false;
+    }
+    if (__atomic_compare_exchange_n(range, &cur, pack_range(lo + 1, hi), true,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      *chunk = lo;
+      return true;
+    }
+  }
+}
+
+// Takes the back half of `range`, at least one chunk, into `lo` and `hi`
+static bool steal_chunks(uint64_t *range, uint32_t *lo, uint32_t *hi) {
+  uint64_t cur = __atomic_load_n(range, __ATOMIC_ACQUIRE);
+  for (;;) {
+    uint32_t first = cur, end = cur >> 32;
+    if (first >= end) {
+      return false;
+    }
+    uint32_t mid = first + (end - first) / 2;
+    if (__atomic_compare_exchange_n(range, &cur, pack_range(first, mid), true,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      *lo = mid;
+      *hi = end;
+      return true;
+    }
+  }
+}
+
+// First iteration of chunk `chunk`, chunks differ in size by one at most
+static int64_t chunk_start(struct job *job, uint32_t chunk) {
+  uint64_t size = job->trip / job->nchunks, extra = job->trip % job->nchunks;
+  uint64_t offset = chunk * size + (chunk < extra ? chunk : extra);
+  return (int64_t)((uint64_t)job->start + offset);
+}
+
+// Writes outputs of all chunks done so far which are next in order
+static void write_outputs(struct job *job, uint32_t chunk) {
+  pthread_mutex_lock(&pool.output_lock);
+  job->outputs[chunk].done = true;
+  while (job->next_output < job->nchunks && job->outputs[job->next_output].done) {
+    struct output_buf *buf = &job->outputs[job->next_output++].buf;
+    output_write(job->sink, buf->data, buf->len);
+    free(buf->data);
+  }
+  pthread_mutex_unlock(&pool.output_lock);
+}
+
+static void run_chunk(struct job *job, int self, uint32_t chunk) {
+  struct worker *worker = &pool.workers[self];
+  struct par_loop *plan = job->plan;
+  int64_t lo = chunk_start(job, chunk), hi = chunk_start(job, chunk + 1);
+  struct output_buf *prev = NULL;
+  if (job->outputs) {
+    prev = output_capture(&job->outputs[chunk].buf);
+  }
+  if (plan->chunk) {
+    worker->regs[plan->chunk->range].num = lo;
+    worker->regs[plan->chunk->range + 1].num = hi;
+    vm_execute_regs(plan->chunk, worker->regs);
+  } else {
+    struct node *body = CHILD(plan->loop, loop.body);
+    for (int64_t i = lo; i != hi; i = (int64_t)((uint64_t)i + 1)) {
+      frame.values[plan->var].val.num = i;
+      execute_node(body);
+    }
+  }
+  // The worker may run earlier chunks after this one
+  if (chunk == job->nchunks - 1) {
+    for (int i = 0; i < plan->nslots; ++i) {
+      job->last[i] = frame.values[plan->slots[i]].val;
+    }
+  }
+  if (job->outputs) {
+    output_capture(prev);
+    write_outputs(job, chunk);
+  }
+}
+
+static void run_chunks(struct job *job, int self) {
+  uint64_t *own = &pool.workers[job->nranges == 1 ? 0 : self].range;
+  uint32_t chunk, hi;
+  for (;;) {
+    if (take_chunk(own, &chunk)) {
+      run_chunk(job, self, chunk);
+      continue;
+    }
+    if (job->nranges == 1) {
+      return;
+    }
+    bool stolen = false;
+    for (int i = 1; i < pool.nthreads && !stolen; ++i) {
+      struct worker *victim = &pool.workers[(self + i) % pool.nthreads];
+      if (steal_chunks(&victim->range, &chunk, &hi)) {
+        // Nobody steals from an empty range, so it can just be replaced
+        __atomic_store_n(own, pack_range(chunk + 1, hi), __ATOMIC_RELEASE);
+        run_chunk(job, self, chunk);
+        stolen = true;
+      }
+    }
+    if (!stolen) {
+      return;
+    }
+  }
+}
+
+// Runs chunks of `job` on the variables of the calling thread's worker,
+// which start as a copy of the frame of the loop with reductions at zero
+// or one
+static void work(struct job *job, int self) {
+  struct worker *worker = &pool.workers[self];
+  struct par_loop *plan = job->plan;
+  struct frame saved = frame;
+  frame = worker->frame;
+  if (frame.capacity < job->nslots) {
+    frame.values = realloc(frame.values, job->nslots * sizeof(struct zapp_value));
+    if (!frame.values) {
+      panic("Error: %s\n", strerror(errno));
+    }
+    frame.capacity = job->nslots;
+  }
+  memcpy(frame.values, job->values, job->nslots * sizeof(struct zapp_value));
+  frame.nslots = job->nslots;
+  for (int i = 0; i < plan->nslots; ++i) {
+    if (plan->shares[i] != SHARE_LAST) {
+      frame.values[plan->slots[i]].val.num = plan->shares[i] == SHARE_SUM ? 0 : 1;
+    }
+  }
+  if (plan->chunk) {
+    if (worker->nregs < plan->chunk->nregs) {
+      worker->nregs = plan->chunk->nregs;
+      worker->regs = realloc(worker->regs, worker->nregs * sizeof(union actual_value));
+      if (!worker->regs) {
+        panic("Error: %s\n", strerror(errno));
+      }
+    }
+    memcpy(worker->regs, plan->chunk->regs, plan->chunk->nregs * sizeof(union actual_value));
+  }
+
+  in_job = true;
+  run_chunks(job, self);
+  in_job = false;
+  worker->frame = frame;
+  frame = saved;
+}
+
+static void *worker_main(void *arg) {
+  int self = (intptr_t)arg;
+  uint64_t seen = 0;
+  for (;;) {
+    pthread_mutex_lock(&pool.lock);
+    while (pool.generation == seen) {
+      pthread_cond_wait(&pool.posted, &pool.lock);
+    }
+    seen = pool.generation;
+    struct job *job = pool.job;
+    pthread_mutex_unlock(&pool.lock);
+
+    work(job, self);
+
+    pthread_mutex_lock(&pool.lock);
+    if (--pool.nbusy == 0) {
+      pthread_cond_signal(&pool.finished);
+    }
+    pthread_mutex_unlock(&pool.lock);
+  }
+  return NULL;
+}
+
+static void start_pool() {
+  pool.workers = calloc(pool.nthreads, sizeof(struct worker));
+  if (!pool.workers) {
+    panic("Error: %s\n", strerror(errno));
+  }
+  for (int i = 1; i < pool.nthreads; ++i) {
+    pthread_t thread;
+    int err = pthread_create(&thread, NULL, worker_main, (void *)(intptr_t)i);
+    if (err) {
+      panic("Error: %s\n", strerror(err));
+    }
+    pthread_detach(thread);
+  }
+  pool.started = true;
+}
+
+// Combines the variables of the workers into the frame, as if the loop ran
+// sequentially
+static void merge_frames(struct job *job) {
+  struct par_loop *plan = job->plan;
+  frame.values[plan->var].val.num = (int64_t)((uint64_t)job->start + job->trip);
+  for (int i = 0; i < plan->nslots; ++i) {
+    int slot = plan->slots[i];
+    union actual_value *value = &frame.values[slot].val;
+    if (plan->shares[i] == SHARE_LAST) {
+      *value = job->last[i];
+      continue;
+    }
+    uint64_t acc = value->num;
+    for (int j = 0; j < pool.nthreads; ++j) {
+      uint64_t part = pool.workers[j].frame.values[slot].val.num;
+      acc = plan->shares[i] == SHARE_SUM ? acc + part : acc * part;
+    }
+    value->num = (int64_t)acc;
+  }
+}
+
+// Runs loop `loop` on threads, its variable has to be assigned the start of
+// the range already. Returns false, having done nothing, if the loop is too
+// short to be worth it or is nested in a loop running on threads.
+bool par_execute(struct par_loop *loop) {
+  if (pool.nthreads <= 1 || in_job) {
+    return false;
+  }
+  int64_t start = frame.values[loop->var].val.num;
+  int64_t end = eval_int(CHILD(CHILD(loop->loop, loop.cond), bin.rhs));
+  if (end <= start) {
+    return false;
+  }
+  struct job job = {
+    .plan = loop,
+    .values = frame.values,
+    .nslots = frame.nslots,
+    .start = start,
+    .trip = (uint64_t)end - (uint64_t)start,
+  };
+  if (job.trip < 2 || job.trip < PAR_MIN_WORK / (uint64_t)loop->nnodes) {
+    return false;
+  }
+  if (!pool.started) {
+    start_pool();
+  }
+
+  // Loops which print take chunks in order, so that few of them wait for
+  // their output to be written
+  uint64_t nchunks = pool.nthreads * PAR_CHUNKS_PER_THREAD;
+  if (loop->prints && job.trip / PAR_PRINT_CHUNK > nchunks) {
+    nchunks = job.trip / PAR_PRINT_CHUNK;
+  }
+  if (nchunks > PAR_MAX_CHUNKS) {
+    nchunks = PAR_MAX_CHUNKS;
+  }
+  if (nchunks > job.trip) {
+    nchunks = job.trip;
+  }
+  job.nchunks = nchunks;
+  job.last = malloc((loop->nslots ? loop->nslots : 1) * sizeof(union actual_value));
+  if (!job.last) {
+    panic("Error: %s\n", strerror(errno));
+  }
+  job.nranges = loop->prints ? 1 : pool.nthreads;
+  for (int i = 0; i < pool.nthreads; ++i) {
+    uint32_t lo = i < job.nranges ? (uint64_t)job.nchunks * i / job.nranges : 0;
+    uint32_t hi = i < job.nranges ? (uint64_t)job.nchunks * (i + 1) / job.nranges : 0;
+    pool.workers[i].range = pack_range(lo, hi);
+  }
+  if (loop->prints) {
+    job.outputs = calloc(job.nchunks, sizeof(struct chunk_output));
+    if (!job.outputs) {
+      panic("Error: %s\n", strerror(errno));
+    }
+    // Anything printed before the loop is written before its output
+    job.sink = output_capture(NULL);
+  }
+
+  pthread_mutex_lock(&pool.lock);
+  pool.job = &job;
+  pool.nbusy = pool.nthreads - 1;
+  ++pool.generation;
+  pthread_cond_broadcast(&pool.posted);
+  pthread_mutex_unlock(&pool.lock);
+
+  work(&job, 0);
+
+  pthread_mutex_lock(&pool.lock);
+  while (pool.nbusy) {
+    pthread_cond_wait(&pool.finished, &pool.lock);
+  }
+  pthread_mutex_unlock(&pool.lock);
+
+  merge_frames(&job);
+  free(job.last);
+  if (loop->prints) {
+    output_capture(job.sink);
+    free(job.outputs);
+  }
+  return true;
+}
+
+// Runs range loop `loop`, whose variable was just initialized, on threads
+// if that can be done without changing what the program does. Loops are
+// analyzed every time they run, but only if the loop is long enough for that
+// to be cheap in comparison.
+bool par_execute_node(struct node *loop) {
+  if (pool.nthreads <= 1 || in_job || !is_range_loop(loop)) {
+    return false;
+  }
+  struct node *end = CHILD(CHILD(loop, loop.cond), bin.rhs);
+  if (has_assign(end)) {
+    return false;
+  }
+  int64_t start = frame.values[CHILD(CHILD(loop, loop.init), bin.lhs)->var.slot].val.num;
+  int64_t stop = eval_int(end);
+  if (stop <= start || (uint64_t)stop - (uint64_t)start < PAR_MIN_TRIP) {
+    return false;
+  }
+  struct par_loop *plan = par_analyze(loop, false);
+  bool done = plan && par_execute(plan);
+  par_free(plan);
+  return done;
+}
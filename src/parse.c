@@ -1,12 +1,25 @@
+#include <sys/mman.h>
+
 #include "zapp.h"
-#include "hash/hashtable.h"
 
-struct node *stmt(struct tokenizer *tokenizer);
+uint32_t expr(struct tokenizer *tokenizer);
+uint32_t stmt(struct tokenizer *tokenizer);
+
+#define POOL_INITSIZE 256
 
-static struct hashtable vars = {};
+// Nodes are addressed by their index in the pool while parsing, because
+// growing the pool moves it.
+#define NODE(tokenizer, idx) (&(tokenizer)->ctx->pool->nodes[idx])
+#define LINK(tokenizer, parent, field, child) \
+  (NODE(tokenizer, parent)->field = (int32_t)(child) - (int32_t)(parent))
 
-static struct type type_int = { .kind = TY_INT };
-static struct type type_float = { .kind = TY_FLOAT };
+static int64_t custom_atoi(char *a) {
+  uint64_t rv = 0;
+  while (*a >= '0' && *a <= '9') {
+    rv = rv * 10 + (*a++ - '0');
+  }
+  return rv;
+}
 
 static double custom_atof(char *a) {
   double rv = 0;
@@ -24,60 +37,80 @@ static double custom_atof(char *a) {
   return rv;
 }
 
-static struct type *pick_type(struct type *ty1, struct type *ty2) {
-  if (ty1->kind == TY_INT && ty2->kind == TY_INT) {
-    return ty1;
-  }
-
-  if (ty1->kind == TY_FLOAT) {
-    return ty1;
+// Nodes of a pool loaded from the cache are copied out of the mapping
+// before the pool can grow
+static void pool_unmap(struct node_pool *pool) {
+  struct node *nodes = malloc(pool->len * sizeof(struct node));
+  if (!nodes) {
+    panic("Error: %s\n", strerror(errno));
   }
+  memcpy(nodes, pool->nodes, pool->len * sizeof(struct node));
+  munmap(pool->map, pool->map_size);
+  pool->nodes = nodes;
+  pool->map = NULL;
+}
 
-  if (ty2->kind == TY_FLOAT) {
-    return ty2;
+uint32_t pool_new_node(struct node_pool *pool, node_kind kind) {
+  if (pool->len == pool->capacity) {
+    if (pool->map) {
+      pool_unmap(pool);
+    }
+    pool->capacity = pool->capacity ? pool->capacity * 2 : POOL_INITSIZE;
+    pool->nodes = realloc(pool->nodes, pool->capacity * sizeof(struct node));
+    if (!pool->nodes) {
+      panic("Error: %s\n", strerror(errno));
+    }
+    STAT_ALLOC(pool->capacity * sizeof(struct node));
   }
+  struct node *node = &pool->nodes[pool->len];
+  memset(node, 0, sizeof(*node));
+  node->kind = kind;
+  STAT_INC(nodes[kind]);
+  return pool->len++;
+}
 
-  return ty1;
+static uint32_t new_node(struct tokenizer *tokenizer, node_kind kind) {
+  return pool_new_node(tokenizer->ctx->pool, kind);
 }
 
-static struct node *new_node(node_kind kind) {
-  struct node *node = calloc(1, sizeof(*node));
-  node->kind = kind;
-  return node;
+// Line of the statement `node`, 0 for expressions and statements made by the
+// optimizer
+uint32_t node_line(struct node *node) {
+  if (node->kind == ND_FOR) {
+    return CHILD(node, loop.init)->loc.nline;
+  }
+  return node->loc.nline;
 }
 
-static struct node *new_binary(node_kind kind, struct node *lhs, struct node *rhs) {
-  struct node *node = new_node(kind);
-  node->lhs = lhs;
-  node->rhs = rhs;
-  node->type = pick_type(lhs->type, rhs->type);
+static uint32_t new_binary(struct tokenizer *tokenizer, node_kind kind,
+                           uint32_t lhs, uint32_t rhs) {
+  uint32_t node = new_node(tokenizer, kind);
+  LINK(tokenizer, node, bin.lhs, lhs);
+  LINK(tokenizer, node, bin.rhs, rhs);
   return node;
 }
 
-static struct node *new_num_literal(double num) {
-  struct node *node = new_node(ND_NUM);
-  node->val.num = num;
+static uint32_t new_num_literal(struct tokenizer *tokenizer, double num) {
+  uint32_t node = new_node(tokenizer, ND_NUM);
   if ((int)num != num) {
-    node->type = &type_float;
+    NODE(tokenizer, node)->val.fnum = num;
+    NODE(tokenizer, node)->type = TY_FLOAT;
   } else {
-    node->type = &type_int;
+    NODE(tokenizer, node)->val.num = num;
+    NODE(tokenizer, node)->type = TY_INT;
   }
   return node;
 }
 
 // ident = [a-zA-Z_][a-zA-Z0-9_]*
-struct node *ident(struct tokenizer *tokenizer) {
+uint32_t ident(struct tokenizer *tokenizer) {
   struct token *tok;
   if ((tok = tok_peek(tokenizer))->kind == TOKEN_IDENT) {
-    struct node *node = new_node(ND_VAR);
-    node->var.name = strndup(tok->start, tok->len);
-    node->var.len = tok->len;
-    if (htable_contains(&vars, tok->start, tok->len)) {
-      struct node *var_value = htable_get(&vars, tok->start, tok->len);
-      node->type = var_value->type;
-    }
+    uint32_t idx = new_node(tokenizer, ND_VAR);
+    struct node *node = NODE(tokenizer, idx);
+    node->var.sym = tok->sym;
     tok_consume_lookahead(tokenizer);
-    return node;
+    return idx;
   }
   panic_tok(tokenizer, "Expected an identifier, but received something else");
 }
@@ -85,10 +118,10 @@ struct node *ident(struct tokenizer *tokenizer) {
 // num = [1-9][0-9]*
 //     | '(' expr ')'
 //     | ident
-struct node *num(struct tokenizer *tokenizer) {
-  if (tok_consume(tokenizer, "(")) {
-    struct node *node = expr(tokenizer);
-    if (!tok_consume(tokenizer, ")")) {
+uint32_t num(struct tokenizer *tokenizer) {
+  if (tok_consume(tokenizer, TOKEN_LPAREN)) {
+    uint32_t node = expr(tokenizer);
+    if (!tok_consume(tokenizer, TOKEN_RPAREN)) {
       panic_tok(tokenizer, "Not closed parentheses");
     }
     return node;
@@ -96,35 +129,35 @@ struct node *num(struct tokenizer *tokenizer) {
 
   struct token *tok;
   if ((tok = tok_peek(tokenizer))->kind == TOKEN_NUM) {
-    struct node *node = new_node(ND_NUM);
-    if (tok->type->kind == TY_FLOAT) {
-      node->val.fnum = custom_atof(tok->start);
+    uint32_t idx = new_node(tokenizer, ND_NUM);
+    struct node *node = NODE(tokenizer, idx);
+    if (tok->type == TY_FLOAT) {
+      node->val.fnum = custom_atof(TOK_STR(tokenizer, tok));
     } else {
-      node->val.num = custom_atof(tok->start);
+      node->val.num = custom_atoi(TOK_STR(tokenizer, tok));
     }
     node->type = tok->type;
     tok_consume_lookahead(tokenizer);
-    return node;
+    return idx;
   }
 
   if (tok_peek(tokenizer)->kind == TOKEN_IDENT) {
-    struct node *node = ident(tokenizer);
-    return node;
+    return ident(tokenizer);
   }
   panic_tok(tokenizer, "Expected a number, but received something else");
 }
 
 // unary = ("-" | "+") unary
 //       | num
-struct node *unary(struct tokenizer *tokenizer) {
-  if (tok_consume(tokenizer, "-")) {
-    struct node *node = new_node(ND_NEG);
-    node->rhs = unary(tokenizer);
-    node->type = node->rhs->type;
+uint32_t unary(struct tokenizer *tokenizer) {
+  if (tok_consume(tokenizer, TOKEN_MINUS)) {
+    uint32_t node = new_node(tokenizer, ND_NEG);
+    uint32_t rhs = unary(tokenizer);
+    LINK(tokenizer, node, bin.rhs, rhs);
     return node;
   }
 
-  if (tok_consume(tokenizer, "+")) {
+  if (tok_consume(tokenizer, TOKEN_PLUS)) {
     return unary(tokenizer);
   }
 
@@ -132,15 +165,15 @@ struct node *unary(struct tokenizer *tokenizer) {
 }
 
 // mul = unary ('*' unary | '/' unary)*
-struct node *mul(struct tokenizer *tokenizer) {
-  struct node *node = unary(tokenizer);
+uint32_t mul(struct tokenizer *tokenizer) {
+  uint32_t node = unary(tokenizer);
   for (;;) {
-    if (tok_consume(tokenizer, "*")) {
-      node = new_binary(ND_MUL, node, unary(tokenizer));
+    if (tok_consume(tokenizer, TOKEN_STAR)) {
+      node = new_binary(tokenizer, ND_MUL, node, unary(tokenizer));
       continue;
     }
-    if (tok_consume(tokenizer, "/")) {
-      node = new_binary(ND_DIV, node, unary(tokenizer));
+    if (tok_consume(tokenizer, TOKEN_SLASH)) {
+      node = new_binary(tokenizer, ND_DIV, node, unary(tokenizer));
       continue;
     }
 
@@ -149,15 +182,15 @@ struct node *mul(struct tokenizer *tokenizer) {
 }
 
 // add = mul ('+' mul | '-' mul)*
-struct node *add(struct tokenizer *tokenizer) {
-  struct node *node = mul(tokenizer);
+uint32_t add(struct tokenizer *tokenizer) {
+  uint32_t node = mul(tokenizer);
   for (;;) {
-    if (tok_consume(tokenizer, "+")) {
-      node = new_binary(ND_ADD, node, mul(tokenizer));
+    if (tok_consume(tokenizer, TOKEN_PLUS)) {
+      node = new_binary(tokenizer, ND_ADD, node, mul(tokenizer));
       continue;
     }
-    if (tok_consume(tokenizer, "-")) {
-      node = new_binary(ND_SUB, node, mul(tokenizer));
+    if (tok_consume(tokenizer, TOKEN_MINUS)) {
+      node = new_binary(tokenizer, ND_SUB, node, mul(tokenizer));
       continue;
     }
 
@@ -166,20 +199,22 @@ struct node *add(struct tokenizer *tokenizer) {
 }
 
 // logical = add ("<=" add | ">=" add | ">" add | "<" add)*
-struct node *logical(struct tokenizer *tokenizer) {
-  struct node *node = add(tokenizer);
+uint32_t logical(struct tokenizer *tokenizer) {
+  uint32_t node = add(tokenizer);
   for (;;) {
-    if (tok_consume(tokenizer, "<=")) {
-      node = new_binary(ND_LTE, node, add(tokenizer));
+    if (tok_consume(tokenizer, TOKEN_LTE)) {
+      node = new_binary(tokenizer, ND_LTE, node, add(tokenizer));
     }
-    if (tok_consume(tokenizer, "<")) {
-      node = new_binary(ND_LT, node, add(tokenizer));
+    if (tok_consume(tokenizer, TOKEN_LT)) {
+      node = new_binary(tokenizer, ND_LT, node, add(tokenizer));
     }
-    if (tok_consume(tokenizer, ">")) {
-      node = new_binary(ND_LT, add(tokenizer), node);
+    if (tok_consume(tokenizer, TOKEN_GT)) {
+      uint32_t rhs = add(tokenizer);
+      node = new_binary(tokenizer, ND_LT, rhs, node);
     }
-    if (tok_consume(tokenizer, ">=")) {
-      node = new_binary(ND_LT, add(tokenizer), node);
+    if (tok_consume(tokenizer, TOKEN_GTE)) {
+      uint32_t rhs = add(tokenizer);
+      node = new_binary(tokenizer, ND_LT, rhs, node);
     }
 
     return node;
@@ -187,15 +222,15 @@ struct node *logical(struct tokenizer *tokenizer) {
 }
 
 // equation = logical ("==" logical | "!=" logical)*
-struct node *equation(struct tokenizer *tokenizer) {
-  struct node *node = logical(tokenizer);
+uint32_t equation(struct tokenizer *tokenizer) {
+  uint32_t node = logical(tokenizer);
 
   for (;;) {
-    if (tok_consume(tokenizer, "==")) {
-      node = new_binary(ND_EQ, node, logical(tokenizer));
+    if (tok_consume(tokenizer, TOKEN_EQ)) {
+      node = new_binary(tokenizer, ND_EQ, node, logical(tokenizer));
     }
-    if (tok_consume(tokenizer, "!=")) {
-      node = new_binary(ND_NEQ, node, logical(tokenizer));
+    if (tok_consume(tokenizer, TOKEN_NEQ)) {
+      node = new_binary(tokenizer, ND_NEQ, node, logical(tokenizer));
     }
 
     return node;
@@ -204,35 +239,39 @@ struct node *equation(struct tokenizer *tokenizer) {
 
 // expr = equation
 //      | ident "=" expr
-struct node *expr(struct tokenizer *tokenizer) {
-  struct node *node;
-  if (tok_peek(tokenizer)->kind == TOKEN_IDENT && tok_equals(tok_npeek(tokenizer, 2), "=")) {
-    struct token *tok = tok_peek(tokenizer);
-    struct node *var = ident(tokenizer);
-    tok_skip(tokenizer, "=");
-    struct node *rhs = expr(tokenizer);
-    var->type = rhs->type;
-    htable_push(&vars, var->var.name, var->var.len, var);
-    node = new_binary(ND_ASSIGN, var, rhs);
+uint32_t expr(struct tokenizer *tokenizer) {
+  uint32_t node;
+  if (tok_peek(tokenizer)->kind == TOKEN_IDENT && tok_npeek(tokenizer, 2)->kind == TOKEN_ASSIGN) {
+    uint32_t var = ident(tokenizer);
+    tok_skip(tokenizer, TOKEN_ASSIGN);
+    uint32_t rhs = expr(tokenizer);
+    node = new_binary(tokenizer, ND_ASSIGN, var, rhs);
   } else {
     node = equation(tokenizer);
   }
   return node;
 }
 
-// braces_body = "{" stmt* "}"
-struct node *braces_body(struct tokenizer *tokenizer) {
-  struct node *node = new_node(ND_BLOCK);
-  tok_skip(tokenizer, "{");
-
-  struct node **cur_node = &node->body;
-  while (!(tok_equals(tok_peek(tokenizer), "}") || tok_peek(tokenizer)->kind == TOKEN_EOF)) {
-    *cur_node = stmt(tokenizer);
-    cur_node = &(*cur_node)->next;
+// Parses statements until `}` or end of input into block `node`
+static void stmt_list(struct tokenizer *tokenizer, uint32_t node) {
+  uint32_t last = 0;
+  while (!(tok_peek(tokenizer)->kind == TOKEN_RBRACE || tok_peek(tokenizer)->kind == TOKEN_EOF)) {
+    uint32_t cur = stmt(tokenizer);
+    if (last) {
+      LINK(tokenizer, last, next, cur);
+    } else {
+      LINK(tokenizer, node, block.body, cur);
+    }
+    last = cur;
   }
+}
 
-  tok_skip(tokenizer, "}");
-
+// braces_body = "{" stmt* "}"
+uint32_t braces_body(struct tokenizer *tokenizer) {
+  uint32_t node = new_node(tokenizer, ND_BLOCK);
+  tok_skip(tokenizer, TOKEN_LBRACE);
+  stmt_list(tokenizer, node);
+  tok_skip(tokenizer, TOKEN_RBRACE);
   return node;
 }
 
@@ -240,56 +279,125 @@ struct node *braces_body(struct tokenizer *tokenizer) {
 //      | "print" expr
 //      | "for" ident "in" num ".." num braces_body
 //      | expr
-struct node *stmt(struct tokenizer *tokenizer) {
-  if (tok_consume(tokenizer, "if")) {
-    struct node *node = new_node(ND_IF);
-    node->cond = expr(tokenizer);
-    node->then = braces_body(tokenizer);
-    if (tok_consume(tokenizer, "else")) {
-      node->els = braces_body(tokenizer);
+static uint32_t stmt_node(struct tokenizer *tokenizer) {
+  switch (tok_peek(tokenizer)->kind) {
+    case TOKEN_IF: {
+      tok_consume_lookahead(tokenizer);
+      uint32_t node = new_node(tokenizer, ND_IF);
+      uint32_t cond = expr(tokenizer);
+      LINK(tokenizer, node, branch.cond, cond);
+      uint32_t then = braces_body(tokenizer);
+      LINK(tokenizer, node, branch.then, then);
+      if (tok_consume(tokenizer, TOKEN_ELSE)) {
+        uint32_t els = braces_body(tokenizer);
+        LINK(tokenizer, node, branch.els, els);
+      }
+      return node;
     }
-    return node;
+    case TOKEN_PRINT: {
+      tok_consume_lookahead(tokenizer);
+      uint32_t node = new_node(tokenizer, ND_PRINT);
+      uint32_t rhs = expr(tokenizer);
+      LINK(tokenizer, node, bin.rhs, rhs);
+      return node;
+    }
+    case TOKEN_FOR: {
+      tok_consume_lookahead(tokenizer);
+      uint32_t node = new_node(tokenizer, ND_FOR);
+
+      uint32_t var = ident(tokenizer);
+      tok_skip(tokenizer, TOKEN_IN);
+      uint32_t start = expr(tokenizer);
+      tok_skip(tokenizer, TOKEN_DOTDOT);
+      uint32_t end = expr(tokenizer);
+
+      uint32_t init = new_binary(tokenizer, ND_ASSIGN, var, start);
+      LINK(tokenizer, node, loop.init, init);
+      uint32_t cond = new_binary(tokenizer, ND_LT, var, end);
+      LINK(tokenizer, node, loop.cond, cond);
+      uint32_t one = new_num_literal(tokenizer, 1);
+      uint32_t inc = new_binary(tokenizer, ND_ASSIGN, var,
+                                new_binary(tokenizer, ND_ADD, var, one));
+      LINK(tokenizer, node, loop.inc, inc);
+      uint32_t body = braces_body(tokenizer);
+      LINK(tokenizer, node, loop.body, body);
+      return node;
+    }
+    default:
+      return expr(tokenizer);
   }
+}
 
-  if (tok_consume(tokenizer, "print")) {
-    struct node *node = new_node(ND_PRINT);
-    node->rhs = expr(tokenizer);
-    return node;
+// Statements keep the line they start on, so the profiler can tell them apart
+uint32_t stmt(struct tokenizer *tokenizer) {
+  uint32_t nline = tok_peek(tokenizer)->nline + 1;
+  uint32_t idx = stmt_node(tokenizer);
+  struct node *node = NODE(tokenizer, idx);
+  if (node->kind == ND_FOR) {
+    node = CHILD(node, loop.init);
   }
+  node->loc.nline = nline;
+  return idx;
+}
 
-  if (tok_consume(tokenizer, "for")) {
-    struct node *node = new_node(ND_FOR);
-
-    struct node *var = ident(tokenizer);
-    tok_skip(tokenizer, "in");
-    struct node *start = expr(tokenizer);
-    tok_skip(tokenizer, "..");
-    struct node *end = expr(tokenizer);
-
-    var->type = start->type;
-    htable_push(&vars, var->var.name, var->var.len, var);
+// Types of nodes other than literals are assigned by `resolve`. Every call
+// parses into a pool of its own, so nodes of a returned program
+// are never moved by later calls (`optimize` aside).
+struct node *parse(struct tokenizer *tokenizer) {
+  struct context *ctx = tokenizer->ctx;
+  struct node_pool *pool = calloc(1, sizeof(*pool));
+  if (!pool) {
+    panic("Error: %s\n", strerror(errno));
+  }
+  pool->next = ctx->pools;
+  ctx->pools = ctx->pool = pool;
 
-    node->init = new_binary(ND_ASSIGN, var, start);
-    node->cond = new_binary(ND_LT, var, end);
-    node->inc = new_binary(ND_ASSIGN, var,
-        new_binary(ND_ADD, var, new_num_literal(1)));
-    node->body = braces_body(tokenizer);
-    return node;
+  uint32_t head = new_node(tokenizer, ND_BLOCK);
+  stmt_list(tokenizer, head);
+  if (tok_peek(tokenizer)->kind != TOKEN_EOF) {
+    panic_tok(tokenizer, "Unexpected `}`");
   }
 
-  return expr(tokenizer);
+  pool->nodes = realloc(pool->nodes, pool->len * sizeof(struct node));
+  pool->capacity = pool->len;
+  ctx->pool = NULL;
+
+  struct node *prog = &pool->nodes[head];
+  resolve(ctx, prog);
+  return prog;
 }
 
-struct node *parse(struct tokenizer *tokenizer) {
-  struct node *head = new_node(ND_BLOCK);
-  struct node **cur_node = &head->body;
-  if (!vars.buckets) {
-    htable_init(&vars, NULL);
+// Parses the next top-level statement into a program of its own. All of them
+// share one pool, which is emptied on every call, so a program is only valid
+// until the next call and memory stays bounded by the largest statement.
+// Returns NULL at the end of input.
+struct node *parse_next(struct tokenizer *tokenizer) {
+  struct context *ctx = tokenizer->ctx;
+  struct token *tok = tok_peek(tokenizer);
+  if (tok->kind == TOKEN_EOF) {
+    return NULL;
   }
-  while (tok_peek(tokenizer)->kind != TOKEN_EOF) {
-    struct node *node = stmt(tokenizer);
-    (*cur_node) = node;
-    cur_node = &(*cur_node)->next;
+  if (tok->kind == TOKEN_RBRACE) {
+    panic_tok(tokenizer, "Unexpected `}`");
   }
-  return head;
+
+  if (!ctx->stream) {
+    ctx->stream = calloc(1, sizeof(*ctx->stream));
+    if (!ctx->stream) {
+      panic("Error: %s\n", strerror(errno));
+    }
+    ctx->stream->next = ctx->pools;
+    ctx->pools = ctx->stream;
+  }
+  ctx->pool = ctx->stream;
+  ctx->pool->len = 0;
+
+  uint32_t head = new_node(tokenizer, ND_BLOCK);
+  uint32_t body = stmt(tokenizer);
+  LINK(tokenizer, head, block.body, body);
+  ctx->pool = NULL;
+
+  struct node *prog = &ctx->stream->nodes[head];
+  resolve(ctx, prog);
+  return prog;
 }
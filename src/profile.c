@@ -0,0 +1,282 @@
+#include <time.h>
+
+#include "zapp.h"
+#include "hash/hashtable.h"
+
+#define SITES_INITSIZE 64
+#define PROFILE_TOP 20 // lines listed by `profile_report`
+
+// Statement as seen by the profiler: a source line in the nest of loops and
+// conditions it runs in. Statements parsed again from the same line, as they
+// are under `-s`, share their site.
+struct site_key {
+  uint32_t parent; // site of the enclosing ND_FOR or ND_IF, 0 at top level
+  uint32_t nline;
+  uint32_t kind;   // node_kind
+};
+
+struct site {
+  struct site_key key;
+  uint64_t hits;
+  uint64_t ns; // time spent in the statement itself, not in nested ones
+};
+
+// Site 0 stands for the program itself and collects the time spent between
+// top-level statements
+static struct {
+  struct arena arena;       // keys of `by_key`
+  struct hashtable by_key;  // site_key -> index of the site
+  struct site *sites;
+  uint32_t nsites;
+  uint32_t capacity;
+  uint32_t *node_sites;     // site of every statement node of the program run
+  uint32_t node_capacity;
+  struct node *base;        // first node of the pool the program is in
+  uint32_t cur;             // site being executed
+  uint64_t last;            // when time was last accounted to `cur`
+} prof = {};
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static bool key_cmp_func(const char *key1, const char *key2, size_t len) {
+  return !memcmp(key1, key2, len);
+}
+
+static void profile_init() {
+  htable_init(&prof.by_key, key_cmp_func, &prof.arena);
+  prof.capacity = SITES_INITSIZE;
+  prof.sites = calloc(prof.capacity, sizeof(struct site));
+  if (!prof.sites) {
+    panic("Error: %s\n", strerror(errno));
+  }
+  prof.nsites = 1;
+}
+
+static uint32_t site_of(uint32_t parent, struct node *node) {
+  struct site_key key = { parent, node_line(node), node->kind };
+  intptr_t site = (intptr_t)htable_get(&prof.by_key, (char *)&key, sizeof(key));
+  if (site) {
+    return site;
+  }
+  if (prof.nsites == prof.capacity) {
+    prof.capacity *= 2;
+    prof.sites = realloc(prof.sites, prof.capacity * sizeof(struct site));
+    if (!prof.sites) {
+      panic("Error: %s\n", strerror(errno));
+    }
+  }
+  memset(&prof.sites[prof.nsites], 0, sizeof(struct site));
+  prof.sites[prof.nsites].key = key;
+  char *owned = arena_alloc(&prof.arena, sizeof(key));
+  memcpy(owned, &key, sizeof(key));
+  htable_push(&prof.by_key, owned, sizeof(key), (void *)(intptr_t)prof.nsites);
+  return prof.nsites++;
+}
+
+// Looks sites of all statements up before running them, so executing a
+// statement only takes an index into `node_sites`
+static void map_sites(struct node *node, uint32_t parent) {
+  if (node->kind == ND_BLOCK) {
+    for (struct node *cur = OPT_CHILD(node, block.body); cur; cur = OPT_CHILD(cur, next)) {
+      map_sites(cur, parent);
+    }
+    return;
+  }
+  uint32_t site = site_of(parent, node);
+  prof.node_sites[node - prof.base] = site;
+  if (node->kind == ND_FOR) {
+    map_sites(CHILD(node, loop.body), site);
+  } else if (node->kind == ND_IF) {
+    map_sites(CHILD(node, branch.then), site);
+    if (node->branch.els) {
+      map_sites(CHILD(node, branch.els), site);
+    }
+  }
+}
+
+static struct node_pool *pool_of(struct context *ctx, struct node *node) {
+  for (struct node_pool *pool = ctx->pools; pool; pool = pool->next) {
+    if (node >= pool->nodes && node < pool->nodes + pool->len) {
+      return pool;
+    }
+  }
+  return ctx->stream;
+}
+
+static uint32_t enter(uint32_t site) {
+  uint64_t now = now_ns();
+  prof.sites[prof.cur].ns += now - prof.last;
+  prof.last = now;
+  uint32_t caller = prof.cur;
+  prof.cur = site;
+  ++prof.sites[site].hits;
+  return caller;
+}
+
+static void leave(uint32_t caller) {
+  uint64_t now = now_ns();
+  prof.sites[prof.cur].ns += now - prof.last;
+  prof.last = now;
+  prof.cur = caller;
+}
+
+static void profile_stmt(struct node *node);
+
+static void profile_body(struct node *node) {
+  if (node->kind != ND_BLOCK) {
+    profile_stmt(node);
+    return;
+  }
+  for (struct node *cur = OPT_CHILD(node, block.body); cur; cur = OPT_CHILD(cur, next)) {
+    profile_body(cur);
+  }
+}
+
+// Same as `execute_node`, with the time of every statement accounted to its
+// site. Statements without nested ones are left to `execute_node`.
+static void profile_stmt(struct node *node) {
+  uint32_t caller = enter(prof.node_sites[node - prof.base]);
+  switch (node->kind) {
+    case ND_IF: {
+      struct node *cond = CHILD(node, branch.cond);
+      if (cond->type == TY_INT ? eval_int(cond) : eval_float(cond)) {
+        profile_body(CHILD(node, branch.then));
+      } else if (node->branch.els) {
+        profile_body(CHILD(node, branch.els));
+      }
+      break;
+    }
+    case ND_FOR:
+      execute_node(CHILD(node, loop.init));
+      while (eval_int(CHILD(node, loop.cond))) {
+        profile_body(CHILD(node, loop.body));
+        execute_node(CHILD(node, loop.inc));
+      }
+      break;
+    default:
+      execute_node(node);
+      break;
+  }
+  leave(caller);
+}
+
+// Executes `prog` by walking it like `execute_node`, counting executions and
+// time of every statement. Counts add up over all programs run.
+void profile_execute(struct context *ctx, struct node *prog) {
+  if (!prof.sites) {
+    profile_init();
+  }
+  struct node_pool *pool = pool_of(ctx, prog);
+  if (pool->len > prof.node_capacity) {
+    prof.node_capacity = pool->len;
+    prof.node_sites = realloc(prof.node_sites, prof.node_capacity * sizeof(uint32_t));
+    if (!prof.node_sites) {
+      panic("Error: %s\n", strerror(errno));
+    }
+  }
+  prof.base = pool->nodes;
+  map_sites(prog, 0);
+
+  prof.last = now_ns();
+  profile_body(prog);
+  prof.sites[prof.cur].ns += now_ns() - prof.last;
+}
+
+static const char *site_label(struct site *site) {
+  switch (site->key.kind) {
+    case ND_FOR: return "for";
+    case ND_IF: return "if";
+    case ND_PRINT: return "print";
+    case ND_ASSIGN: return "assign";
+    default: return "expr";
+  }
+}
+
+// Writes names of the sites from the top level down to `site`, separated by
+// `sep`
+static void print_path(FILE *fp, uint32_t site, const char *sep) {
+  if (!site) {
+    fprintf(fp, "main");
+    return;
+  }
+  print_path(fp, prof.sites[site].key.parent, sep);
+  fprintf(fp, "%s%s:%u", sep, site_label(&prof.sites[site]), prof.sites[site].key.nline);
+}
+
+// Totals of all sites on a source line
+struct line_total {
+  uint32_t nline;
+  uint32_t site; // first site on the line
+  uint64_t hits;
+  uint64_t ns;
+};
+
+static int cmp_line_total(const void *a, const void *b) {
+  const struct line_total *l = a, *r = b;
+  if (l->ns != r->ns) {
+    return l->ns < r->ns ? 1 : -1;
+  }
+  if (l->hits != r->hits) {
+    return l->hits < r->hits ? 1 : -1;
+  }
+  return l->nline < r->nline ? -1 : l->nline > r->nline;
+}
+
+// Lines sorted by the time spent in their statements, compiler-made
+// statements are listed as line 0
+void profile_report(FILE *fp) {
+  uint32_t nlines = 0;
+  uint64_t total = 0;
+  for (uint32_t i = 0; i < prof.nsites; ++i) {
+    total += prof.sites[i].ns;
+    if (i && prof.sites[i].key.nline >= nlines) {
+      nlines = prof.sites[i].key.nline + 1;
+    }
+  }
+  struct line_total *lines = calloc(nlines ? nlines : 1, sizeof(struct line_total));
+  if (!lines) {
+    panic("Error: %s\n", strerror(errno));
+  }
+  for (uint32_t i = 1; i < prof.nsites; ++i) {
+    struct line_total *line = &lines[prof.sites[i].key.nline];
+    if (!line->site) {
+      line->site = i;
+    }
+    line->nline = prof.sites[i].key.nline;
+    line->hits += prof.sites[i].hits;
+    line->ns += prof.sites[i].ns;
+  }
+  qsort(lines, nlines, sizeof(struct line_total), cmp_line_total);
+
+  fprintf(fp, "%8s %14s %12s %7s  %s\n", "line", "hits", "self ms", "%", "context");
+  for (uint32_t i = 0; i < nlines && i < PROFILE_TOP && lines[i].hits; ++i) {
+    fprintf(fp, "%8u %14" PRIu64 " %12.3f %6.2f%%  ", lines[i].nline, lines[i].hits,
+            lines[i].ns / 1e6, total ? 100.0 * lines[i].ns / total : 0.0);
+    print_path(fp, lines[i].site, " > ");
+    fprintf(fp, "\n");
+  }
+  fprintf(fp, "%8s %14s %12.3f\n", "total", "", total / 1e6);
+  free(lines);
+}
+
+// One line per site in the format of flamegraph.pl, `main;for:3;if:5;print:6 N`,
+// where N is the time spent in the site in nanoseconds
+void profile_write_folded(const char *fname) {
+  FILE *fp = fopen(fname, "w");
+  if (!fp) {
+    panic("Error: %s: %s\n", fname, strerror(errno));
+  }
+  for (uint32_t i = 0; i < prof.nsites; ++i) {
+    if (prof.sites[i].ns) {
+      print_path(fp, i, ";");
+      fprintf(fp, " %" PRIu64 "\n", prof.sites[i].ns);
+    }
+  }
+  if (fclose(fp) != 0) {
+    panic("Error: %s: %s\n", fname, strerror(errno));
+  }
+}
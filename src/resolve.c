@@ -0,0 +1,289 @@
+#include "zapp.h"
+#include "hash/hashtable.h"
+
+#define FRAME_INITSIZE 16
+
+_Thread_local struct frame frame = {};
+
+static _Thread_local struct hashtable slots = {}; // variable name -> slot + 1
+
+static void frame_grow(int nslots) {
+  if (nslots <= frame.capacity) {
+    return;
+  }
+  int capacity = frame.capacity ? frame.capacity : FRAME_INITSIZE;
+  while (capacity < nslots) {
+    capacity *= 2;
+  }
+  frame.values = realloc(frame.values, capacity * sizeof(struct zapp_value));
+  frame.names = realloc(frame.names, capacity * sizeof(struct symbol));
+  if (!frame.values || !frame.names) {
+    panic("Error: %s\n", strerror(errno));
+  }
+  STAT_ALLOC(capacity * sizeof(struct zapp_value));
+  STAT_ALLOC(capacity * sizeof(struct symbol));
+  memset(&frame.values[frame.capacity], 0,
+         (capacity - frame.capacity) * sizeof(struct zapp_value));
+  frame.capacity = capacity;
+}
+
+// Slots outlive the context that parsed them, so keep own copy of the name
+static int new_slot(const char *name, int len) {
+  frame_grow(frame.nslots + 1);
+  struct symbol *owned = &frame.names[frame.nslots];
+  memset(owned, 0, sizeof(*owned));
+  owned->name = strndup(name, len);
+  owned->len = len;
+  owned->slot = frame.nslots + 1;
+  htable_push(&slots, owned->name, owned->len, (void *)(intptr_t)owned->slot);
+  return frame.nslots++;
+}
+
+// Names are looked up in the global slot table once per symbol of a context,
+// afterwards the slot is cached in the symbol itself
+static int slot_of(struct context *ctx, struct var *var) {
+  struct symbol *symbol = &ctx->symbols[var->sym];
+  if (symbol->slot) {
+    return symbol->slot - 1;
+  }
+  intptr_t slot = (intptr_t)htable_get(&slots, symbol->name, symbol->len);
+  if (!slot) {
+    slot = new_slot(symbol->name, symbol->len) + 1;
+  }
+  symbol->slot = slot;
+  return slot - 1;
+}
+
+static void resolve_node(struct context *ctx, struct node *node) {
+  switch (node->kind) {
+    case ND_VAR:
+      node->var.slot = slot_of(ctx, &node->var);
+      return;
+    case ND_NUM:
+      return;
+    case ND_BLOCK:
+      for (struct node *cur = OPT_CHILD(node, block.body); cur; cur = OPT_CHILD(cur, next)) {
+        resolve_node(ctx, cur);
+      }
+      return;
+    case ND_IF:
+      resolve_node(ctx, CHILD(node, branch.cond));
+      resolve_node(ctx, CHILD(node, branch.then));
+      if (node->branch.els) {
+        resolve_node(ctx, CHILD(node, branch.els));
+      }
+      return;
+    case ND_FOR:
+      resolve_node(ctx, CHILD(node, loop.init));
+      resolve_node(ctx, CHILD(node, loop.cond));
+      resolve_node(ctx, CHILD(node, loop.inc));
+      resolve_node(ctx, CHILD(node, loop.body));
+      return;
+    default:
+      if (node->bin.lhs) {
+        resolve_node(ctx, CHILD(node, bin.lhs));
+      }
+      resolve_node(ctx, CHILD(node, bin.rhs));
+      return;
+  }
+}
+
+// Slots of temporaries made so far, the first `used` of them are taken
+static _Thread_local struct {
+  int *slots;
+  int len;
+  int capacity;
+  int used;
+  int nnames; // names tried for temporaries
+} temps = {};
+
+// Adds a slot for a variable introduced by the compiler. Its name starts with
+// '$', which the lexer never produces, so no variable of the program can
+// refer to it. Slots given back by `frame_release_temps` are handed out again
+// first.
+int frame_temp(type_kind type) {
+  if (temps.used < temps.len) {
+    int slot = temps.slots[temps.used++];
+    memset(&frame.values[slot], 0, sizeof(struct zapp_value));
+    frame.values[slot].kind = type;
+    return slot;
+  }
+
+  char name[32];
+  do {
+    snprintf(name, sizeof(name), "$t%d", temps.nnames++);
+  } while (htable_contains(&slots, name, strlen(name)));
+  int slot = new_slot(name, strlen(name));
+  frame.values[slot].kind = type;
+
+  if (temps.len == temps.capacity) {
+    temps.capacity = temps.capacity ? temps.capacity * 2 : FRAME_INITSIZE;
+    temps.slots = realloc(temps.slots, temps.capacity * sizeof(int));
+    if (!temps.slots) {
+      panic("Error: %s\n", strerror(errno));
+    }
+  }
+  temps.slots[temps.len++] = slot;
+  temps.used = temps.len;
+  return slot;
+}
+
+// Temporaries are only used by the program they were made for, once it has
+// run they can be reused by the next one
+void frame_release_temps() {
+  temps.used = 0;
+}
+
+// Forgets all variables, so the next program starts from an empty frame.
+// Symbols cache their slots, so contexts used so far must not be used again.
+void frame_destroy() {
+  for (int i = 0; i < frame.nslots; ++i) {
+    free(frame.names[i].name);
+  }
+  free(frame.values);
+  free(frame.names);
+  memset(&frame, 0, sizeof(frame));
+  if (slots.ctrl) {
+    htable_destroy(&slots);
+  }
+  memset(&slots, 0, sizeof(slots));
+  free(temps.slots);
+  memset(&temps, 0, sizeof(temps));
+}
+
+// Adds a slot for a variable whose type is already known, as for programs
+// loaded from the cache
+int frame_add_slot(const char *name, int len, type_kind type) {
+  if (!slots.ctrl) {
+    htable_init(&slots, NULL, NULL);
+  }
+  int slot = new_slot(name, len);
+  frame.values[slot].kind = type;
+  return slot;
+}
+
+// Table of variable names of the calling thread, for `--stats`
+struct hashtable *frame_slot_table() {
+  return &slots;
+}
+
+// Set while `type_node` makes its first pass over a program, in which
+// variables have the types they have at that point of the source
+static _Thread_local bool first_pass;
+
+static type_kind pick_type(type_kind ty1, type_kind ty2) {
+  if (ty1 == TY_FLOAT || ty2 == TY_FLOAT) {
+    return TY_FLOAT;
+  }
+  return TY_INT;
+}
+
+// Widens slot of `var` to a float, converting the value it holds
+static bool widen_slot(struct node *var) {
+  struct zapp_value *value = &frame.values[var->var.slot];
+  if (value->kind == TY_FLOAT) {
+    return false;
+  }
+  value->val.fnum = value->val.num;
+  value->kind = TY_FLOAT;
+  return true;
+}
+
+// Assigns types to all nodes of `node`, returns whether any slot had to be
+// widened, in which case already typed uses of it are stale.
+static bool type_node(struct node *node) {
+  bool changed = false;
+  switch (node->kind) {
+    case ND_NUM:
+      return false;
+    case ND_VAR:
+      node->type = frame.values[node->var.slot].kind;
+      return false;
+    case ND_BLOCK:
+      for (struct node *cur = OPT_CHILD(node, block.body); cur; cur = OPT_CHILD(cur, next)) {
+        changed |= type_node(cur);
+      }
+      return changed;
+    case ND_IF:
+      changed |= type_node(CHILD(node, branch.cond));
+      changed |= type_node(CHILD(node, branch.then));
+      if (node->branch.els) {
+        changed |= type_node(CHILD(node, branch.els));
+      }
+      return changed;
+    case ND_FOR:
+      changed |= type_node(CHILD(node, loop.init));
+      changed |= type_node(CHILD(node, loop.cond));
+      changed |= type_node(CHILD(node, loop.inc));
+      changed |= type_node(CHILD(node, loop.body));
+      return changed;
+    case ND_ASSIGN: {
+      struct node *lhs = CHILD(node, bin.lhs);
+      changed |= type_node(CHILD(node, bin.rhs));
+      if (CHILD(node, bin.rhs)->type == TY_FLOAT) {
+        changed |= widen_slot(lhs);
+      }
+      type_node(lhs);
+      node->type = lhs->type;
+      return changed;
+    }
+    case ND_PRINT:
+      // A value is printed in the type it has where the print is, even if a
+      // float is assigned to one of its variables further on. The value is
+      // then converted back to an integer as it is printed.
+      changed |= type_node(CHILD(node, bin.rhs));
+      if (first_pass) {
+        node->type = CHILD(node, bin.rhs)->type;
+      }
+      return changed;
+    case ND_NEG:
+      changed |= type_node(CHILD(node, bin.rhs));
+      node->type = CHILD(node, bin.rhs)->type;
+      return changed;
+    case ND_LT:
+    case ND_LTE:
+    case ND_EQ:
+    case ND_NEQ:
+      // Comparisons yield an integer, operands are compared in the wider type
+      changed |= type_node(CHILD(node, bin.lhs));
+      changed |= type_node(CHILD(node, bin.rhs));
+      node->type = TY_INT;
+      return changed;
+    default:
+      changed |= type_node(CHILD(node, bin.lhs));
+      changed |= type_node(CHILD(node, bin.rhs));
+      node->type = pick_type(CHILD(node, bin.lhs)->type, CHILD(node, bin.rhs)->type);
+      return changed;
+  }
+}
+
+// Types top-level statement `stmt` with the slot types left by the ones
+// before it. Its prints get their type in the first pass over it.
+static bool type_stmt(struct node *stmt) {
+  first_pass = true;
+  bool changed = type_node(stmt);
+  first_pass = false;
+  if (changed) {
+    while (type_node(stmt)) {
+    }
+  }
+  return changed;
+}
+
+// Slots have a single type across the whole program, so typing is repeated
+// until no assignment widens any of them. Statements are typed one by one
+// first, the same as under `-s`, so that prints are given the same types
+// either way. Programs resolved by earlier calls keep the types they were
+// given.
+void resolve(struct context *ctx, struct node *prog) {
+  if (!slots.ctrl) {
+    htable_init(&slots, NULL, NULL);
+  }
+  resolve_node(ctx, prog);
+  bool changed = false;
+  for (struct node *cur = OPT_CHILD(prog, block.body); cur; cur = OPT_CHILD(cur, next)) {
+    changed |= type_stmt(cur);
+  }
+  while (changed && type_node(prog)) {
+  }
+}
@@ -0,0 +1,100 @@
+#include <time.h>
+
+#include "zapp.h"
+#include "hash/hashtable.h"
+
+_Thread_local struct stats stats = {};
+
+static const char *stage_str[] = {
+  "read",
+  "lex",
+  "parse",
+  "optimize",
+  "compile",
+  "execute",
+  "codegen",
+  "cache"
+};
+
+static double clock_secs(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Stages do not nest, the time since the last `stats_start` is added to the
+// stage that is stopped
+void stats_start() {
+  if (!stats.enabled) {
+    return;
+  }
+  stats.wall_start = clock_secs(CLOCK_MONOTONIC);
+  stats.cpu_start = clock_secs(CLOCK_PROCESS_CPUTIME_ID);
+}
+
+void stats_stop(stage_kind stage) {
+  if (!stats.enabled) {
+    return;
+  }
+  stats.wall[stage] += clock_secs(CLOCK_MONOTONIC) - stats.wall_start;
+  stats.cpu[stage] += clock_secs(CLOCK_PROCESS_CPUTIME_ID) - stats.cpu_start;
+}
+
+static void print_table(FILE *fp, const char *name, struct hashtable *ht) {
+  struct hashtable_stats hs;
+  htable_stats(ht, &hs);
+  fprintf(fp, "  %-10s %10d %10d %10d %10d %10d\n", name, hs.nentries, hs.nbuckets,
+          hs.ndeleted, hs.longest_probe, hs.nrehashes);
+}
+
+#ifdef ZAPP_STATS
+static void print_counts(FILE *fp, const char *what, const uint64_t *counts, int n,
+                         const char *(*kind_name)(int kind)) {
+  uint64_t total = 0;
+  for (int i = 0; i < n; ++i) {
+    total += counts[i];
+  }
+  fprintf(fp, "%s: %" PRIu64 "\n", what, total);
+  for (int i = 0; i < n; ++i) {
+    if (counts[i]) {
+      fprintf(fp, "  %-14s %12" PRIu64 "\n", kind_name(i), counts[i]);
+    }
+  }
+}
+
+static const char *token_name(int kind) {
+  return token_kind_name(kind);
+}
+
+static const char *node_name(int kind) {
+  return node_kind_name(kind);
+}
+#endif
+
+void stats_print(struct context *ctx, FILE *fp) {
+  double wall = 0, cpu = 0;
+  fprintf(fp, "%-10s %12s %12s\n", "stage", "wall ms", "cpu ms");
+  for (stage_kind stage = 0; stage < NSTAGES; ++stage) {
+    fprintf(fp, "%-10s %12.3f %12.3f\n", stage_str[stage], stats.wall[stage] * 1e3,
+            stats.cpu[stage] * 1e3);
+    wall += stats.wall[stage];
+    cpu += stats.cpu[stage];
+  }
+  fprintf(fp, "%-10s %12.3f %12.3f\n\n", "total", wall * 1e3, cpu * 1e3);
+
+#ifdef ZAPP_STATS
+  print_counts(fp, "tokens", stats.tokens, NTOKEN_KINDS, token_name);
+  print_counts(fp, "nodes", stats.nodes, NNODE_KINDS, node_name);
+  fprintf(fp, "heap: %" PRIu64 " allocations, %" PRIu64 " bytes\n", stats.nallocs,
+          stats.alloc_bytes);
+#else
+  fprintf(fp, "token, node and allocation counts need a build with `make STATS=1`\n");
+#endif
+  fprintf(fp, "arena: %d allocations, %zu bytes used of %zu in %d blocks\n\n",
+          ctx->arena.nallocs, ctx->arena.used, ctx->arena.reserved, ctx->arena.nblocks);
+
+  fprintf(fp, "%-12s %10s %10s %10s %10s %10s\n", "hashtable", "entries", "buckets",
+          "deleted", "probes", "rehashes");
+  print_table(fp, "symbols", ctx->symtab);
+  print_table(fp, "slots", frame_slot_table());
+}
@@ -1,198 +1,672 @@
 #include "zapp.h"
 #include <ctype.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define SCAN_AVX2 1
+#else
+#define SCAN_AVX2 0
+#endif
+
+// Vector scans read whole blocks, which may extend past the terminating '\0'
+// and so past the end of the buffer. Blocks which would cross into the next
+// page are read aligned instead, so no read ever touches a page the buffer
+// does not reach into.
+#define SCAN_PAGE_SIZE 4096
+#define PAGE_OFFSET(p) ((uintptr_t)(p) & (SCAN_PAGE_SIZE - 1))
+#if defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define NO_ASAN __attribute__((no_sanitize_address))
+#endif
+#endif
+#if !defined(NO_ASAN) && defined(__SANITIZE_ADDRESS__)
+#define NO_ASAN __attribute__((no_sanitize_address))
+#endif
+#ifndef NO_ASAN
+#define NO_ASAN
+#endif
+
+#define TOKENS_INITSIZE 64
+#define STREAM_CHUNK (64 * 1024)
+
+typedef enum {
+  CLASS_SPACE, // ' ', '\t' and '\n'
+  CLASS_DIGIT, // [0-9]
+  CLASS_IDENT  // [a-zA-Z0-9_]
+} char_class_kind;
+
+// Newlines passed by a scan over CLASS_SPACE
+struct newlines {
+  int count;
+  const char *last;
+};
+
+// Returns the first byte at or after `p` outside of class `cls`
+typedef const char *(*scan_func)(const char *p, char_class_kind cls, struct newlines *nl);
+
+static bool in_class(char c, char_class_kind cls) {
+  switch (cls) {
+    case CLASS_SPACE:
+      return IS_SPACE(c);
+    case CLASS_DIGIT:
+      return c >= '0' && c <= '9';
+    default:
+      return IS_CHAR(c) || c == '_' || (c >= '0' && c <= '9');
+  }
+}
+
+#ifndef __SSE2__
+static const char *scan_scalar(const char *p, char_class_kind cls, struct newlines *nl) {
+  for (; in_class(*p, cls); ++p) {
+    if (*p == '\n') {
+      nl->count++;
+      nl->last = p;
+    }
+  }
+  return p;
+}
+#endif // __SSE2__
+
+// Records newlines of `lines`, a bitmask over the block at `block`
+static inline void count_newlines(struct newlines *nl, const char *block, uint32_t lines) {
+  if (lines) {
+    nl->count += __builtin_popcount(lines);
+    nl->last = block + 31 - __builtin_clz(lines);
+  }
+}
+
+#ifdef __SSE2__
+// Bytes `c` with lo <= c <= lo + n - 1, compared as signed after moving the
+// range to the bottom, since SSE2 has no unsigned byte comparison
+static inline __m128i in_range_sse2(__m128i bytes, char lo, int n) {
+  __m128i shifted = _mm_add_epi8(bytes, _mm_set1_epi8((char)(-128 - lo)));
+  return _mm_cmplt_epi8(shifted, _mm_set1_epi8((char)(-128 + n)));
+}
+
+static inline uint32_t class_mask_sse2(__m128i bytes, char_class_kind cls) {
+  __m128i in;
+  switch (cls) {
+    case CLASS_SPACE:
+      in = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(' ')),
+                                     _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\t'))),
+                        _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\n')));
+      break;
+    case CLASS_DIGIT:
+      in = in_range_sse2(bytes, '0', 10);
+      break;
+    default:
+      in = _mm_or_si128(_mm_or_si128(in_range_sse2(bytes, '0', 10),
+                                     _mm_cmpeq_epi8(bytes, _mm_set1_epi8('_'))),
+                        in_range_sse2(_mm_or_si128(bytes, _mm_set1_epi8(0x20)), 'a', 26));
+      break;
+  }
+  return _mm_movemask_epi8(in);
+}
+
+NO_ASAN
+static const char *scan_sse2(const char *p, char_class_kind cls, struct newlines *nl) {
+  for (;;) {
+    const char *block = p;
+    uint32_t skip = 0xffff;
+    if (PAGE_OFFSET(p) > SCAN_PAGE_SIZE - 16) {
+      block = p - ((uintptr_t)p & 15);
+      skip = (0xffff << (p - block)) & 0xffff;
+    }
+    __m128i bytes = _mm_loadu_si128((const __m128i *)block);
+    uint32_t stop = ~class_mask_sse2(bytes, cls) & skip;
+    if (cls == CLASS_SPACE) {
+      uint32_t before = stop ? (1u << __builtin_ctz(stop)) - 1 : 0xffff;
+      count_newlines(nl, block, _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8('\n'))) &
+                                skip & before);
+    }
+    if (stop) {
+      return block + __builtin_ctz(stop);
+    }
+    p = block + 16;
+  }
+}
+#endif // __SSE2__
+
+#if SCAN_AVX2
+__attribute__((target("avx2")))
+static inline __m256i in_range_avx2(__m256i bytes, char lo, int n) {
+  __m256i shifted = _mm256_add_epi8(bytes, _mm256_set1_epi8((char)(-128 - lo)));
+  return _mm256_cmpgt_epi8(_mm256_set1_epi8((char)(-128 + n)), shifted);
+}
+
+__attribute__((target("avx2")))
+static inline uint32_t class_mask_avx2(__m256i bytes, char_class_kind cls) {
+  __m256i in;
+  switch (cls) {
+    case CLASS_SPACE:
+      in = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(' ')),
+                                           _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('\t'))),
+                           _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('\n')));
+      break;
+    case CLASS_DIGIT:
+      in = in_range_avx2(bytes, '0', 10);
+      break;
+    default:
+      in = _mm256_or_si256(_mm256_or_si256(in_range_avx2(bytes, '0', 10),
+                                           _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('_'))),
+                           in_range_avx2(_mm256_or_si256(bytes, _mm256_set1_epi8(0x20)), 'a', 26));
+      break;
+  }
+  return _mm256_movemask_epi8(in);
+}
+
+NO_ASAN __attribute__((target("avx2")))
+static const char *scan_avx2(const char *p, char_class_kind cls, struct newlines *nl) {
+  for (;;) {
+    const char *block = p;
+    uint32_t skip = UINT32_MAX;
+    if (PAGE_OFFSET(p) > SCAN_PAGE_SIZE - 32) {
+      block = p - ((uintptr_t)p & 31);
+      skip = UINT32_MAX << (p - block);
+    }
+    __m256i bytes = _mm256_loadu_si256((const __m256i *)block);
+    uint32_t stop = ~class_mask_avx2(bytes, cls) & skip;
+    if (cls == CLASS_SPACE) {
+      uint32_t before = stop ? (uint32_t)((1ull << __builtin_ctz(stop)) - 1) : UINT32_MAX;
+      count_newlines(nl, block, _mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('\n'))) &
+                                skip & before);
+    }
+    if (stop) {
+      return block + __builtin_ctz(stop);
+    }
+    p = block + 32;
+  }
+}
+#endif // SCAN_AVX2
+
+// Picks the widest scan the CPU supports
+static scan_func select_scan() {
+#if SCAN_AVX2
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return scan_avx2;
+  }
+#endif
+#ifdef __SSE2__
+  return scan_sse2;
+#else
+  return scan_scalar;
+#endif
+}
+
+static scan_func scan;
+
+// Picked up front, as tokenizers may be created by several threads at once
+__attribute__((constructor))
+static void scan_init() {
+  scan = select_scan();
+}
+
+// Skips the rest of a token of class `cls` starting at `p`. Most tokens and
+// gaps between them are a byte or two long, those are handled without
+// calling into a vector scan.
+static inline const char *skip_class(const char *p, char_class_kind cls, struct newlines *nl) {
+  if (!in_class(p[0], cls)) {
+    return p;
+  }
+  if (!in_class(p[1], cls)) {
+    if (p[0] == '\n') {
+      nl->count++;
+      nl->last = p;
+    }
+    return p + 1;
+  }
+  return scan(p, cls, nl);
+}
 
 void tokenizer_init(struct tokenizer *tokenizer, char *buf) {
+  tokenizer_init_ctx(tokenizer, buf, default_context());
+}
+
+void tokenizer_init_ctx(struct tokenizer *tokenizer, char *buf, struct context *ctx) {
+  tokenizer->ctx = ctx;
   tokenizer->buf = tokenizer->cur = buf;
-  memset(tokenizer->lookahead, 0, sizeof(struct token) * MAX_LOOKAHEAD);
-  tokenizer->avail_tokens = 0;
+  tokenizer->tokens = NULL;
+  tokenizer->ntokens = tokenizer->capacity = tokenizer->pos = 0;
   tokenizer->nline = 0;
   tokenizer->ncol = 0;
+  tokenizer->fd = -1;
+  tokenizer->end = tokenizer->filled = tokenizer->bufsize = 0;
+  tokenizer->held = '\0';
+  tokenizer->mapped = tokenizer->owns_fd = false;
+}
+
+// Source is read from `fd` as the lexer reaches the end of what has been
+// read so far, `fd` is left open
+void tokenizer_init_fd(struct tokenizer *tokenizer, int fd, struct context *ctx) {
+  char *buf = malloc(STREAM_CHUNK);
+  if (!buf) {
+    panic("Error: %s\n", strerror(errno));
+  }
+  STAT_ALLOC(STREAM_CHUNK);
+  buf[0] = '\0';
+  tokenizer_init_ctx(tokenizer, buf, ctx);
+  tokenizer->fd = fd;
+  tokenizer->bufsize = STREAM_CHUNK;
+}
+
+// Maps a regular file read-only. The mapping is followed by at least one
+// zero byte, which the lexer takes for the end of the source: the rest of
+// the last page of a file is zero filled, and when the file ends on a page
+// boundary an anonymous page is mapped after it.
+static char *map_file(int fd, size_t size, size_t *map_size) {
+  size_t page = sysconf(_SC_PAGESIZE);
+  *map_size = (size / page + 1) * page;
+  char *buf = mmap(NULL, *map_size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buf == MAP_FAILED) {
+    return NULL;
+  }
+  if (size && mmap(buf, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+    munmap(buf, *map_size);
+    return NULL;
+  }
+  madvise(buf, size, MADV_SEQUENTIAL);
+  return buf;
+}
+
+// Reads source from file `fname`, or from the standard input for "-".
+// Regular files are mapped into memory unless `stream` is set, anything
+// else is read as a stream.
+void tokenizer_init_file(struct tokenizer *tokenizer, const char *fname, bool stream,
+                         struct context *ctx) {
+  bool is_stdin = !strcmp(fname, "-");
+  int fd = is_stdin ? STDIN_FILENO : open(fname, O_RDONLY);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) != 0) {
+    panic("Error: %s: %s\n", fname, strerror(errno));
+  }
+  if (S_ISDIR(st.st_mode)) {
+    panic("Error: %s: %s\n", fname, strerror(EISDIR));
+  }
+
+  if (S_ISREG(st.st_mode) && !stream) {
+    size_t map_size;
+    char *buf = map_file(fd, st.st_size, &map_size);
+    if (!buf) {
+      panic("Error: %s: %s\n", fname, strerror(errno));
+    }
+    if (!is_stdin) {
+      close(fd);
+    }
+    tokenizer_init_ctx(tokenizer, buf, ctx);
+    tokenizer->end = tokenizer->filled = st.st_size;
+    tokenizer->bufsize = map_size;
+    tokenizer->mapped = true;
+  } else {
+    tokenizer_init_fd(tokenizer, fd, ctx);
+    tokenizer->owns_fd = !is_stdin;
+  }
+}
+
+void tokenizer_destroy(struct tokenizer *tokenizer) {
+  free(tokenizer->tokens);
+  tokenizer->tokens = NULL;
+  tokenizer->ntokens = tokenizer->capacity = tokenizer->pos = 0;
+  if (tokenizer->mapped) {
+    munmap(tokenizer->buf, tokenizer->bufsize);
+  } else if (tokenizer->bufsize) {
+    free(tokenizer->buf);
+  }
+  if (tokenizer->owns_fd && tokenizer->fd != -1) {
+    close(tokenizer->fd);
+  }
+  if (tokenizer->bufsize) {
+    tokenizer->buf = tokenizer->cur = NULL;
+    tokenizer->bufsize = 0;
+  }
+  tokenizer->fd = -1;
+  tokenizer->mapped = tokenizer->owns_fd = false;
 }
 
-static int punct_lookup(char *s) {
-  static char *kw[] = {
-    "<=", ">=", "!=", "==", "..", "+", "-", "/", "*", "<", ">", "(", ")", "{", "}", "=", "."
-  };
-  for (int i = 0; i < sizeof(kw)/sizeof(*kw); ++i) {
-    if (!strncmp(kw[i], s, strlen(kw[i]))) {
-      return strlen(kw[i]);
+// Reads the next chunk of a streamed source, returns whether anything new
+// became visible to the lexer. The buffer only grows when the lines being
+// parsed do not fit into it, it is read into directly so nothing is copied
+// twice.
+static bool tok_refill(struct tokenizer *tokenizer) {
+  if (tokenizer->fd == -1) {
+    return false;
+  }
+  tokenizer->buf[tokenizer->end] = tokenizer->held;
+
+  // Lines before the oldest token still to be parsed are not needed anymore,
+  // so the buffer only has to hold the lines being parsed. The token at the
+  // end of `tokens` is the one being lexed.
+  char *keep = tokenizer->cur;
+  if (tokenizer->pos + 1 < tokenizer->ntokens) {
+    keep = TOK_STR(tokenizer, &tokenizer->tokens[tokenizer->pos]);
+  }
+  while (keep > tokenizer->buf && keep[-1] != '\n') {
+    --keep;
+  }
+  size_t shift = keep - tokenizer->buf;
+  if (shift) {
+    memmove(tokenizer->buf, keep, tokenizer->filled - shift);
+    for (uint32_t i = tokenizer->pos; i < tokenizer->ntokens; ++i) {
+      tokenizer->tokens[i].start -= shift;
     }
+    tokenizer->cur -= shift;
+    tokenizer->end -= shift;
+    tokenizer->filled -= shift;
   }
-  return 0;
+
+  size_t offset = tokenizer->cur - tokenizer->buf;
+  size_t visible = tokenizer->end;
+  for (;;) {
+    // Keep a byte spare for the '\0' past the end of the source
+    if (tokenizer->bufsize - tokenizer->filled < STREAM_CHUNK / 2) {
+      tokenizer->bufsize *= 2;
+      tokenizer->buf = realloc(tokenizer->buf, tokenizer->bufsize);
+      if (!tokenizer->buf) {
+        panic("Error: %s\n", strerror(errno));
+      }
+      STAT_ALLOC(tokenizer->bufsize);
+    }
+    char *chunk = tokenizer->buf + tokenizer->filled;
+    ssize_t n = read(tokenizer->fd, chunk, tokenizer->bufsize - tokenizer->filled - 1);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      panic("Error: %s\n", strerror(errno));
+    }
+    tokenizer->filled += n;
+    if (n == 0) {
+      if (tokenizer->owns_fd) {
+        close(tokenizer->fd);
+      }
+      tokenizer->fd = -1;
+      tokenizer->end = tokenizer->filled;
+      break;
+    }
+    char *nl = chunk + n;
+    while (nl > chunk && nl[-1] != '\n') {
+      --nl;
+    }
+    if (nl > chunk) {
+      tokenizer->end = nl - tokenizer->buf;
+      break;
+    }
+  }
+  tokenizer->held = tokenizer->buf[tokenizer->end];
+  tokenizer->buf[tokenizer->end] = '\0';
+  tokenizer->cur = tokenizer->buf + offset;
+  return tokenizer->end > visible;
 }
 
-static void tok_init(struct token *tok, token_kind kind, char *start,
-                     int len, int nline, int ncol) {
-  tok->kind = kind;
-  tok->start = start;
-  tok->len = len;
-  tok->nline = nline;
-  tok->ncol = ncol;
+// Keywords are lexed as identifiers first, this tells them apart
+static token_kind keyword_kind(const char *s, int len) {
+  switch (len) {
+    case 2:
+      if (s[0] == 'i' && s[1] == 'f') {
+        return TOKEN_IF;
+      }
+      if (s[0] == 'i' && s[1] == 'n') {
+        return TOKEN_IN;
+      }
+      break;
+    case 3:
+      if (!memcmp(s, "for", 3)) {
+        return TOKEN_FOR;
+      }
+      break;
+    case 4:
+      if (!memcmp(s, "else", 4)) {
+        return TOKEN_ELSE;
+      }
+      break;
+    case 5:
+      if (!memcmp(s, "print", 5)) {
+        return TOKEN_PRINT;
+      }
+      break;
+  }
+  return TOKEN_IDENT;
 }
 
-static struct type *new_type(type_kind kind) {
-  struct type *type = malloc(sizeof(*type));
-  type->kind = kind;
-  return type;
+// Returns length of the punctuator at `s` and stores its kind to `kind`, 0
+// if there is none
+static int punct_lookup(const char *s, token_kind *kind) {
+  switch (s[0]) {
+    case '<':
+      *kind = s[1] == '=' ? TOKEN_LTE : TOKEN_LT;
+      return *kind == TOKEN_LTE ? 2 : 1;
+    case '>':
+      *kind = s[1] == '=' ? TOKEN_GTE : TOKEN_GT;
+      return *kind == TOKEN_GTE ? 2 : 1;
+    case '=':
+      *kind = s[1] == '=' ? TOKEN_EQ : TOKEN_ASSIGN;
+      return *kind == TOKEN_EQ ? 2 : 1;
+    case '.':
+      *kind = s[1] == '.' ? TOKEN_DOTDOT : TOKEN_DOT;
+      return *kind == TOKEN_DOTDOT ? 2 : 1;
+    case '!':
+      if (s[1] == '=') {
+        *kind = TOKEN_NEQ;
+        return 2;
+      }
+      return 0;
+    case '+': *kind = TOKEN_PLUS; return 1;
+    case '-': *kind = TOKEN_MINUS; return 1;
+    case '/': *kind = TOKEN_SLASH; return 1;
+    case '*': *kind = TOKEN_STAR; return 1;
+    case '(': *kind = TOKEN_LPAREN; return 1;
+    case ')': *kind = TOKEN_RPAREN; return 1;
+    case '{': *kind = TOKEN_LBRACE; return 1;
+    case '}': *kind = TOKEN_RBRACE; return 1;
+    default:
+      return 0;
+  }
 }
 
-static void lex_one(struct tokenizer *tokenizer, struct token *tok) {
-retry:
-  if (*tokenizer->cur == ' ' || *tokenizer->cur == '\t') {
-    INCR_COL(tokenizer, 1);
-    ++tokenizer->cur;
-    goto retry;
+static void tok_init(struct tokenizer *tokenizer, struct token *tok, token_kind kind,
+                     char *start, int len) {
+  if (len > UINT16_MAX) {
+    panic("Error: token is too long at [%d;%d]\n", tokenizer->nline, tokenizer->ncol);
   }
+  tok->kind = kind;
+  tok->start = start - tokenizer->buf;
+  tok->len = len;
+  tok->nline = tokenizer->nline;
+}
 
-  if (*tokenizer->cur == '\n') {
-    INCR_LINE(tokenizer);
-    ++tokenizer->cur;
-    goto retry;
+static void lex_one(struct tokenizer *tokenizer, struct token *tok) {
+  if (IS_SPACE(*tokenizer->cur)) {
+    struct newlines nl = {};
+    const char *end = skip_class(tokenizer->cur, CLASS_SPACE, &nl);
+    if (nl.count) {
+      tokenizer->nline += nl.count;
+      tokenizer->ncol = end - nl.last - 1;
+    } else {
+      INCR_COL(tokenizer, end - tokenizer->cur);
+    }
+    tokenizer->cur = (char *)end;
   }
 
   char *start = tokenizer->cur;
 
   // [1-9][0-9]*(.[0-9]*|.\s)?
   if (*tokenizer->cur >= '0' && *tokenizer->cur <= '9') {
-    ++tokenizer->cur;
-
     type_kind kind = TY_INT;
 
-    while (*tokenizer->cur >= '0' && *tokenizer->cur <= '9') {
-      ++tokenizer->cur;
-    }
+    tokenizer->cur = (char *)skip_class(tokenizer->cur + 1, CLASS_DIGIT, NULL);
     if (*tokenizer->cur == '.' && (IS_SPACE(*(tokenizer->cur+1)) ||
          (*(tokenizer->cur+1) >= '0' && *(tokenizer->cur+1) <= '9')))
     {
-      ++tokenizer->cur;
       kind = TY_FLOAT;
-      while (*tokenizer->cur >= '0' && *tokenizer->cur <= '9') {
-        ++tokenizer->cur;
-      }
+      tokenizer->cur = (char *)skip_class(tokenizer->cur + 1, CLASS_DIGIT, NULL);
     }
 
     int len = tokenizer->cur - start;
-    tok_init(tok, TOKEN_NUM, start, len, tokenizer->nline, tokenizer->ncol);
+    tok_init(tokenizer, tok, TOKEN_NUM, start, len);
     INCR_COL(tokenizer, len);
-    tok->type = new_type(kind);
+    tok->type = kind;
     return;
   }
 
   // [a-zA-Z_][a-zA-Z0-9_]*
   if (IS_CHAR(*tokenizer->cur) || *tokenizer->cur == '_') {
-    ++tokenizer->cur;
-    while (IS_CHAR(*tokenizer->cur) || *tokenizer->cur == '_' ||
-           (*tokenizer->cur >= '0' && *tokenizer->cur <= '9')) {
-      ++tokenizer->cur;
-    }
+    tokenizer->cur = (char *)skip_class(tokenizer->cur + 1, CLASS_IDENT, NULL);
 
     int len = tokenizer->cur - start;
-    tok_init(tok, TOKEN_IDENT, start, len, tokenizer->nline, tokenizer->ncol);
+    token_kind kind = keyword_kind(start, len);
+    tok_init(tokenizer, tok, kind, start, len);
+    if (kind == TOKEN_IDENT) {
+      tok->sym = intern(tokenizer->ctx, start, len);
+    }
     INCR_COL(tokenizer, len);
     return;
   }
 
-  int punct_len = punct_lookup(tokenizer->cur);
+  token_kind kind;
+  int punct_len = punct_lookup(tokenizer->cur, &kind);
   if (punct_len) {
-    tok_init(tok, TOKEN_PUNCT, start, punct_len, tokenizer->nline, tokenizer->ncol);
+    tok_init(tokenizer, tok, kind, start, punct_len);
     INCR_COL(tokenizer, punct_len);
     tokenizer->cur += punct_len;
     return;
   }
 
   if (*tokenizer->cur == '\0') {
-    tok_init(tok, TOKEN_EOF, start, 0, tokenizer->nline, tokenizer->ncol);
+    tok_init(tokenizer, tok, TOKEN_EOF, start, 0);
     return;
   }
 
-  panic_tok(tokenizer, "Received incorrect token");
+  panic("Error: Received incorrect token at [%d;%d]\n", tokenizer->nline, tokenizer->ncol);
 }
 
-static const char *token_types_str[] = {
-  "TOKEN_NUM",
-  "TOKEN_FNUM",
-  "TOKEN_PUNCT",
-  "TOKEN_IDENT",
-  "TOKEN_EOF"
+static const char *token_kind_str[] = {
+  "number",
+  "number",
+  "identifier",
+  "end of input",
+  "if",
+  "else",
+  "for",
+  "in",
+  "print",
+  "<=",
+  ">=",
+  "!=",
+  "==",
+  "..",
+  "+",
+  "-",
+  "/",
+  "*",
+  "<",
+  ">",
+  "(",
+  ")",
+  "{",
+  "}",
+  "=",
+  "."
 };
 
-static void lex_one_token(struct tokenizer *tokenizer, struct token *tok) {
-  lex_one(tokenizer, tok);
+// Lexes the next token to the end of `tokens`
+static void lex_one_token(struct tokenizer *tokenizer) {
+  if (tokenizer->ntokens == tokenizer->capacity) {
+    tokenizer->capacity = tokenizer->capacity ? tokenizer->capacity * 2 : TOKENS_INITSIZE;
+    tokenizer->tokens = realloc(tokenizer->tokens, tokenizer->capacity * sizeof(struct token));
+    if (!tokenizer->tokens) {
+      panic("Error: %s\n", strerror(errno));
+    }
+    STAT_ALLOC(tokenizer->capacity * sizeof(struct token));
+  }
+  if (tokenizer->cur - tokenizer->buf > UINT32_MAX) {
+    panic("Error: source is too large\n");
+  }
+  struct token *tok = &tokenizer->tokens[tokenizer->ntokens++];
+  do {
+    lex_one(tokenizer, tok);
+  } while (tok->kind == TOKEN_EOF && tok_refill(tokenizer));
+  STAT_INC(tokens[tok->kind]);
 #ifdef DEBUG
-  fprintf(stderr, "[%s] `%.*s` at [%d;%d]\n", token_types_str[tok->kind],
-          tok->len, tok->start, tok->nline, tok->ncol);
+  fprintf(stderr, "[%s] `%.*s` at [%d;%d]\n", token_kind_str[tok->kind],
+          tok->len, TOK_STR(tokenizer, tok), tok->nline, tok_col(tokenizer, tok));
 #endif
 }
 
-void tok_consume_lookahead(struct tokenizer *tokenizer) {
-  memmove(&tokenizer->lookahead[0], &tokenizer->lookahead[1],
-          sizeof(struct token) * (MAX_LOOKAHEAD - tokenizer->avail_tokens));
-  tokenizer->avail_tokens--;
+const char *token_kind_name(token_kind kind) {
+  return token_kind_str[kind];
 }
 
-int tok_equals(struct token *tok, const char *s) {
-  return !strncmp(tok->start, s, tok->len) && s[tok->len] == '\0';
-}
-
-static void _tok_skip(struct tokenizer *tokenizer, const char *s) {
-  struct token *tok = &tokenizer->lookahead[0];
-  if (tok_equals(tok, s)) {
-    tok_consume_lookahead(tokenizer);
-    return;
+int tok_col(struct tokenizer *tokenizer, struct token *tok) {
+  char *start = TOK_STR(tokenizer, tok);
+  char *line = start;
+  while (line > tokenizer->buf && line[-1] != '\n') {
+    --line;
   }
-  panic_tok(tokenizer, "Expected `%s`, but received %.*s", s, tok->len, tok->start);
+  return start - line;
 }
 
-void tok_skip(struct tokenizer *tokenizer, const char *s) {
-  if (tokenizer->avail_tokens == 0) {
-    lex_one_token(tokenizer, &tokenizer->lookahead[0]);
-    tokenizer->avail_tokens = 1;
+// Sources average a few bytes per token, so the token vector is sized from
+// the length of the input up front rather than grown by copying
+void tok_lex_all(struct tokenizer *tokenizer) {
+  size_t estimate = (tokenizer->end - (tokenizer->cur - tokenizer->buf)) / 4 + TOKENS_INITSIZE;
+  if (estimate > tokenizer->capacity && estimate <= UINT32_MAX) {
+    tokenizer->capacity = estimate;
+    tokenizer->tokens = realloc(tokenizer->tokens, tokenizer->capacity * sizeof(struct token));
+    if (!tokenizer->tokens) {
+      panic("Error: %s\n", strerror(errno));
+    }
+    STAT_ALLOC(tokenizer->capacity * sizeof(struct token));
   }
-  _tok_skip(tokenizer, s);
+  do {
+    lex_one_token(tokenizer);
+  } while (tokenizer->tokens[tokenizer->ntokens - 1].kind != TOKEN_EOF);
 }
 
-// _tok_consume expects at least one lookahead to be already filled,
-// otherwise calling this is UB
-static int _tok_consume(struct tokenizer *tokenizer, const char *s) {
-  struct token *tok = &tokenizer->lookahead[0];
-  if (tok_equals(tok, s)) {
-    tok_consume_lookahead(tokenizer);
-    return 1;
+// Tokens lexed on demand are dropped once all of them are consumed, so
+// memory stays bounded by the lookahead used
+struct token *tok_npeek(struct tokenizer *tokenizer, int n) {
+  if (tokenizer->pos == tokenizer->ntokens) {
+    tokenizer->pos = tokenizer->ntokens = 0;
   }
-  return 0;
-}
-
-int tok_consume(struct tokenizer *tokenizer, const char *s) {
-  if (tokenizer->avail_tokens == 0) {
-    lex_one_token(tokenizer, &tokenizer->lookahead[0]);
-    tokenizer->avail_tokens = 1;
+  while (tokenizer->ntokens - tokenizer->pos < (uint32_t)n) {
+    lex_one_token(tokenizer);
   }
-  return _tok_consume(tokenizer, s);
+  return &tokenizer->tokens[tokenizer->pos + n - 1];
 }
 
 struct token *tok_peek(struct tokenizer *tokenizer) {
-  if (tokenizer->avail_tokens == 0) {
-    lex_one_token(tokenizer, &tokenizer->lookahead[0]);
-    tokenizer->avail_tokens = 1;
+  if (tokenizer->pos < tokenizer->ntokens) {
+    return &tokenizer->tokens[tokenizer->pos];
   }
-  return &tokenizer->lookahead[0];
+  return tok_npeek(tokenizer, 1);
 }
 
-struct token *tok_npeek(struct tokenizer *tokenizer, int n) {
-  if (n > MAX_LOOKAHEAD) {
-    // TODO: Make a better way of raising ICE
-    fprintf(stderr, "ICE: desired lookahead is disabled by the compiler configuration\n");
-    exit(1);
-  }
+void tok_consume_lookahead(struct tokenizer *tokenizer) {
+  tokenizer->pos++;
+}
 
-  if (tokenizer->avail_tokens >= n) {
-    return &tokenizer->lookahead[n-1];
+void tok_skip(struct tokenizer *tokenizer, token_kind kind) {
+  struct token *tok = tok_peek(tokenizer);
+  if (tok->kind == kind) {
+    tok_consume_lookahead(tokenizer);
+    return;
   }
+  panic_tok(tokenizer, "Expected `%s`, but received %.*s", token_kind_str[kind],
+            tok->len, TOK_STR(tokenizer, tok));
+}
 
-  int avail;
-  for (avail = tokenizer->avail_tokens; avail < n; ++avail) {
-    lex_one_token(tokenizer, &tokenizer->lookahead[avail]);
+int tok_consume(struct tokenizer *tokenizer, token_kind kind) {
+  if (tok_peek(tokenizer)->kind == kind) {
+    tok_consume_lookahead(tokenizer);
+    return 1;
   }
-  tokenizer->avail_tokens = avail;
-  return &tokenizer->lookahead[n-1];
+  return 0;
 }
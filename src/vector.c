@@ -0,0 +1,616 @@
+#include "zapp.h"
+
+#define VEC_BLOCK 512      // iterations evaluated at once
+#define VEC_MIN_TRIP 64    // shorter loops are left to the scalar code
+#define VEC_MAX_COLUMNS 64 // longer bodies would not fit in the cache
+
+// Use the vector extensions of the compiler when it has them, so that
+// kernels work on several iterations per instruction, otherwise one by one
+#if defined(__GNUC__) || defined(__clang__)
+#define VEC_SIMD 1
+#define VEC_LANES 4
+typedef uint64_t vec_uint __attribute__((vector_size(VEC_LANES * sizeof(int64_t))));
+typedef double vec_float __attribute__((vector_size(VEC_LANES * sizeof(double))));
+#else
+#define VEC_SIMD 0
+#define VEC_LANES 1
+#endif
+
+static bool enabled = true;
+
+// Values of an expression in every iteration of a block
+union column {
+  int64_t num[VEC_BLOCK];
+  double fnum[VEC_BLOCK];
+#if VEC_SIMD
+  vec_uint vunum[VEC_BLOCK / VEC_LANES];
+  vec_float vfnum[VEC_BLOCK / VEC_LANES];
+#endif
+};
+
+typedef enum {
+  VEC_ADDI,
+  VEC_SUBI,
+  VEC_MULI,
+  VEC_DIVI,
+  VEC_LTI,
+  VEC_LTEI,
+  VEC_EQI,
+  VEC_NEQI,
+  VEC_NEGI,
+  VEC_ADDF,
+  VEC_SUBF,
+  VEC_MULF,
+  VEC_DIVF,
+  VEC_LTF,
+  VEC_LTEF,
+  VEC_EQF,
+  VEC_NEQF,
+  VEC_NEGF,
+  VEC_I2F
+} vec_op_kind;
+
+// columns[dst] = columns[lhs] op columns[rhs]
+struct vec_op {
+  uint8_t kind;
+  uint8_t dst;
+  uint8_t lhs;
+  uint8_t rhs;
+};
+
+// Column holding the same value in every iteration, filled before the loop
+struct vec_input {
+  int col;
+  int slot;                // variable the value is read from, -1 for `val`
+  uint8_t type;
+  union actual_value val;
+};
+
+// Variable assigned by the body, either the value of the last iteration
+// (ND_ASSIGN) or folded over all of them in order (ND_ADD, ND_SUB, ND_MUL)
+struct vec_result {
+  int slot;
+  int col;
+  uint8_t type;
+  uint8_t op;
+};
+
+struct vec_print {
+  int col;
+  uint8_t type;
+};
+
+struct vec_loop {
+  int var;           // slot of the loop variable, which is in column 0
+  struct node *end;
+  struct vec_op *ops;
+  int nops;
+  struct vec_input *inputs;
+  int ninputs;
+  struct vec_result *results;
+  int nresults;
+  struct vec_print *prints; // in the order they are printed in an iteration
+  int nprints;
+  int ncolumns;
+};
+
+/*
+ * analysis
+ */
+
+typedef enum {
+  WR_NONE,
+  WR_ASSIGN,
+  WR_REDUCE
+} written_kind;
+
+struct vec_compiler {
+  struct vec_loop *loop;
+  uint8_t *written; // written_kind of every slot
+  int *cols;        // column holding the value of every slot so far, or -1
+};
+
+static void *grow(void *array, int n, size_t size) {
+  array = realloc(array, (n + 1) * size);
+  if (!array) {
+    panic("Error: %s\n", strerror(errno));
+  }
+  return array;
+}
+
+static bool is_fold(struct node *node) {
+  return node->kind == ND_ADD || node->kind == ND_SUB || node->kind == ND_MUL;
+}
+
+static bool is_var(struct node *node, int slot) {
+  return node->kind == ND_VAR && node->var.slot == slot;
+}
+
+// If `stmt` is `v = v op e` (or `v = e op v` for op + and *), returns the
+// node applying op to `v`. Integers wrap around, so for them `v = v + a - b`
+// is `v = v + (a - b)`, the same goes for products.
+static struct node *reduction_base(struct node *stmt) {
+  struct node *var = CHILD(stmt, bin.lhs);
+  struct node *rhs = CHILD(stmt, bin.rhs);
+  int slot = var->var.slot;
+  if (!is_fold(rhs) || rhs->type != var->type) {
+    return NULL;
+  }
+  if (rhs->kind != ND_SUB && is_var(CHILD(rhs, bin.rhs), slot)) {
+    return rhs;
+  }
+  for (struct node *node = rhs;; node = CHILD(node, bin.lhs)) {
+    struct node *lhs = CHILD(node, bin.lhs);
+    if (is_var(lhs, slot)) {
+      return node;
+    }
+    if (var->type != TY_INT || !is_fold(lhs) ||
+        (lhs->kind == ND_MUL) != (rhs->kind == ND_MUL)) {
+      return NULL;
+    }
+  }
+}
+
+// Marks the variables assigned by the statements of `node`, which may only
+// be plain assignments, prints and blocks of them
+static bool mark_written(struct vec_compiler *c, struct node *node) {
+  switch (node->kind) {
+    case ND_BLOCK:
+      for (struct node *stmt = OPT_CHILD(node, block.body); stmt; stmt = OPT_CHILD(stmt, next)) {
+        if (!mark_written(c, stmt)) {
+          return false;
+        }
+      }
+      return true;
+    case ND_PRINT:
+      return true;
+    case ND_ASSIGN: {
+      int slot = CHILD(node, bin.lhs)->var.slot;
+      written_kind kind = reduction_base(node) ? WR_REDUCE : WR_ASSIGN;
+      // A variable is folded by a single statement and assigned by no other
+      if (slot == c->loop->var || (c->written[slot] != WR_NONE &&
+                                   (kind == WR_REDUCE || c->written[slot] == WR_REDUCE))) {
+        return false;
+      }
+      c->written[slot] = kind;
+      return true;
+    }
+    default:
+      return false;
+  }
+}
+
+static int new_column(struct vec_compiler *c) {
+  return c->loop->ncolumns < VEC_MAX_COLUMNS ? c->loop->ncolumns++ : -1;
+}
+
+static int emit(struct vec_compiler *c, vec_op_kind kind, int lhs, int rhs) {
+  struct vec_loop *loop = c->loop;
+  int dst = new_column(c);
+  if (dst < 0 || lhs < 0 || rhs < 0) {
+    return -1;
+  }
+  loop->ops = grow(loop->ops, loop->nops, sizeof(struct vec_op));
+  loop->ops[loop->nops++] = (struct vec_op){ kind, dst, lhs, rhs };
+  return dst;
+}
+
+static int input(struct vec_compiler *c, int slot, type_kind type, union actual_value val) {
+  struct vec_loop *loop = c->loop;
+  int col = new_column(c);
+  if (col < 0) {
+    return -1;
+  }
+  loop->inputs = grow(loop->inputs, loop->ninputs, sizeof(struct vec_input));
+  loop->inputs[loop->ninputs++] = (struct vec_input){ col, slot, type, val };
+  return col;
+}
+
+// Column of the value of expression `node` as `type`, or -1 if it can not
+// be evaluated a block at a time
+static int compile_expr(struct vec_compiler *c, struct node *node, type_kind type) {
+  int col = -1;
+  switch (node->kind) {
+    case ND_NUM:
+      col = input(c, -1, node->type, node->val);
+      break;
+    case ND_VAR: {
+      int slot = node->var.slot;
+      if (slot == c->loop->var) {
+        col = 0;
+      } else if (c->written[slot] == WR_NONE && c->cols[slot] < 0) {
+        col = c->cols[slot] = input(c, slot, node->type, (union actual_value){0});
+      } else if (c->written[slot] != WR_REDUCE) {
+        // Assigned by an earlier statement of the iteration, or -1 if read
+        // before, which would carry the value from the previous iteration
+        col = c->cols[slot];
+      }
+      break;
+    }
+    case ND_NEG: {
+      int rhs = compile_expr(c, CHILD(node, bin.rhs), node->type);
+      col = emit(c, node->type == TY_INT ? VEC_NEGI : VEC_NEGF, rhs, rhs);
+      break;
+    }
+    case ND_ADD:
+    case ND_SUB:
+    case ND_MUL:
+    case ND_DIV: {
+      struct node *rhs_node = CHILD(node, bin.rhs);
+      // Integer division by anything but a nonzero constant may fail
+      if (node->kind == ND_DIV && node->type == TY_INT &&
+          (rhs_node->kind != ND_NUM || rhs_node->val.num == 0)) {
+        return -1;
+      }
+      int lhs = compile_expr(c, CHILD(node, bin.lhs), node->type);
+      int rhs = compile_expr(c, rhs_node, node->type);
+      vec_op_kind kind = (node->type == TY_INT ? VEC_ADDI : VEC_ADDF) + (node->kind - ND_ADD);
+      col = emit(c, kind, lhs, rhs);
+      break;
+    }
+    case ND_LT:
+    case ND_LTE:
+    case ND_EQ:
+    case ND_NEQ: {
+      // Compared in the wider of the operand types
+      struct node *lhs_node = CHILD(node, bin.lhs), *rhs_node = CHILD(node, bin.rhs);
+      type_kind operands = lhs_node->type == TY_INT && rhs_node->type == TY_INT ? TY_INT
+                                                                                : TY_FLOAT;
+      int lhs = compile_expr(c, lhs_node, operands);
+      int rhs = compile_expr(c, rhs_node, operands);
+      vec_op_kind kind = (operands == TY_INT ? VEC_LTI : VEC_LTF) + (node->kind - ND_LT);
+      col = emit(c, kind, lhs, rhs);
+      break;
+    }
+    default:
+      return -1;
+  }
+  if (col >= 0 && node->type != type) {
+    // Integers are only ever widened
+    col = type == TY_FLOAT ? emit(c, VEC_I2F, col, col) : -1;
+  }
+  return col;
+}
+
+// Column of what the operations from `base` up to `node` apply to `var`, as
+// a single operand of the op of `base`
+static int compile_reduction(struct vec_compiler *c, struct node *node, struct node *base,
+                             struct node *var) {
+  if (node == base) {
+    struct node *lhs = CHILD(base, bin.lhs);
+    return compile_expr(c, is_var(lhs, var->var.slot) ? CHILD(base, bin.rhs) : lhs, var->type);
+  }
+  int lhs = compile_reduction(c, CHILD(node, bin.lhs), base, var);
+  int rhs = compile_expr(c, CHILD(node, bin.rhs), var->type);
+  return emit(c, base->kind == ND_MUL ? VEC_MULI : node->kind == base->kind ? VEC_ADDI : VEC_SUBI,
+              lhs, rhs);
+}
+
+static void add_result(struct vec_loop *loop, int slot, int col, type_kind type, node_kind op) {
+  for (int i = 0; i < loop->nresults; ++i) {
+    if (loop->results[i].slot == slot) {
+      loop->results[i].col = col;
+      return;
+    }
+  }
+  loop->results = grow(loop->results, loop->nresults, sizeof(struct vec_result));
+  loop->results[loop->nresults++] = (struct vec_result){ slot, col, type, op };
+}
+
+static bool compile_stmt(struct vec_compiler *c, struct node *node) {
+  struct vec_loop *loop = c->loop;
+  switch (node->kind) {
+    case ND_BLOCK:
+      for (struct node *stmt = OPT_CHILD(node, block.body); stmt; stmt = OPT_CHILD(stmt, next)) {
+        if (!compile_stmt(c, stmt)) {
+          return false;
+        }
+      }
+      return true;
+    case ND_PRINT: {
+      struct node *rhs = CHILD(node, bin.rhs);
+      int col = node->type == rhs->type ? compile_expr(c, rhs, rhs->type) : -1;
+      if (col < 0) {
+        return false;
+      }
+      loop->prints = grow(loop->prints, loop->nprints, sizeof(struct vec_print));
+      loop->prints[loop->nprints++] = (struct vec_print){ col, rhs->type };
+      return true;
+    }
+    default: {
+      struct node *var = CHILD(node, bin.lhs);
+      int slot = var->var.slot;
+      if (c->written[slot] == WR_REDUCE) {
+        struct node *base = reduction_base(node);
+        int col = compile_reduction(c, CHILD(node, bin.rhs), base, var);
+        add_result(loop, slot, col, var->type, base->kind);
+        return col >= 0;
+      }
+      struct node *rhs = CHILD(node, bin.rhs);
+      if (var->type == TY_INT && rhs->type != TY_INT) {
+        return false;
+      }
+      int col = c->cols[slot] = compile_expr(c, rhs, var->type);
+      add_result(loop, slot, col, var->type, ND_ASSIGN);
+      return col >= 0;
+    }
+  }
+}
+
+// The end of the range is evaluated once, so it may not read what the body
+// assigns
+static bool is_invariant(struct vec_compiler *c, struct node *node) {
+  switch (node->kind) {
+    case ND_NUM:
+      return true;
+    case ND_VAR:
+      return node->var.slot != c->loop->var && c->written[node->var.slot] == WR_NONE;
+    case ND_ASSIGN:
+    case ND_FOR:
+    case ND_IF:
+    case ND_PRINT:
+    case ND_BLOCK:
+      return false;
+    default:
+      return (!node->bin.lhs || is_invariant(c, CHILD(node, bin.lhs))) &&
+             (!node->bin.rhs || is_invariant(c, CHILD(node, bin.rhs)));
+  }
+}
+
+void vec_free(struct vec_loop *loop) {
+  if (!loop) {
+    return;
+  }
+  free(loop->ops);
+  free(loop->inputs);
+  free(loop->results);
+  free(loop->prints);
+  free(loop);
+}
+
+void vec_init(bool on) {
+  enabled = on;
+}
+
+struct vec_loop *vec_analyze(struct node *loop) {
+  if (!enabled || !is_range_loop(loop)) {
+    return NULL;
+  }
+  struct vec_compiler c = {};
+  c.loop = calloc(1, sizeof(struct vec_loop));
+  c.written = calloc(frame.nslots ? frame.nslots : 1, sizeof(uint8_t));
+  c.cols = malloc((frame.nslots ? frame.nslots : 1) * sizeof(int));
+  if (!c.loop || !c.written || !c.cols) {
+    panic("Error: %s\n", strerror(errno));
+  }
+  for (int i = 0; i < frame.nslots; ++i) {
+    c.cols[i] = -1;
+  }
+  c.loop->var = CHILD(CHILD(loop, loop.init), bin.lhs)->var.slot;
+  c.loop->end = CHILD(CHILD(loop, loop.cond), bin.rhs);
+  c.loop->ncolumns = 1;
+
+  struct node *body = CHILD(loop, loop.body);
+  if (!mark_written(&c, body) || !is_invariant(&c, c.loop->end) || !compile_stmt(&c, body)) {
+    vec_free(c.loop);
+    c.loop = NULL;
+  }
+  free(c.written);
+  free(c.cols);
+  return c.loop;
+}
+
+/*
+ * execution
+ */
+
+// Columns of the loops run by the thread, kept from one loop to the next
+static _Thread_local union column *columns;
+static _Thread_local int ncolumns;
+
+// Operations on all iterations of a block. Lanes of 64-bit integer
+// products, compares and conversions have no instructions on plain x86-64,
+// so those are left as loops for the compiler to vectorize where it can.
+#define VEC_LOOP(scalar)                            \
+  for (int k = 0; k < n; ++k) {                     \
+    scalar;                                         \
+  }                                                 \
+  break
+
+#if VEC_SIMD
+#define VEC_KERNEL(vector, scalar)                  \
+  for (int k = 0; k < n / VEC_LANES; ++k) {         \
+    vector;                                         \
+  }                                                 \
+  break
+#else
+#define VEC_KERNEL(vector, scalar) VEC_LOOP(scalar)
+#endif
+
+// Runs `op` on the first `n` iterations of the block, a multiple of the
+// number of lanes
+static void run_op(struct vec_op *op, int n) {
+  union column *d = &columns[op->dst], *l = &columns[op->lhs], *r = &columns[op->rhs];
+  switch (op->kind) {
+    case VEC_ADDI:
+      VEC_KERNEL(d->vunum[k] = l->vunum[k] + r->vunum[k],
+                 d->num[k] = WRAP(l->num[k], +, r->num[k]));
+    case VEC_SUBI:
+      VEC_KERNEL(d->vunum[k] = l->vunum[k] - r->vunum[k],
+                 d->num[k] = WRAP(l->num[k], -, r->num[k]));
+    case VEC_MULI:
+      VEC_LOOP(d->num[k] = WRAP(l->num[k], *, r->num[k]));
+    case VEC_DIVI:
+      // Divisors are nonzero constants
+      VEC_LOOP(d->num[k] = r->num[k] == -1 ? WRAP(0, -, l->num[k]) : l->num[k] / r->num[k]);
+    case VEC_LTI:
+      VEC_LOOP(d->num[k] = l->num[k] < r->num[k]);
+    case VEC_LTEI:
+      VEC_LOOP(d->num[k] = l->num[k] <= r->num[k]);
+    case VEC_EQI:
+      VEC_LOOP(d->num[k] = l->num[k] == r->num[k]);
+    case VEC_NEQI:
+      VEC_LOOP(d->num[k] = l->num[k] != r->num[k]);
+    case VEC_NEGI:
+      VEC_KERNEL(d->vunum[k] = -l->vunum[k], d->num[k] = WRAP(0, -, l->num[k]));
+    case VEC_ADDF:
+      VEC_KERNEL(d->vfnum[k] = l->vfnum[k] + r->vfnum[k], d->fnum[k] = l->fnum[k] + r->fnum[k]);
+    case VEC_SUBF:
+      VEC_KERNEL(d->vfnum[k] = l->vfnum[k] - r->vfnum[k], d->fnum[k] = l->fnum[k] - r->fnum[k]);
+    case VEC_MULF:
+      VEC_KERNEL(d->vfnum[k] = l->vfnum[k] * r->vfnum[k], d->fnum[k] = l->fnum[k] * r->fnum[k]);
+    case VEC_DIVF:
+      VEC_KERNEL(d->vfnum[k] = l->vfnum[k] / r->vfnum[k], d->fnum[k] = l->fnum[k] / r->fnum[k]);
+    case VEC_LTF:
+      VEC_LOOP(d->num[k] = l->fnum[k] < r->fnum[k]);
+    case VEC_LTEF:
+      VEC_LOOP(d->num[k] = l->fnum[k] <= r->fnum[k]);
+    case VEC_EQF:
+      VEC_LOOP(d->num[k] = l->fnum[k] == r->fnum[k]);
+    case VEC_NEQF:
+      VEC_LOOP(d->num[k] = l->fnum[k] != r->fnum[k]);
+    case VEC_NEGF:
+      VEC_KERNEL(d->vfnum[k] = -l->vfnum[k], d->fnum[k] = -l->fnum[k]);
+    case VEC_I2F:
+      VEC_LOOP(d->fnum[k] = l->num[k]);
+  }
+}
+
+// Folds the first `n` iterations of `result` into its variable in order, as
+// the scalar code would
+static void fold(struct vec_result *result, int n) {
+  union column *col = &columns[result->col];
+  union actual_value *value = &frame.values[result->slot].val;
+  if (result->type == TY_INT) {
+    // Integers can be summed in any order, floats can not
+    uint64_t acc = result->op == ND_MUL;
+    if (result->op == ND_MUL) {
+      for (int k = 0; k < n; ++k) {
+        acc *= col->num[k];
+      }
+    } else {
+      for (int k = 0; k < n; ++k) {
+        acc += col->num[k];
+      }
+    }
+    value->num = result->op == ND_ADD ? WRAP(value->num, +, acc)
+               : result->op == ND_SUB ? WRAP(value->num, -, acc)
+                                      : WRAP(value->num, *, acc);
+    return;
+  }
+  double acc = value->fnum;
+  switch (result->op) {
+    case ND_ADD:
+      for (int k = 0; k < n; ++k) {
+        acc += col->fnum[k];
+      }
+      break;
+    case ND_SUB:
+      for (int k = 0; k < n; ++k) {
+        acc -= col->fnum[k];
+      }
+      break;
+    default:
+      for (int k = 0; k < n; ++k) {
+        acc *= col->fnum[k];
+      }
+      break;
+  }
+  value->fnum = acc;
+}
+
+bool vec_execute(struct vec_loop *loop) {
+  int64_t start = frame.values[loop->var].val.num;
+  int64_t end = eval_int(loop->end);
+  if (end <= start || (uint64_t)end - (uint64_t)start < VEC_MIN_TRIP) {
+    return false;
+  }
+  uint64_t trip = (uint64_t)end - (uint64_t)start;
+  if (ncolumns < loop->ncolumns) {
+    free(columns);
+    columns = aligned_alloc(_Alignof(union column), loop->ncolumns * sizeof(union column));
+    if (!columns) {
+      panic("Error: %s\n", strerror(errno));
+    }
+    ncolumns = loop->ncolumns;
+  }
+  for (int i = 0; i < loop->ninputs; ++i) {
+    struct vec_input *input = &loop->inputs[i];
+    union actual_value val = input->slot < 0 ? input->val : frame.values[input->slot].val;
+    union column *col = &columns[input->col];
+    for (int k = 0; k < VEC_BLOCK; ++k) {
+      if (input->type == TY_INT) {
+        col->num[k] = val.num;
+      } else {
+        col->fnum[k] = val.fnum;
+      }
+    }
+  }
+
+  int n = 0;
+  for (uint64_t done = 0; done < trip; done += n) {
+    n = trip - done < VEC_BLOCK ? trip - done : VEC_BLOCK;
+    int lanes = (n + VEC_LANES - 1) / VEC_LANES * VEC_LANES;
+    for (int k = 0; k < lanes; ++k) {
+      columns[0].num[k] = (int64_t)((uint64_t)start + done + k);
+    }
+    for (int i = 0; i < loop->nops; ++i) {
+      run_op(&loop->ops[i], lanes);
+    }
+    for (int i = 0; i < loop->nresults; ++i) {
+      if (loop->results[i].op != ND_ASSIGN) {
+        fold(&loop->results[i], n);
+      }
+    }
+    for (int k = 0; k < n && loop->nprints; ++k) {
+      for (int i = 0; i < loop->nprints; ++i) {
+        union column *col = &columns[loop->prints[i].col];
+        if (loop->prints[i].type == TY_INT) {
+          output_int(col->num[k]);
+        } else {
+          output_float(col->fnum[k]);
+        }
+      }
+    }
+  }
+
+  // Variables are left as the last iteration left them
+  for (int i = 0; i < loop->nresults; ++i) {
+    struct vec_result *result = &loop->results[i];
+    if (result->op == ND_ASSIGN) {
+      frame.values[result->slot].val = result->type == TY_INT
+        ? (union actual_value){ .num = columns[result->col].num[n - 1] }
+        : (union actual_value){ .fnum = columns[result->col].fnum[n - 1] };
+    }
+  }
+  frame.values[loop->var].val.num = end;
+  return true;
+}
+
+// Runs range loop `loop`, whose variable was just initialized, a block of
+// iterations at a time if it can be. Like threads, this is only looked into
+// for loops which run long enough to make up for the analysis.
+bool vec_execute_node(struct node *loop) {
+  // The flag may be set by several threads running the same loop at once
+  if (!enabled || (__atomic_load_n(&loop->flags, __ATOMIC_RELAXED) & NODE_NO_VEC) ||
+      !is_range_loop(loop)) {
+    return false;
+  }
+  struct node *end = CHILD(CHILD(loop, loop.cond), bin.rhs);
+  if (has_assign(end)) {
+    return false;
+  }
+  int64_t start = frame.values[CHILD(CHILD(loop, loop.init), bin.lhs)->var.slot].val.num;
+  int64_t stop = eval_int(end);
+  if (stop <= start || (uint64_t)stop - (uint64_t)start < VEC_MIN_TRIP) {
+    return false;
+  }
+  struct vec_loop *plan = vec_analyze(loop);
+  if (!plan) {
+    __atomic_fetch_or(&loop->flags, NODE_NO_VEC, __ATOMIC_RELAXED);
+    return false;
+  }
+  bool done = vec_execute(plan);
+  vec_free(plan);
+  return done;
+}
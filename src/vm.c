@@ -0,0 +1,192 @@
+#include "zapp.h"
+
+// Use computed goto dispatch when the compiler supports labels as values,
+// otherwise fall back to a plain switch inside of a loop.
+#if defined(__GNUC__) || defined(__clang__)
+#define VM_COMPUTED_GOTO 1
+#else
+#define VM_COMPUTED_GOTO 0
+#endif
+
+#if VM_COMPUTED_GOTO
+#define VM_SWITCH() VM_DISPATCH();
+#define VM_CASE(op) lbl_##op:
+#define VM_DISPATCH() goto *dispatch_table[pc->op]
+#define VM_END()
+#else
+#define VM_SWITCH() for (;;) switch (pc->op) {
+#define VM_CASE(op) case op:
+#define VM_DISPATCH() continue
+#define VM_END() }
+#endif
+
+// Reads operands of type `type` from field `in` and stores result to `out`
+#define VM_BINARY(op, type, in, out, expr)              \
+  VM_CASE(op) {                                         \
+    type lhs = r[pc->b].in, rhs = r[pc->c].in;          \
+    r[pc->a].out = (expr);                              \
+    ++pc;                                               \
+    VM_DISPATCH();                                      \
+  }
+
+static void copy_frame(union actual_value *r, int nvars, bool in) {
+  for (int i = 0; i < nvars; ++i) {
+    if (in) {
+      r[i] = frame.values[i].val;
+    } else {
+      frame.values[i].val = r[i];
+    }
+  }
+}
+
+void vm_execute(struct chunk *chunk) {
+  vm_execute_regs(chunk, chunk->regs);
+}
+
+// Runs `chunk` on registers `r`, a copy of the registers of the chunk, so a
+// chunk can run on several threads at once
+void vm_execute_regs(struct chunk *chunk, union actual_value *r) {
+  struct instr *pc = chunk->code;
+
+  // Variable registers mirror the frame for the duration of the run
+  copy_frame(r, chunk->nvars, true);
+
+#if VM_COMPUTED_GOTO
+  static void *dispatch_table[] = {
+    [OP_HALT] = &&lbl_OP_HALT,
+    [OP_MOVE] = &&lbl_OP_MOVE,
+    [OP_LOADK] = &&lbl_OP_LOADK,
+    [OP_I2F] = &&lbl_OP_I2F,
+    [OP_F2I] = &&lbl_OP_F2I,
+    [OP_TESTF] = &&lbl_OP_TESTF,
+    [OP_ADDI] = &&lbl_OP_ADDI,
+    [OP_SUBI] = &&lbl_OP_SUBI,
+    [OP_MULI] = &&lbl_OP_MULI,
+    [OP_DIVI] = &&lbl_OP_DIVI,
+    [OP_LTI] = &&lbl_OP_LTI,
+    [OP_LTEI] = &&lbl_OP_LTEI,
+    [OP_EQI] = &&lbl_OP_EQI,
+    [OP_NEQI] = &&lbl_OP_NEQI,
+    [OP_NEGI] = &&lbl_OP_NEGI,
+    [OP_ADDF] = &&lbl_OP_ADDF,
+    [OP_SUBF] = &&lbl_OP_SUBF,
+    [OP_MULF] = &&lbl_OP_MULF,
+    [OP_DIVF] = &&lbl_OP_DIVF,
+    [OP_LTF] = &&lbl_OP_LTF,
+    [OP_LTEF] = &&lbl_OP_LTEF,
+    [OP_EQF] = &&lbl_OP_EQF,
+    [OP_NEQF] = &&lbl_OP_NEQF,
+    [OP_NEGF] = &&lbl_OP_NEGF,
+    [OP_JMP] = &&lbl_OP_JMP,
+    [OP_JMPF] = &&lbl_OP_JMPF,
+    [OP_JMPT] = &&lbl_OP_JMPT,
+    [OP_JLTI] = &&lbl_OP_JLTI,
+    [OP_JLTF] = &&lbl_OP_JLTF,
+    [OP_PRINTI] = &&lbl_OP_PRINTI,
+    [OP_PRINTF] = &&lbl_OP_PRINTF,
+    [OP_PFOR] = &&lbl_OP_PFOR,
+    [OP_VFOR] = &&lbl_OP_VFOR
+  };
+#endif
+
+  VM_SWITCH()
+    VM_CASE(OP_HALT)
+      copy_frame(r, chunk->nvars, false);
+      return;
+    VM_CASE(OP_MOVE)
+      r[pc->a] = r[pc->b];
+      ++pc;
+      VM_DISPATCH();
+    VM_CASE(OP_LOADK)
+      r[pc->a] = chunk->consts[pc->target];
+      ++pc;
+      VM_DISPATCH();
+    VM_CASE(OP_I2F)
+      r[pc->a].fnum = r[pc->b].num;
+      ++pc;
+      VM_DISPATCH();
+    VM_CASE(OP_F2I)
+      r[pc->a].num = r[pc->b].fnum;
+      ++pc;
+      VM_DISPATCH();
+    VM_CASE(OP_TESTF)
+      r[pc->a].num = r[pc->b].fnum != 0;
+      ++pc;
+      VM_DISPATCH();
+    VM_BINARY(OP_ADDI, int64_t, num, num, WRAP(lhs, +, rhs))
+    VM_BINARY(OP_SUBI, int64_t, num, num, WRAP(lhs, -, rhs))
+    VM_BINARY(OP_MULI, int64_t, num, num, WRAP(lhs, *, rhs))
+    VM_CASE(OP_DIVI) {
+      int64_t lhs = r[pc->b].num, rhs = r[pc->c].num;
+      if (rhs == 0) {
+        copy_frame(r, chunk->nvars, false);
+        panic("Error: division by zero\n");
+      }
+      r[pc->a].num = rhs == -1 ? WRAP(0, -, lhs) : lhs / rhs;
+      ++pc;
+      VM_DISPATCH();
+    }
+    VM_BINARY(OP_LTI, int64_t, num, num, lhs < rhs)
+    VM_BINARY(OP_LTEI, int64_t, num, num, lhs <= rhs)
+    VM_BINARY(OP_EQI, int64_t, num, num, lhs == rhs)
+    VM_BINARY(OP_NEQI, int64_t, num, num, lhs != rhs)
+    VM_CASE(OP_NEGI)
+      r[pc->a].num = WRAP(0, -, r[pc->b].num);
+      ++pc;
+      VM_DISPATCH();
+    VM_BINARY(OP_ADDF, double, fnum, fnum, lhs + rhs)
+    VM_BINARY(OP_SUBF, double, fnum, fnum, lhs - rhs)
+    VM_BINARY(OP_MULF, double, fnum, fnum, lhs * rhs)
+    VM_BINARY(OP_DIVF, double, fnum, fnum, lhs / rhs)
+    VM_BINARY(OP_LTF, double, fnum, num, lhs < rhs)
+    VM_BINARY(OP_LTEF, double, fnum, num, lhs <= rhs)
+    VM_BINARY(OP_EQF, double, fnum, num, lhs == rhs)
+    VM_BINARY(OP_NEQF, double, fnum, num, lhs != rhs)
+    VM_CASE(OP_NEGF)
+      r[pc->a].fnum = -r[pc->b].fnum;
+      ++pc;
+      VM_DISPATCH();
+    VM_CASE(OP_JMP)
+      pc = &chunk->code[pc->target];
+      VM_DISPATCH();
+    VM_CASE(OP_JMPF)
+      pc = r[pc->a].num == 0 ? &chunk->code[pc->target] : pc + 1;
+      VM_DISPATCH();
+    VM_CASE(OP_JMPT)
+      pc = r[pc->a].num != 0 ? &chunk->code[pc->target] : pc + 1;
+      VM_DISPATCH();
+    VM_CASE(OP_JLTI)
+      pc = r[pc->a].num < r[pc->b].num ? pc + 1 + (int16_t)pc->c : pc + 1;
+      VM_DISPATCH();
+    VM_CASE(OP_JLTF)
+      pc = r[pc->a].fnum < r[pc->b].fnum ? pc + 1 + (int16_t)pc->c : pc + 1;
+      VM_DISPATCH();
+    VM_CASE(OP_PRINTI)
+      output_int(r[pc->a].num);
+      ++pc;
+      VM_DISPATCH();
+    VM_CASE(OP_PRINTF)
+      output_float(r[pc->a].fnum);
+      ++pc;
+      VM_DISPATCH();
+    VM_CASE(OP_PFOR)
+      // Threads see variables in the frame
+      copy_frame(r, chunk->nvars, false);
+      if (par_execute(chunk->loops[pc->a])) {
+        copy_frame(r, chunk->nvars, true);
+        pc = &chunk->code[pc->target];
+      } else {
+        ++pc;
+      }
+      VM_DISPATCH();
+    VM_CASE(OP_VFOR)
+      copy_frame(r, chunk->nvars, false);
+      if (vec_execute(chunk->vec_loops[pc->a])) {
+        copy_frame(r, chunk->nvars, true);
+        pc = &chunk->code[pc->target];
+      } else {
+        ++pc;
+      }
+      VM_DISPATCH();
+  VM_END()
+}
@@ -8,7 +8,7 @@ void test_basic_assign() {
 
   tokenizer_init(&tokenizer, "a");
   prog = parse(&tokenizer);
-  ASSERT_EQ(123, eval_node(prog->body));
+  ASSERT_EQ(123, eval_node(CHILD(prog, block.body)));
 }
 
 void test_assign_sum_of_values() {
@@ -19,7 +19,7 @@ void test_assign_sum_of_values() {
 
   tokenizer_init(&tokenizer, "c");
   prog = parse(&tokenizer);
-  ASSERT_EQ(9, eval_node(prog->body));
+  ASSERT_EQ(9, eval_node(CHILD(prog, block.body)));
 }
 
 void test_assign_expression() {
@@ -30,7 +30,7 @@ void test_assign_expression() {
 
   tokenizer_init(&tokenizer, "a");
   prog = parse(&tokenizer);
-  ASSERT_EQ(6, eval_node(prog->body));
+  ASSERT_EQ(6, eval_node(CHILD(prog, block.body)));
 }
 
 void test_braces_assignment() {
@@ -41,7 +41,49 @@ void test_braces_assignment() {
 
   tokenizer_init(&tokenizer, "a");
   prog = parse(&tokenizer);
-  ASSERT_EQ(4, eval_node(prog->body));
+  ASSERT_EQ(4, eval_node(CHILD(prog, block.body)));
+}
+
+// Statements parsed one at a time see variables assigned by the ones
+// executed before them, and all of them reuse the same nodes
+void test_parse_next() {
+  struct tokenizer tokenizer;
+  tokenizer_init(&tokenizer, "p = 1\nfor i in 0..3 { p = p * 2 }\nq = p + 0.5\nr = q");
+  struct node *stmt;
+  int count = 0;
+  while ((stmt = parse_next(&tokenizer))) {
+    ASSERT_EQ(default_context()->stream->nodes, stmt);
+    execute_node(stmt);
+    ++count;
+  }
+  ASSERT_EQ(4, count);
+
+  tokenizer_init(&tokenizer, "r");
+  struct node *prog = parse(&tokenizer);
+  ASSERT_EQ(TY_FLOAT, CHILD(prog, block.body)->type);
+  ASSERT_EQ(8.5, eval_node(CHILD(prog, block.body)));
+}
+
+// A statement runs with the types variables have when it is parsed, so an
+// integer division stays one even if a later statement makes a float of its
+// operand, unlike in a program parsed as a whole
+void test_parse_next_types() {
+  struct tokenizer tokenizer;
+  tokenizer_init(&tokenizer, "sa = 9\nsx = sa / 2\nsa = 0.5\nsy = sx * 2");
+  struct node *stmt;
+  while ((stmt = parse_next(&tokenizer))) {
+    execute_node(stmt);
+  }
+  tokenizer_init(&tokenizer, "pa = 9\npx = pa / 2\npa = 0.5\npy = px * 2");
+  execute_node(parse(&tokenizer));
+
+  tokenizer_init(&tokenizer, "sy\npy");
+  struct node *prog = parse(&tokenizer);
+  struct node *streamed = CHILD(prog, block.body);
+  ASSERT_EQ(TY_INT, streamed->type);
+  ASSERT_EQ(8, eval_node(streamed));
+  ASSERT_EQ(TY_FLOAT, CHILD(streamed, next)->type);
+  ASSERT_EQ(9, eval_node(CHILD(streamed, next)));
 }
 
 int main() {
@@ -49,5 +91,7 @@ int main() {
   test_assign_sum_of_values();
   test_assign_expression();
   test_braces_assignment();
+  test_parse_next();
+  test_parse_next_types();
   return 0;
 }
@@ -0,0 +1,68 @@
+#include <unistd.h>
+
+#include "test.h"
+
+static char *read_all(const char *fname, size_t *len) {
+  FILE *fp = fopen(fname, "rb");
+  ASSERT_NEQ(NULL, fp);
+  fseek(fp, 0, SEEK_END);
+  *len = ftell(fp);
+  rewind(fp);
+  char *buf = malloc(*len + 1);
+  ASSERT_EQ(*len, fread(buf, 1, *len, fp));
+  buf[*len] = '\0';
+  fclose(fp);
+  return buf;
+}
+
+// Files compiled concurrently come out the same as when compiled one at a
+// time, none of them sees variables of the others
+void test_compile_batch() {
+  char *srcs[] = {
+    "a = 1\nfor i in 0..10 { a = a * 2 }\nprint a",
+    "x = 0.5\ny = x * 3\nprint y",
+    "a = 7\nif (a > 3) { b = a - 3 } else { b = 0 }\nprint b",
+  };
+  int n = sizeof(srcs) / sizeof(*srcs);
+  char *fnames[n];
+  for (int i = 0; i < n; ++i) {
+    char name[] = "/tmp/zapp_batchXXXXXX.zapp";
+    int fd = mkstemps(name, 5);
+    ASSERT_NEQ(-1, fd);
+    ASSERT_EQ(strlen(srcs[i]), write(fd, srcs[i], strlen(srcs[i])));
+    close(fd);
+    fnames[i] = strdup(name);
+  }
+
+  compile_batch(fnames, n, n, false);
+
+  for (int i = 0; i < n; ++i) {
+    struct context ctx;
+    context_init(&ctx);
+    struct tokenizer tokenizer;
+    tokenizer_init_ctx(&tokenizer, srcs[i], &ctx);
+    size_t expected_len;
+    char *expected = c_codegen_str(parse(&tokenizer), &expected_len);
+    context_destroy(&ctx);
+    frame_destroy();
+
+    char *out_name = strdup(fnames[i]);
+    strcpy(out_name + strlen(out_name) - strlen(".zapp"), ".c");
+    size_t len;
+    char *code = read_all(out_name, &len);
+    ASSERT_EQ(expected_len, len);
+    ASSERT_EQ(0, memcmp(expected, code, len));
+
+    unlink(fnames[i]);
+    unlink(out_name);
+    free(expected);
+    free(code);
+    free(out_name);
+    free(fnames[i]);
+  }
+}
+
+int main() {
+  test_compile_batch();
+  return 0;
+}
@@ -0,0 +1,83 @@
+#include "test.h"
+
+static void run_vm(struct node *prog) {
+  vm_execute(bc_compile(prog));
+}
+
+static double run_both(char *src, char *var) {
+  return run_both_with(src, var, run_vm);
+}
+
+void test_vm_assign_expression() {
+  ASSERT_EQ(6, run_both("a = 2 + 2 * 2", "a"));
+  ASSERT_EQ(-4, run_both("b = 1 - -2 * -2 - 1", "b"));
+}
+
+void test_vm_for_loop() {
+  ASSERT_EQ(45, run_both("sum = 0\nfor i in 0..10 { sum = sum + i }", "sum"));
+  ASSERT_EQ(10, run_both("n = 0\nfor i in 0..5 { for j in 0..i { n = n + 1 } }", "n"));
+}
+
+void test_vm_if_else() {
+  ASSERT_EQ(2, run_both("c = 0\nif (c != 0) { c = 1 } else { c = 2 }", "c"));
+  ASSERT_EQ(3, run_both("d = 0\nfor i in 0..10 { if (i < 3) { d = d + 1 } }", "d"));
+}
+
+void test_vm_nested_assign() {
+  ASSERT_EQ(8, run_both("e = 3\nf = e + (e = 5)", "f"));
+  ASSERT_EQ(5, run_both("g = h = 5", "h"));
+}
+
+void test_vm_int_and_float() {
+  ASSERT_EQ(3, run_both("k = 7 / 2", "k"));
+  ASSERT_EQ(3.5, run_both("l = 7 / 2.0", "l"));
+  ASSERT_EQ(2.5, run_both("m = 1\nm = m + 1.5", "m"));
+  ASSERT_EQ(1, run_both("n2 = 0.5 < 1", "n2"));
+}
+
+void test_vm_int64() {
+  run_both("big = 3037000499 * 3037000499", "big");
+  ASSERT_EQ(9223372030926249001, frame.values[slot_of("big")].val.num);
+  run_both("w = 9223372036854775807 + 1", "w");
+  ASSERT_EQ(INT64_MIN, frame.values[slot_of("w")].val.num);
+}
+
+// Constants which do not fit into the 16-bit register operands are loaded
+// from the constant table by OP_LOADK instead
+void test_vm_many_constants() {
+  enum { NCONSTS = 70000 };
+  char *src = malloc(NCONSTS * 32);
+  size_t len = sprintf(src, "kc = 0\nkf = 0.5\n");
+  int64_t sum = 0;
+  for (int i = 0; i < NCONSTS; ++i) {
+    len += sprintf(src + len, "kc = kc + %d\n", 100000 + i);
+    sum += 100000 + i;
+  }
+  sprintf(src + len, "kf = kf + 0.25\n");
+
+  struct tokenizer tokenizer;
+  tokenizer_init(&tokenizer, src);
+  struct chunk *chunk = bc_compile(parse(&tokenizer));
+  ASSERT_GT(chunk->nconsts, chunk->nkregs);
+  int nloads = 0;
+  for (int i = 0; i < chunk->ncode; ++i) {
+    nloads += chunk->code[i].op == OP_LOADK;
+  }
+  ASSERT_GT(nloads, 0);
+  bc_free(chunk);
+
+  ASSERT_EQ(sum, run_both(src, "kc"));
+  ASSERT_EQ(0.75, run_both(src, "kf"));
+  free(src);
+}
+
+int main() {
+  test_vm_assign_expression();
+  test_vm_for_loop();
+  test_vm_if_else();
+  test_vm_nested_assign();
+  test_vm_int_and_float();
+  test_vm_int64();
+  test_vm_many_constants();
+  return 0;
+}
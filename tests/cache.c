@@ -0,0 +1,222 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "test.h"
+
+static const char *src =
+  "a = 1\n"
+  "x = 0.5\n"
+  "for i in 0..10 { a = a * 2 x = x + a }\n"
+  "print x\n";
+
+static struct node *parse_src(struct context *ctx) {
+  struct tokenizer tokenizer;
+  tokenizer_init_ctx(&tokenizer, strdup(src), ctx);
+  return parse(&tokenizer);
+}
+
+// Path of the only file in `dir`
+static void cache_file(const char *dir, char *path, size_t size) {
+  DIR *d = opendir(dir);
+  ASSERT_NEQ(NULL, d);
+  struct dirent *ent;
+  int nfiles = 0;
+  while ((ent = readdir(d))) {
+    if (ent->d_name[0] != '.') {
+      snprintf(path, size, "%s/%s", dir, ent->d_name);
+      ++nfiles;
+    }
+  }
+  closedir(d);
+  ASSERT_EQ(1, nfiles);
+}
+
+// Program loaded from the cache compiles to the same code as the parsed
+// one, with the same variables in the same slots
+void test_cache_roundtrip() {
+  char dir[] = "/tmp/zapp_cacheXXXXXX";
+  ASSERT_NEQ(NULL, mkdtemp(dir));
+  setenv("ZAPP_CACHE_DIR", dir, 1);
+
+  struct cache_key key;
+  cache_key_init(&key, src, strlen(src), 0);
+  struct context ctx;
+  context_init(&ctx);
+  struct node *prog = parse_src(&ctx);
+  size_t len;
+  char *expected = c_codegen_str(prog, &len);
+  int nslots = frame.nslots;
+  ASSERT_EQ(NULL, cache_load(&ctx, &key)); // frame is not empty
+  cache_store(&ctx, prog, &key);
+  context_destroy(&ctx);
+  frame_destroy();
+
+  context_init(&ctx);
+  prog = cache_load(&ctx, &key);
+  ASSERT_NEQ(NULL, prog);
+  ASSERT_EQ(nslots, frame.nslots);
+  ASSERT_EQ(TY_FLOAT, frame.values[1].kind);
+  ASSERT_EQ(0, strcmp("x", frame.names[1].name));
+  char *code = c_codegen_str(prog, &len);
+  ASSERT_EQ(0, strcmp(expected, code));
+  free(code);
+  context_destroy(&ctx);
+  frame_destroy();
+
+  // Other flags or another source are not found
+  struct cache_key other;
+  cache_key_init(&other, src, strlen(src), CACHE_OPTIMIZED);
+  context_init(&ctx);
+  ASSERT_EQ(NULL, cache_load(&ctx, &other));
+  cache_key_init(&other, src, strlen(src) - 1, 0);
+  ASSERT_EQ(NULL, cache_load(&ctx, &other));
+
+  // Neither is a truncated file
+  char path[512];
+  cache_file(dir, path, sizeof(path));
+  ASSERT_EQ(0, truncate(path, 100));
+  ASSERT_EQ(NULL, cache_load(&ctx, &key));
+  ASSERT_EQ(0, frame.nslots);
+  context_destroy(&ctx);
+
+  unlink(path);
+  rmdir(dir);
+  free(expected);
+}
+
+// Files written by another version or build of zapp are misses. Both are
+// stored right after the 8 byte magic.
+void test_cache_other_build() {
+  char dir[] = "/tmp/zapp_cacheXXXXXX";
+  ASSERT_NEQ(NULL, mkdtemp(dir));
+  setenv("ZAPP_CACHE_DIR", dir, 1);
+
+  struct cache_key key;
+  cache_key_init(&key, src, strlen(src), 0);
+  struct context ctx;
+  context_init(&ctx);
+  cache_store(&ctx, parse_src(&ctx), &key);
+  context_destroy(&ctx);
+  frame_destroy();
+
+  char path[512];
+  cache_file(dir, path, sizeof(path));
+  int fd = open(path, O_RDWR);
+  ASSERT_GE(fd, 0);
+  off_t offsets[] = { 8, 16 }; // version, build
+  for (size_t i = 0; i < sizeof(offsets) / sizeof(*offsets); ++i) {
+    uint32_t value, other;
+    ASSERT_EQ(sizeof(value), pread(fd, &value, sizeof(value), offsets[i]));
+    other = value + 1;
+    ASSERT_EQ(sizeof(other), pwrite(fd, &other, sizeof(other), offsets[i]));
+    context_init(&ctx);
+    ASSERT_EQ(NULL, cache_load(&ctx, &key));
+    ASSERT_EQ(0, frame.nslots);
+    context_destroy(&ctx);
+
+    ASSERT_EQ(sizeof(value), pwrite(fd, &value, sizeof(value), offsets[i]));
+    context_init(&ctx);
+    ASSERT_NEQ(NULL, cache_load(&ctx, &key));
+    context_destroy(&ctx);
+    frame_destroy();
+  }
+  close(fd);
+
+  unlink(path);
+  rmdir(dir);
+}
+
+// Writes `node` over node `idx` of the file, checks that the file is a
+// miss then and a hit again once the node is restored
+static void check_corrupt(int fd, off_t nodes, int idx, struct node node, struct cache_key *key) {
+  struct node saved;
+  off_t offset = nodes + idx * sizeof(struct node);
+  ASSERT_EQ(sizeof(saved), pread(fd, &saved, sizeof(saved), offset));
+  ASSERT_EQ(sizeof(node), pwrite(fd, &node, sizeof(node), offset));
+  struct context ctx;
+  context_init(&ctx);
+  ASSERT_EQ(NULL, cache_load(&ctx, key));
+  ASSERT_EQ(0, frame.nslots);
+  context_destroy(&ctx);
+
+  ASSERT_EQ(sizeof(saved), pwrite(fd, &saved, sizeof(saved), offset));
+  context_init(&ctx);
+  ASSERT_NEQ(NULL, cache_load(&ctx, key));
+  context_destroy(&ctx);
+  frame_destroy();
+}
+
+// Files whose nodes refer outside of the file or the frame are misses
+void test_cache_corrupt_nodes() {
+  char dir[] = "/tmp/zapp_cacheXXXXXX";
+  ASSERT_NEQ(NULL, mkdtemp(dir));
+  setenv("ZAPP_CACHE_DIR", dir, 1);
+
+  struct cache_key key;
+  cache_key_init(&key, src, strlen(src), 0);
+  struct context ctx;
+  context_init(&ctx);
+  struct node *prog = parse_src(&ctx);
+  int len = ctx.pools->len;
+  int root = prog - ctx.pools->nodes;
+  struct node *nodes = malloc(len * sizeof(struct node));
+  memcpy(nodes, ctx.pools->nodes, len * sizeof(struct node));
+  cache_store(&ctx, prog, &key);
+  context_destroy(&ctx);
+  frame_destroy();
+
+  // Nodes are stored as they are in the pool
+  char path[512];
+  cache_file(dir, path, sizeof(path));
+  int fd = open(path, O_RDWR);
+  ASSERT_GE(fd, 0);
+  struct stat st;
+  ASSERT_EQ(0, fstat(fd, &st));
+  char *file = malloc(st.st_size);
+  ASSERT_EQ(st.st_size, pread(fd, file, st.st_size, 0));
+  size_t size = len * sizeof(struct node);
+  off_t base = 0;
+  while (base + size <= (size_t)st.st_size && memcmp(file + base, nodes, size)) {
+    base += 8;
+  }
+  ASSERT_LE(base + size, (size_t)st.st_size);
+  free(file);
+
+  int var = 0, assign = 0;
+  for (int i = 0; i < len; ++i) {
+    var = nodes[i].kind == ND_VAR ? i : var;
+    assign = nodes[i].kind == ND_ASSIGN ? i : assign;
+  }
+  struct node node = nodes[var];
+  node.var.slot = 1000;
+  check_corrupt(fd, base, var, node, &key);
+  node = nodes[var];
+  node.kind = NNODE_KINDS;
+  check_corrupt(fd, base, var, node, &key);
+  node = nodes[root];
+  node.block.body = len;
+  check_corrupt(fd, base, root, node, &key);
+  node = nodes[assign];
+  node.bin.rhs = -assign - 1;
+  check_corrupt(fd, base, assign, node, &key);
+
+  // First statement followed by the block holding it
+  int first = root + nodes[root].block.body;
+  node = nodes[first];
+  node.next = root - first;
+  check_corrupt(fd, base, first, node, &key);
+  close(fd);
+
+  unlink(path);
+  rmdir(dir);
+  free(nodes);
+}
+
+int main() {
+  test_cache_roundtrip();
+  test_cache_other_build();
+  test_cache_corrupt_nodes();
+  return 0;
+}
@@ -8,7 +8,7 @@ void test_basic_if() {
 
   tokenizer_init(&tokenizer, "a");
   prog = parse(&tokenizer);
-  ASSERT_EQ(5, eval_node(prog->body));
+  ASSERT_EQ(5, eval_node(CHILD(prog, block.body)));
 }
 
 void test_basic_if_else() {
@@ -19,7 +19,7 @@ void test_basic_if_else() {
 
   tokenizer_init(&tokenizer, "a");
   prog = parse(&tokenizer);
-  ASSERT_EQ(2, eval_node(prog->body));
+  ASSERT_EQ(2, eval_node(CHILD(prog, block.body)));
 }
 
 int main() {
@@ -0,0 +1,84 @@
+#include "test.h"
+#include "../src/hash/hashtable.h"
+
+#define NKEYS 10000
+
+static char keys[NKEYS][16];
+
+void test_htable_push_get() {
+  struct hashtable ht;
+  htable_init(&ht, NULL, NULL);
+  for (int i = 0; i < NKEYS; ++i) {
+    htable_push(&ht, keys[i], strlen(keys[i]), (void *)(intptr_t)(i + 1));
+  }
+  ASSERT_EQ(NKEYS, ht.nentries);
+  for (int i = 0; i < NKEYS; ++i) {
+    ASSERT_EQ(i + 1, (intptr_t)htable_get(&ht, keys[i], strlen(keys[i])));
+  }
+  ASSERT_EQ(NULL, htable_get(&ht, "missing", 7));
+  // Prefix of a stored key is a different key
+  ASSERT_EQ(false, htable_contains(&ht, keys[1000], 3));
+}
+
+void test_htable_overwrite() {
+  struct hashtable ht;
+  htable_init(&ht, NULL, NULL);
+  htable_push(&ht, "abc", 3, (void *)1);
+  htable_push(&ht, "abc", 3, (void *)2);
+  ASSERT_EQ(1, ht.nentries);
+  ASSERT_EQ((void *)2, htable_get(&ht, "abc", 3));
+}
+
+void test_htable_remove() {
+  struct hashtable ht;
+  htable_init(&ht, NULL, NULL);
+  // Removing and re-adding keys many times leaves lots of tombstones, which
+  // must be cleaned up without growing the table forever
+  for (int round = 0; round < 20; ++round) {
+    for (int i = 0; i < NKEYS; ++i) {
+      htable_push(&ht, keys[i], strlen(keys[i]), NULL);
+    }
+    for (int i = 0; i < NKEYS; i += 2) {
+      htable_remove(&ht, keys[i], strlen(keys[i]));
+    }
+    for (int i = 0; i < NKEYS; ++i) {
+      ASSERT_EQ(i % 2 == 1, htable_contains(&ht, keys[i], strlen(keys[i])));
+    }
+  }
+  ASSERT_EQ(NKEYS / 2, ht.nentries);
+  ASSERT_LE(ht.nbuckets, 4 * NKEYS);
+}
+
+void test_htable_stats() {
+  struct hashtable ht;
+  htable_init(&ht, NULL, NULL);
+  struct hashtable_stats stats;
+  htable_stats(&ht, &stats);
+  ASSERT_EQ(0, stats.nentries);
+  ASSERT_EQ(0, stats.longest_probe);
+  ASSERT_EQ(0, stats.nrehashes);
+
+  for (int i = 0; i < NKEYS; ++i) {
+    htable_push(&ht, keys[i], strlen(keys[i]), NULL);
+  }
+  htable_remove(&ht, keys[0], strlen(keys[0]));
+  htable_stats(&ht, &stats);
+  ASSERT_EQ(NKEYS - 1, stats.nentries);
+  ASSERT_EQ(1, stats.ndeleted);
+  ASSERT_EQ(ht.nbuckets, stats.nbuckets);
+  // Table doubles from HASHTABLE_INITSIZE until NKEYS fit
+  ASSERT_LE(9, stats.nrehashes);
+  ASSERT_LE(1, stats.longest_probe);
+  ASSERT_LE(stats.longest_probe, stats.nbuckets / HASHTABLE_GROUP_WIDTH);
+}
+
+int main() {
+  for (int i = 0; i < NKEYS; ++i) {
+    snprintf(keys[i], sizeof(keys[i]), "var%d", i);
+  }
+  test_htable_push_get();
+  test_htable_overwrite();
+  test_htable_remove();
+  test_htable_stats();
+  return 0;
+}
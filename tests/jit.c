@@ -0,0 +1,46 @@
+#include "test.h"
+
+static void run_jit(struct node *prog) {
+  struct jit_code *code = jit_compile(prog);
+  jit_execute(code);
+  jit_free(code);
+}
+
+static double run_both(char *src, char *var) {
+  return run_both_with(src, var, run_jit);
+}
+
+void test_jit_arithmetic() {
+  ASSERT_EQ(6, run_both("a = 2 + 2 * 2", "a"));
+  ASSERT_EQ(-4, run_both("b = 1 - -2 * -2 - 1", "b"));
+  ASSERT_EQ(-3, run_both("c = 7\nc = (0 - c) / 2", "c"));
+  ASSERT_EQ(8, run_both("e = 3\nf = e + (e = 5)", "f"));
+}
+
+void test_jit_loops() {
+  ASSERT_EQ(45, run_both("sum = 0\nfor i in 0..10 { sum = sum + i }", "sum"));
+  ASSERT_EQ(10, run_both("n = 0\nfor i in 0..5 { for j in 0..i { n = n + 1 } }", "n"));
+  ASSERT_EQ(3, run_both("d = 0\nfor i in 0..10 { if (i < 3) { d = d + 1 } }", "d"));
+}
+
+void test_jit_float() {
+  ASSERT_EQ(3.5, run_both("l = 7 / 2.0", "l"));
+  ASSERT_EQ(2.5, run_both("m = 1\nm = m + 1.5", "m"));
+  ASSERT_EQ(1, run_both("o = 0.5 < 1", "o"));
+  ASSERT_EQ(2, run_both("p = 0.0\nq = 0\nif (p) { q = 1 } else { q = 2 }", "q"));
+}
+
+void test_jit_int64() {
+  run_both("w = 9223372036854775807 + 1", "w");
+  ASSERT_EQ(INT64_MIN, frame.values[slot_of("w")].val.num);
+  run_both("v = 0 - 9223372036854775807 - 1\nv = v / -1", "v");
+  ASSERT_EQ(INT64_MIN, frame.values[slot_of("v")].val.num);
+}
+
+int main() {
+  test_jit_arithmetic();
+  test_jit_loops();
+  test_jit_float();
+  test_jit_int64();
+  return 0;
+}
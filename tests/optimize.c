@@ -0,0 +1,161 @@
+#include "test.h"
+
+static struct node *optimized(char *src) {
+  struct tokenizer tokenizer;
+  tokenizer_init(&tokenizer, src);
+  return optimize(tokenizer.ctx, parse(&tokenizer));
+}
+
+void test_fold_constants() {
+  struct node *stmt = CHILD(optimized("2 + 2 * 2"), block.body);
+  ASSERT_EQ(ND_NUM, stmt->kind);
+  ASSERT_EQ(6, stmt->val.num);
+
+  stmt = CHILD(optimized("7 / 2.0 - 1"), block.body);
+  ASSERT_EQ(ND_NUM, stmt->kind);
+  ASSERT_EQ(TY_FLOAT, stmt->type);
+  ASSERT_EQ(2.5, stmt->val.fnum);
+
+  // Division by zero is still reported when the program runs
+  stmt = CHILD(optimized("1 / 0"), block.body);
+  ASSERT_EQ(ND_DIV, stmt->kind);
+}
+
+void test_simplify_identities() {
+  struct node *stmt = CHILD(optimized("x = 3\nx * 1 + 0"), block.body);
+  stmt = CHILD(stmt, next);
+  ASSERT_EQ(ND_VAR, stmt->kind);
+
+  stmt = CHILD(optimized("x * 0"), block.body);
+  ASSERT_EQ(ND_NUM, stmt->kind);
+
+  // Would drop the assignment
+  stmt = CHILD(optimized("(x = 2) * 0"), block.body);
+  ASSERT_EQ(ND_MUL, stmt->kind);
+
+  // Would drop the division by zero
+  stmt = CHILD(optimized("z = 0\na = (10 / z) * 0"), block.body);
+  stmt = CHILD(CHILD(stmt, next), bin.rhs);
+  ASSERT_EQ(ND_MUL, stmt->kind);
+}
+
+void test_fold_if() {
+  struct node *prog = optimized("a = 1\nif (2 < 1) { a = 2 } else { a = 3\na = 4 }\na = 5");
+  int nstmts = 0;
+  for (struct node *cur = CHILD(prog, block.body); cur; cur = OPT_CHILD(cur, next)) {
+    ASSERT_EQ(ND_ASSIGN, cur->kind);
+    ++nstmts;
+  }
+  ASSERT_EQ(4, nstmts);
+
+  prog = optimized("if (0) { a = 2 }");
+  ASSERT_EQ(0, prog->block.body);
+}
+
+static int count_loops(struct node *block) {
+  int n = 0;
+  for (struct node *cur = OPT_CHILD(block, block.body); cur; cur = OPT_CHILD(cur, next)) {
+    n += cur->kind == ND_FOR;
+  }
+  return n;
+}
+
+static int64_t int_of(char *var) {
+  struct tokenizer tokenizer;
+  tokenizer_init(&tokenizer, var);
+  struct node *prog = parse(&tokenizer);
+  return frame.values[CHILD(prog, block.body)->var.slot].val.num;
+}
+
+void test_unroll_loop() {
+  struct node *prog = optimized("ua = 0\nfor ui in 0..4 { ua = ua * 2 + ui }");
+  ASSERT_EQ(0, count_loops(prog));
+  execute_node(prog);
+  ASSERT_EQ(11, int_of("ua"));
+  ASSERT_EQ(4, int_of("ui"));
+
+  // Loop variable is changed by the body
+  prog = optimized("for uj in 0..4 { uj = uj + 2 }");
+  ASSERT_EQ(1, count_loops(prog));
+}
+
+void test_fuse_loops() {
+  struct node *prog = optimized("fn = 10\nfor fi in 0..fn { fa = fa * 2 + fi }\n"
+                                "for fj in 0..fn { fb = fb * 2 + fj }");
+  ASSERT_EQ(1, count_loops(prog));
+  execute_node(prog);
+  ASSERT_EQ(1013, int_of("fa"));
+  ASSERT_EQ(1013, int_of("fb"));
+  ASSERT_EQ(10, int_of("fj"));
+
+  // Second loop reads what the first one writes
+  prog = optimized("for fk in 0..fn { fc = fc * 2 + fk }\nfor fl in 0..fn { fd = fd * 2 + fc }");
+  ASSERT_EQ(2, count_loops(prog));
+}
+
+void test_hoist_invariants() {
+  struct node *prog = optimized("hn = 100\nhk = 3\n"
+                                "for hi in 0..hn * 2 { if (hi < 150) { hs = hs + hk * hk } }");
+  struct node *loop = CHILD(prog, block.body);
+  while (loop->kind != ND_FOR) {
+    loop = CHILD(loop, next);
+  }
+  ASSERT_EQ(ND_VAR, CHILD(CHILD(loop, loop.cond), bin.rhs)->kind);
+  struct node *stmt = CHILD(CHILD(CHILD(loop, loop.body), block.body), branch.then);
+  stmt = CHILD(stmt, block.body);
+  ASSERT_EQ(ND_VAR, CHILD(CHILD(stmt, bin.rhs), bin.rhs)->kind);
+  execute_node(prog);
+  ASSERT_EQ(1350, int_of("hs"));
+}
+
+void test_closed_form_loops() {
+  struct node *prog = optimized("cn = 1000\nck = 3\nfor ci in 1..cn + 1 {\n"
+                                "  cj = cj + 2\n  ca = ca + ci * ci * ci\n  cb = cb - ck * cj\n}");
+  ASSERT_EQ(0, count_loops(prog));
+  execute_node(prog);
+  ASSERT_EQ(250500250000, int_of("ca"));
+  ASSERT_EQ(-3003000, int_of("cb"));
+  ASSERT_EQ(2000, int_of("cj"));
+  ASSERT_EQ(1001, int_of("ci"));
+
+  // Sums wrap around exactly like the loop would
+  prog = optimized("for cl in 0..3000000000 { cs = cs + cl * cl }");
+  execute_node(prog);
+  ASSERT_EQ(6908886848337831168, int_of("cs"));
+
+  // Reads a variable which is not a linear induction variable
+  prog = optimized("for cm in 0..10 { cc = cc + cm\ncd = cd + cc }");
+  ASSERT_EQ(1, count_loops(prog));
+}
+
+// Temporaries are reused by every statement under `-s`, a variable assigned
+// in between must not turn into one of them
+void test_stream_temps() {
+  struct tokenizer tokenizer;
+  tokenizer_init(&tokenizer, "a = 3 b = 4 s = 0\n"
+                             "for i in 0..5 { s = s + a*b*i*i }\n"
+                             "_t0 = 100\n"
+                             "for i in 0..5 { s = s + a*b }");
+  struct node *stmt;
+  frame_release_temps();
+  while ((stmt = parse_next(&tokenizer))) {
+    execute_node(optimize(tokenizer.ctx, stmt));
+    frame_release_temps();
+  }
+
+  tokenizer_init(&tokenizer, "_t0");
+  struct node *prog = parse(&tokenizer);
+  ASSERT_EQ(100, eval_node(CHILD(prog, block.body)));
+}
+
+int main() {
+  test_fold_constants();
+  test_simplify_identities();
+  test_fold_if();
+  test_unroll_loop();
+  test_fuse_loops();
+  test_hoist_invariants();
+  test_closed_form_loops();
+  test_stream_temps();
+  return 0;
+}
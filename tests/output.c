@@ -0,0 +1,131 @@
+#include <float.h>
+#include <math.h>
+
+#include "test.h"
+
+static void check_int(int64_t value) {
+  char buf[FMT_INT_SIZE + 1], expected[32];
+  buf[fmt_int(buf, value)] = '\0';
+  snprintf(expected, sizeof(expected), "%" PRId64, value);
+  ASSERT_EQ(0, strcmp(expected, buf));
+}
+
+static void check_float(double value) {
+  char buf[FMT_FLOAT_SIZE], expected[FMT_FLOAT_SIZE];
+  buf[fmt_float(buf, value)] = '\0';
+  snprintf(expected, sizeof(expected), "%f", value);
+  ASSERT_EQ(0, strcmp(expected, buf));
+}
+
+void test_fmt_int() {
+  int64_t values[] = { 0, 1, -1, 9, 10, 99, 100, -100, 123456789, INT64_MAX, INT64_MIN };
+  for (size_t i = 0; i < sizeof(values) / sizeof(*values); ++i) {
+    check_int(values[i]);
+  }
+  uint64_t x = 88172645463325252ULL;
+  for (int i = 0; i < 100000; ++i) {
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    check_int((int64_t)x >> (i % 64));
+  }
+}
+
+// Formatted the same as printf, including ties at the sixth decimal which
+// are rounded to even
+void test_fmt_float() {
+  double values[] = {
+    0.0, -0.0, 0.5, 1.5, -2.25, 0.1, 1e-7, 5e-7, 0.0000005, 0.0000015, 0.0078125,
+    -0.0078125, 2.5e-7, 123456.0000005, 999999999999.9999, 1e12, -1e12, 1e300,
+    DBL_MIN, DBL_TRUE_MIN, DBL_MAX, -DBL_MAX, INFINITY, -INFINITY, NAN,
+  };
+  for (size_t i = 0; i < sizeof(values) / sizeof(*values); ++i) {
+    check_float(values[i]);
+  }
+  uint64_t x = 88172645463325252ULL;
+  for (int i = 0; i < 100000; ++i) {
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    double value;
+    memcpy(&value, &x, sizeof(value));
+    check_float(value);
+    check_float(ldexp((double)(x >> 11), (int)(x % 100) - 113));
+    check_float((double)(x % 2000000001) / 2e6);
+  }
+}
+
+enum print_mode { MODE_WALK, MODE_VM, MODE_JIT, MODE_OPTIMIZE, MODE_STREAM, NPRINT_MODES };
+
+// Runs `src` in `mode` and returns what it printed. Variables keep their type
+// from one program to the next, so '#' in `src` is replaced by a letter of
+// its own for every mode.
+static struct output_buf run_mode(const char *src, enum print_mode mode) {
+  char *text = strdup(src);
+  for (char *c = text; *c; ++c) {
+    if (*c == '#') {
+      *c = 'a' + mode;
+    }
+  }
+  struct output_buf out = {0};
+  struct output_buf *prev = output_capture(&out);
+  struct tokenizer tokenizer;
+  tokenizer_init(&tokenizer, text);
+  if (mode == MODE_STREAM) {
+    struct node *stmt;
+    while ((stmt = parse_next(&tokenizer))) {
+      execute_node(stmt);
+    }
+  } else {
+    struct node *prog = parse(&tokenizer);
+    if (mode == MODE_VM) {
+      struct chunk *chunk = bc_compile(prog);
+      vm_execute(chunk);
+      bc_free(chunk);
+    } else if (mode == MODE_JIT) {
+      struct jit_code *code = jit_compile(prog);
+      jit_execute(code);
+      jit_free(code);
+    } else {
+      execute_node(mode == MODE_OPTIMIZE ? optimize(tokenizer.ctx, prog) : prog);
+    }
+  }
+  output_capture(prev);
+  free(text);
+  return out;
+}
+
+// A value is printed in the type its variables have after the statements
+// before the print, also when a float is assigned to one of them later on.
+// Loops read the float back as an integer then.
+void test_print_type() {
+  const char *src = "x# = 1\nprint x#\nx# = 1.5\nprint x#\n"
+                    "y# = 1\nfor i# in 0..2 { print y#\ny# = y# + 0.75 }\nprint y#\n"
+                    "w# = 0.5\nfor j# in 0..2 { v# = u#\nu# = w# }\nprint v#";
+  const char *expected = "1\n1.500000\n1\n1\n2.500000\n0.500000\n";
+  for (int mode = 0; mode < NPRINT_MODES; ++mode) {
+    struct output_buf out = run_mode(src, mode);
+    ASSERT_EQ(strlen(expected), out.len);
+    ASSERT_EQ(0, memcmp(expected, out.data, out.len));
+    free(out.data);
+  }
+
+  // Emitted C prints the same
+  struct tokenizer tokenizer;
+  tokenizer_init(&tokenizer, "z = 1\nprint z\nz = 1.5\nprint z");
+  size_t len;
+  char *code = c_codegen_str(parse(&tokenizer), &len);
+  const char *print_int = "printf(\"%lld\\n\", (long long)(z));";
+  char *first = strstr(code, "printf(\"");
+  ASSERT_NEQ(NULL, first);
+  ASSERT_EQ(0, strncmp(first, print_int, strlen(print_int)));
+  ASSERT_NEQ(NULL, strstr(first + 1, "printf(\"%lf\\n\", (double)(z));"));
+  free(code);
+}
+
+int main() {
+  test_fmt_int();
+  test_fmt_float();
+  test_print_type();
+  return 0;
+}
@@ -0,0 +1,69 @@
+#include "test.h"
+
+static bool can_split(char *src) {
+  struct par_loop *loop = par_analyze(last_stmt(parse_str(src)), false);
+  par_free(loop);
+  return loop != NULL;
+}
+
+// The loop of the program runs on threads on the VM
+static void one_par_loop(struct chunk *chunk) {
+  ASSERT_EQ(1, chunk->nloops);
+}
+
+void test_par_analyze() {
+  ASSERT_EQ(true, can_split("s = 0\nfor i in 0..100 { s = s + i * i }"));
+  ASSERT_EQ(true, can_split("p = 1\nfor i in 0..100 { p = (i + 1) * p }"));
+  ASSERT_EQ(true, can_split("for i in 0..100 { x = i * 2\ny = x + 1 }"));
+  ASSERT_EQ(true, can_split("for i in 0..100 { if (i < 5) { z = 1 } else { z = 2 }\nprint z }"));
+  ASSERT_EQ(true, can_split("for i in 0..100 { q = i / 2 }"));
+
+  // Values carried from one iteration to the next
+  ASSERT_EQ(false, can_split("b = 0\nc = 0\nfor i in 0..100 { b = c\nc = i }"));
+  ASSERT_EQ(false, can_split("d = 1\nfor i in 0..100 { d = d * 2 + i }"));
+  ASSERT_EQ(false, can_split("e = 0\nfor i in 0..100 { e = e + i\nprint e }"));
+  ASSERT_EQ(false, can_split("f = 0\nfor i in 0..100 { if (i < 5) { f = i } }"));
+  ASSERT_EQ(false, can_split("for i in 0..100 { i = i + 1 }"));
+  ASSERT_EQ(false, can_split("n = 100\nfor i in 0..n { n = i }"));
+
+  // Which iteration fails first would depend on the split
+  ASSERT_EQ(false, can_split("for i in 0..100 { g = 10 / i }"));
+}
+
+void test_par_execute(bool walk) {
+  struct output_buf out = {0};
+  run_captured("s = 0\np = 1\n"
+               "for i in 0..300000 { s = s + i * i\np = p * 3\nx = i * 2\ny = x + 1 }",
+               walk, &out, one_par_loop);
+  uint64_t p = 1;
+  for (int i = 0; i < 300000; ++i) {
+    p *= 3;
+  }
+  ASSERT_EQ(0, out.len);
+  ASSERT_EQ((int64_t)299999 * 300000 * 599999 / 6, frame.values[slot_of("s")].val.num);
+  ASSERT_EQ((int64_t)p, frame.values[slot_of("p")].val.num);
+  ASSERT_EQ(599998, frame.values[slot_of("x")].val.num);
+  ASSERT_EQ(599999, frame.values[slot_of("y")].val.num);
+  ASSERT_EQ(300000, frame.values[slot_of("i")].val.num);
+
+  // Output is in the order of the iterations
+  run_captured("for i in 0..300000 { print i * 3 }", walk, &out, one_par_loop);
+  char *expected = malloc(300000 * 16);
+  size_t len = 0;
+  for (int i = 0; i < 300000; ++i) {
+    len += fmt_int(expected + len, i * 3);
+    expected[len++] = '\n';
+  }
+  ASSERT_EQ(len, out.len);
+  ASSERT_EQ(0, memcmp(expected, out.data, len));
+  free(expected);
+  free(out.data);
+}
+
+int main() {
+  par_init(4);
+  test_par_analyze();
+  test_par_execute(true);
+  test_par_execute(false);
+  return 0;
+}
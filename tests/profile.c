@@ -0,0 +1,89 @@
+#include <unistd.h>
+
+#include "test.h"
+
+static const char *src =
+  "s = 0\n"
+  "for i in 0..10 {\n"
+  "  s = s + i\n"
+  "  if (s > 20) {\n"
+  "    s = 0\n"
+  "  }\n"
+  "}\n";
+
+// Statements keep the line they start on, ND_FOR through its `init`
+void test_node_line() {
+  struct context ctx;
+  context_init(&ctx);
+  struct tokenizer tokenizer;
+  tokenizer_init_ctx(&tokenizer, strdup(src), &ctx);
+  struct node *prog = parse(&tokenizer);
+
+  struct node *assign = CHILD(prog, block.body);
+  ASSERT_EQ(1, node_line(assign));
+  struct node *loop = CHILD(assign, next);
+  ASSERT_EQ(ND_FOR, loop->kind);
+  ASSERT_EQ(2, node_line(loop));
+  struct node *body = CHILD(CHILD(loop, loop.body), block.body);
+  ASSERT_EQ(3, node_line(body));
+  ASSERT_EQ(ND_IF, CHILD(body, next)->kind);
+  ASSERT_EQ(4, node_line(CHILD(body, next)));
+  // Expressions have no line of their own
+  ASSERT_EQ(0, node_line(CHILD(assign, bin.rhs)));
+  context_destroy(&ctx);
+}
+
+// Every line of the loop body is hit once per iteration, and folded stacks
+// name the loops and conditions a statement runs in
+void test_profile_execute() {
+  struct context ctx;
+  context_init(&ctx);
+  struct tokenizer tokenizer;
+  tokenizer_init_ctx(&tokenizer, strdup(src), &ctx);
+  struct node *prog = parse(&tokenizer);
+  profile_execute(&ctx, prog);
+
+  FILE *report = tmpfile();
+  profile_report(report);
+  rewind(report);
+  char line[256];
+  uint64_t hits[8] = {};
+  ASSERT_NEQ(NULL, fgets(line, sizeof(line), report));
+  while (fgets(line, sizeof(line), report)) {
+    unsigned nline;
+    uint64_t count;
+    if (sscanf(line, "%u %" SCNu64, &nline, &count) == 2 && nline < 8) {
+      hits[nline] = count;
+    }
+  }
+  fclose(report);
+  ASSERT_EQ(1, hits[1]);
+  ASSERT_EQ(1, hits[2]);
+  ASSERT_EQ(10, hits[3]);
+  ASSERT_EQ(10, hits[4]);
+  // s goes 0 1 3 6 10 15 21 -> 0 7 15 24 -> 0
+  ASSERT_EQ(2, hits[5]);
+
+  char fname[] = "/tmp/zapp_foldedXXXXXX";
+  int fd = mkstemp(fname);
+  ASSERT_NEQ(-1, fd);
+  close(fd);
+  profile_write_folded(fname);
+  FILE *folded = fopen(fname, "r");
+  bool found = false;
+  while (fgets(line, sizeof(line), folded)) {
+    if (!strncmp(line, "main;for:2;if:4;assign:5 ", 25)) {
+      found = true;
+    }
+  }
+  fclose(folded);
+  unlink(fname);
+  ASSERT_EQ(true, found);
+  context_destroy(&ctx);
+}
+
+int main() {
+  test_node_line();
+  test_profile_execute();
+  return 0;
+}
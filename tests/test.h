@@ -13,4 +13,64 @@
 #define ASSERT_LE(x, y) (assert((x) <= (y)))
 #define ASSERT_GE(x, y) (assert((x) >= (y)))
 
+// Fixtures shared by the tests of several modules, inline so that tests
+// which do not use all of them compile without warnings
+
+static inline struct node *parse_str(char *src) {
+  struct tokenizer tokenizer;
+  tokenizer_init(&tokenizer, src);
+  return parse(&tokenizer);
+}
+
+static inline int slot_of(char *var) {
+  return CHILD(parse_str(var), block.body)->var.slot;
+}
+
+// Last top-level statement of `prog`
+static inline struct node *last_stmt(struct node *prog) {
+  struct node *stmt = CHILD(prog, block.body);
+  while (stmt->next) {
+    stmt = CHILD(stmt, next);
+  }
+  return stmt;
+}
+
+static inline double value_of(char *var) {
+  struct zapp_value *value = &frame.values[slot_of(var)];
+  return value->kind == TY_INT ? value->val.num : value->val.fnum;
+}
+
+// Runs `src` through both the tree walker and `engine` and checks that
+// variable `var` ends up with the same value
+static inline double run_both_with(char *src, char *var,
+                                   void (*engine)(struct node *prog)) {
+  struct node *prog = parse_str(src);
+  execute_node(prog);
+  double walked = value_of(var);
+
+  // Both engines share variable slots, so clear the result in between
+  frame.values[slot_of(var)].val.num = 0;
+  engine(prog);
+  double value = value_of(var);
+  ASSERT_EQ(walked, value);
+  return value;
+}
+
+// Runs `src` by walking it or on the VM and collects what it prints in `out`.
+// The VM code is passed to `check` before it runs.
+static inline void run_captured(char *src, bool walk, struct output_buf *out,
+                                void (*check)(struct chunk *chunk)) {
+  struct node *prog = parse_str(src);
+  struct output_buf *prev = output_capture(out);
+  if (walk) {
+    execute_node(prog);
+  } else {
+    struct chunk *chunk = bc_compile(prog);
+    check(chunk);
+    vm_execute(chunk);
+    bc_free(chunk);
+  }
+  output_capture(prev);
+}
+
 #endif // _H_TEST
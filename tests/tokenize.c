@@ -0,0 +1,133 @@
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "test.h"
+
+static struct token next(struct tokenizer *tokenizer) {
+  struct token tok = *tok_peek(tokenizer);
+  tok_consume_lookahead(tokenizer);
+  return tok;
+}
+
+void test_long_runs() {
+  char src[256];
+  // Runs longer than any vector block, newlines in the middle of them
+  snprintf(src, sizeof(src), "%40s\n\n%35s%s = 12345678901234567890.123456789012345\n  x",
+           "", "", "an_identifier_longer_than_thirty_two_bytes");
+  struct tokenizer tokenizer;
+  tokenizer_init(&tokenizer, src);
+
+  struct token tok = next(&tokenizer);
+  ASSERT_EQ(TOKEN_IDENT, tok.kind);
+  ASSERT_EQ(42, tok.len);
+  ASSERT_EQ(2, tok.nline);
+  ASSERT_EQ(35, tok_col(&tokenizer, &tok));
+  ASSERT_EQ(TOKEN_ASSIGN, next(&tokenizer).kind);
+  tok = next(&tokenizer);
+  ASSERT_EQ(TOKEN_NUM, tok.kind);
+  ASSERT_EQ(TY_FLOAT, tok.type);
+  ASSERT_EQ(36, tok.len);
+  tok = next(&tokenizer);
+  ASSERT_EQ(3, tok.nline);
+  ASSERT_EQ(2, tok_col(&tokenizer, &tok));
+  ASSERT_EQ(TOKEN_EOF, next(&tokenizer).kind);
+}
+
+void test_keywords_and_puncts() {
+  struct tokenizer tokenizer;
+  tokenizer_init(&tokenizer, "for i in 0..n { if (i >= 2) { print i } else { iffy = i != 1 } }");
+  token_kind kinds[] = {
+    TOKEN_FOR, TOKEN_IDENT, TOKEN_IN, TOKEN_NUM, TOKEN_DOTDOT, TOKEN_IDENT, TOKEN_LBRACE,
+    TOKEN_IF, TOKEN_LPAREN, TOKEN_IDENT, TOKEN_GTE, TOKEN_NUM, TOKEN_RPAREN, TOKEN_LBRACE,
+    TOKEN_PRINT, TOKEN_IDENT, TOKEN_RBRACE, TOKEN_ELSE, TOKEN_LBRACE, TOKEN_IDENT,
+    TOKEN_ASSIGN, TOKEN_IDENT, TOKEN_NEQ, TOKEN_NUM, TOKEN_RBRACE, TOKEN_RBRACE, TOKEN_EOF
+  };
+  for (int i = 0; i < sizeof(kinds) / sizeof(*kinds); ++i) {
+    ASSERT_EQ(kinds[i], next(&tokenizer).kind);
+  }
+}
+
+void test_lex_all() {
+  struct tokenizer tokenizer;
+  tokenizer_init(&tokenizer, "a = 1\nb = a + 2\n");
+  tok_lex_all(&tokenizer);
+  ASSERT_EQ(9, tokenizer.ntokens);
+  ASSERT_EQ(TOKEN_PLUS, tok_npeek(&tokenizer, 7)->kind);
+  ASSERT_EQ(TOKEN_EOF, tok_npeek(&tokenizer, 9)->kind);
+  // Peeking past the end keeps returning the end of input
+  ASSERT_EQ(TOKEN_EOF, tok_npeek(&tokenizer, 12)->kind);
+
+  struct node *prog = parse(&tokenizer);
+  ASSERT_EQ(ND_ASSIGN, CHILD(prog, block.body)->kind);
+  tokenizer_destroy(&tokenizer);
+}
+
+// Scanning a token which ends right before an unreadable page must not
+// touch that page
+void test_page_end() {
+  long page = sysconf(_SC_PAGESIZE);
+  char *mem = mmap(NULL, 2 * page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  ASSERT_NEQ(MAP_FAILED, mem);
+  mprotect(mem + page, page, PROT_NONE);
+
+  const char *tail[] = { "abc", "  \n  ", "1234567", "x = 1\n" };
+  for (int i = 0; i < sizeof(tail) / sizeof(*tail); ++i) {
+    char *src = mem + page - strlen(tail[i]) - 1;
+    strcpy(src, tail[i]);
+    struct tokenizer tokenizer;
+    tokenizer_init(&tokenizer, src);
+    while (next(&tokenizer).kind != TOKEN_EOF) {
+    }
+  }
+  munmap(mem, 2 * page);
+}
+
+// A source read in chunks lexes to the same tokens as the whole of it,
+// including lines longer than a chunk and tokens at chunk boundaries. Lines
+// already lexed are dropped, so the buffer stays smaller than the source.
+void test_stream() {
+  size_t size = 300 * 1024;
+  char *src = malloc(size + 1);
+  size_t len = 0;
+  for (int i = 0; len < size - 100 * 1024; ++i) {
+    len += sprintf(src + len, "v%d = %d.5 + v%d\n", i, i, i / 2);
+  }
+  while (len < size - 16) {
+    len += sprintf(src + len, " w%zu", len);
+  }
+  src[len++] = '\n';
+  src[len] = '\0';
+
+  FILE *file = tmpfile();
+  ASSERT_EQ(len, fwrite(src, 1, len, file));
+  fflush(file);
+  rewind(file);
+
+  struct tokenizer expected, streamed;
+  tokenizer_init(&expected, src);
+  tokenizer_init_fd(&streamed, fileno(file), default_context());
+  struct token tok;
+  do {
+    tok = next(&expected);
+    struct token got = next(&streamed);
+    ASSERT_EQ(tok.kind, got.kind);
+    ASSERT_EQ(tok.len, got.len);
+    ASSERT_EQ(0, memcmp(TOK_STR(&expected, &tok), TOK_STR(&streamed, &got), tok.len));
+    ASSERT_EQ(tok.nline, got.nline);
+    ASSERT_EQ(tok.sym, got.sym);
+  } while (tok.kind != TOKEN_EOF);
+  ASSERT_EQ(-1, streamed.fd);
+  ASSERT_LT(streamed.bufsize, len);
+  tokenizer_destroy(&streamed);
+  fclose(file);
+  free(src);
+}
+
+int main() {
+  test_long_runs();
+  test_keywords_and_puncts();
+  test_lex_all();
+  test_page_end();
+  test_stream();
+  return 0;
+}
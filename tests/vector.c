@@ -0,0 +1,106 @@
+#include "test.h"
+
+static bool can_vectorize(char *src) {
+  struct vec_loop *loop = vec_analyze(last_stmt(parse_str(src)));
+  vec_free(loop);
+  return loop != NULL;
+}
+
+// The loop of the program runs a block at a time on the VM
+static void one_vec_loop(struct chunk *chunk) {
+  ASSERT_EQ(1, chunk->nvec_loops);
+}
+
+void test_vec_analyze() {
+  ASSERT_EQ(true, can_vectorize("a = 1\nfor i in 0..100 { x = i * 3 + a\ny = x / 2 }"));
+  ASSERT_EQ(true, can_vectorize("s = 0\nfor i in 0..100 { s = s + i * i }"));
+  ASSERT_EQ(true, can_vectorize("s = 0\nfor i in 0..100 { s = s + i - 3 * i }"));
+  ASSERT_EQ(true, can_vectorize("f = 0.5\nfor i in 0..100 { f = f * (i + 0.5) }"));
+  ASSERT_EQ(true, can_vectorize("for i in 0..100 { print i < 50\nprint i / 2.0 }"));
+
+  // Values carried from one iteration to the next
+  ASSERT_EQ(false, can_vectorize("b = 1\nfor i in 0..100 { b = b * 2 + i }"));
+  ASSERT_EQ(false, can_vectorize("c = 0\nfor i in 0..100 { d = c\nc = i }"));
+  ASSERT_EQ(false, can_vectorize("s = 0\nfor i in 0..100 { s = s + i\nprint s }"));
+  ASSERT_EQ(false, can_vectorize("f = 0.5\nfor i in 0..100 { f = f + i - 0.5 }"));
+  ASSERT_EQ(false, can_vectorize("for i in 0..100 { i = i + 1 }"));
+  ASSERT_EQ(false, can_vectorize("n = 100\nfor i in 0..n { n = i }"));
+
+  // Only arithmetic
+  ASSERT_EQ(false, can_vectorize("for i in 0..100 { if (i < 5) { e = 1 } }"));
+  ASSERT_EQ(false, can_vectorize("for i in 0..100 { for j in 0..i { e = j } }"));
+  ASSERT_EQ(false, can_vectorize("for i in 0..100 { e = (g = i) }"));
+  ASSERT_EQ(false, can_vectorize("for i in 0..100 { e = 10 / i }"));
+  ASSERT_EQ(false, can_vectorize("for i in 0..100 { e = i / 0 }"));
+}
+
+void test_vec_execute(bool walk) {
+  struct output_buf out = {0};
+  run_captured("a = 3\ns = 0\nf = 0.5\n"
+               "for i in 0..1000 { x = i * a - 700\ns = s + x * x - i\nf = f + x / 4.0\n"
+               "print x < 0 }",
+               walk, &out, one_vec_loop);
+  int64_t s = 0;
+  double f = 0.5;
+  size_t len = 0;
+  for (int64_t i = 0; i < 1000; ++i) {
+    int64_t x = i * 3 - 700;
+    s = s + x * x - i;
+    f = f + x / 4.0;
+    ASSERT_EQ(x < 0 ? '1' : '0', out.data[len]);
+    len += 2;
+  }
+  ASSERT_EQ(len, out.len);
+  ASSERT_EQ(s, frame.values[slot_of("s")].val.num);
+  ASSERT_EQ(f, frame.values[slot_of("f")].val.fnum);
+  ASSERT_EQ(2297, frame.values[slot_of("x")].val.num);
+  ASSERT_EQ(1000, frame.values[slot_of("i")].val.num);
+
+  // Products wrap around, the last block is short
+  out.len = 0;
+  run_captured("p = 1\nfor i in 0..513 { p = p * 3 * (i - 700) }", walk, &out, one_vec_loop);
+  int64_t p = 1;
+  for (int64_t i = 0; i < 513; ++i) {
+    p = (int64_t)((uint64_t)p * 3 * (uint64_t)(i - 700));
+  }
+  ASSERT_EQ(0, out.len);
+  ASSERT_EQ(p, frame.values[slot_of("p")].val.num);
+  free(out.data);
+}
+
+// Enters `loop` the way the tree walker does
+static bool enter(struct node *loop) {
+  execute_node(CHILD(loop, loop.init));
+  return vec_execute_node(loop);
+}
+
+// Loops which can not run a block at a time are analyzed once, and none of
+// them is once it is turned off
+void test_vec_switches() {
+  struct node *loop = last_stmt(parse_str("b = 1\nfor i in 0..100 { b = b * 2 + i }"));
+  ASSERT_EQ(false, enter(loop));
+  ASSERT_EQ(NODE_NO_VEC, loop->flags & NODE_NO_VEC);
+
+  // Too short to be worth it this time, which says nothing about the body
+  loop = last_stmt(parse_str("for i in 0..10 { x = i * 3 }"));
+  ASSERT_EQ(false, enter(loop));
+  ASSERT_EQ(0, loop->flags & NODE_NO_VEC);
+
+  vec_init(false);
+  struct node *prog = parse_str("for i in 0..100 { x = i * 3 }");
+  ASSERT_EQ(false, enter(last_stmt(prog)));
+  ASSERT_EQ(0, last_stmt(prog)->flags & NODE_NO_VEC);
+  struct chunk *chunk = bc_compile(prog);
+  ASSERT_EQ(0, chunk->nvec_loops);
+  bc_free(chunk);
+  vec_init(true);
+  ASSERT_EQ(true, enter(last_stmt(prog)));
+}
+
+int main() {
+  test_vec_analyze();
+  test_vec_execute(true);
+  test_vec_execute(false);
+  test_vec_switches();
+  return 0;
+}